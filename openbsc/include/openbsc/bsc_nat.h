@@ -23,8 +23,12 @@
 #define BSC_NAT_H
 
 #include "mgcp.h"
+#include "bsc_nat_sccp.h"
+#include "worker_queue.h"
 
 #include <sys/types.h>
+#include <stdio.h>
+#include <pthread.h>
 
 #include <osmocore/select.h>
 #include <osmocore/msgb.h>
@@ -43,6 +47,11 @@
 struct sccp_connections;
 struct bsc_nat_parsed;
 struct bsc_nat;
+struct bsc_msc_connection;
+struct bsc_nat_worker;
+struct bsc_nat_reader;
+struct bsc_nat_frames;
+struct snapshot_writer;
 
 enum {
 	NAT_CON_TYPE_NONE,
@@ -53,6 +62,33 @@ enum {
 	NAT_CON_TYPE_OTHER,
 };
 
+/*
+ * The write queues to the BSCs and MSCs are bounded in messages and
+ * bytes. The queued messages are kept in the order of their class, the
+ * signalling of established connections goes first. Paging is dropped
+ * first and new connections are refused before the queue is full.
+ */
+enum bsc_nat_prio {
+	NAT_PRIO_CON,
+	NAT_PRIO_CR,
+	NAT_PRIO_PAGING,
+	NAT_PRIO_CLASSES,
+};
+
+struct bsc_nat_queue_limit {
+	unsigned int msgs;
+	unsigned int bytes;
+};
+
+struct bsc_nat_queue {
+	struct write_queue *wq;
+	const struct bsc_nat_queue_limit *limit;
+
+	unsigned int bytes;
+	unsigned int queued[NAT_PRIO_CLASSES];
+	unsigned long dropped[NAT_PRIO_CLASSES];
+};
+
 /*
  * Per BSC data structure
  */
@@ -64,6 +100,7 @@ struct bsc_connection {
 
 	/* the fd we use to communicate */
 	struct write_queue write_queue;
+	struct bsc_nat_queue queue;
 
 	/* the BSS associated */
 	struct bsc_config *cfg;
@@ -81,13 +118,69 @@ struct bsc_connection {
 
 	/* a back pointer */
 	struct bsc_nat *nat;
+
+	/* the thread reading from the BSC, the free waits for it */
+	struct bsc_nat_reader *reader;
+	int closing;
+
+	/* the index of the authenticated BSCs by LAC */
+	struct llist_head lac_entry;
+	unsigned int paging_generation;
+};
+
+/*
+ * Forwarding latency. A message is stamped with the monotonic time in
+ * usec when it is read and the time it took is recorded once the write
+ * queue wrote it. The histograms are log-linear, eight buckets for each
+ * power of two, this keeps the error of a percentile below 12.5%.
+ */
+#define NAT_LAT_SUB_BITS	3
+#define NAT_LAT_BUCKETS		200
+
+enum bsc_nat_lat_dir {
+	NAT_LAT_TO_MSC,
+	NAT_LAT_TO_BSC,
+	NAT_LAT_DIRS,
+};
+
+enum bsc_nat_lat_type {
+	NAT_LAT_CR,
+	NAT_LAT_CC,
+	NAT_LAT_DT1,
+	NAT_LAT_RLSD,
+	NAT_LAT_UDT,
+	NAT_LAT_OTHER,
+	NAT_LAT_TYPES,
+};
+
+struct bsc_nat_lat_hist {
+	unsigned long count;
+	uint64_t sum;
+	uint32_t max;
+	uint32_t buckets[NAT_LAT_BUCKETS];
 };
 
+/* kept in the control buffer of a msgb while it is forwarded */
+struct bsc_nat_msg_cb {
+	uint32_t stamp;
+	int type;
+	int prio;
+	struct bsc_config *cfg;
+};
+
+#define NAT_MSGB_CB(__msgb) ((struct bsc_nat_msg_cb *) &(__msgb)->cb[0])
+
 /**
  * Stats per BSC
  */
 struct bsc_config_stats {
 	struct rate_ctr_group *ctrg;
+
+	/* the time from reading a message to writing it out */
+	struct bsc_nat_lat_hist lat[NAT_LAT_DIRS][NAT_LAT_TYPES];
+
+	/* the longest write queue towards the BSC */
+	unsigned int wq_hwm;
 };
 
 enum bsc_cfg_ctr {
@@ -121,6 +214,50 @@ struct bsc_config {
 	struct bsc_config_stats stats;
 };
 
+enum bsc_msc_ctr {
+	MSC_CTR_SCCP_CONN,
+	MSC_CTR_SCCP_RELEASED,
+	MSC_CTR_RECONN,
+	MSC_CTR_LOST,
+};
+
+/* how new SCCP connections are distributed over the MSCs */
+enum bsc_nat_msc_dist {
+	NAT_MSC_DIST_IMSI,
+	NAT_MSC_DIST_ROUND_ROBIN,
+};
+
+/**
+ * One MSC of the pool. Each MSC has its own space of patched SCCP
+ * references and a connection stays with the MSC it was created on.
+ */
+struct bsc_nat_msc {
+	struct llist_head entry;
+
+	int nr;
+	char *ip;
+	int port;
+	int weight;
+
+	/* smooth weighted round robin */
+	int current_weight;
+
+	struct bsc_msc_connection *con;
+	struct bsc_nat_queue queue;
+	struct sccp_ref_pool refs;
+
+	/* backpointer */
+	struct bsc_nat *nat;
+
+	struct rate_ctr_group *ctrg;
+
+	/* the longest write queue towards the MSC */
+	unsigned int wq_hwm;
+
+	/* the reset waits for the connections of the snapshot */
+	int reset_deferred;
+};
+
 /**
  * BSCs point of view of endpoints
  */
@@ -131,6 +268,8 @@ struct bsc_endpoint {
 	char *transaction_id;
 	/* the bsc we are talking to */
 	struct bsc_connection *bsc;
+	/* the connection the MSC assigned this endpoint to */
+	struct sccp_connections *con;
 };
 
 /**
@@ -152,12 +291,51 @@ struct bsc_nat_statistics {
 	} msc;
 };
 
+/*
+ * The access lists are compiled before they are used. Entries made of
+ * digits, digit ranges and a trailing ".*" are put into a trie for the
+ * anchored and an Aho-Corasick automaton for the other patterns. Both
+ * are walked once per IMSI. The rest is still handled by regexec().
+ */
+#define ACC_ALLOW_ANY	0x01
+#define ACC_ALLOW_END	0x02
+#define ACC_DENY_ANY	0x04
+#define ACC_DENY_END	0x08
+
+struct bsc_nat_acc_node {
+	int child[10];
+	int fail;
+	uint8_t flags;
+};
+
+struct bsc_nat_acc_trie {
+	struct bsc_nat_acc_node *nodes;
+	int nr_nodes;
+	int size;
+};
+
 struct bsc_nat_acc_lst {
 	struct llist_head list;
 
 	/* the name of the list */
 	const char *name;
 	struct llist_head fltr_list;
+
+	/* the compiled list */
+	unsigned int generation;
+	struct bsc_nat_acc_trie anchored;
+	struct bsc_nat_acc_trie unanchored;
+	regex_t **allow_re;
+	int nr_allow_re;
+	regex_t **deny_re;
+	int nr_deny_re;
+	unsigned long compile_usec;
+
+	/* statistics */
+	unsigned long checks;
+	unsigned long allow_hits;
+	unsigned long deny_hits;
+	unsigned long regex_hits;
 };
 
 struct bsc_nat_acc_lst_entry {
@@ -170,15 +348,68 @@ struct bsc_nat_acc_lst_entry {
 	regex_t imsi_deny_re;
 };
 
+/*
+ * The SCCP connections are written to a snapshot file from time to
+ * time. After a restart the connections of a BSC that comes back within
+ * the grace time are taken over with their references and endpoints.
+ */
+#define NAT_SNAP_REMOTE		0x01
+#define NAT_SNAP_IMSI_CHECKED	0x02
+#define NAT_SNAP_DONE		0x80
+
+struct bsc_nat_snapshot_con {
+	uint16_t bsc_nr;
+	uint16_t lac;
+	uint16_t msc_nr;
+	uint8_t con_type;
+	uint8_t flags;
+	uint32_t real_ref;
+	uint32_t patched_ref;
+	uint32_t remote_ref;
+	int16_t msc_endp;
+	int16_t bsc_endp;
+};
+
+struct bsc_nat_snapshot {
+	char *file;
+	int interval;
+	int grace;
+	struct timer_list timer;
+	struct snapshot_writer *writer;
+
+	/* the connections of the last run, sorted by BSC */
+	struct bsc_nat_snapshot_con *pending;
+	int nr_pending;
+	int left;
+	struct timer_list grace_timer;
+
+	/* statistics */
+	unsigned long written;
+	unsigned long write_errors;
+	unsigned long adopted;
+	unsigned long expired;
+};
+
+/*
+ * The authenticated BSC connections hashed by the LAC of their config.
+ * A paging only looks at the buckets of the LACs it is sent to.
+ */
+#define NAT_LAC_BUCKETS	256
+
 /**
  * the structure of the "nat" network
  */
 struct bsc_nat {
 	/* active SCCP connections that need patching */
 	struct llist_head sccp_connections;
+	struct sccp_con_table sccp_by_real;
+	struct sccp_con_table sccp_by_patched;
+	struct sccp_con_table sccp_by_remote;
 
 	/* active BSC connections that need patching */
 	struct llist_head bsc_connections;
+	struct llist_head bsc_by_lac[NAT_LAC_BUCKETS];
+	unsigned int paging_generation;
 
 	/* access lists */
 	struct llist_head access_lists;
@@ -187,6 +418,7 @@ struct bsc_nat {
 	struct llist_head bsc_configs;
 	int num_bsc;
 	int bsc_ip_dscp;
+	struct bsc_nat_queue_limit bsc_queue_limit;
 
 	/* MGCP config */
 	struct mgcp_config *mgcp_cfg;
@@ -194,10 +426,11 @@ struct bsc_nat {
 	int mgcp_length;
 
 	/* msc things */
-	char *msc_ip;
-	int msc_port;
-	struct bsc_msc_connection *msc_con;
+	struct llist_head mscs;
+	int num_msc;
+	int msc_dist;
 	char *token;
+	struct bsc_nat_queue_limit msc_queue_limit;
 
 	/* timeouts */
 	int auth_timeout;
@@ -211,14 +444,129 @@ struct bsc_nat {
 
 	/* statistics */
 	struct bsc_nat_statistics stats;
+
+	/* BSC reader threads */
+	int num_workers;
+	struct bsc_nat_worker *workers;
+	struct bsc_nat_frames *frames;
+
+	/* the connections for a warm restart */
+	struct bsc_nat_snapshot snapshot;
+
+	/* latency histograms appended to a file */
+	char *lat_dump_file;
+	int lat_dump_interval;
+	struct timer_list lat_dump_timer;
 };
 
+/*
+ * BSC reader threads. A worker owns the receive side of the BSC
+ * sockets handed to it. It splits the IPA stream into messages and
+ * parses them. The result is passed to the select loop through one
+ * multi producer/single consumer queue. The select loop keeps the
+ * SCCP patching, the MSC links and the write queues to the BSCs.
+ */
+#define NAT_WORKER_RING		256
+#define NAT_WORKER_FRAMES	4096
+
+enum bsc_nat_worker_cmd_type {
+	NAT_WORKER_ADD,
+	NAT_WORKER_CLOSE,
+};
+
+struct bsc_nat_worker_cmd {
+	int type;
+	struct bsc_nat_reader *reader;
+};
+
+enum bsc_nat_frame_type {
+	NAT_FRAME_MSG,
+	NAT_FRAME_LOST,
+	NAT_FRAME_CLOSED,
+};
+
+struct bsc_nat_frame {
+	struct worker_queue_node node;
+	int type;
+	struct bsc_connection *bsc;
+
+	/* the error of a lost connection */
+	int error;
+
+	/* the time it was read */
+	uint32_t stamp;
+
+	/* the result of bsc_nat_parse_quiet on the worker */
+	int parse_rc;
+	struct bsc_nat_parsed parsed;
+	int l3_off;
+	int l4_off;
+
+	unsigned int len;
+	uint8_t data[0];
+};
+
+struct bsc_nat_frames {
+	struct bsc_nat *nat;
+
+	/* pushed by the workers, popped by the select loop */
+	struct worker_queue queue;
+
+	struct bsc_fd bfd;
+
+	void (*msg_cb)(struct bsc_connection *bsc, struct msgb *msg,
+		       struct bsc_nat_parsed *parsed);
+	void (*lost_cb)(struct bsc_connection *bsc, int error);
+
+	/* statistics */
+	unsigned long wakeups;
+	unsigned long frames;
+	unsigned long dropped;
+};
+
+/* counted behind the errors of every worker thread */
+enum bsc_nat_worker_error {
+	NAT_WORKER_ERR_ALLOC = _WORKER_ERR_MAX,
+	NAT_WORKER_ERR_MSG_SIZE,
+	NAT_WORKER_ERR_WATCH,
+	NAT_WORKER_ERR_PARSE,
+	_NAT_WORKER_ERR_MAX,
+};
+
+struct bsc_nat_worker {
+	struct worker_thread thread;
+	int epoll_fd;
+	struct bsc_nat_frames *frames;
+	struct bsc_nat_worker_cmd ring[NAT_WORKER_RING];
+
+	/* the select loop */
+	unsigned int connections;
+
+	/* the worker */
+	unsigned long wakeups;
+	unsigned long messages;
+	unsigned long bytes;
+	/* closed readers, handed back once no event refers to them */
+	struct bsc_nat_reader *closed;
+};
+
+int bsc_nat_workers_start(struct bsc_nat *nat,
+			  void (*msg_cb)(struct bsc_connection *, struct msgb *,
+					 struct bsc_nat_parsed *),
+			  void (*lost_cb)(struct bsc_connection *, int));
+int bsc_nat_worker_add(struct bsc_nat *nat, struct bsc_connection *bsc);
+void bsc_nat_worker_close(struct bsc_connection *bsc);
+
 /* create and init the structures */
 struct bsc_config *bsc_config_alloc(struct bsc_nat *nat, const char *token, unsigned int lac);
 struct bsc_config *bsc_config_num(struct bsc_nat *nat, int num);
 struct bsc_nat *bsc_nat_alloc(void);
 struct bsc_connection *bsc_connection_alloc(struct bsc_nat *nat);
 void bsc_nat_set_msc_ip(struct bsc_nat *bsc, const char *ip);
+struct bsc_nat_msc *bsc_nat_msc_alloc(struct bsc_nat *nat, int nr);
+struct bsc_nat_msc *bsc_nat_msc_num(struct bsc_nat *nat, int nr);
+struct bsc_nat_msc *bsc_nat_msc_select(struct bsc_nat *nat, struct bsc_nat_parsed *parsed);
+void bsc_nat_msc_send_reset(struct bsc_nat_msc *msc);
 
 void sccp_connection_destroy(struct sccp_connections *);
 void bsc_close_connection(struct bsc_connection *);
@@ -228,14 +576,30 @@ const char *bsc_con_type_to_string(int type);
 /**
  * parse the given message into the above structure
  */
-struct bsc_nat_parsed *bsc_nat_parse(struct msgb *msg);
+enum bsc_nat_parse_error {
+	NAT_PARSE_ERR_SHORT = 1,
+	NAT_PARSE_ERR_LENGTH,
+	NAT_PARSE_ERR_SCCP,
+	NAT_PARSE_ERR_PAYLOAD,
+	_NAT_PARSE_ERR_MAX,
+};
+
+int bsc_nat_parse(struct msgb *msg, struct bsc_nat_parsed *parsed);
+int bsc_nat_parse_quiet(struct msgb *msg, struct bsc_nat_parsed *parsed);
+const char *bsc_nat_parse_strerror(int rc);
+void bsc_nat_parsed_rebase(struct bsc_nat_parsed *parsed, const uint8_t *old, uint8_t *new);
+const uint8_t *bsc_nat_find_ie(const uint8_t *data, int len, uint8_t tag, uint16_t *ie_len);
 
 /**
  * filter based on IP Access header in both directions
  */
 int bsc_nat_filter_ipa(int direction, struct msgb *msg, struct bsc_nat_parsed *parsed);
 int bsc_nat_vty_init(struct bsc_nat *nat);
-struct bsc_connection *bsc_nat_find_bsc(struct bsc_nat *nat, struct msgb *msg, int *_lac);
+int bsc_nat_find_paging(struct bsc_nat *nat, struct msgb *msg, int *_lac,
+			void (*cb)(struct bsc_connection *bsc, void *data), void *data);
+void bsc_nat_lac_add(struct bsc_connection *bsc);
+void bsc_nat_lac_del(struct bsc_connection *bsc);
+void bsc_nat_lac_update(struct bsc_nat *nat, struct bsc_config *conf);
 
 /**
  * Content filtering.
@@ -248,24 +612,32 @@ int bsc_nat_filter_dt(struct bsc_connection *bsc, struct msgb *msg,
 /**
  * SCCP patching and handling
  */
-struct sccp_connections *create_sccp_src_ref(struct bsc_connection *bsc, struct bsc_nat_parsed *parsed);
+struct sccp_connections *create_sccp_src_ref(struct bsc_connection *bsc, struct bsc_nat_msc *msc,
+					     struct bsc_nat_parsed *parsed);
 int update_sccp_src_ref(struct sccp_connections *sccp, struct bsc_nat_parsed *parsed);
+void sccp_connection_set_remote(struct sccp_connections *sccp, struct sccp_source_reference *ref);
+void sccp_connection_unlink(struct sccp_connections *sccp);
 void remove_sccp_src_ref(struct bsc_connection *bsc, struct msgb *msg, struct bsc_nat_parsed *parsed);
-struct sccp_connections *patch_sccp_src_ref_to_bsc(struct msgb *, struct bsc_nat_parsed *, struct bsc_nat *);
+struct sccp_connections *patch_sccp_src_ref_to_bsc(struct msgb *, struct bsc_nat_parsed *, struct bsc_nat_msc *);
 struct sccp_connections *patch_sccp_src_ref_to_msc(struct msgb *, struct bsc_nat_parsed *, struct bsc_connection *);
+int sccp_ref_reserve(struct bsc_nat_msc *msc, uint32_t ref);
+void sccp_ref_release(struct bsc_nat_msc *msc, uint32_t ref);
+struct sccp_connections *sccp_connection_adopt(struct bsc_connection *bsc, struct bsc_nat_msc *msc,
+					       struct sccp_source_reference *real,
+					       struct sccp_source_reference *patched);
 
 /**
  * MGCP/Audio handling
  */
 int bsc_write_mgcp(struct bsc_connection *bsc, const uint8_t *data, unsigned int length);
-int bsc_mgcp_assign_patch(struct sccp_connections *, struct msgb *msg);
+int bsc_mgcp_assign_patch(struct sccp_connections *, struct msgb *msg, struct bsc_nat_parsed *);
 void bsc_mgcp_init(struct sccp_connections *);
 void bsc_mgcp_dlcx(struct sccp_connections *);
 void bsc_mgcp_free_endpoints(struct bsc_nat *nat);
 int bsc_mgcp_nat_init(struct bsc_nat *nat);
 
 struct sccp_connections *bsc_mgcp_find_con(struct bsc_nat *, int endpoint_number);
-struct msgb *bsc_mgcp_rewrite(char *input, int length, int endp, const char *ip, int port);
+struct msgb *bsc_mgcp_rewrite(const char *input, int length, int endp, const char *ip, int port);
 void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg);
 
 void bsc_mgcp_clear_endpoints_for(struct bsc_connection *bsc);
@@ -275,14 +647,45 @@ uint32_t bsc_mgcp_extract_ci(const char *resp);
 
 int bsc_write(struct bsc_connection *bsc, struct msgb *msg, int id);
 
+/* bounded write queues */
+void bsc_nat_queue_init(struct bsc_nat_queue *queue, struct write_queue *wq,
+			const struct bsc_nat_queue_limit *limit);
+int bsc_nat_queue_admit(struct bsc_nat_queue *queue, int prio, unsigned int len);
+int bsc_nat_queue_enqueue(struct bsc_nat_queue *queue, struct msgb *msg);
+void bsc_nat_queue_written(struct bsc_nat_queue *queue, struct msgb *msg);
+
 /* IMSI allow/deny handling */
 void bsc_parse_reg(void *ctx, regex_t *reg, char **imsi, int argc, const char **argv);
 struct bsc_nat_acc_lst *bsc_nat_acc_lst_find(struct bsc_nat *nat, const char *name);
 struct bsc_nat_acc_lst *bsc_nat_acc_lst_get(struct bsc_nat *nat, const char *name);
 void bsc_nat_acc_lst_delete(struct bsc_nat_acc_lst *lst);
+int bsc_nat_acc_lst_compile(struct bsc_nat_acc_lst *lst);
+int bsc_nat_acc_lst_check(struct bsc_nat_acc_lst *lst, const char *imsi, int allow);
 
 struct bsc_nat_acc_lst_entry *bsc_nat_acc_lst_entry_create(struct bsc_nat_acc_lst *);
 
 int bsc_nat_msc_is_connected(struct bsc_nat *nat);
 
+/* latency */
+uint32_t bsc_nat_lat_now(void);
+int bsc_nat_lat_type(int sccp_type);
+const char *bsc_nat_lat_type_name(int type);
+int bsc_nat_lat_bucket(uint32_t usec);
+uint32_t bsc_nat_lat_bucket_start(int bucket);
+void bsc_nat_lat_add(struct bsc_nat_lat_hist *hist, uint32_t usec);
+void bsc_nat_lat_merge(struct bsc_nat_lat_hist *dst, const struct bsc_nat_lat_hist *src);
+uint32_t bsc_nat_lat_percentile(const struct bsc_nat_lat_hist *hist, int permille);
+void bsc_nat_lat_record(struct bsc_config *cfg, int dir, struct msgb *msg);
+int bsc_nat_lat_dump(struct bsc_nat *nat, FILE *file);
+void bsc_nat_lat_dump_schedule(struct bsc_nat *nat);
+
+/* warm restart */
+int bsc_nat_snapshot_write(struct bsc_nat *nat);
+void bsc_nat_snapshot_schedule(struct bsc_nat *nat);
+int bsc_nat_snapshot_load(struct bsc_nat *nat);
+int bsc_nat_snapshot_adopt(struct bsc_connection *bsc);
+int bsc_nat_snapshot_pending(struct bsc_nat_msc *msc);
+int bsc_nat_snapshot_defer_reset(struct bsc_nat_msc *msc);
+void bsc_nat_snapshot_expire(struct bsc_nat *nat);
+
 #endif
@@ -24,6 +24,10 @@
 #define BSC_NAT_SCCP_H
 
 #include <sys/types.h>
+#include <stdint.h>
+
+#include <osmocore/linuxlist.h>
+#include <osmocore/protocol/gsm_04_08.h>
 #include <osmocom/sccp/sccp_types.h>
 
 /*
@@ -31,7 +35,9 @@
  * the received message. This would require us to parse
  * the IPA and SCCP header twice. Instead of doing this
  * we will have one analyze structure and have the patching
- * and filter operate on the same structure.
+ * and filter operate on the same structure. It is filled by
+ * bsc_nat_parse() and lives on the stack of the caller, the
+ * pointers point into the message.
  */
 struct bsc_nat_parsed {
 	/* ip access prototype */
@@ -57,6 +63,43 @@ struct bsc_nat_parsed {
 
 	/* the gsm0808 message type */
 	int gsm_type;
+
+	/* the BSSMAP IEs or the DTAP payload after the header */
+	uint8_t *payload;
+	int payload_len;
+
+	/* the IMSI found by the CR filter, empty otherwise */
+	char imsi[GSM48_MI_SIZE];
+};
+
+/*
+ * The SCCP connections are indexed by the references in hash
+ * tables. The hash is kept in the entry to grow the table.
+ */
+struct sccp_con_hentry {
+	struct llist_head list;
+	uint32_t hash;
+};
+
+struct sccp_con_table {
+	struct llist_head *buckets;
+	unsigned int size;
+	unsigned int count;
+};
+
+/*
+ * The local references handed out by the NAT. There is one bit for
+ * every reference and every level above has one bit for each full
+ * word of the level below. Finding a free reference looks at a few
+ * words instead of comparing with every connection.
+ */
+#define SCCP_REF_BITS	24
+#define SCCP_REF_LEVELS	5
+
+struct sccp_ref_pool {
+	uint32_t last;
+	unsigned int used;
+	uint32_t *bits[SCCP_REF_LEVELS];
 };
 
 /*
@@ -67,9 +110,17 @@ struct bsc_nat_parsed {
 struct sccp_connections {
 	struct llist_head list_entry;
 
+	/* (bsc, real_ref), patched_ref and (bsc, remote_ref) index */
+	struct sccp_con_hentry by_real;
+	struct sccp_con_hentry by_patched;
+	struct sccp_con_hentry by_remote;
+
 	struct bsc_connection *bsc;
 	struct bsc_msc_connection *msc_con;
 
+	/* the MSC of the patched reference, kept after a local release */
+	struct bsc_nat_msc *msc;
+
 	struct sccp_source_reference real_ref;
 	struct sccp_source_reference patched_ref;
 	struct sccp_source_reference remote_ref;
@@ -5,4 +5,11 @@
 
 u_int32_t crc24_calc(u_int32_t fcs, u_int8_t *cp, unsigned int len);
 
+/* the implementations crc24_calc() picks from, for tests and benchmarks */
+u_int32_t crc24_calc_table(u_int32_t fcs, u_int8_t *cp, unsigned int len);
+u_int32_t crc24_calc_slice8(u_int32_t fcs, u_int8_t *cp, unsigned int len);
+/* only with HAVE_PCLMUL, check crc24_pclmul_supported() before use */
+int crc24_pclmul_supported(void);
+u_int32_t crc24_calc_pclmul(u_int32_t fcs, u_int8_t *cp, unsigned int len);
+
 #endif
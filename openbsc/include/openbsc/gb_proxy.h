@@ -2,18 +2,152 @@
 #define _GB_PROXY_H
 
 #include <sys/types.h>
+#include <pthread.h>
 
 #include <osmocore/msgb.h>
+#include <osmocore/select.h>
 
 #include <openbsc/gprs_ns.h>
+#include <openbsc/worker_queue.h>
 #include <osmocom/vty/command.h>
 
+struct gbprox_worker;
+struct gbprox_frames;
+struct gbprox_sender;
+
 struct gbproxy_config {
 	/* parsed from config file */
 	u_int16_t nsip_sgsn_nsei;
+	int num_workers;
 
 	/* misc */
 	struct gprs_ns_inst *nsi;
+	struct gbprox_worker *workers;
+	struct gbprox_frames *frames;
+	struct gbprox_sender *sender;
+};
+
+/*
+ * NS/UDP worker threads. Every worker reads its own socket of the
+ * SO_REUSEPORT group of the NS/UDP port, the kernel keeps all the
+ * datagrams of a remote NS-VC on one socket and so the BVCs of a NSE
+ * on one thread. The worker relays the PTP UNITDATA of unblocked NS-VCs
+ * itself: to the SGSN through the queue of the sender thread and to
+ * the BSS from its own socket. Everything else is passed to the select
+ * loop, it keeps all NS and BSSGP state and updates a private copy of
+ * the NS-VCs and PTP BVCs on every worker through its command ring.
+ */
+#define GBPROX_WORKER_RING	1024
+#define GBPROX_WORKER_FRAMES	4096
+#define GBPROX_SENDER_QUEUE	4096
+
+/* the worker may relay PTP UNITDATA from and to the NSE */
+#define GBPROX_NSE_FWD		0x01
+/* the NSE is the SGSN, its PTP UNITDATA goes to the BSS */
+#define GBPROX_NSE_SGSN		0x02
+
+enum gbprox_worker_cmd_type {
+	GBPROX_WORKER_NSE,
+	GBPROX_WORKER_BVC,
+};
+
+struct gbprox_worker_cmd {
+	int type;
+	uint16_t nsei;
+	uint16_t bvci;
+	/* NSE: GBPROX_NSE_*, BVC: the BVC is known */
+	unsigned int flags;
+	struct sockaddr_in addr;
+};
+
+/* a NS/UDP datagram, malloc'ed by the worker */
+struct gbprox_dgram {
+	struct worker_queue_node node;
+	/* the count of its BVC on the slow path, or NULL */
+	volatile unsigned int *slow;
+	/* where it came from, or where the sender sends it to */
+	struct sockaddr_in addr;
+	unsigned int len;
+	uint8_t data[0];
+};
+
+/* datagrams for the NS layer in the select loop */
+struct gbprox_frames {
+	struct worker_queue queue;
+	struct bsc_fd bfd;
+	struct gprs_ns_inst *nsi;
+	struct gbproxy_config *cfg;
+
+	/* statistics */
+	unsigned long wakeups;
+	unsigned long frames;
+	unsigned long dropped;
+};
+
+/* sends the UNITDATA for the SGSN from the NS/UDP socket of the NS layer */
+struct gbprox_sender {
+	struct worker_queue queue;
+	pthread_t thread;
+	int fd;
+	int event_fd;
+
+	/* statistics */
+	unsigned long wakeups;
+	unsigned long sent;
+	unsigned long errors;
+	unsigned long blocked;
+	unsigned long wakeup_errors;
+	unsigned long reported_wakeup;
+};
+
+/* addresses in network byte order, no address is 0.0.0.0:0 */
+struct gbprox_worker_nse {
+	uint32_t ip;
+	uint16_t port;
+	uint16_t flags;
+};
+
+struct gbprox_worker_addr {
+	uint32_t ip;
+	uint16_t port;
+	uint16_t nsei;
+};
+
+/* counted behind the errors of every worker thread */
+enum gbprox_worker_error {
+	GBPROX_WORKER_ERR_NSE = _WORKER_ERR_MAX,
+	_GBPROX_WORKER_ERR_MAX,
+};
+
+struct gbprox_worker {
+	struct worker_thread thread;
+	int epoll_fd;
+	int fd;
+	struct gbprox_frames *frames;
+	struct gbprox_sender *sender;
+	struct gbprox_worker_cmd ring[GBPROX_WORKER_RING];
+
+	/* buffers for the next recvmmsg() */
+	struct gbprox_dgram *rx[NSIP_RX_BATCH];
+
+	/* the worker: the NSEs by NSEI, the NSEI of a BVCI with the
+	 * known bit and the NSEI of a remote address */
+	struct gbprox_worker_nse *nse;
+	uint32_t *bvci_nsei;
+	/* the datagrams of a BVCI the NS layer has not handled yet, the
+	 * worker counts up and the select loop down */
+	volatile unsigned int *bvci_slow;
+	struct gbprox_worker_addr *addrs;
+	unsigned int addrs_size;
+	unsigned int addrs_count;
+	uint16_t sgsn_nsei;
+
+	unsigned long wakeups;
+	unsigned long received;
+	unsigned long to_sgsn;
+	unsigned long to_bss;
+	unsigned long slow_path;
+	unsigned long dropped;
 };
 
 extern struct gbproxy_config gbcfg;
@@ -36,4 +170,12 @@ int gbprox_signal(unsigned int subsys, unsigned int signal,
 /* Reset all persistent NS-VC's */
 int gbprox_reset_persistent_nsvcs(struct gprs_ns_inst *nsi);
 
+
+/* gb_proxy_worker.c */
+
+int gbprox_workers_start(struct gbproxy_config *cfg);
+void gbprox_workers_nsvc(struct gbproxy_config *cfg, struct gprs_nsvc *nsvc);
+void gbprox_workers_bvc(struct gbproxy_config *cfg, uint16_t bvci,
+			struct gprs_nsvc *nsvc);
+
 #endif
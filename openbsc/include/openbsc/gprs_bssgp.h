@@ -2,6 +2,12 @@
 #define _GPRS_BSSGP_H
 
 #include <stdint.h>
+#include <sys/time.h>
+
+#include <osmocore/linuxlist.h>
+#include <osmocore/timer.h>
+
+#include <openbsc/hash_index.h>
 
 /* Section 5.4.1 */
 #define BVCI_SIGNALLING	0x0000
@@ -151,10 +157,71 @@ int bssgp_tx_simple_bvci(uint8_t pdu_type, uint16_t nsei,
 /* Chapter 10.4.14: Status */
 int bssgp_tx_status(uint8_t cause, uint16_t *bvci, struct msgb *orig_msg);
 
+/* gprs_bssgp_fc.c */
+
+struct msgb;
+struct rate_ctr;
+
+/* counters of a flow control, consecutive in a rate_ctr_group */
+enum bssgp_fc_ctr {
+	BSSGP_FC_CTR_DELAYED,		/* PDUs held back */
+	BSSGP_FC_CTR_DROPPED,		/* PDUs dropped for a full queue */
+	BSSGP_FC_CTR_DELAY,		/* milliseconds spent in the queue */
+};
+
+/*
+ * Token bucket of Chapter 8.2 / Annex D for the DL of a BVC or a MS.
+ * A PDU of L octets conforms when B + L <= Bmax or the bucket is empty,
+ * B leaks with R octets per second. PDUs that do not conform are
+ * queued and passed to out_cb in order once they do. A flow control
+ * with a bucket_size_max of 0 has not been configured by the BSS yet
+ * and passes everything.
+ */
+struct bssgp_flow_control {
+	uint32_t bucket_size_max;	/* Bmax in octets */
+	uint32_t bucket_leak_rate;	/* R in octets per second */
+	uint32_t bucket_counter;	/* B in octets */
+	struct timeval time_last_pdu;
+
+	/* held back PDUs, oldest first */
+	struct llist_head queue;
+	unsigned int queue_depth;
+	unsigned int max_queue_depth;
+	struct timer_list timer;
+
+	/* the counters of enum bssgp_fc_ctr, NULL for none */
+	struct rate_ctr *ctr;
+
+	int (*out_cb)(struct bssgp_flow_control *fc, struct msgb *msg,
+		      uint32_t llc_pdu_len, void *priv);
+	void *priv;
+};
+
+void bssgp_fc_init(struct bssgp_flow_control *fc, uint32_t max_queue_depth,
+		   int (*out_cb)(struct bssgp_flow_control *fc, struct msgb *msg,
+				 uint32_t llc_pdu_len, void *priv),
+		   void *priv);
+/* change Bmax and R, queued PDUs are re-evaluated */
+void bssgp_fc_set(struct bssgp_flow_control *fc, uint32_t bucket_size_max,
+		  uint32_t bucket_leak_rate);
+/* pass a PDU through the flow control, it is freed when dropped */
+int bssgp_fc_in(struct bssgp_flow_control *fc, struct msgb *msg,
+		uint32_t llc_pdu_len);
+/* drop all queued PDUs */
+void bssgp_fc_flush(struct bssgp_flow_control *fc);
+/* the clock of the flow control, a test can replace it */
+extern int (*bssgp_fc_gettime)(struct timeval *tv);
+
 /* gprs_bssgp.c */
 
+extern void *bssgp_tall_ctx;
+
 #define BVC_S_BLOCKED	0x0001
 
+/* held back DL PDUs per BVC and per MS */
+#define BSSGP_FC_BVC_QUEUE	256
+#define BSSGP_FC_MS_QUEUE	64
+
 /* The per-BTS context that we keep on the SGSN side of the BSSGP link */
 struct bssgp_bvc_ctx {
 	struct llist_head list;
@@ -172,6 +239,17 @@ struct bssgp_bvc_ctx {
 
 	struct rate_ctr_group *ctrg;
 
+	/* DL flow control of the BVC and the defaults for a MS, the
+	 * flow control of each MS is indexed by TLLI */
+	struct bssgp_flow_control fc;
+	uint32_t bmax_default_ms;
+	uint32_t r_default_ms;
+	struct hash_index ms_fc;
+
+	/* lookup by BVCI+NSEI and by RA ID+Cell ID */
+	struct hash_entry bvci_entry;
+	struct hash_entry cell_entry;
+
 	/* we might want to add this as a shortcut later, avoiding the NSVC
 	 * lookup for every packet, similar to a routing cache */
 	//struct gprs_nsvc *nsvc;
@@ -187,7 +265,7 @@ struct bssgp_bvc_ctx *btsctx_by_bvci_nsei(uint16_t bvci, uint16_t nsei);
 /* BSSGP-UL-UNITDATA.ind */
 int gprs_bssgp_rcvmsg(struct msgb *msg);
 
-/* BSSGP-DL-UNITDATA.req */
+/* BSSGP-DL-UNITDATA.req, the msgb is consumed in any case, also on error */
 struct sgsn_mm_ctx;
 int gprs_bssgp_tx_dl_ud(struct msgb *msg, struct sgsn_mm_ctx *mmctx);
 
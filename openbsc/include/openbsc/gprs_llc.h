@@ -129,8 +129,11 @@ struct gprs_llc_llme {
 
 	enum gprs_llc_llme_state state;
 
+	/* indexed, only changed by gprs_llgmm_assign() */
 	uint32_t tlli;
 	uint32_t old_tlli;
+	struct hash_entry tlli_entry;
+	struct hash_entry old_tlli_entry;
 
 	/* Crypto parameters */
 	enum gprs_ciph_algo algo;
@@ -147,10 +150,15 @@ extern struct llist_head gprs_llc_llmes;
 /* BSSGP-UL-UNITDATA.ind */
 int gprs_llc_rcvmsg(struct msgb *msg, struct tlv_parsed *tv);
 
-/* LL-UNITDATA.req */
+/* LL-UNITDATA.req, the msgb is consumed in any case, also on error */
 int gprs_llc_tx_ui(struct msgb *msg, uint8_t sapi, int command,
 		   void *mmctx);
 
+/* LL-XID.req: send the Layer-3 parameters in a XID command, the response
+ * goes to sndcp_ll_xid_conf() */
+int gprs_ll_xid_req(struct gprs_llc_lle *lle, const uint8_t *l3,
+		    unsigned int l3_len);
+
 /* 04.64 Chapter 7.2.1.1 LLGMM-ASSIGN */
 int gprs_llgmm_assign(struct gprs_llc_llme *llme,
 		      uint32_t old_tlli, uint32_t new_tlli,
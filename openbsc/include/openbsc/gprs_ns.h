@@ -82,6 +82,8 @@ enum ns_cause {
 #include <osmocore/timer.h>
 #include <osmocore/select.h>
 
+#include <openbsc/hash_index.h>
+
 #define NS_TIMERS_COUNT 7
 #define NS_TIMERS "(tns-block|tns-block-retries|tns-reset|tns-reset-retries|tns-test|tns-alive|tns-alive-retries)"
 #define NS_TIMERS_HELP	\
@@ -114,6 +116,10 @@ enum gprs_ns_evt {
 	GPRS_NS_EVT_UNIT_DATA,
 };
 
+/* NS/UDP datagrams read or written with one system call */
+#define NSIP_RX_BATCH	32
+#define NSIP_TX_BATCH	32
+
 struct gprs_nsvc;
 typedef int gprs_ns_cb_t(enum gprs_ns_evt event, struct gprs_nsvc *nsvc,
 			 struct msgb *msg, uint16_t bvci);
@@ -125,10 +131,17 @@ struct gprs_ns_inst {
 
 	/* linked lists of all NSVC in this instance */
 	struct llist_head gprs_nsvcs;
+	/* the same NSVC indexed by NSVCI, NSEI and remote address */
+	struct hash_index idx_nsvci;
+	struct hash_index idx_nsei;
+	struct hash_index idx_addr;
 
 	/* a NSVC object that's needed to deal with packets for unknown NSVC */
 	struct gprs_nsvc *unknown_nsvc;
 
+	/* the received message, freed after the callback unless taken */
+	struct msgb *rx_msg;
+
 	uint16_t timeout[NS_TIMERS_COUNT];
 
 	/* NS-over-IP specific bits */
@@ -136,6 +149,15 @@ struct gprs_ns_inst {
 		struct bsc_fd fd;
 		uint32_t local_ip;
 		uint16_t local_port;
+		/* let gprs_ns_nsip_socket() bind more sockets to the port */
+		int reuse_port;
+		/* buffers for the next recvmmsg() */
+		struct msgb *rx_msgs[NSIP_RX_BATCH];
+		/* datagrams the kernel dropped for a full socket buffer */
+		uint32_t rx_overflow;
+		/* NS-VCs with messages waiting for the socket */
+		struct llist_head tx_pending;
+		unsigned int tx_queue_max;
 	} nsip;
 	/* NS-over-FR-over-GRE-over-IP specific bits */
 	struct {
@@ -157,9 +179,14 @@ struct gprs_nsvc {
 	struct llist_head list;
 	struct gprs_ns_inst *nsi;
 
+	/* change with nsvc_set_nsei(), nsvc_set_nsvci(), nsvc_set_addr() */
 	uint16_t nsei;		/* end-to-end significance */
 	uint16_t nsvci;	/* uniquely identifies NS-VC at SGSN */
+	struct hash_entry nsei_entry;
+	struct hash_entry nsvci_entry;
+	struct hash_entry addr_entry;
 
+	/* changes are announced with S_NS_CHANGED */
 	uint32_t state;
 	uint32_t remote_state;
 
@@ -175,6 +202,11 @@ struct gprs_nsvc {
 	/* which link-layer are we based on? */
 	enum gprs_ns_ll ll;
 
+	/* messages waiting for the NS/UDP socket to become writable */
+	struct llist_head tx_queue;
+	unsigned int tx_queue_len;
+	struct llist_head tx_pending;
+
 	union {
 		struct {
 			struct sockaddr_in bts_addr;
@@ -194,11 +226,21 @@ void gprs_ns_destroy(struct gprs_ns_inst *nsi);
 /* Listen for incoming GPRS packets via NS/UDP */
 int gprs_ns_nsip_listen(struct gprs_ns_inst *nsi);
 
+/* Another socket of the SO_REUSEPORT group of the NS/UDP port */
+int gprs_ns_nsip_socket(struct gprs_ns_inst *nsi);
+
 struct sockaddr_in;
 
 /* main function for higher layers (BSSGP) to send NS messages */
 int gprs_ns_sendmsg(struct gprs_ns_inst *nsi, struct msgb *msg);
 
+/* main entry point, here incoming NS frames enter, msg is freed */
+int gprs_ns_rcvmsg(struct gprs_ns_inst *nsi, struct msgb *msg,
+		   struct sockaddr_in *saddr, enum gprs_ns_ll ll);
+
+/* keep the msgb of a UNIT DATA IND beyond the callback */
+struct msgb *gprs_ns_msgb_take(struct gprs_ns_inst *nsi, struct msgb *msg);
+
 int gprs_ns_tx_reset(struct gprs_nsvc *nsvc, uint8_t cause);
 int gprs_ns_tx_block(struct gprs_nsvc *nsvc, uint8_t cause);
 int gprs_ns_tx_unblock(struct gprs_nsvc *nsvc);
@@ -216,6 +258,11 @@ void nsvc_delete(struct gprs_nsvc *nsvc);
 struct gprs_nsvc *nsvc_by_nsei(struct gprs_ns_inst *nsi, uint16_t nsei);
 struct gprs_nsvc *nsvc_by_nsvci(struct gprs_ns_inst *nsi, uint16_t nsvci);
 
+/* update the keys of a NS-VC together with the lookup tables */
+void nsvc_set_nsei(struct gprs_nsvc *nsvc, uint16_t nsei);
+void nsvc_set_nsvci(struct gprs_nsvc *nsvc, uint16_t nsvci);
+void nsvc_set_addr(struct gprs_nsvc *nsvc, const struct sockaddr_in *addr);
+
 /* Initiate a RESET procedure (including timer start, ...)*/
 void gprs_nsvc_reset(struct gprs_nsvc *nsvc, uint8_t cause);
 
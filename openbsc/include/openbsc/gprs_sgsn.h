@@ -8,6 +8,8 @@
 
 #include <osmocom/crypt/gprs_cipher.h>
 
+#include <openbsc/hash_index.h>
+
 #define GSM_IMSI_LENGTH 17
 #define GSM_IMEI_LENGTH 17
 #define GSM_EXTENSION_LENGTH 15
@@ -42,6 +44,7 @@ enum gprs_pdp_ctx {
 	PDP_CTR_PKTS_UDATA_OUT,
 	PDP_CTR_BYTES_UDATA_IN,
 	PDP_CTR_BYTES_UDATA_OUT,
+	PDP_CTR_PKTS_UDATA_DROP,
 };
 
 enum gprs_t3350_mode {
@@ -57,6 +60,8 @@ enum gprs_t3350_mode {
 struct sgsn_mm_ctx {
 	struct llist_head	list;
 
+	/* change the IMSI, P-TMSIs and TLLI with the sgsn_mm_ctx_set_*()
+	 * functions, they are indexed */
 	char 			imsi[GSM_IMSI_LENGTH];
 	enum gprs_mm_state	mm_state;
 	uint32_t 		p_tmsi;
@@ -108,6 +113,12 @@ struct sgsn_mm_ctx {
 
 	enum gprs_t3350_mode	t3350_mode;
 	uint8_t			t3370_id_type;
+
+	/* lookup by TLLI, P-TMSI, old P-TMSI and IMSI */
+	struct hash_entry	tlli_entry;
+	struct hash_entry	ptmsi_entry;
+	struct hash_entry	ptmsi_old_entry;
+	struct hash_entry	imsi_entry;
 };
 
 /* look-up a SGSN MM context based on TLLI + RAI */
@@ -120,6 +131,12 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_by_imsi(const char *imsi);
 struct sgsn_mm_ctx *sgsn_mm_ctx_alloc(uint32_t tlli,
 					const struct gprs_ra_id *raid);
 
+/* update the keys of a MM context together with the lookup tables */
+void sgsn_mm_ctx_set_tlli(struct sgsn_mm_ctx *ctx, uint32_t tlli);
+void sgsn_mm_ctx_set_ptmsi(struct sgsn_mm_ctx *ctx, uint32_t p_tmsi,
+			   uint32_t p_tmsi_old);
+void sgsn_mm_ctx_set_imsi(struct sgsn_mm_ctx *ctx, const char *imsi);
+
 
 enum pdp_ctx_state {
 	PDP_STATE_NONE,
@@ -162,6 +179,18 @@ struct sgsn_pdp_ctx {
 	uint32_t		rx_gtp_snu;
 	//uint32_t		charging_id;
 	int			reordering_reqd;
+
+	/* user plane fast path, set up once the GGSN accepted the PDP */
+	struct {
+		/* the LLE and SNDCP entity the downlink goes to */
+		struct gprs_llc_lle	*lle;
+		struct gprs_sndcp_entity *sne;
+		/* the GTP-U peer and header of the uplink T-PDUs */
+		struct sockaddr_in	gtpu_addr;
+		int			gtpu_fd;
+		uint8_t			gtpu_hdr[20];
+		uint8_t			gtpu_hdr_len;
+	} fp;
 };
 
 
@@ -0,0 +1,79 @@
+#ifndef _BSC_HASH_INDEX_H
+#define _BSC_HASH_INDEX_H
+
+#include <stdint.h>
+
+#include <osmocore/linuxlist.h>
+
+/*
+ * Hash index over objects that are kept in a list anyway. The object
+ * embeds one struct hash_entry per key, the caller computes the hash
+ * and walks the bucket comparing the real key. New entries are added
+ * to the head of their bucket, a lookup finds the most recent object
+ * just like a walk of a list filled with llist_add. The table doubles
+ * when it has more entries than buckets, a zeroed index is empty.
+ */
+
+struct hash_entry {
+	struct llist_head list;
+	uint32_t hash;
+};
+
+struct hash_index {
+	struct llist_head *buckets;
+	unsigned int size;
+	unsigned int count;
+};
+
+int hash_index_add(void *ctx, struct hash_index *idx,
+		   struct hash_entry *entry, uint32_t hash);
+void hash_index_del(struct hash_index *idx, struct hash_entry *entry);
+void hash_index_rehash(void *ctx, struct hash_index *idx,
+		       struct hash_entry *entry, uint32_t hash);
+void hash_index_free(struct hash_index *idx);
+
+static inline int hash_index_linked(struct hash_entry *entry)
+{
+	return entry->list.next && !llist_empty(&entry->list);
+}
+
+/* bucket to walk for the hash, NULL for an empty index */
+static inline struct llist_head *hash_index_bucket(struct hash_index *idx,
+						   uint32_t hash)
+{
+	if (!idx->size)
+		return NULL;
+	return &idx->buckets[hash & (idx->size - 1)];
+}
+
+/* walk the entries that might match the hash, the hash is computed once
+ * and an else behind the body does not bind into the macro */
+#define hash_index_for_each(pos, idx, _hash, member)			\
+	for (uint32_t __hi_hash = (_hash), __hi_once = 1; __hi_once;	\
+	     __hi_once = 0)						\
+		for (struct llist_head *__hi_bucket =			\
+			hash_index_bucket(idx, __hi_hash);		\
+		     __hi_bucket; __hi_bucket = NULL)			\
+			llist_for_each_entry(pos, __hi_bucket, member.list) \
+				if (pos->member.hash != __hi_hash) {} else
+
+static inline uint32_t hash_index_u32(uint32_t key)
+{
+	key *= 0x9e3779b1;
+	return key ^ (key >> 16);
+}
+
+/* FNV-1a for keys that are an octet string */
+static inline uint32_t hash_index_bytes(const void *data, unsigned int len)
+{
+	const uint8_t *p = data;
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619;
+	}
+	return hash_index_u32(hash);
+}
+
+#endif
@@ -64,6 +64,8 @@ static inline int rtp_calculate_port(int multiplex, int base)
  */
 struct mgcp_endpoint;
 struct mgcp_config;
+struct mgcp_shard;
+struct mgcp_trans_cache;
 
 #define MGCP_ENDP_CRCX 1
 #define MGCP_ENDP_DLCX 2
@@ -100,6 +102,10 @@ struct mgcp_port_range {
 	int range_start;
 	int range_end;
 	int last_port;
+
+	/* one bit per RTP/RTCP pair of the range, set when in use */
+	uint32_t *used;
+	int nr_used;
 };
 
 struct mgcp_config {
@@ -138,6 +144,15 @@ struct mgcp_config {
 
 	struct mgcp_endpoint *endpoints;
 	uint32_t last_call_id;
+
+	/* media plane threads, zero keeps everything in the select loop */
+	int num_shards;
+	struct mgcp_shard *shards;
+	/* set in the private copy of a media thread only */
+	struct mgcp_shard *media_shard;
+
+	/* responses for retransmitted commands */
+	struct mgcp_trans_cache *trans_cache;
 };
 
 /* config management */
@@ -147,12 +162,15 @@ int mgcp_vty_init(void);
 int mgcp_endpoints_allocate(struct mgcp_config *cfg);
 void mgcp_free_endp(struct mgcp_endpoint *endp);
 int mgcp_reset_transcoder(struct mgcp_config *cfg);
+int mgcp_shards_start(struct mgcp_config *cfg);
+void mgcp_shards_reconfigure(struct mgcp_config *cfg);
 
 /*
  * format helper functions
  */
 struct msgb *mgcp_handle_message(struct mgcp_config *cfg, struct msgb *msg);
 struct msgb *mgcp_create_response_with_data(int code, const char *msg, const char *trans, const char *data);
+void mgcp_trans_cache_response(struct mgcp_config *cfg, const char *trans_id, struct msgb *resp);
 
 /* adc helper */
 static inline int mgcp_timeslot_to_endpoint(int multiplex, int timeslot)
@@ -26,6 +26,9 @@
 
 #include <osmocore/select.h>
 
+#include <pthread.h>
+#include <time.h>
+
 #define CI_UNUSED 0
 
 enum mgcp_connection_mode {
@@ -113,18 +116,147 @@ struct mgcp_endpoint {
 
 #define ENDPOINT_NUMBER(endp) abs(endp - endp->cfg->endpoints)
 
+/*
+ * Media plane worker. Each shard owns the endpoints with
+ * ENDPOINT_NUMBER % num_shards == nr and runs their RTP/RTCP
+ * forwarding from its own epoll loop. The select loop keeps the
+ * MGCP signalling and hands endpoint changes over through the
+ * single producer/single consumer ring below.
+ */
+#define MGCP_SHARD_RING	256
+
+enum mgcp_shard_cmd_type {
+	MGCP_SHARD_SYNC,
+	MGCP_SHARD_CLOSE,
+	MGCP_SHARD_CONFIG,
+};
+
+struct mgcp_shard_cmd {
+	int type;
+	int endpoint;
+	int fd;
+	union {
+		struct mgcp_endpoint endp;
+		struct mgcp_config cfg;
+	} u;
+};
+
+/*
+ * A media thread must not log, the logging code is not thread safe.
+ * It counts what it would have logged and the select loop reports it.
+ */
+enum mgcp_shard_event {
+	MGCP_SHARD_EV_RECV_FAIL,
+	MGCP_SHARD_EV_WRONG_SOURCE,
+	MGCP_SHARD_EV_DUMMY,
+	MGCP_SHARD_EV_SSRC_CHANGE,
+	MGCP_SHARD_EV_BTS_FOUND,
+	MGCP_SHARD_EV_NO_TRANSCODER,
+	MGCP_SHARD_EV_SEND_FAIL,
+	MGCP_SHARD_EV_WATCH_FAIL,
+	MGCP_SHARD_EV_WAKEUP_FAIL,
+	_MGCP_SHARD_EV_MAX,
+};
+
+struct mgcp_shard {
+	int nr;
+	pthread_t thread;
+	int epoll_fd;
+	int event_fd;
+	/* the select loop blocks on it while the ring is full */
+	int space_fd;
+
+	/* private copies only touched by the worker */
+	struct mgcp_config cfg;
+	struct mgcp_endpoint *endpoints;
+
+	/* written by the select loop, read by the worker */
+	volatile unsigned int head;
+	/* written by the worker, read by the select loop */
+	volatile unsigned int tail;
+	/* the select loop waits for the worker to free a slot */
+	volatile int producer_waiting;
+	struct mgcp_shard_cmd ring[MGCP_SHARD_RING];
+
+	/* statistics, written by the worker */
+	unsigned long wakeups;
+	unsigned long commands;
+	unsigned long events[_MGCP_SHARD_EV_MAX];
+	/* the errno when the worker stopped */
+	volatile int failed;
+
+	/* only used by the select loop */
+	unsigned long ring_full;
+	unsigned long reported[_MGCP_SHARD_EV_MAX];
+	int failure_reported;
+};
+
 struct mgcp_msg_ptr {
 	unsigned int start;
 	unsigned int length;
 };
 
-int mgcp_analyze_header(struct mgcp_config *cfg, struct msgb *msg,
-			struct mgcp_msg_ptr *ptr, int size,
-			const char **transaction_id, struct mgcp_endpoint **endp);
+/*
+ * A parsed MGCP message. The message itself is not modified, all
+ * positions are offsets into it.
+ */
+struct mgcp_parse_data {
+	const char *data;
+	unsigned int len;
+
+	/* the first line was understood */
+	int valid;
+	/* the response code or -1 for a command */
+	int code;
+
+	struct mgcp_msg_ptr verb;
+	struct mgcp_msg_ptr trans;
+	struct mgcp_msg_ptr endp;
+	char trans_id[32];
+	uint32_t trans_nr;
+
+	/* "X: value" lines, the offset of the value */
+	uint32_t params_mask;
+	struct mgcp_msg_ptr params[26];
+
+	/* the SDP and the first connection and audio lines */
+	unsigned int sdp;
+	struct mgcp_msg_ptr sdp_conn;
+	struct mgcp_msg_ptr sdp_audio;
+
+	/* offset of the first line that could not be parsed or -1 */
+	int bad_line;
+};
+
+/* responses kept for retransmissions, T-HIST of RFC 3435 */
+#define MGCP_TRANS_CACHE	256
+#define MGCP_TRANS_HIST		30
+
+struct mgcp_trans_entry {
+	uint32_t trans_nr;
+	time_t stamp;
+	char verb[4];
+	/* -1 when there was no response */
+	int length;
+	char data[512];
+};
+
+struct mgcp_trans_cache {
+	unsigned long hits;
+	unsigned long stored;
+	struct mgcp_trans_entry entries[MGCP_TRANS_CACHE];
+};
+
+int mgcp_parse_msg(struct mgcp_parse_data *data, const char *msg, unsigned int len);
 int mgcp_send_dummy(struct mgcp_endpoint *endp);
 int mgcp_bind_bts_rtp_port(struct mgcp_endpoint *endp, int rtp_port);
 int mgcp_bind_net_rtp_port(struct mgcp_endpoint *endp, int rtp_port);
 int mgcp_bind_transcoder_rtp_port(struct mgcp_endpoint *enp, int rtp_port);
 int mgcp_free_rtp_port(struct mgcp_rtp_end *end);
 
+void mgcp_shard_sync(struct mgcp_endpoint *endp);
+void mgcp_shard_close_fd(struct mgcp_endpoint *endp, int fd);
+struct mgcp_endpoint *mgcp_shard_media_endp(struct mgcp_endpoint *endp);
+const char *mgcp_shard_event_name(int event);
+
 #endif
@@ -0,0 +1,53 @@
+#ifndef _BSC_MMSG_H
+#define _BSC_MMSG_H
+
+/*
+ * recvmmsg() and sendmmsg() for C libraries without them, one system
+ * call per message. Include bscconfig.h before this file.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifndef HAVE_RECVMMSG
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+static inline int recvmmsg(int fd, struct mmsghdr *mmsg, unsigned int vlen,
+			   int flags, void *timeout)
+{
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < vlen; ++i) {
+		rc = recvmsg(fd, &mmsg[i].msg_hdr, flags);
+		if (rc < 0)
+			return i > 0 ? i : rc;
+		mmsg[i].msg_len = rc;
+	}
+
+	return i;
+}
+#endif
+
+#ifndef HAVE_SENDMMSG
+static inline int sendmmsg(int fd, struct mmsghdr *mmsg, unsigned int vlen,
+			   int flags)
+{
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < vlen; ++i) {
+		rc = sendmsg(fd, &mmsg[i].msg_hdr, flags);
+		if (rc < 0)
+			return i > 0 ? i : rc;
+		mmsg[i].msg_len = rc;
+	}
+
+	return i;
+}
+#endif
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _BSC_SELECT_EPOLL_H
+#define _BSC_SELECT_EPOLL_H
+
+#include <osmocore/select.h>
+
+/*
+ * epoll backend for sockets that exist in large numbers (RTP, BSC
+ * connections). Without bsc_epoll_init() every call is forwarded to
+ * the select() based code of libosmocore.
+ */
+int bsc_epoll_init(void);
+int bsc_epoll_enabled(void);
+
+int bsc_epoll_register_fd(struct bsc_fd *fd);
+void bsc_epoll_unregister_fd(struct bsc_fd *fd);
+void bsc_epoll_update_fd(struct bsc_fd *fd);
+
+#endif
@@ -8,11 +8,19 @@
 #include <openbsc/gprs_ns.h>
 #include <openbsc/gprs_sgsn.h>
 
+/* RFC 1144 TCP/IP header compression in SNDCP */
+enum sgsn_pcomp_mode {
+	SGSN_PCOMP_OFF,		/* reject it when the MS proposes it */
+	SGSN_PCOMP_PASSIVE,	/* accept it when the MS proposes it */
+	SGSN_PCOMP_ACTIVE,	/* also propose it for each NSAPI */
+};
+
 struct sgsn_config {
 	/* parsed from config file */
 
 	char *gtp_statedir;
 	struct sockaddr_in gtp_listenaddr;
+	enum sgsn_pcomp_mode pcomp_rfc1144;
 
 	/* misc */
 	struct gprs_ns_inst *nsi;
@@ -50,8 +58,26 @@ struct sgsn_pdp_ctx *sgsn_create_pdp_ctx(struct sgsn_ggsn_ctx *ggsn,
 					 struct tlv_parsed *tp);
 int sgsn_delete_pdp_ctx(struct sgsn_pdp_ctx *pctx);
 
+/* room for the SNDCP, LLC, BSSGP and NS headers in front of a downlink
+ * N-PDU: NS 4, BSSGP DL-UNITDATA with its IEs at most 82 (header 8,
+ * PDU lifetime 4, MS Radio Access Capability up to 2 + 51, DRX 4,
+ * IMSI 10, LLC-PDU 3), LLC 3 and SNDCP 4, so 93 octets rounded up;
+ * behind it the LLC FCS */
+#define SGSN_GB_HEADROOM	128
+#define SGSN_GB_TAILROOM	3
+
 /* gprs_sndcp.c */
 
+/* LL-UNITDATA.ind */
+int sndcp_llunitdata_ind(struct msgb *msg, struct gprs_llc_lle *lle,
+			 uint8_t *hdr, uint16_t len);
+/* LL-XID.ind: the SNDCP XID parameters of a XID command of the MS, the
+ * ones of the response are put into resp, returns their length */
+int sndcp_ll_xid_ind(struct gprs_llc_lle *lle, const uint8_t *xid,
+		     unsigned int len, uint8_t *resp, unsigned int resp_max);
+/* LL-XID.cnf: the SNDCP XID parameters of the response of the MS */
+int sndcp_ll_xid_conf(struct gprs_llc_lle *lle, const uint8_t *xid,
+		      unsigned int len);
 /* Entry point for the SNSM-ACTIVATE.indication */
 int sndcp_sm_activate_ind(struct gprs_llc_lle *lle, uint8_t nsapi);
 /* Entry point for the SNSM-DEACTIVATE.indication */
@@ -59,7 +85,13 @@ int sndcp_sm_deactivate_ind(struct gprs_llc_lle *lle, uint8_t nsapi);
 /* Called by SNDCP when it has received/re-assembled a N-PDU */
 int sgsn_rx_sndcp_ud_ind(struct gprs_ra_id *ra_id, int32_t tlli, uint8_t nsapi,
 			 struct msgb *msg, uint32_t npdu_len, uint8_t *npdu);
+/* SN-UNITDATA.req, the msgb is consumed in any case, also on error */
 int sndcp_unitdata_req(struct msgb *msg, struct gprs_llc_lle *lle, uint8_t nsapi,
 			void *mmcontext);
+/* the same for an entity known by the caller, see sgsn_pdp_ctx.fp */
+struct gprs_sndcp_entity *gprs_sndcp_entity_by_lle(const struct gprs_llc_lle *lle,
+						   uint8_t nsapi);
+int sndcp_unitdata_req_sne(struct msgb *msg, struct gprs_sndcp_entity *sne,
+			   void *mmcontext);
 
 #endif
@@ -175,6 +175,7 @@ enum signal_ns {
 	S_NS_BLOCK,
 	S_NS_UNBLOCK,
 	S_NS_ALIVE_EXP,	/* Tns-alive expired more than N times */
+	S_NS_CHANGED,	/* state, NSEI or address of the NS-VC changed */
 };
 
 struct ns_signal_data {
@@ -0,0 +1,61 @@
+#ifndef _SLHC_H
+#define _SLHC_H
+
+/* TCP/IP header compression as per RFC 1144 */
+
+#include <stdint.h>
+
+/* IP and TCP header with options */
+#define SLHC_MAX_HDR		120
+/* the most states, SNDCP negotiates up to 256 (S0-1 is an octet) */
+#define SLHC_MAX_STATES		256
+
+enum slhc_type {
+	SLHC_TYPE_IP,			/* not compressed, any IP packet */
+	SLHC_TYPE_UNCOMPRESSED_TCP,	/* protocol field is the connection */
+	SLHC_TYPE_COMPRESSED_TCP,
+};
+
+/* the header of one TCP connection, the same for both directions */
+struct slhc_cstate {
+	struct slhc_cstate *next;	/* LRU list, compressor only */
+	uint8_t id;
+	uint8_t hlen;
+	uint8_t hdr[SLHC_MAX_HDR];
+};
+
+struct slhc {
+	/* compressor: the least recently used state, ->next is the most
+	 * recently used one */
+	struct slhc_cstate *last_cs;
+	unsigned int last_xmit;
+	unsigned int tslots;
+	struct slhc_cstate *tstate;
+
+	/* decompressor */
+	unsigned int last_recv;
+	int toss;
+	unsigned int rslots;
+	struct slhc_cstate *rstate;
+};
+
+struct slhc *slhc_alloc(void *ctx, unsigned int tslots, unsigned int rslots);
+void slhc_free(struct slhc *comp);
+
+/* Compress the TCP/IP header of the packet at *pkt in place, *pkt and *len
+ * are moved to the compressed packet. The connection number is left out
+ * when it is the one of the previous packet if compress_cid is set. */
+enum slhc_type slhc_compress(struct slhc *comp, uint8_t **pkt,
+			     unsigned int *len, int compress_cid);
+
+/* Restore the packet at *pkt in place, a compressed packet grows by up to
+ * SLHC_MAX_HDR octets in front of *pkt. Returns the length, 0 when the
+ * packet is to be discarded or a negative error. */
+int slhc_uncompress(struct slhc *comp, enum slhc_type type, uint8_t **pkt,
+		    unsigned int len);
+
+/* a packet got lost, discard compressed packets until one names the
+ * connection again */
+void slhc_toss(struct slhc *comp);
+
+#endif
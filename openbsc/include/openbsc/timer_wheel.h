@@ -0,0 +1,63 @@
+#ifndef _BSC_TIMER_WHEEL_H
+#define _BSC_TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#include <osmocore/linuxlist.h>
+#include <osmocore/timer.h>
+
+/*
+ * Hierarchical timer wheel for subsystems arming a lot of timers.
+ * Arming and cancelling are O(1) compared to the sorted list of
+ * libosmocore. A struct timer_list is used for the timers so code can
+ * be converted by using the calls below. The resolution is one tick.
+ */
+
+#define TW_TICK_MS	10
+
+#define TW_ROOT_BITS	8
+#define TW_LVL_BITS	6
+#define TW_LEVELS	4
+#define TW_ROOT_SIZE	(1 << TW_ROOT_BITS)
+#define TW_LVL_SIZE	(1 << TW_LVL_BITS)
+
+struct bsc_timer_wheel {
+	/* list of all wheels */
+	struct llist_head entry;
+	const char *name;
+
+	/* statistics */
+	unsigned int armed;
+	unsigned int max_armed;
+	unsigned long scheduled;
+	unsigned long expired;
+	unsigned long cancelled;
+
+	/* the next tick to be processed */
+	uint32_t now;
+	struct llist_head root[TW_ROOT_SIZE];
+	struct llist_head lvl[TW_LEVELS][TW_LVL_SIZE];
+};
+
+/* one wheel per subsystem, initialized on first use */
+#define BSC_TIMER_WHEEL(_name) { .name = _name, }
+
+extern struct llist_head bsc_timer_wheels;
+
+void bsc_wheel_schedule(struct bsc_timer_wheel *wheel, struct timer_list *timer,
+			int seconds, int microseconds);
+void bsc_wheel_del(struct bsc_timer_wheel *wheel, struct timer_list *timer);
+
+static inline int bsc_wheel_pending(struct timer_list *timer)
+{
+	return timer->active;
+}
+
+/* same API as libosmocore using the "other" wheel */
+void bsc_wheel_schedule_timer(struct timer_list *timer, int seconds, int microseconds);
+void bsc_wheel_del_timer(struct timer_list *timer);
+int bsc_wheel_timer_pending(struct timer_list *timer);
+
+void bsc_timer_wheel_vty_init(void);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef _BSC_WORKER_QUEUE_H
+#define _BSC_WORKER_QUEUE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <osmocore/linuxlist.h>
+
+/*
+ * Lock free hand over between the select loop and worker threads. The
+ * threads pass their results through a multi producer/single consumer
+ * queue. The select loop passes commands to a thread through a single
+ * producer/single consumer ring, the slots of the ring are kept by the
+ * user. Both sides are woken up through an eventfd.
+ *
+ * The threads never call the logging code, it is not thread safe.
+ * They count their errors and the select loop reports them.
+ */
+
+/* embedded in the item that is queued */
+struct worker_queue_node {
+	struct worker_queue_node *volatile next;
+};
+
+struct worker_queue {
+	/* pushed by any thread */
+	struct worker_queue_node *volatile head;
+	/* popped by the consumer */
+	struct worker_queue_node *tail;
+	struct worker_queue_node stub;
+	volatile unsigned int queued;
+};
+
+#define worker_queue_entry(node, type, member) container_of(node, type, member)
+
+void worker_queue_init(struct worker_queue *queue);
+void worker_queue_push(struct worker_queue *queue, struct worker_queue_node *node);
+struct worker_queue_node *worker_queue_pop(struct worker_queue *queue);
+
+/* any thread, return -1 when the eventfd could not be written or read */
+int worker_event_signal(int fd);
+int worker_event_clear(int fd);
+
+/* the errors every thread counts, the user adds its own behind them */
+enum worker_error {
+	WORKER_ERR_WAKEUP,
+	_WORKER_ERR_MAX,
+};
+
+#define WORKER_ERRORS	8
+
+struct worker_thread;
+
+struct worker_desc {
+	/* how the select loop logs about the thread */
+	const char *name;
+	int subsys;
+	/* indexed by the errors of the user, up to WORKER_ERRORS */
+	const char **error_names;
+	unsigned int num_errors;
+
+	/* the thread takes the command in the slot of the ring */
+	unsigned int ring_size;
+	void (*apply)(struct worker_thread *thread, unsigned int slot);
+};
+
+struct worker_thread {
+	const struct worker_desc *desc;
+	int nr;
+	pthread_t thread;
+	/* the thread sleeps on it, commands and the end of a throttle */
+	int event_fd;
+	/* the select loop blocks on it while the ring is full */
+	int space_fd;
+
+	/* written by the select loop, read by the thread */
+	volatile unsigned int head;
+	/* written by the thread, read by the select loop */
+	volatile unsigned int tail;
+
+	/* the select loop waits for a free slot of the ring */
+	volatile int producer_waiting;
+	/* the thread waits for the select loop to take its items */
+	volatile int throttle_waiting;
+
+	/* the select loop */
+	unsigned long ring_full;
+	unsigned long reported[WORKER_ERRORS];
+	int failure_reported;
+
+	/* the thread */
+	unsigned long throttled;
+	unsigned long errors[WORKER_ERRORS];
+	/* the errno when the thread stopped */
+	volatile int failed;
+};
+
+int worker_thread_init(struct worker_thread *thread,
+		       const struct worker_desc *desc, int nr);
+void worker_thread_close(struct worker_thread *thread);
+int worker_thread_start(pthread_t *thread, void *(*start)(void *), void *data);
+
+/* the select loop */
+void worker_wakeup(struct worker_thread *thread);
+unsigned int worker_cmd_get(struct worker_thread *thread);
+void worker_cmd_put(struct worker_thread *thread);
+void worker_resume(struct worker_thread *thread, struct worker_queue *queue,
+		   unsigned int limit);
+void worker_report(struct worker_thread *thread);
+
+/* the thread */
+void worker_drain(struct worker_thread *thread);
+void worker_throttle(struct worker_thread *thread, struct worker_queue *queue,
+		     unsigned int limit, int consumer_fd);
+
+#endif
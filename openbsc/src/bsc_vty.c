@@ -44,6 +44,7 @@
 #include <openbsc/gprs_ns.h>
 #include <openbsc/system_information.h>
 #include <openbsc/debug.h>
+#include <openbsc/timer_wheel.h>
 
 #include "../bscconfig.h"
 
@@ -2399,6 +2400,7 @@ int bsc_vty_init(void)
 	install_element(TS_NODE, &cfg_ts_e1_subslot_cmd);
 
 	abis_nm_vty_init();
+	bsc_timer_wheel_vty_init();
 
 	bsc_vty_init_extra();
 
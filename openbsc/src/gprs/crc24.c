@@ -23,6 +23,8 @@
 #include <sys/types.h>
 #include <openbsc/crc24.h>
 
+#include "../../bscconfig.h"
+
 /* CRC24 table - FCS */
 static const u_int32_t tbl_crc24[256] = {
 	0x00000000, 0x00d6a776, 0x00f64557, 0x0020e221, 0x00b78115, 0x00612663, 0x0041c442, 0x00976334,
@@ -59,11 +61,70 @@ static const u_int32_t tbl_crc24[256] = {
 	0x00dafe19, 0x000c596f, 0x002cbb4e, 0x00fa1c38, 0x006d7f0c, 0x00bbd87a, 0x009b3a5b, 0x004d9d2d
 };
 
-#define INIT_CRC24	0xffffff
+/* tbl_slice[k][i] is the CRC of byte i followed by k zero bytes */
+static u_int32_t tbl_slice[8][256];
+static int tbl_slice_ready;
 
-u_int32_t crc24_calc(u_int32_t fcs, u_int8_t *cp, unsigned int len)
+static void crc24_init_slice(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; ++i)
+		tbl_slice[0][i] = tbl_crc24[i];
+	for (k = 1; k < 8; ++k)
+		for (i = 0; i < 256; ++i)
+			tbl_slice[k][i] = (tbl_slice[k - 1][i] >> 8) ^
+				tbl_crc24[tbl_slice[k - 1][i] & 0xff];
+	tbl_slice_ready = 1;
+}
+
+u_int32_t crc24_calc_table(u_int32_t fcs, u_int8_t *cp, unsigned int len)
 {
 	while (len--)
 		fcs = (fcs >> 8) ^ tbl_crc24[(fcs ^ *cp++) & 0xff];
 	return fcs;
 }
+
+/* eight octets per round, the loads are independent of the CRC */
+u_int32_t crc24_calc_slice8(u_int32_t fcs, u_int8_t *cp, unsigned int len)
+{
+	if (!tbl_slice_ready)
+		crc24_init_slice();
+
+	while (len >= 8) {
+		u_int32_t lo = fcs ^ (cp[0] | cp[1] << 8 | cp[2] << 16 |
+				      (u_int32_t) cp[3] << 24);
+		u_int32_t hi = cp[4] | cp[5] << 8 | cp[6] << 16 |
+			       (u_int32_t) cp[7] << 24;
+
+		fcs = tbl_slice[7][lo & 0xff] ^ tbl_slice[6][(lo >> 8) & 0xff] ^
+		      tbl_slice[5][(lo >> 16) & 0xff] ^ tbl_slice[4][lo >> 24] ^
+		      tbl_slice[3][hi & 0xff] ^ tbl_slice[2][(hi >> 8) & 0xff] ^
+		      tbl_slice[1][(hi >> 16) & 0xff] ^ tbl_slice[0][hi >> 24];
+		cp += 8;
+		len -= 8;
+	}
+
+	return crc24_calc_table(fcs, cp, len);
+}
+
+static u_int32_t crc24_calc_select(u_int32_t fcs, u_int8_t *cp, unsigned int len);
+static u_int32_t (*crc24_impl)(u_int32_t fcs, u_int8_t *cp, unsigned int len) =
+	crc24_calc_select;
+
+/* pick the implementation on the first call */
+static u_int32_t crc24_calc_select(u_int32_t fcs, u_int8_t *cp, unsigned int len)
+{
+	crc24_init_slice();
+	crc24_impl = crc24_calc_slice8;
+#ifdef HAVE_PCLMUL
+	if (crc24_pclmul_supported())
+		crc24_impl = crc24_calc_pclmul;
+#endif
+	return crc24_impl(fcs, cp, len);
+}
+
+u_int32_t crc24_calc(u_int32_t fcs, u_int8_t *cp, unsigned int len)
+{
+	return crc24_impl(fcs, cp, len);
+}
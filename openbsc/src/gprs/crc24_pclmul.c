@@ -0,0 +1,137 @@
+/* GPRS LLC CRC-24 with carry-less multiplication (PCLMULQDQ) */
+
+/* (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * Only built with HAVE_PCLMUL and -mpclmul, crc24_calc() uses it when
+ * the CPU has the instruction.
+ *
+ * The message is folded into 128 bit by replacing the upper and lower
+ * 64 bit of a block B with B_hi * (x^(D+64) mod P) + B_lo * (x^D mod P)
+ * which is congruent to B * x^D modulo the CRC polynomial P and then
+ * adding the block D bits further. The CRC of the remaining 16 octets
+ * is the CRC of the message. The CRC is bit reflected, the product of
+ * two reflected 64 bit values is off by one bit which is accounted for
+ * by using x^(n-1) for the constants.
+ */
+
+#include <sys/types.h>
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#include <openbsc/crc24.h>
+
+/* x^24 + x^23 + x^21 + x^20 + x^19 + x^17 + x^16 + x^15 + x^13 + x^8
+ * + x^7 + x^5 + x^4 + x^2 + 1, the table of crc24.c is the reflected one */
+#define CRC24_POLY	0x1bba1b5
+
+/* fold by 4 blocks (D = 512) and by one block (D = 128) */
+static __m128i k_fold4, k_fold1;
+static int k_ready;
+
+/* x^n mod P reflected into the upper bits of 64 bit */
+static u_int64_t xn_mod_p_reflected(unsigned int n)
+{
+	u_int64_t reflected = 0;
+	u_int32_t rem = 1;
+	int i;
+
+	while (n--) {
+		rem <<= 1;
+		if (rem & 0x1000000)
+			rem ^= CRC24_POLY;
+	}
+
+	for (i = 0; i < 24; ++i)
+		if (rem & (1 << i))
+			reflected |= 1ULL << (63 - i);
+	return reflected;
+}
+
+static void init_constants(void)
+{
+	k_fold4 = _mm_set_epi64x(xn_mod_p_reflected(512 - 1),
+				 xn_mod_p_reflected(512 + 64 - 1));
+	k_fold1 = _mm_set_epi64x(xn_mod_p_reflected(128 - 1),
+				 xn_mod_p_reflected(128 + 64 - 1));
+	k_ready = 1;
+}
+
+static inline __m128i fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+			     _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+#define LOAD(p)	_mm_loadu_si128((const __m128i *) (p))
+
+int crc24_pclmul_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_PCLMUL) && (edx & bit_SSE2);
+}
+
+u_int32_t crc24_calc_pclmul(u_int32_t fcs, u_int8_t *cp, unsigned int len)
+{
+	__m128i x0, x1, x2, x3;
+	u_int8_t rem[16];
+
+	/* not worth it for short frames */
+	if (len < 64)
+		return crc24_calc_slice8(fcs, cp, len);
+
+	if (!k_ready)
+		init_constants();
+
+	/* the CRC so far is added to the first octets */
+	x0 = _mm_xor_si128(LOAD(cp), _mm_cvtsi32_si128(fcs));
+	x1 = LOAD(cp + 16);
+	x2 = LOAD(cp + 32);
+	x3 = LOAD(cp + 48);
+	cp += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x0 = _mm_xor_si128(fold(x0, k_fold4), LOAD(cp));
+		x1 = _mm_xor_si128(fold(x1, k_fold4), LOAD(cp + 16));
+		x2 = _mm_xor_si128(fold(x2, k_fold4), LOAD(cp + 32));
+		x3 = _mm_xor_si128(fold(x3, k_fold4), LOAD(cp + 48));
+		cp += 64;
+		len -= 64;
+	}
+
+	x1 = _mm_xor_si128(fold(x0, k_fold1), x1);
+	x2 = _mm_xor_si128(fold(x1, k_fold1), x2);
+	x3 = _mm_xor_si128(fold(x2, k_fold1), x3);
+
+	while (len >= 16) {
+		x3 = _mm_xor_si128(fold(x3, k_fold1), LOAD(cp));
+		cp += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *) rem, x3);
+	fcs = crc24_calc_slice8(0, rem, sizeof(rem));
+	return crc24_calc_slice8(fcs, cp, len);
+}
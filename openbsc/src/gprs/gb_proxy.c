@@ -51,16 +51,32 @@ struct gbprox_peer {
 
 	/* Routeing Area that this peer is part of (raw 04.08 encoding) */
 	uint8_t ra[6];
+
+	/* lookup by BVCI, NS-VC, RA and LA */
+	struct hash_entry bvci_entry;
+	struct hash_entry nsvc_entry;
+	struct hash_entry rac_entry;
+	struct hash_entry lac_entry;
 };
 
 /* Linked list of all Gb peers (except SGSN) */
 static LLIST_HEAD(gbprox_bts_peers);
+static struct hash_index peer_by_bvci_idx;
+static struct hash_index peer_by_nsvc_idx;
+static struct hash_index peer_by_rac_idx;
+static struct hash_index peer_by_lac_idx;
+
+static uint32_t nsvc_hash(struct gprs_nsvc *nsvc)
+{
+	return hash_index_bytes(&nsvc, sizeof(nsvc));
+}
 
 /* Find the gbprox_peer by its BVCI */
 static struct gbprox_peer *peer_by_bvci(uint16_t bvci)
 {
 	struct gbprox_peer *peer;
-	llist_for_each_entry(peer, &gbprox_bts_peers, list) {
+	hash_index_for_each(peer, &peer_by_bvci_idx, hash_index_u32(bvci),
+			    bvci_entry) {
 		if (peer->bvci == bvci)
 			return peer;
 	}
@@ -70,7 +86,8 @@ static struct gbprox_peer *peer_by_bvci(uint16_t bvci)
 static struct gbprox_peer *peer_by_nsvc(struct gprs_nsvc *nsvc)
 {
 	struct gbprox_peer *peer;
-	llist_for_each_entry(peer, &gbprox_bts_peers, list) {
+	hash_index_for_each(peer, &peer_by_nsvc_idx, nsvc_hash(nsvc),
+			    nsvc_entry) {
 		if (peer->nsvc == nsvc)
 			return peer;
 	}
@@ -81,7 +98,8 @@ static struct gbprox_peer *peer_by_nsvc(struct gprs_nsvc *nsvc)
 static struct gbprox_peer *peer_by_rac(const uint8_t *ra)
 {
 	struct gbprox_peer *peer;
-	llist_for_each_entry(peer, &gbprox_bts_peers, list) {
+	hash_index_for_each(peer, &peer_by_rac_idx, hash_index_bytes(ra, 6),
+			    rac_entry) {
 		if (!memcmp(peer->ra, ra, 6))
 			return peer;
 	}
@@ -92,14 +110,32 @@ static struct gbprox_peer *peer_by_rac(const uint8_t *ra)
 static struct gbprox_peer *peer_by_lac(const uint8_t *la)
 {
 	struct gbprox_peer *peer;
-	llist_for_each_entry(peer, &gbprox_bts_peers, list) {
+	hash_index_for_each(peer, &peer_by_lac_idx, hash_index_bytes(la, 5),
+			    lac_entry) {
 		if (!memcmp(peer->ra, la, 5))
 			return peer;
 	}
 	return NULL;
 }
 
-static struct gbprox_peer *peer_alloc(uint16_t bvci)
+static void peer_set_ra(struct gbprox_peer *peer, const uint8_t *ra)
+{
+	memcpy(peer->ra, ra, sizeof(peer->ra));
+	hash_index_rehash(tall_bsc_ctx, &peer_by_rac_idx, &peer->rac_entry,
+			  hash_index_bytes(peer->ra, 6));
+	hash_index_rehash(tall_bsc_ctx, &peer_by_lac_idx, &peer->lac_entry,
+			  hash_index_bytes(peer->ra, 5));
+}
+
+static void peer_unindex(struct gbprox_peer *peer)
+{
+	hash_index_del(&peer_by_bvci_idx, &peer->bvci_entry);
+	hash_index_del(&peer_by_nsvc_idx, &peer->nsvc_entry);
+	hash_index_del(&peer_by_rac_idx, &peer->rac_entry);
+	hash_index_del(&peer_by_lac_idx, &peer->lac_entry);
+}
+
+static struct gbprox_peer *peer_alloc(uint16_t bvci, struct gprs_nsvc *nsvc)
 {
 	struct gbprox_peer *peer;
 
@@ -108,13 +144,29 @@ static struct gbprox_peer *peer_alloc(uint16_t bvci)
 		return NULL;
 
 	peer->bvci = bvci;
+	peer->nsvc = nsvc;
+	if (hash_index_add(tall_bsc_ctx, &peer_by_bvci_idx, &peer->bvci_entry,
+			   hash_index_u32(bvci)) != 0 ||
+	    hash_index_add(tall_bsc_ctx, &peer_by_nsvc_idx, &peer->nsvc_entry,
+			   nsvc_hash(nsvc)) != 0 ||
+	    hash_index_add(tall_bsc_ctx, &peer_by_rac_idx, &peer->rac_entry,
+			   hash_index_bytes(peer->ra, 6)) != 0 ||
+	    hash_index_add(tall_bsc_ctx, &peer_by_lac_idx, &peer->lac_entry,
+			   hash_index_bytes(peer->ra, 5)) != 0) {
+		peer_unindex(peer);
+		talloc_free(peer);
+		return NULL;
+	}
 	llist_add(&peer->list, &gbprox_bts_peers);
+	gbprox_workers_bvc(&gbcfg, bvci, nsvc);
 
 	return peer;
 }
 
 static void peer_free(struct gbprox_peer *peer)
 {
+	gbprox_workers_bvc(&gbcfg, peer->bvci, NULL);
+	peer_unindex(peer);
 	llist_del(&peer->list);
 	talloc_free(peer);
 }
@@ -165,12 +217,16 @@ static void strip_ns_hdr(struct msgb *msg)
 	msgb_pull(msg, strip_len);
 }
 
+/*
+ * The received message is taken from the NS layer and sent on. Its NS
+ * header is stripped and gprs_ns_sendmsg() pushes the new one into the
+ * same place, the BSSGP PDU itself is not copied.
+ */
+
 /* feed a message down the NS-VC associated with the specified peer */
-static int gbprox_relay2sgsn(struct msgb *old_msg, uint16_t ns_bvci)
+static int gbprox_relay2sgsn(struct msgb *msg, uint16_t ns_bvci)
 {
-	/* create a copy of the message so the old one can
-	 * be free()d safely when we return from gbprox_rcvmsg() */
-	struct msgb *msg = msgb_copy(old_msg, "msgb_relay2sgsn");
+	gprs_ns_msgb_take(bssgp_nsi, msg);
 
 	DEBUGP(DGPRS, "NSEI=%u proxying BTS->SGSN (NS_BVCI=%u, NSEI=%u)\n",
 		msgb_nsei(msg), ns_bvci, gbcfg.nsip_sgsn_nsei);
@@ -184,12 +240,10 @@ static int gbprox_relay2sgsn(struct msgb *old_msg, uint16_t ns_bvci)
 }
 
 /* feed a message down the NS-VC associated with the specified peer */
-static int gbprox_relay2peer(struct msgb *old_msg, struct gbprox_peer *peer,
+static int gbprox_relay2peer(struct msgb *msg, struct gbprox_peer *peer,
 			  uint16_t ns_bvci)
 {
-	/* create a copy of the message so the old one can
-	 * be free()d safely when we return from gbprox_rcvmsg() */
-	struct msgb *msg = msgb_copy(old_msg, "msgb_relay2peer");
+	gprs_ns_msgb_take(bssgp_nsi, msg);
 
 	DEBUGP(DGPRS, "NSEI=%u proxying SGSN->BSS (NS_BVCI=%u, NSEI=%u)\n",
 		msgb_nsei(msg), ns_bvci, peer->nsvc->nsei);
@@ -261,8 +315,7 @@ static int gbprox_rx_sig_from_bss(struct msgb *msg, struct gprs_nsvc *nsvc,
 		from_peer = peer_by_nsvc(nsvc);
 		if (!from_peer)
 			goto err_no_peer;
-		memcpy(from_peer->ra, TLVP_VAL(&tp, BSSGP_IE_ROUTEING_AREA),
-			sizeof(from_peer->ra));
+		peer_set_ra(from_peer, TLVP_VAL(&tp, BSSGP_IE_ROUTEING_AREA));
 		gsm48_parse_ra(&raid, from_peer->ra);
 		LOGP(DGPRS, LOGL_INFO, "NSEI=%u BSSGP SUSPEND/RESUME "
 			"RAC snooping: RAC %u-%u-%u-%u behind BVCI=%u, "
@@ -292,8 +345,7 @@ static int gbprox_rx_sig_from_bss(struct msgb *msg, struct gprs_nsvc *nsvc,
 				LOGP(DGPRS, LOGL_INFO, "Allocationg new peer for "
 				     "BVCI=%u via NSVCI=%u/NSEI=%u\n", bvci,
 				     nsvc->nsvci, nsvc->nsei);
-				from_peer = peer_alloc(bvci);
-				from_peer->nsvc = nsvc;
+				from_peer = peer_alloc(bvci, nsvc);
 			}
 			if (TLVP_PRESENT(&tp, BSSGP_IE_CELL_ID)) {
 				struct gprs_ra_id raid;
@@ -301,9 +353,8 @@ static int gbprox_rx_sig_from_bss(struct msgb *msg, struct gprs_nsvc *nsvc,
 				 * PDU, this means we can extend our local
 				 * state information about this particular cell
 				 * */
-				memcpy(from_peer->ra,
-					TLVP_VAL(&tp, BSSGP_IE_CELL_ID),
-					sizeof(from_peer->ra));
+				peer_set_ra(from_peer,
+					    TLVP_VAL(&tp, BSSGP_IE_CELL_ID));
 				gsm48_parse_ra(&raid, from_peer->ra);
 				LOGP(DGPRS, LOGL_INFO, "NSEI=%u/BVCI=%u "
 				     "Cell ID %u-%u-%u-%u\n", nsvc->nsei,
@@ -388,8 +439,13 @@ static int rx_reset_from_sgsn(struct msgb *msg, struct tlv_parsed *tp,
 	 * from the SGSN.  As the signalling BVCI is shared
 	 * among all the BSS's that we multiplex, it needs to
 	 * be relayed  */
-	llist_for_each_entry(peer, &gbprox_bts_peers, list)
-		gbprox_relay2peer(msg, peer, ns_bvci);
+	llist_for_each_entry(peer, &gbprox_bts_peers, list) {
+		struct msgb *copy = msgb_copy(msg, "msgb_relay2peer");
+
+		if (!copy)
+			return -ENOMEM;
+		gbprox_relay2peer(copy, peer, ns_bvci);
+	}
 
 	return 0;
 }
@@ -519,8 +575,7 @@ int gbprox_rcvmsg(struct msgb *msg, struct gprs_nsvc *nsvc, uint16_t ns_bvci)
 				LOGP(DGPRS, LOGL_INFO, "Allocationg new peer for "
 				     "BVCI=%u via NSVC=%u/NSEI=%u\n", ns_bvci,
 				     nsvc->nsvci, nsvc->nsei);
-				peer = peer_alloc(ns_bvci);
-				peer->nsvc = nsvc;
+				peer = peer_alloc(ns_bvci, nsvc);
 			}
 			rc = gbprox_relay2peer(msg, peer, ns_bvci);
 		}
@@ -560,6 +615,17 @@ int gbprox_signal(unsigned int subsys, unsigned int signal,
 		nsvc->remote_end_is_sgsn = 1;
 	}
 
+	/* the NS threads relay only between alive and unblocked NS-VCs */
+	gbprox_workers_nsvc(&gbcfg, nsvc);
+	if (signal == S_NS_CHANGED) {
+		/* the NSEI of the BVCs might have changed */
+		if (gbcfg.workers)
+			llist_for_each_entry(peer, &gbprox_bts_peers, list)
+				if (peer->nsvc == nsvc)
+					gbprox_workers_bvc(&gbcfg, peer->bvci, nsvc);
+		return 0;
+	}
+
 	if (signal == S_NS_ALIVE_EXP && nsvc->remote_end_is_sgsn) {
 		LOGP(DGPRS, LOGL_NOTICE, "Tns alive expired too often, "
 			"re-starting RESET procedure\n");
@@ -591,6 +657,37 @@ int gbprox_signal(unsigned int subsys, unsigned int signal,
 
 #include <osmocom/vty/command.h>
 
+static void show_workers(struct vty *vty)
+{
+	struct gbprox_sender *sender = gbcfg.sender;
+	struct gbprox_frames *frames = gbcfg.frames;
+	int i;
+
+	vty_out(vty, "NS threads: wakeups: %lu to NS: %lu queued: %u dropped: %lu%s",
+		frames->wakeups, frames->frames, frames->queue.queued,
+		frames->dropped, VTY_NEWLINE);
+	vty_out(vty, " SGSN sender: wakeups: %lu sent: %lu queued: %u "
+		"errors: %lu blocked: %lu wakeup errors: %lu%s", sender->wakeups,
+		sender->sent, sender->queue.queued, sender->errors,
+		sender->blocked, sender->wakeup_errors, VTY_NEWLINE);
+	for (i = 0; i < gbcfg.num_workers; ++i) {
+		struct gbprox_worker *worker = &gbcfg.workers[i];
+
+		vty_out(vty, " NS thread %d: wakeups: %lu received: %lu "
+			"to SGSN: %lu to BSS: %lu to NS: %lu dropped: %lu%s",
+			i, worker->wakeups, worker->received, worker->to_sgsn,
+			worker->to_bss, worker->slow_path, worker->dropped,
+			VTY_NEWLINE);
+		vty_out(vty, "  commands: %u ring full: %lu throttled: %lu%s",
+			worker->thread.head - worker->thread.tail,
+			worker->thread.ring_full, worker->thread.throttled,
+			VTY_NEWLINE);
+		vty_out(vty, "  errors: NSE: %lu wakeup: %lu%s",
+			worker->thread.errors[GBPROX_WORKER_ERR_NSE],
+			worker->thread.errors[WORKER_ERR_WAKEUP], VTY_NEWLINE);
+	}
+}
+
 gDEFUN(show_gbproxy, show_gbproxy_cmd, "show gbproxy",
        SHOW_STR "Display information about the Gb proxy")
 {
@@ -612,5 +709,8 @@ gDEFUN(show_gbproxy, show_gbproxy_cmd, "show gbproxy",
 		else
 			vty_out(vty, "%s", VTY_NEWLINE);
 	}
+
+	if (gbcfg.workers)
+		show_workers(vty);
 	return CMD_SUCCESS;
 }
@@ -255,6 +255,10 @@ int main(int argc, char **argv)
 		exit(2);
 	}
 
+	/* the NS threads bind their own sockets to the same port */
+	if (gbcfg.num_workers > 0)
+		bssgp_nsi->nsip.reuse_port = 1;
+
 	rc = gprs_ns_nsip_listen(bssgp_nsi);
 	if (rc < 0) {
 		LOGP(DGPRS, LOGL_FATAL, "Cannot bind/listen on NSIP socket\n");
@@ -276,6 +280,13 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* after the fork, the threads would not survive it */
+	rc = gbprox_workers_start(&gbcfg);
+	if (rc < 0) {
+		LOGP(DGPRS, LOGL_FATAL, "Cannot start the NS threads\n");
+		exit(2);
+	}
+
 	/* Reset all the persistent NS-VCs that we've read from the config */
 	gbprox_reset_persistent_nsvcs(bssgp_nsi);
 
@@ -30,6 +30,7 @@
 #include <openbsc/gb_proxy.h>
 #include <openbsc/gprs_ns.h>
 #include <openbsc/vty.h>
+#include <openbsc/timer_wheel.h>
 
 #include <osmocom/vty/command.h>
 #include <osmocom/vty/vty.h>
@@ -51,6 +52,9 @@ static int config_write_gbproxy(struct vty *vty)
 
 	vty_out(vty, " sgsn nsei %u%s", g_cfg->nsip_sgsn_nsei,
 		VTY_NEWLINE);
+	if (g_cfg->num_workers > 0)
+		vty_out(vty, " worker-threads %d%s", g_cfg->num_workers,
+			VTY_NEWLINE);
 
 	return CMD_SUCCESS;
 }
@@ -75,9 +79,19 @@ DEFUN(cfg_nsip_sgsn_nsei,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_worker_threads,
+      cfg_worker_threads_cmd,
+      "worker-threads <0-64>",
+      "Relay the NS/UDP traffic on the given number of threads. This is not dynamic.")
+{
+	g_cfg->num_workers = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 int gbproxy_vty_init(void)
 {
 	install_element_ve(&show_gbproxy_cmd);
+	bsc_timer_wheel_vty_init();
 
 	install_element(CONFIG_NODE, &cfg_gbproxy_cmd);
 	install_node(&gbproxy_node, config_write_gbproxy);
@@ -85,6 +99,7 @@ int gbproxy_vty_init(void)
 	install_element(GBPROXY_NODE, &ournode_exit_cmd);
 	install_element(GBPROXY_NODE, &ournode_end_cmd);
 	install_element(GBPROXY_NODE, &cfg_nsip_sgsn_nsei_cmd);
+	install_element(GBPROXY_NODE, &cfg_worker_threads_cmd);
 
 	return 0;
 }
@@ -0,0 +1,813 @@
+/* NS/UDP worker threads of the Gb proxy */
+
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * The select loop keeps reading the NS/UDP socket of the NS layer, the
+ * workers read the other sockets of its SO_REUSEPORT group. A worker
+ * only relays the NS UNITDATA of a PTP BVC between two NS-VCs that are
+ * alive and unblocked, just like gbprox_rcvmsg() would. The NS header
+ * is the same on both sides and the datagram is sent as it is. The
+ * datagrams for the SGSN go through the queue of the sender thread, it
+ * writes them from the socket of the NS layer so the SGSN sees a single
+ * NS-VC. The datagrams for a BSS are written from the socket of the
+ * worker. Everything else is passed to the NS layer in the select loop.
+ *
+ * The datagrams are plain malloc'ed memory, no talloc or msgb is used
+ * on the threads. The copy of the NS-VCs and BVCs is owned by the
+ * worker and only changed by the commands of the select loop.
+ *
+ * Once a datagram of a PTP BVC went to the NS layer the later ones of
+ * the BVC follow it there, until the NS layer has handled all of them.
+ * Otherwise a datagram relayed by the worker could overtake them.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <osmocore/talloc.h>
+#include <osmocore/select.h>
+#include <osmocore/timer.h>
+#include <osmocore/utils.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/gprs_ns.h>
+#include <openbsc/gb_proxy.h>
+#include <openbsc/hash_index.h>
+#include <openbsc/worker_queue.h>
+#include "../../bscconfig.h"
+#include <openbsc/mmsg.h>
+
+#define GBPROX_BVCI_KNOWN	0x10000
+#define GBPROX_ADDRS_MIN	64
+#define GBPROX_WORKER_REPORT	10
+
+extern void *tall_bsc_ctx;
+
+static const char *worker_error_names[_GBPROX_WORKER_ERR_MAX] = {
+	[GBPROX_WORKER_ERR_NSE]		= "NSEs that could not be added",
+};
+
+static void worker_apply(struct worker_thread *thread, unsigned int slot);
+
+static const struct worker_desc worker_desc = {
+	.name		= "NS thread",
+	.subsys		= DGPRS,
+	.error_names	= worker_error_names,
+	.num_errors	= _GBPROX_WORKER_ERR_MAX,
+	.ring_size	= GBPROX_WORKER_RING,
+	.apply		= worker_apply,
+};
+
+static struct timer_list report_timer;
+
+static struct gbprox_dgram *dgram_alloc(void)
+{
+	return malloc(sizeof(struct gbprox_dgram) + NS_ALLOC_SIZE);
+}
+
+static void queue_push(struct worker_queue *queue, struct gbprox_dgram *dgram)
+{
+	worker_queue_push(queue, &dgram->node);
+}
+
+static struct gbprox_dgram *queue_pop(struct worker_queue *queue)
+{
+	struct worker_queue_node *node = worker_queue_pop(queue);
+
+	if (!node)
+		return NULL;
+	return worker_queue_entry(node, struct gbprox_dgram, node);
+}
+
+/*
+ * Update the NS-VC on the workers. Only NS/UDP NS-VCs are relayed, the
+ * port of a FR/GRE NS-VC is its DLCI.
+ */
+void gbprox_workers_nsvc(struct gbproxy_config *cfg, struct gprs_nsvc *nsvc)
+{
+	unsigned int flags = 0;
+	int i;
+
+	if (!cfg->workers || nsvc == cfg->nsi->unknown_nsvc)
+		return;
+
+	if (nsvc->ll == GPRS_NS_LL_UDP && nsvc->state == NSE_S_ALIVE)
+		flags |= GBPROX_NSE_FWD;
+	if (nsvc->remote_end_is_sgsn)
+		flags |= GBPROX_NSE_SGSN;
+
+	for (i = 0; i < cfg->num_workers; ++i) {
+		struct gbprox_worker *worker = &cfg->workers[i];
+		struct gbprox_worker_cmd *cmd =
+			&worker->ring[worker_cmd_get(&worker->thread)];
+
+		cmd->type = GBPROX_WORKER_NSE;
+		cmd->nsei = nsvc->nsei;
+		cmd->flags = flags;
+		memset(&cmd->addr, 0, sizeof(cmd->addr));
+		if (nsvc->ll == GPRS_NS_LL_UDP)
+			cmd->addr = nsvc->ip.bts_addr;
+		worker_cmd_put(&worker->thread);
+	}
+}
+
+/* Update the PTP BVC on the workers, it is unknown without a NS-VC */
+void gbprox_workers_bvc(struct gbproxy_config *cfg, uint16_t bvci,
+			struct gprs_nsvc *nsvc)
+{
+	int i;
+
+	if (!cfg->workers)
+		return;
+
+	for (i = 0; i < cfg->num_workers; ++i) {
+		struct gbprox_worker *worker = &cfg->workers[i];
+		struct gbprox_worker_cmd *cmd =
+			&worker->ring[worker_cmd_get(&worker->thread)];
+
+		cmd->type = GBPROX_WORKER_BVC;
+		cmd->bvci = bvci;
+		cmd->nsei = nsvc ? nsvc->nsei : 0;
+		cmd->flags = nsvc != NULL;
+		worker_cmd_put(&worker->thread);
+	}
+}
+
+/* the datagram is done, the worker may relay its BVC again */
+static void frame_done(struct gbprox_dgram *dgram)
+{
+	if (dgram->slow)
+		__sync_fetch_and_sub(dgram->slow, 1);
+	free(dgram);
+}
+
+static void frame_handle(struct gbprox_frames *frames, struct gbprox_dgram *dgram)
+{
+	struct msgb *msg;
+
+	msg = gprs_ns_msgb_alloc();
+	if (!msg) {
+		LOGP(DGPRS, LOGL_ERROR, "Failed to allocate the NS msg.\n");
+		frames->dropped += 1;
+		frame_done(dgram);
+		return;
+	}
+
+	msg->l2h = msgb_put(msg, dgram->len);
+	memcpy(msg->l2h, dgram->data, dgram->len);
+	frames->frames += 1;
+	gprs_ns_rcvmsg(frames->nsi, msg, &dgram->addr, GPRS_NS_LL_UDP);
+	frame_done(dgram);
+}
+
+static int frames_cb(struct bsc_fd *bfd, unsigned int what)
+{
+	struct gbprox_frames *frames = bfd->data;
+	struct gbproxy_config *cfg = frames->cfg;
+	int i, nr;
+
+	if (worker_event_clear(bfd->fd) != 0)
+		LOGP(DGPRS, LOGL_ERROR, "Failed to read the wakeup of the NS threads.\n");
+	frames->wakeups += 1;
+
+	for (i = 0; i < GBPROX_WORKER_FRAMES; ++i) {
+		struct gbprox_dgram *dgram = queue_pop(&frames->queue);
+
+		if (!dgram)
+			break;
+		frame_handle(frames, dgram);
+	}
+
+	/* the throttled workers can go on */
+	for (nr = 0; cfg->workers && nr < cfg->num_workers; ++nr)
+		worker_resume(&cfg->workers[nr].thread, &frames->queue,
+			      GBPROX_WORKER_FRAMES);
+
+	/* give the other sockets a turn and come back */
+	if (i == GBPROX_WORKER_FRAMES && worker_event_signal(bfd->fd) != 0)
+		LOGP(DGPRS, LOGL_ERROR, "Failed to wake up the select loop.\n");
+	return 0;
+}
+
+static void workers_report(void *data)
+{
+	struct gbproxy_config *cfg = data;
+	struct gbprox_sender *sender = cfg->sender;
+	unsigned long now;
+	int i;
+
+	now = sender->wakeup_errors;
+	if (now != sender->reported_wakeup) {
+		LOGP(DGPRS, LOGL_ERROR, "SGSN sender: %lu failed wakeups.\n",
+		     now - sender->reported_wakeup);
+		sender->reported_wakeup = now;
+	}
+
+	for (i = 0; i < cfg->num_workers; ++i)
+		worker_report(&cfg->workers[i].thread);
+
+	bsc_schedule_timer(&report_timer, GBPROX_WORKER_REPORT, 0);
+}
+
+/*
+ * Below is running inside the worker thread.
+ */
+static uint32_t addr_hash(uint32_t ip, uint16_t port)
+{
+	return hash_index_u32(ip ^ hash_index_u32(port));
+}
+
+static struct gbprox_worker_addr *addr_find(struct gbprox_worker *worker,
+					    uint32_t ip, uint16_t port)
+{
+	unsigned int mask = worker->addrs_size - 1;
+	unsigned int i;
+
+	if (!worker->addrs_size)
+		return NULL;
+
+	for (i = addr_hash(ip, port) & mask; ; i = (i + 1) & mask) {
+		struct gbprox_worker_addr *slot = &worker->addrs[i];
+
+		if (!slot->ip && !slot->port)
+			return NULL;
+		if (slot->ip == ip && slot->port == port)
+			return slot;
+	}
+}
+
+static struct gbprox_worker_addr *addr_slot(struct gbprox_worker_addr *addrs,
+					    unsigned int size,
+					    uint32_t ip, uint16_t port)
+{
+	unsigned int i;
+
+	for (i = addr_hash(ip, port) & (size - 1); ; i = (i + 1) & (size - 1))
+		if ((!addrs[i].ip && !addrs[i].port) ||
+		    (addrs[i].ip == ip && addrs[i].port == port))
+			return &addrs[i];
+}
+
+/* the table is kept at most half full */
+static int addr_set(struct gbprox_worker *worker, uint32_t ip, uint16_t port,
+		    uint16_t nsei)
+{
+	struct gbprox_worker_addr *slot;
+
+	if ((worker->addrs_count + 1) * 2 > worker->addrs_size) {
+		unsigned int size = worker->addrs_size ?
+				worker->addrs_size * 2 : GBPROX_ADDRS_MIN;
+		struct gbprox_worker_addr *addrs;
+		unsigned int i;
+
+		addrs = calloc(size, sizeof(*addrs));
+		if (!addrs)
+			return -ENOMEM;
+
+		for (i = 0; i < worker->addrs_size; ++i) {
+			struct gbprox_worker_addr *old = &worker->addrs[i];
+
+			if (old->ip || old->port)
+				*addr_slot(addrs, size, old->ip, old->port) = *old;
+		}
+
+		free(worker->addrs);
+		worker->addrs = addrs;
+		worker->addrs_size = size;
+	}
+
+	slot = addr_slot(worker->addrs, worker->addrs_size, ip, port);
+	if (!slot->ip && !slot->port)
+		worker->addrs_count += 1;
+	slot->ip = ip;
+	slot->port = port;
+	slot->nsei = nsei;
+	return 0;
+}
+
+/* move the entries behind the hole up, no probe sequence may be cut */
+static void addr_del(struct gbprox_worker *worker, struct gbprox_worker_addr *slot)
+{
+	unsigned int mask = worker->addrs_size - 1;
+	unsigned int hole = slot - worker->addrs;
+	unsigned int i, home;
+
+	for (i = (hole + 1) & mask; ; i = (i + 1) & mask) {
+		struct gbprox_worker_addr *next = &worker->addrs[i];
+
+		if (!next->ip && !next->port)
+			break;
+
+		/* an entry can move to the hole if that is not before its home */
+		home = addr_hash(next->ip, next->port) & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			worker->addrs[hole] = *next;
+			hole = i;
+		}
+	}
+
+	memset(&worker->addrs[hole], 0, sizeof(worker->addrs[hole]));
+	worker->addrs_count -= 1;
+}
+
+static void worker_apply_nse(struct gbprox_worker *worker,
+			     struct gbprox_worker_cmd *cmd)
+{
+	struct gbprox_worker_nse *nse = &worker->nse[cmd->nsei];
+	uint32_t ip = cmd->addr.sin_addr.s_addr;
+	uint16_t port = cmd->addr.sin_port;
+	struct gbprox_worker_addr *slot;
+
+	/* the NSE moved away from its old address */
+	if ((nse->ip || nse->port) && (nse->ip != ip || nse->port != port)) {
+		slot = addr_find(worker, nse->ip, nse->port);
+		if (slot && slot->nsei == cmd->nsei)
+			addr_del(worker, slot);
+	}
+
+	if (ip || port) {
+		/* the address belonged to another NSE before */
+		slot = addr_find(worker, ip, port);
+		if (slot && slot->nsei != cmd->nsei)
+			memset(&worker->nse[slot->nsei], 0, sizeof(*nse));
+
+		if (addr_set(worker, ip, port, cmd->nsei) != 0) {
+			worker->thread.errors[GBPROX_WORKER_ERR_NSE] += 1;
+			ip = port = 0;
+		}
+	}
+
+	nse->ip = ip;
+	nse->port = port;
+	nse->flags = ip || port ? cmd->flags : 0;
+}
+
+static void worker_apply(struct worker_thread *thread, unsigned int slot)
+{
+	struct gbprox_worker *worker =
+		container_of(thread, struct gbprox_worker, thread);
+	struct gbprox_worker_cmd *cmd = &worker->ring[slot];
+
+	switch (cmd->type) {
+	case GBPROX_WORKER_NSE:
+		worker_apply_nse(worker, cmd);
+		break;
+	case GBPROX_WORKER_BVC:
+		worker->bvci_nsei[cmd->bvci] =
+			cmd->flags ? GBPROX_BVCI_KNOWN | cmd->nsei : 0;
+		break;
+	}
+}
+
+static void nse_addr(struct gbprox_worker_nse *nse, struct sockaddr_in *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = nse->ip;
+	addr->sin_port = nse->port;
+}
+
+/*
+ * The NSE of the source address and the one of the destination must
+ * be alive and unblocked, otherwise the NS layer has to look at it.
+ */
+static struct gbprox_worker_nse *worker_route(struct gbprox_worker *worker,
+					      struct gbprox_dgram *dgram)
+{
+	struct gbprox_worker_addr *slot;
+	struct gbprox_worker_nse *from;
+	uint16_t bvci;
+	uint32_t to;
+
+	dgram->slow = NULL;
+	if (dgram->len < 4 || dgram->data[0] != NS_PDUT_UNITDATA)
+		return NULL;
+
+	/* the signalling BVCs are handled by the proxy */
+	bvci = dgram->data[2] << 8 | dgram->data[3];
+	if (bvci < 2)
+		return NULL;
+
+	/* stay behind the datagrams of the BVC the NS layer still has */
+	dgram->slow = &worker->bvci_slow[bvci];
+	if (*dgram->slow)
+		return NULL;
+
+	slot = addr_find(worker, dgram->addr.sin_addr.s_addr, dgram->addr.sin_port);
+	if (!slot)
+		return NULL;
+	from = &worker->nse[slot->nsei];
+	if (!(from->flags & GBPROX_NSE_FWD))
+		return NULL;
+
+	if (from->flags & GBPROX_NSE_SGSN) {
+		to = worker->bvci_nsei[bvci];
+		if (!(to & GBPROX_BVCI_KNOWN))
+			return NULL;
+	} else
+		to = worker->sgsn_nsei;
+
+	if (!(worker->nse[to & 0xffff].flags & GBPROX_NSE_FWD))
+		return NULL;
+	return &worker->nse[to & 0xffff];
+}
+
+/*
+ * Read one batch. The datagrams for a BSS are sent from here in one
+ * batch, those for the SGSN and the NS layer are handed over.
+ */
+static void worker_read(struct gbprox_worker *worker)
+{
+	struct gbprox_dgram **rx = worker->rx;
+	struct mmsghdr mmsg[NSIP_RX_BATCH];
+	struct iovec iov[NSIP_RX_BATCH];
+	struct mmsghdr tx_mmsg[NSIP_RX_BATCH];
+	struct iovec tx_iov[NSIP_RX_BATCH];
+	int i, j, nr, rc, tx = 0, to_sgsn = 0, to_ns = 0;
+
+	memset(mmsg, 0, sizeof(mmsg));
+	for (nr = 0; nr < NSIP_RX_BATCH; ++nr) {
+		if (!rx[nr])
+			rx[nr] = dgram_alloc();
+		if (!rx[nr])
+			break;
+
+		iov[nr].iov_base = rx[nr]->data;
+		iov[nr].iov_len = NS_ALLOC_SIZE;
+		mmsg[nr].msg_hdr.msg_iov = &iov[nr];
+		mmsg[nr].msg_hdr.msg_iovlen = 1;
+		mmsg[nr].msg_hdr.msg_name = &rx[nr]->addr;
+		mmsg[nr].msg_hdr.msg_namelen = sizeof(rx[nr]->addr);
+	}
+
+	if (nr == 0)
+		return;
+
+	rc = recvmmsg(worker->fd, mmsg, nr, MSG_DONTWAIT, NULL);
+	if (rc <= 0)
+		return;
+
+	memset(tx_mmsg, 0, sizeof(tx_mmsg));
+	for (i = 0; i < rc; ++i) {
+		struct gbprox_dgram *dgram = rx[i];
+		struct gbprox_worker_nse *to;
+
+		if (mmsg[i].msg_len == 0)
+			continue;
+
+		dgram->len = mmsg[i].msg_len;
+		worker->received += 1;
+
+		to = worker_route(worker, dgram);
+		if (!to) {
+			rx[i] = NULL;
+			worker->slow_path += 1;
+			if (dgram->slow)
+				__sync_fetch_and_add(dgram->slow, 1);
+			queue_push(&worker->frames->queue, dgram);
+			to_ns = 1;
+		} else if (to->flags & GBPROX_NSE_SGSN) {
+			if (worker->sender->queue.queued >= GBPROX_SENDER_QUEUE) {
+				worker->dropped += 1;
+				continue;
+			}
+			rx[i] = NULL;
+			nse_addr(to, &dgram->addr);
+			worker->to_sgsn += 1;
+			queue_push(&worker->sender->queue, dgram);
+			to_sgsn = 1;
+		} else {
+			/* the buffer stays with us, it is sent below */
+			nse_addr(to, &dgram->addr);
+			tx_iov[tx].iov_base = dgram->data;
+			tx_iov[tx].iov_len = dgram->len;
+			tx_mmsg[tx].msg_hdr.msg_iov = &tx_iov[tx];
+			tx_mmsg[tx].msg_hdr.msg_iovlen = 1;
+			tx_mmsg[tx].msg_hdr.msg_name = &dgram->addr;
+			tx_mmsg[tx].msg_hdr.msg_namelen = sizeof(dgram->addr);
+			tx += 1;
+		}
+	}
+
+	/* one wakeup for everything of this batch */
+	if (to_ns && worker_event_signal(worker->frames->bfd.fd) != 0)
+		worker->thread.errors[WORKER_ERR_WAKEUP] += 1;
+	if (to_sgsn && worker_event_signal(worker->sender->event_fd) != 0)
+		worker->thread.errors[WORKER_ERR_WAKEUP] += 1;
+
+	/* a full socket drops the rest, like the kernel would */
+	for (i = 0; i < tx; i += rc) {
+		rc = sendmmsg(worker->fd, &tx_mmsg[i], tx - i, MSG_DONTWAIT);
+		if (rc <= 0) {
+			if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != ENOBUFS) {
+				/* skip the one that fails */
+				worker->dropped += 1;
+				rc = 1;
+				continue;
+			}
+			worker->dropped += tx - i;
+			break;
+		}
+		worker->to_bss += rc;
+	}
+
+	/* move the unused buffers to the front */
+	for (i = 0, j = 0; i < NSIP_RX_BATCH; ++i) {
+		if (!rx[i])
+			continue;
+		if (i != j) {
+			rx[j] = rx[i];
+			rx[i] = NULL;
+		}
+		j += 1;
+	}
+}
+
+static void *worker_main(void *data)
+{
+	struct gbprox_worker *worker = data;
+	struct epoll_event events[2];
+	int i, rc;
+
+	while (1) {
+		rc = epoll_wait(worker->epoll_fd, events, ARRAY_SIZE(events), -1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			worker->thread.failed = errno;
+			break;
+		}
+
+		worker->wakeups += 1;
+
+		/* a NS-VC change applies to the datagrams read after it */
+		for (i = 0; i < rc; ++i)
+			if (events[i].data.fd == worker->thread.event_fd)
+				worker_drain(&worker->thread);
+
+		worker_throttle(&worker->thread, &worker->frames->queue,
+				GBPROX_WORKER_FRAMES, worker->frames->bfd.fd);
+		for (i = 0; i < rc; ++i)
+			if (events[i].data.fd == worker->fd)
+				worker_read(worker);
+	}
+
+	return NULL;
+}
+
+/*
+ * Below is running inside the sender thread.
+ */
+static void sender_wait(int fd, short events)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+		;
+}
+
+static void *sender_main(void *data)
+{
+	struct gbprox_sender *sender = data;
+	struct gbprox_dgram *batch[NSIP_TX_BATCH];
+	struct mmsghdr mmsg[NSIP_TX_BATCH];
+	struct iovec iov[NSIP_TX_BATCH];
+	int i, nr = 0, rc;
+
+	while (1) {
+		while (nr < NSIP_TX_BATCH) {
+			struct gbprox_dgram *dgram = queue_pop(&sender->queue);
+
+			if (!dgram)
+				break;
+			batch[nr++] = dgram;
+		}
+
+		if (nr == 0) {
+			sender_wait(sender->event_fd, POLLIN);
+			if (worker_event_clear(sender->event_fd) != 0)
+				sender->wakeup_errors += 1;
+			sender->wakeups += 1;
+			continue;
+		}
+
+		memset(mmsg, 0, sizeof(mmsg));
+		for (i = 0; i < nr; ++i) {
+			iov[i].iov_base = batch[i]->data;
+			iov[i].iov_len = batch[i]->len;
+			mmsg[i].msg_hdr.msg_iov = &iov[i];
+			mmsg[i].msg_hdr.msg_iovlen = 1;
+			mmsg[i].msg_hdr.msg_name = &batch[i]->addr;
+			mmsg[i].msg_hdr.msg_namelen = sizeof(batch[i]->addr);
+		}
+
+		rc = sendmmsg(sender->fd, mmsg, nr, MSG_DONTWAIT);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				/* the UNITDATA wait, the workers drop once we are full */
+				sender->blocked += 1;
+				sender_wait(sender->fd, POLLOUT);
+				continue;
+			}
+
+			/* the first one can not be sent, do not retry it */
+			sender->errors += 1;
+			rc = 1;
+		} else
+			sender->sent += rc;
+
+		for (i = 0; i < rc; ++i)
+			free(batch[i]);
+		nr -= rc;
+		memmove(batch, &batch[rc], nr * sizeof(batch[0]));
+	}
+
+	return NULL;
+}
+
+static int worker_init(struct gbproxy_config *cfg, struct gbprox_worker *worker, int nr)
+{
+	struct epoll_event ev;
+	int rc;
+
+	worker->frames = cfg->frames;
+	worker->sender = cfg->sender;
+	worker->sgsn_nsei = cfg->nsip_sgsn_nsei;
+	worker->fd = worker->epoll_fd = -1;
+
+	rc = worker_thread_init(&worker->thread, &worker_desc, nr);
+	if (rc != 0) {
+		LOGP(DGPRS, LOGL_ERROR, "Failed to create the eventfd: %s\n",
+		     strerror(-rc));
+		return -1;
+	}
+
+	worker->nse = calloc(65536, sizeof(*worker->nse));
+	worker->bvci_nsei = calloc(65536, sizeof(*worker->bvci_nsei));
+	worker->bvci_slow = calloc(65536, sizeof(*worker->bvci_slow));
+	if (!worker->nse || !worker->bvci_nsei || !worker->bvci_slow)
+		return -1;
+
+	worker->fd = gprs_ns_nsip_socket(cfg->nsi);
+	if (worker->fd < 0) {
+		LOGP(DGPRS, LOGL_ERROR, "Failed to open the NS/UDP socket.\n");
+		return -1;
+	}
+
+	worker->epoll_fd = epoll_create(2);
+	if (worker->epoll_fd < 0) {
+		LOGP(DGPRS, LOGL_ERROR, "Failed to create the epoll set: %s\n",
+		     strerror(errno));
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = worker->thread.event_fd;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->thread.event_fd, &ev) != 0)
+		return -1;
+	ev.data.fd = worker->fd;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->fd, &ev) != 0)
+		return -1;
+
+	return 0;
+}
+
+static int frames_init(struct gbproxy_config *cfg)
+{
+	struct gbprox_frames *frames;
+
+	frames = talloc_zero(tall_bsc_ctx, struct gbprox_frames);
+	if (!frames)
+		return -1;
+
+	worker_queue_init(&frames->queue);
+	frames->nsi = cfg->nsi;
+	frames->cfg = cfg;
+
+	frames->bfd.fd = eventfd(0, EFD_NONBLOCK);
+	if (frames->bfd.fd < 0) {
+		LOGP(DGPRS, LOGL_ERROR, "Failed to create the eventfd: %s\n",
+		     strerror(errno));
+		talloc_free(frames);
+		return -1;
+	}
+
+	frames->bfd.when = BSC_FD_READ;
+	frames->bfd.cb = frames_cb;
+	frames->bfd.data = frames;
+	if (bsc_register_fd(&frames->bfd) != 0) {
+		LOGP(DGPRS, LOGL_ERROR, "Failed to register the eventfd.\n");
+		close(frames->bfd.fd);
+		talloc_free(frames);
+		return -1;
+	}
+
+	cfg->frames = frames;
+	return 0;
+}
+
+static int sender_init(struct gbproxy_config *cfg)
+{
+	struct gbprox_sender *sender;
+
+	sender = talloc_zero(tall_bsc_ctx, struct gbprox_sender);
+	if (!sender)
+		return -1;
+
+	worker_queue_init(&sender->queue);
+	sender->fd = cfg->nsi->nsip.fd.fd;
+	sender->event_fd = eventfd(0, EFD_NONBLOCK);
+	if (sender->event_fd < 0) {
+		LOGP(DGPRS, LOGL_ERROR, "Failed to create the eventfd: %s\n",
+		     strerror(errno));
+		talloc_free(sender);
+		return -1;
+	}
+
+	cfg->sender = sender;
+	return 0;
+}
+
+/*
+ * Start the NS/UDP threads. gprs_ns_nsip_listen() must have been
+ * called with reuse_port set. The NS-VCs known so far are copied to
+ * the workers, later changes are passed on by gbprox_signal().
+ */
+int gbprox_workers_start(struct gbproxy_config *cfg)
+{
+	struct gprs_nsvc *nsvc;
+	int i, rc;
+
+	if (cfg->num_workers <= 0 || cfg->workers)
+		return 0;
+
+	if (frames_init(cfg) != 0 || sender_init(cfg) != 0)
+		return -1;
+
+	cfg->workers = _talloc_zero_array(tall_bsc_ctx, sizeof(struct gbprox_worker),
+					  cfg->num_workers, "gbprox-workers");
+	if (!cfg->workers)
+		return -1;
+
+	for (i = 0; i < cfg->num_workers; ++i) {
+		if (worker_init(cfg, &cfg->workers[i], i) != 0) {
+			LOGP(DGPRS, LOGL_FATAL, "Failed to create NS thread %d.\n", i);
+			cfg->workers = NULL;
+			return -1;
+		}
+	}
+
+	rc = worker_thread_start(&cfg->sender->thread, sender_main, cfg->sender);
+	for (i = 0; rc == 0 && i < cfg->num_workers; ++i)
+		rc = worker_thread_start(&cfg->workers[i].thread.thread,
+					 worker_main, &cfg->workers[i]);
+	if (rc != 0) {
+		LOGP(DGPRS, LOGL_FATAL, "Failed to start the NS threads: %s\n",
+		     strerror(rc));
+		return -1;
+	}
+
+	/* the threads run, the rings can not fill up for good */
+	llist_for_each_entry(nsvc, &cfg->nsi->gprs_nsvcs, list)
+		gbprox_workers_nsvc(cfg, nsvc);
+
+	report_timer.cb = workers_report;
+	report_timer.data = cfg;
+	bsc_schedule_timer(&report_timer, GBPROX_WORKER_REPORT, 0);
+
+	LOGP(DGPRS, LOGL_NOTICE, "Started %d NS threads.\n", cfg->num_workers);
+	return 0;
+}
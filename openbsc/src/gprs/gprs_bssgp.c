@@ -41,6 +41,7 @@
 #include <openbsc/gprs_ns.h>
 #include <openbsc/gprs_sgsn.h>
 #include <openbsc/gprs_gmm.h>
+#include <openbsc/timer_wheel.h>
 
 void *bssgp_tall_ctx = NULL;
 
@@ -53,6 +54,13 @@ enum bssgp_ctr {
 	BSSGP_CTR_BYTES_OUT,
 	BSSGP_CTR_BLOCKED,
 	BSSGP_CTR_DISCARDED,
+	/* in the order of enum bssgp_fc_ctr */
+	BSSGP_CTR_FC_BVC_DELAYED,
+	BSSGP_CTR_FC_BVC_DROPPED,
+	BSSGP_CTR_FC_BVC_DELAY,
+	BSSGP_CTR_FC_MS_DELAYED,
+	BSSGP_CTR_FC_MS_DROPPED,
+	BSSGP_CTR_FC_MS_DELAY,
 };
 
 static const struct rate_ctr_desc bssgp_ctr_description[] = {
@@ -62,6 +70,12 @@ static const struct rate_ctr_desc bssgp_ctr_description[] = {
 	{ "bytes.out",	"Bytes at BSSGP Level   (Out)" },
 	{ "blocked",	"BVC Blocking count" },
 	{ "discarded",	"BVC LLC Discarded count" },
+	{ "fc.bvc.delayed", "PDUs held back by BVC flow control" },
+	{ "fc.bvc.dropped", "PDUs dropped for a full BVC queue" },
+	{ "fc.bvc.delay", "Queue delay of BVC flow control (ms)" },
+	{ "fc.ms.delayed", "PDUs held back by MS flow control" },
+	{ "fc.ms.dropped", "PDUs dropped for a full MS queue" },
+	{ "fc.ms.delay", "Queue delay of MS flow control (ms)" },
 };
 
 static const struct rate_ctr_group_desc bssgp_ctrg_desc = {
@@ -71,14 +85,41 @@ static const struct rate_ctr_group_desc bssgp_ctrg_desc = {
 	.ctr_desc = bssgp_ctr_description,
 };
 
+/* the flow control of a MS on a BVC, freed when idle */
+struct bssgp_ms_fc {
+	struct hash_entry entry;
+	uint32_t tlli;
+	struct bssgp_bvc_ctx *bctx;
+	struct bssgp_flow_control fc;
+	struct timer_list idle_timer;
+};
+
+#define MS_FC_IDLE_TIMEOUT	30	/* seconds */
+
 LLIST_HEAD(bssgp_bvc_ctxts);
+static struct hash_index bvc_by_bvci;
+static struct hash_index bvc_by_cell;
+
+static uint32_t bvci_hash(uint16_t bvci, uint16_t nsei)
+{
+	return hash_index_u32((nsei << 16) | bvci);
+}
+
+static uint32_t cell_hash(const struct gprs_ra_id *raid, uint16_t cid)
+{
+	uint32_t hash;
+
+	hash = hash_index_u32((raid->mcc << 16) | raid->mnc);
+	hash = hash_index_u32(hash ^ ((raid->lac << 16) | raid->rac));
+	return hash_index_u32(hash ^ cid);
+}
 
 /* Find a BTS Context based on parsed RA ID and Cell ID */
 struct bssgp_bvc_ctx *btsctx_by_raid_cid(const struct gprs_ra_id *raid, uint16_t cid)
 {
 	struct bssgp_bvc_ctx *bctx;
 
-	llist_for_each_entry(bctx, &bssgp_bvc_ctxts, list) {
+	hash_index_for_each(bctx, &bvc_by_cell, cell_hash(raid, cid), cell_entry) {
 		if (!memcmp(&bctx->ra_id, raid, sizeof(bctx->ra_id)) &&
 		    bctx->cell_id == cid)
 			return bctx;
@@ -91,13 +132,107 @@ struct bssgp_bvc_ctx *btsctx_by_bvci_nsei(uint16_t bvci, uint16_t nsei)
 {
 	struct bssgp_bvc_ctx *bctx;
 
-	llist_for_each_entry(bctx, &bssgp_bvc_ctxts, list) {
+	hash_index_for_each(bctx, &bvc_by_bvci, bvci_hash(bvci, nsei), bvci_entry) {
 		if (bctx->nsei == nsei && bctx->bvci == bvci)
 			return bctx;
 	}
 	return NULL;
 }
 
+/* the conforming DL PDU of a BVC goes to the NS layer */
+static int bvc_fc_out(struct bssgp_flow_control *fc, struct msgb *msg,
+		      uint32_t llc_pdu_len, void *priv)
+{
+	return gprs_ns_sendmsg(bssgp_nsi, msg);
+}
+
+/* the conforming DL PDU of a MS goes through the BVC flow control */
+static int ms_fc_out(struct bssgp_flow_control *fc, struct msgb *msg,
+		     uint32_t llc_pdu_len, void *priv)
+{
+	struct bssgp_ms_fc *mfc = priv;
+
+	return bssgp_fc_in(&mfc->bctx->fc, msg, llc_pdu_len);
+}
+
+static void ms_fc_idle_cb(void *data)
+{
+	struct bssgp_ms_fc *mfc = data;
+
+	if (mfc->fc.queue_depth) {
+		bsc_wheel_schedule_timer(&mfc->idle_timer, MS_FC_IDLE_TIMEOUT, 0);
+		return;
+	}
+
+	hash_index_del(&mfc->bctx->ms_fc, &mfc->entry);
+	talloc_free(mfc);
+}
+
+static struct bssgp_ms_fc *ms_fc_by_tlli(struct bssgp_bvc_ctx *bctx,
+					 uint32_t tlli)
+{
+	struct bssgp_ms_fc *mfc;
+
+	hash_index_for_each(mfc, &bctx->ms_fc, hash_index_u32(tlli), entry) {
+		if (mfc->tlli == tlli)
+			return mfc;
+	}
+	return NULL;
+}
+
+/* find or create the flow control of a MS with the defaults of the BVC */
+static struct bssgp_ms_fc *ms_fc_get(struct bssgp_bvc_ctx *bctx, uint32_t tlli)
+{
+	struct bssgp_ms_fc *mfc = ms_fc_by_tlli(bctx, tlli);
+
+	if (!mfc) {
+		mfc = talloc_zero(bctx, struct bssgp_ms_fc);
+		if (!mfc)
+			return NULL;
+		if (hash_index_add(bctx, &bctx->ms_fc, &mfc->entry,
+				   hash_index_u32(tlli)) != 0) {
+			talloc_free(mfc);
+			return NULL;
+		}
+		mfc->tlli = tlli;
+		mfc->bctx = bctx;
+		bssgp_fc_init(&mfc->fc, BSSGP_FC_MS_QUEUE, ms_fc_out, mfc);
+		mfc->fc.ctr = &bctx->ctrg->ctr[BSSGP_CTR_FC_MS_DELAYED];
+		bssgp_fc_set(&mfc->fc, bctx->bmax_default_ms, bctx->r_default_ms);
+		mfc->idle_timer.cb = ms_fc_idle_cb;
+		mfc->idle_timer.data = mfc;
+	}
+
+	bsc_wheel_schedule_timer(&mfc->idle_timer, MS_FC_IDLE_TIMEOUT, 0);
+	return mfc;
+}
+
+/*
+ * The BVC was reset or blocked, the PDUs held back for it and its MS
+ * are dropped. Everything starts over unconfigured until the BSS sends
+ * its next FLOW-CONTROL-BVC and FLOW-CONTROL-MS.
+ */
+static void bvc_fc_reset(struct bssgp_bvc_ctx *bctx)
+{
+	struct bssgp_ms_fc *mfc, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < bctx->ms_fc.size; ++i) {
+		llist_for_each_entry_safe(mfc, tmp, &bctx->ms_fc.buckets[i], entry.list) {
+			bsc_wheel_del_timer(&mfc->idle_timer);
+			bssgp_fc_flush(&mfc->fc);
+			hash_index_del(&bctx->ms_fc, &mfc->entry);
+			talloc_free(mfc);
+		}
+	}
+
+	bssgp_fc_flush(&bctx->fc);
+	bssgp_fc_init(&bctx->fc, BSSGP_FC_BVC_QUEUE, bvc_fc_out, bctx);
+	bctx->fc.ctr = &bctx->ctrg->ctr[BSSGP_CTR_FC_BVC_DELAYED];
+	bctx->bmax_default_ms = 0;
+	bctx->r_default_ms = 0;
+}
+
 struct bssgp_bvc_ctx *btsctx_alloc(uint16_t bvci, uint16_t nsei)
 {
 	struct bssgp_bvc_ctx *ctx;
@@ -109,7 +244,17 @@ struct bssgp_bvc_ctx *btsctx_alloc(uint16_t bvci, uint16_t nsei)
 	ctx->nsei = nsei;
 	/* FIXME: BVCI is not unique, only BVCI+NSEI ?!? */
 	ctx->ctrg = rate_ctr_group_alloc(ctx, &bssgp_ctrg_desc, bvci);
-
+	bssgp_fc_init(&ctx->fc, BSSGP_FC_BVC_QUEUE, bvc_fc_out, ctx);
+	ctx->fc.ctr = &ctx->ctrg->ctr[BSSGP_CTR_FC_BVC_DELAYED];
+
+	if (hash_index_add(bssgp_tall_ctx, &bvc_by_bvci, &ctx->bvci_entry,
+			   bvci_hash(bvci, nsei)) != 0 ||
+	    hash_index_add(bssgp_tall_ctx, &bvc_by_cell, &ctx->cell_entry,
+			   cell_hash(&ctx->ra_id, ctx->cell_id)) != 0) {
+		hash_index_del(&bvc_by_bvci, &ctx->bvci_entry);
+		talloc_free(ctx);
+		return NULL;
+	}
 	llist_add(&ctx->list, &bssgp_bvc_ctxts);
 
 	return ctx;
@@ -131,6 +276,25 @@ static int bssgp_tx_fc_bvc_ack(uint16_t nsei, uint8_t tag, uint16_t ns_bvci)
 	return gprs_ns_sendmsg(bssgp_nsi, msg);
 }
 
+/* Chapter 10.4.7: Flow Control MS ACK */
+static int bssgp_tx_fc_ms_ack(uint16_t nsei, uint32_t tlli, uint8_t tag,
+			      uint16_t ns_bvci)
+{
+	struct msgb *msg = bssgp_msgb_alloc();
+	struct bssgp_normal_hdr *bgph =
+			(struct bssgp_normal_hdr *) msgb_put(msg, sizeof(*bgph));
+	uint32_t _tlli = htonl(tlli);
+
+	msgb_nsei(msg) = nsei;
+	msgb_bvci(msg) = ns_bvci;
+
+	bgph->pdu_type = BSSGP_PDUT_FLOW_CONTROL_MS_ACK;
+	msgb_tvlv_put(msg, BSSGP_IE_TLLI, 4, (uint8_t *) &_tlli);
+	msgb_tvlv_put(msg, BSSGP_IE_TAG, 1, &tag);
+
+	return gprs_ns_sendmsg(bssgp_nsi, msg);
+}
+
 /* 10.3.7 SUSPEND-ACK PDU */
 int bssgp_tx_suspend_ack(uint16_t nsei, uint32_t tlli,
 			 const struct gprs_ra_id *ra_id, uint8_t suspend_ref)
@@ -246,6 +410,17 @@ static int bssgp_rx_bvc_reset(struct msgb *msg, struct tlv_parsed *tp,
 	bctx = btsctx_by_bvci_nsei(bvci, nsei);
 	if (!bctx)
 		bctx = btsctx_alloc(bvci, nsei);
+	else
+		bvc_fc_reset(bctx);
+
+	/* 8.4: a reset of the signalling BVC resets all PTP BVCs of the NSE */
+	if (bvci == BVCI_SIGNALLING) {
+		struct bssgp_bvc_ctx *ptp;
+
+		llist_for_each_entry(ptp, &bssgp_bvc_ctxts, list)
+			if (ptp->nsei == nsei && ptp->bvci != BVCI_SIGNALLING)
+				bvc_fc_reset(ptp);
+	}
 
 	/* As opposed to NS-VCs, BVCs are NOT blocked after RESET */
 	bctx->state &= ~BVC_S_BLOCKED;
@@ -261,6 +436,8 @@ static int bssgp_rx_bvc_reset(struct msgb *msg, struct tlv_parsed *tp,
 		/* actually extract RAC / CID */
 		bctx->cell_id = bssgp_parse_cell_id(&bctx->ra_id,
 						TLVP_VAL(tp, BSSGP_IE_CELL_ID));
+		hash_index_rehash(bssgp_tall_ctx, &bvc_by_cell, &bctx->cell_entry,
+				  cell_hash(&bctx->ra_id, bctx->cell_id));
 		LOGP(DBSSGP, LOGL_NOTICE, "Cell %u-%u-%u-%u CI %u on BVCI %u\n",
 			bctx->ra_id.mcc, bctx->ra_id.mnc, bctx->ra_id.lac,
 			bctx->ra_id.rac, bctx->cell_id, bvci);
@@ -294,6 +471,7 @@ static int bssgp_rx_bvc_block(struct msgb *msg, struct tlv_parsed *tp)
 
 	ptp_ctx->state |= BVC_S_BLOCKED;
 	rate_ctr_inc(&ptp_ctx->ctrg->ctr[BSSGP_CTR_BLOCKED]);
+	bvc_fc_reset(ptp_ctx);
 
 	/* FIXME: Send NM_BVC_BLOCK.ind to NM */
 
@@ -451,6 +629,11 @@ static int bssgp_rx_llc_disc(struct msgb *msg, struct tlv_parsed *tp,
 	return 0;
 }
 
+static uint32_t ie_u16(struct tlv_parsed *tp, int iei)
+{
+	return ntohs(*(uint16_t *) TLVP_VAL(tp, iei));
+}
+
 static int bssgp_rx_fc_bvc(struct msgb *msg, struct tlv_parsed *tp,
 			   struct bssgp_bvc_ctx *bctx)
 {
@@ -468,13 +651,46 @@ static int bssgp_rx_fc_bvc(struct msgb *msg, struct tlv_parsed *tp,
 		return bssgp_tx_status(BSSGP_CAUSE_MISSING_MAND_IE, NULL, msg);
 	}
 
-	/* FIXME: actually implement flow control */
+	/* sizes are in units of 100 octets, rates in units of 100 bit/s */
+	bctx->bmax_default_ms = ie_u16(tp, BSSGP_IE_BMAX_DEFAULT_MS) * 100;
+	bctx->r_default_ms = ie_u16(tp, BSSGP_IE_R_DEFAULT_MS) * 100 / 8;
+	bssgp_fc_set(&bctx->fc, ie_u16(tp, BSSGP_IE_BVC_BUCKET_SIZE) * 100,
+		     ie_u16(tp, BSSGP_IE_BUCKET_LEAK_RATE) * 100 / 8);
 
 	/* Send FLOW_CONTROL_BVC_ACK */
 	return bssgp_tx_fc_bvc_ack(msgb_nsei(msg), *TLVP_VAL(tp, BSSGP_IE_TAG),
 				   msgb_bvci(msg));
 }
 
+static int bssgp_rx_fc_ms(struct msgb *msg, struct tlv_parsed *tp,
+			  struct bssgp_bvc_ctx *bctx)
+{
+	struct bssgp_ms_fc *mfc;
+	uint32_t tlli;
+
+	if (!TLVP_PRESENT(tp, BSSGP_IE_TLLI) ||
+	    !TLVP_PRESENT(tp, BSSGP_IE_TAG) ||
+	    !TLVP_PRESENT(tp, BSSGP_IE_MS_BUCKET_SIZE) ||
+	    !TLVP_PRESENT(tp, BSSGP_IE_BUCKET_LEAK_RATE)) {
+		LOGP(DBSSGP, LOGL_ERROR, "BSSGP BVCI=%u Rx FC MS "
+			"missing mandatory IE\n", bctx->bvci);
+		return bssgp_tx_status(BSSGP_CAUSE_MISSING_MAND_IE, NULL, msg);
+	}
+
+	tlli = ntohl(*(uint32_t *) TLVP_VAL(tp, BSSGP_IE_TLLI));
+	DEBUGP(DBSSGP, "BSSGP BVCI=%u TLLI=0x%08x Rx Flow Control MS\n",
+		bctx->bvci, tlli);
+
+	mfc = ms_fc_get(bctx, tlli);
+	if (mfc)
+		bssgp_fc_set(&mfc->fc, ie_u16(tp, BSSGP_IE_MS_BUCKET_SIZE) * 100,
+			     ie_u16(tp, BSSGP_IE_BUCKET_LEAK_RATE) * 100 / 8);
+
+	/* Send FLOW_CONTROL_MS_ACK */
+	return bssgp_tx_fc_ms_ack(msgb_nsei(msg), tlli,
+				  *TLVP_VAL(tp, BSSGP_IE_TAG), msgb_bvci(msg));
+}
+
 /* Receive a BSSGP PDU from a BSS on a PTP BVCI */
 static int gprs_bssgp_rx_ptp(struct msgb *msg, struct tlv_parsed *tp,
 			     struct bssgp_bvc_ctx *bctx)
@@ -515,10 +731,7 @@ static int gprs_bssgp_rx_ptp(struct msgb *msg, struct tlv_parsed *tp,
 		break;
 	case BSSGP_PDUT_FLOW_CONTROL_MS:
 		/* BSS informs us of available bandwidth to one MS */
-		DEBUGP(DBSSGP, "BSSGP BVCI=%u Rx Flow Control MS\n",
-			bctx->bvci);
-		/* FIXME: actually implement flow control */
-		/* FIXME: Send FLOW_CONTROL_MS_ACK */
+		rc = bssgp_rx_fc_ms(msg, tp, bctx);
 		break;
 	case BSSGP_PDUT_STATUS:
 		/* Some exception has occurred */
@@ -702,6 +915,7 @@ int gprs_bssgp_rcvmsg(struct msgb *msg)
 int gprs_bssgp_tx_dl_ud(struct msgb *msg, struct sgsn_mm_ctx *mmctx)
 {
 	struct bssgp_bvc_ctx *bctx;
+	struct bssgp_ms_fc *mfc = NULL;
 	struct bssgp_ud_hdr *budh;
 	uint8_t llc_pdu_tlv_hdr_len = 2;
 	uint8_t *llc_pdu_tlv, *qos_profile;
@@ -716,6 +930,7 @@ int gprs_bssgp_tx_dl_ud(struct msgb *msg, struct sgsn_mm_ctx *mmctx)
 	if (bvci <= BVCI_PTM ) {
 		LOGP(DBSSGP, LOGL_ERROR, "Cannot send DL-UD to BVCI %u\n",
 			bvci);
+		msgb_free(msg);
 		return -EINVAL;
 	}
 
@@ -786,7 +1001,13 @@ int gprs_bssgp_tx_dl_ud(struct msgb *msg, struct sgsn_mm_ctx *mmctx)
 
 	/* Identifiers down: BVCI, NSEI (in msgb->cb) */
 
-	return gprs_ns_sendmsg(bssgp_nsi, msg);
+	/* the MS and then the BVC flow control decide when it is sent, a
+	 * MS only gets one after the BSS sent its defaults */
+	if (bctx->bmax_default_ms)
+		mfc = ms_fc_get(bctx, msgb_tlli(msg));
+	if (mfc)
+		return bssgp_fc_in(&mfc->fc, msg, msg_len);
+	return bssgp_fc_in(&bctx->fc, msg, msg_len);
 }
 
 /* Send a single GMM-PAGING.req to a given NSEI/NS-BVCI */
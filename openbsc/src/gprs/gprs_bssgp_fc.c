@@ -0,0 +1,242 @@
+/* BSSGP flow control as per 3GPP TS 08.18 Chapter 8.2 and Annex D */
+
+/* (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <osmocore/msgb.h>
+#include <osmocore/talloc.h>
+#include <osmocore/rate_ctr.h>
+
+#include <openbsc/gsm_data.h>
+#include <openbsc/gprs_bssgp.h>
+#include <openbsc/timer_wheel.h>
+
+/* a timer per BVC and per MS with queued PDUs */
+static struct bsc_timer_wheel fc_wheel = BSC_TIMER_WHEEL("bssgp-fc");
+static void *tall_fc_ctx;
+
+static int fc_gettimeofday(struct timeval *tv)
+{
+	return gettimeofday(tv, NULL);
+}
+
+int (*bssgp_fc_gettime)(struct timeval *tv) = fc_gettimeofday;
+
+/* a held back PDU, the cb of the msgb is in use by the NS layer */
+struct fc_queue_elem {
+	struct llist_head list;
+	struct msgb *msg;
+	uint32_t llc_pdu_len;
+	struct timeval enqueued;
+};
+
+static void fc_ctr_add(struct bssgp_flow_control *fc, int idx, uint64_t val)
+{
+	if (fc->ctr)
+		rate_ctr_add(&fc->ctr[idx], val);
+}
+
+/* leak the bucket for the time since the last update */
+static void fc_leak(struct bssgp_flow_control *fc, const struct timeval *now)
+{
+	struct timeval diff;
+	uint64_t usecs, leaked;
+
+	/* an empty bucket or a clock that went back starts over */
+	if (!fc->bucket_counter || timercmp(now, &fc->time_last_pdu, <)) {
+		fc->time_last_pdu = *now;
+		return;
+	}
+
+	timersub(now, &fc->time_last_pdu, &diff);
+	usecs = diff.tv_sec * 1000000ULL + diff.tv_usec;
+	leaked = usecs * fc->bucket_leak_rate / 1000000;
+	if (leaked >= fc->bucket_counter) {
+		fc->bucket_counter = 0;
+		fc->time_last_pdu = *now;
+	} else if (leaked) {
+		/* only move by the time of the leaked octets, keep the rest */
+		usecs = leaked * 1000000 / fc->bucket_leak_rate;
+		diff.tv_sec = usecs / 1000000;
+		diff.tv_usec = usecs % 1000000;
+		fc->bucket_counter -= leaked;
+		timeradd(&fc->time_last_pdu, &diff, &fc->time_last_pdu);
+	}
+}
+
+static int fc_conforms(struct bssgp_flow_control *fc, uint32_t llc_pdu_len)
+{
+	return !fc->bucket_size_max || !fc->bucket_counter ||
+	       fc->bucket_counter + llc_pdu_len <= fc->bucket_size_max;
+}
+
+/* arm the timer for the time the head of the queue conforms */
+static void fc_schedule(struct bssgp_flow_control *fc)
+{
+	struct fc_queue_elem *elem;
+	uint64_t octets, usecs;
+
+	if (!fc->bucket_leak_rate)
+		return;
+
+	elem = llist_entry(fc->queue.next, struct fc_queue_elem, list);
+	octets = fc->bucket_counter + elem->llc_pdu_len - fc->bucket_size_max;
+	if (octets > fc->bucket_counter)
+		octets = fc->bucket_counter;
+	usecs = (octets * 1000000 + fc->bucket_leak_rate - 1) / fc->bucket_leak_rate;
+	bsc_wheel_schedule(&fc_wheel, &fc->timer, usecs / 1000000, usecs % 1000000);
+}
+
+/* pass on the PDUs of the queue that conform */
+static void fc_run(struct bssgp_flow_control *fc)
+{
+	struct timeval now, diff;
+
+	bssgp_fc_gettime(&now);
+	fc_leak(fc, &now);
+
+	while (!llist_empty(&fc->queue)) {
+		struct fc_queue_elem *elem;
+		struct msgb *msg;
+		uint32_t llc_pdu_len;
+
+		elem = llist_entry(fc->queue.next, struct fc_queue_elem, list);
+		if (!fc_conforms(fc, elem->llc_pdu_len))
+			break;
+
+		llist_del(&elem->list);
+		fc->queue_depth -= 1;
+		if (fc->bucket_size_max)
+			fc->bucket_counter += elem->llc_pdu_len;
+
+		timersub(&now, &elem->enqueued, &diff);
+		fc_ctr_add(fc, BSSGP_FC_CTR_DELAY,
+			   diff.tv_sec * 1000 + diff.tv_usec / 1000);
+
+		msg = elem->msg;
+		llc_pdu_len = elem->llc_pdu_len;
+		talloc_free(elem);
+		fc->out_cb(fc, msg, llc_pdu_len, fc->priv);
+	}
+
+	if (!llist_empty(&fc->queue))
+		fc_schedule(fc);
+}
+
+static void fc_timer_cb(void *data)
+{
+	fc_run(data);
+}
+
+void bssgp_fc_init(struct bssgp_flow_control *fc, uint32_t max_queue_depth,
+		   int (*out_cb)(struct bssgp_flow_control *fc, struct msgb *msg,
+				 uint32_t llc_pdu_len, void *priv),
+		   void *priv)
+{
+	if (!tall_fc_ctx)
+		tall_fc_ctx = talloc_named_const(bssgp_tall_ctx, 0, "bssgp_fc");
+
+	memset(fc, 0, sizeof(*fc));
+	INIT_LLIST_HEAD(&fc->queue);
+	fc->max_queue_depth = max_queue_depth;
+	fc->timer.cb = fc_timer_cb;
+	fc->timer.data = fc;
+	fc->out_cb = out_cb;
+	fc->priv = priv;
+}
+
+void bssgp_fc_set(struct bssgp_flow_control *fc, uint32_t bucket_size_max,
+		  uint32_t bucket_leak_rate)
+{
+	struct timeval now;
+
+	/* leak with the old rate up to now */
+	bssgp_fc_gettime(&now);
+	fc_leak(fc, &now);
+
+	fc->bucket_size_max = bucket_size_max;
+	fc->bucket_leak_rate = bucket_leak_rate;
+
+	if (!llist_empty(&fc->queue)) {
+		bsc_wheel_del(&fc_wheel, &fc->timer);
+		fc_run(fc);
+	}
+}
+
+int bssgp_fc_in(struct bssgp_flow_control *fc, struct msgb *msg,
+		uint32_t llc_pdu_len)
+{
+	struct fc_queue_elem *elem;
+	struct timeval now;
+
+	if (!fc->bucket_size_max && llist_empty(&fc->queue))
+		return fc->out_cb(fc, msg, llc_pdu_len, fc->priv);
+
+	bssgp_fc_gettime(&now);
+	if (llist_empty(&fc->queue)) {
+		fc_leak(fc, &now);
+		if (fc_conforms(fc, llc_pdu_len)) {
+			fc->bucket_counter += llc_pdu_len;
+			return fc->out_cb(fc, msg, llc_pdu_len, fc->priv);
+		}
+	}
+
+	if (fc->queue_depth >= fc->max_queue_depth) {
+		fc_ctr_add(fc, BSSGP_FC_CTR_DROPPED, 1);
+		msgb_free(msg);
+		return -ENOSPC;
+	}
+
+	elem = talloc(tall_fc_ctx, struct fc_queue_elem);
+	if (!elem) {
+		fc_ctr_add(fc, BSSGP_FC_CTR_DROPPED, 1);
+		msgb_free(msg);
+		return -ENOMEM;
+	}
+	elem->msg = msg;
+	elem->llc_pdu_len = llc_pdu_len;
+	elem->enqueued = now;
+	llist_add_tail(&elem->list, &fc->queue);
+	fc->queue_depth += 1;
+	fc_ctr_add(fc, BSSGP_FC_CTR_DELAYED, 1);
+
+	if (fc->queue_depth == 1)
+		fc_schedule(fc);
+	return 0;
+}
+
+void bssgp_fc_flush(struct bssgp_flow_control *fc)
+{
+	struct fc_queue_elem *elem, *tmp;
+
+	bsc_wheel_del(&fc_wheel, &fc->timer);
+	llist_for_each_entry_safe(elem, tmp, &fc->queue, list) {
+		llist_del(&elem->list);
+		fc_ctr_add(fc, BSSGP_FC_CTR_DROPPED, 1);
+		msgb_free(elem->msg);
+		talloc_free(elem);
+	}
+	fc->queue_depth = 0;
+}
@@ -78,6 +78,12 @@ static void dump_bvc(struct vty *vty, struct bssgp_bvc_ctx *bvc, int stats)
 		bvc->ra_id.mnc, bvc->ra_id.lac, bvc->ra_id.rac, bvc->cell_id,
 		bvc->state & BVC_S_BLOCKED ? "BLOCKED" : "UNBLOCKED",
 		VTY_NEWLINE);
+	if (bvc->fc.bucket_size_max)
+		vty_out(vty, " Flow control: Bmax %u, R %u octets/s, queue %u, "
+			"MS default: Bmax %u, R %u octets/s, MS: %u%s",
+			bvc->fc.bucket_size_max, bvc->fc.bucket_leak_rate,
+			bvc->fc.queue_depth, bvc->bmax_default_ms,
+			bvc->r_default_ms, bvc->ms_fc.count, VTY_NEWLINE);
 	if (stats)
 		vty_out_rate_ctr_group(vty, " ", bvc->ctrg);
 }
@@ -51,6 +51,7 @@
 #include <openbsc/gprs_sgsn.h>
 #include <openbsc/gprs_gmm.h>
 #include <openbsc/sgsn.h>
+#include <openbsc/timer_wheel.h>
 
 #include <pdp.h>
 
@@ -198,12 +199,14 @@ static const struct tlv_definition gsm48_sm_att_tlvdef = {
 
 /* Our implementation, should be kept in SGSN */
 
+static struct bsc_timer_wheel gmm_wheel = BSC_TIMER_WHEEL("gmm");
+
 static void mmctx_timer_cb(void *_mm);
 
 static void mmctx_timer_start(struct sgsn_mm_ctx *mm, unsigned int T,
 				unsigned int seconds)
 {
-	if (bsc_timer_pending(&mm->timer))
+	if (bsc_wheel_pending(&mm->timer))
 		LOGP(DMM, LOGL_ERROR, "Starting MM timer %u while old "
 			"timer %u pending\n", T, mm->T);
 	mm->T = T;
@@ -213,7 +216,7 @@ static void mmctx_timer_start(struct sgsn_mm_ctx *mm, unsigned int T,
 	mm->timer.data = mm;
 	mm->timer.cb = &mmctx_timer_cb;
 
-	bsc_schedule_timer(&mm->timer, seconds, 0);
+	bsc_wheel_schedule(&gmm_wheel, &mm->timer, seconds, 0);
 }
 
 static void mmctx_timer_stop(struct sgsn_mm_ctx *mm, unsigned int T)
@@ -221,7 +224,7 @@ static void mmctx_timer_stop(struct sgsn_mm_ctx *mm, unsigned int T)
 	if (mm->T != T)
 		LOGP(DMM, LOGL_ERROR, "Stopping MM timer %u but "
 			"%u is running\n", T, mm->T);
-	bsc_del_timer(&mm->timer);
+	bsc_wheel_del(&gmm_wheel, &mm->timer);
 }
 
 /* Send a message through the underlying layer */
@@ -588,7 +591,7 @@ static int gsm48_rx_gmm_id_resp(struct sgsn_mm_ctx *ctx, struct msgb *msg)
 		/* we already have a mm context with current TLLI, but no
 		 * P-TMSI / IMSI yet.  What we now need to do is to fill
 		 * this initial context with data from the HLR */
-		strncpy(ctx->imsi, mi_string, sizeof(ctx->imei));
+		sgsn_mm_ctx_set_imsi(ctx, mi_string);
 		break;
 	case GSM_MI_TYPE_IMEI:
 		strncpy(ctx->imei, mi_string, sizeof(ctx->imei));
@@ -675,10 +678,10 @@ static int gsm48_rx_gmm_att_req(struct sgsn_mm_ctx *ctx, struct msgb *msg,
 			ctx = sgsn_mm_ctx_alloc(0, &ra_id);
 			if (!ctx)
 				return gsm48_tx_gmm_att_rej_oldmsg(msg, GMM_CAUSE_NET_FAIL);
-			strncpy(ctx->imsi, mi_string, sizeof(ctx->imsi));
+			sgsn_mm_ctx_set_imsi(ctx, mi_string);
 #endif
 		}
-		ctx->tlli = msgb_tlli(msg);
+		sgsn_mm_ctx_set_tlli(ctx, msgb_tlli(msg));
 		ctx->llme = llme;
 		msgid2mmctx(ctx, msg);
 		break;
@@ -690,9 +693,9 @@ static int gsm48_rx_gmm_att_req(struct sgsn_mm_ctx *ctx, struct msgb *msg,
 			ctx = sgsn_mm_ctx_by_ptmsi(tmsi);
 		if (!ctx) {
 			ctx = sgsn_mm_ctx_alloc(msgb_tlli(msg), &ra_id);
-			ctx->p_tmsi = tmsi;
+			sgsn_mm_ctx_set_ptmsi(ctx, tmsi, ctx->p_tmsi_old);
 		}
-		ctx->tlli = msgb_tlli(msg);
+		sgsn_mm_ctx_set_tlli(ctx, msgb_tlli(msg));
 		ctx->llme = llme;
 		msgid2mmctx(ctx, msg);
 		break;
@@ -713,8 +716,7 @@ static int gsm48_rx_gmm_att_req(struct sgsn_mm_ctx *ctx, struct msgb *msg,
 
 #ifdef PTMSI_ALLOC
 	/* Allocate a new P-TMSI (+ P-TMSI signature) and update TLLI */
-	ctx->p_tmsi_old = ctx->p_tmsi;
-	ctx->p_tmsi = sgsn_alloc_ptmsi();
+	sgsn_mm_ctx_set_ptmsi(ctx, sgsn_alloc_ptmsi(), ctx->p_tmsi);
 #endif
 	/* Even if there is no P-TMSI allocated, the MS will switch from
 	 * foreign TLLI to local TLLI */
@@ -732,6 +734,25 @@ err_inval:
 	return gsm48_tx_gmm_att_rej_oldmsg(msg, GMM_CAUSE_SEM_INCORR_MSG);
 }
 
+/*
+ * TLLI unassignment frees the LLME. gprs_llc_tx_ui() trusts mm->llme and
+ * a DEACT PDP ACK can still be sent later, no MM context may keep it.
+ */
+static void mmctx_llme_unassign(struct sgsn_mm_ctx *ctx)
+{
+	struct gprs_llc_llme *llme = ctx->llme;
+	struct sgsn_mm_ctx *mm;
+
+	if (!llme)
+		return;
+
+	llist_for_each_entry(mm, &sgsn_mm_ctxts, list)
+		if (mm->llme == llme)
+			mm->llme = NULL;
+
+	gprs_llgmm_assign(llme, ctx->tlli, 0xffffffff, GPRS_ALGO_GEA0, NULL);
+}
+
 /* Section 4.7.4.1 / 9.4.5.2 MO Detach request */
 static int gsm48_rx_gmm_det_req(struct sgsn_mm_ctx *ctx, struct msgb *msg)
 {
@@ -765,8 +786,7 @@ static int gsm48_rx_gmm_det_req(struct sgsn_mm_ctx *ctx, struct msgb *msg)
 	rc = gsm48_tx_gmm_det_ack(ctx, 0);
 
 	/* TLLI unassignment */
-	gprs_llgmm_assign(ctx->llme, ctx->tlli, 0xffffffff,
-			  GPRS_ALGO_GEA0, NULL);
+	mmctx_llme_unassign(ctx);
 
 	return rc;
 }
@@ -909,7 +929,7 @@ static int gsm48_rx_gmm_ra_upd_req(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 	/* Update the MM context with the new RA-ID */
 	bssgp_parse_cell_id(&mmctx->ra, msgb_bcid(msg));
 	/* Update the MM context with the new TLLI */
-	mmctx->tlli = msgb_tlli(msg);
+	sgsn_mm_ctx_set_tlli(mmctx, msgb_tlli(msg));
 	/* FIXME: Update the MM context with the MS radio acc capabilities */
 	/* FIXME: Update the MM context with the MS network capabilities */
 
@@ -917,8 +937,7 @@ static int gsm48_rx_gmm_ra_upd_req(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 
 	DEBUGPC(DMM, " ACCEPT\n");
 #ifdef PTMSI_ALLOC
-	mmctx->p_tmsi_old = mmctx->p_tmsi;
-	mmctx->p_tmsi = sgsn_alloc_ptmsi();
+	sgsn_mm_ctx_set_ptmsi(mmctx, sgsn_alloc_ptmsi(), mmctx->p_tmsi);
 	/* Start T3350 and re-transmit up to 5 times until ATTACH COMPLETE */
 	mmctx->t3350_mode = GMM_T3350_MODE_RAU;
 	mmctx_timer_start(mmctx, 3350, GSM0408_T3350_SECS);
@@ -989,9 +1008,9 @@ static int gsm0408_rcv_gmm(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 		/* only in case SGSN offered new P-TMSI */
 		DEBUGP(DMM, "-> ATTACH COMPLETE\n");
 		mmctx_timer_stop(mmctx, 3350);
-		mmctx->p_tmsi_old = 0;
+		sgsn_mm_ctx_set_ptmsi(mmctx, mmctx->p_tmsi, 0);
 		/* Unassign the old TLLI */
-		mmctx->tlli = mmctx->tlli_new;
+		sgsn_mm_ctx_set_tlli(mmctx, mmctx->tlli_new);
 		gprs_llgmm_assign(mmctx->llme, 0xffffffff, mmctx->tlli_new,
 				  GPRS_ALGO_GEA0, NULL);
 		break;
@@ -999,18 +1018,18 @@ static int gsm0408_rcv_gmm(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 		/* only in case SGSN offered new P-TMSI */
 		DEBUGP(DMM, "-> ROUTEING AREA UPDATE COMPLETE\n");
 		mmctx_timer_stop(mmctx, 3350);
-		mmctx->p_tmsi_old = 0;
+		sgsn_mm_ctx_set_ptmsi(mmctx, mmctx->p_tmsi, 0);
 		/* Unassign the old TLLI */
-		mmctx->tlli = mmctx->tlli_new;
+		sgsn_mm_ctx_set_tlli(mmctx, mmctx->tlli_new);
 		gprs_llgmm_assign(mmctx->llme, 0xffffffff, mmctx->tlli_new,
 				  GPRS_ALGO_GEA0, NULL);
 		break;
 	case GSM48_MT_GMM_PTMSI_REALL_COMPL:
 		DEBUGP(DMM, "-> PTMSI REALLLICATION COMPLETE\n");
 		mmctx_timer_stop(mmctx, 3350);
-		mmctx->p_tmsi_old = 0;
+		sgsn_mm_ctx_set_ptmsi(mmctx, mmctx->p_tmsi, 0);
 		/* Unassign the old TLLI */
-		mmctx->tlli = mmctx->tlli_new;
+		sgsn_mm_ctx_set_tlli(mmctx, mmctx->tlli_new);
 		//gprs_llgmm_assign(mmctx->llme, 0xffffffff, mmctx->tlli_new, GPRS_ALGO_GEA0, NULL);
 		break;
 	case GSM48_MT_GMM_AUTH_CIPH_RESP:
@@ -1052,7 +1071,8 @@ static void mmctx_timer_cb(void *_mm)
 			/* FIXME */
 			break;
 		}
-		bsc_schedule_timer(&mm->timer, GSM0408_T3350_SECS, 0);
+		bsc_wheel_schedule(&gmm_wheel, &mm->timer,
+				   GSM0408_T3350_SECS, 0);
 		break;
 	case 3360:	/* waiting for AUTH AND CIPH RESP */
 		if (mm->num_T_exp >= 5) {
@@ -1061,7 +1081,8 @@ static void mmctx_timer_cb(void *_mm)
 			break;
 		}
 		/* FIXME: re-transmit the respective msg and re-start timer */
-		bsc_schedule_timer(&mm->timer, GSM0408_T3360_SECS, 0);
+		bsc_wheel_schedule(&gmm_wheel, &mm->timer,
+				   GSM0408_T3360_SECS, 0);
 		break;
 	case 3370:	/* waiting for IDENTITY RESPONSE */
 		if (mm->num_T_exp >= 5) {
@@ -1072,7 +1093,8 @@ static void mmctx_timer_cb(void *_mm)
 		}
 		/* re-tranmit IDENTITY REQUEST and re-start timer */
 		gsm48_tx_gmm_id_req(mm, mm->t3370_id_type);
-		bsc_schedule_timer(&mm->timer, GSM0408_T3370_SECS, 0);
+		bsc_wheel_schedule(&gmm_wheel, &mm->timer,
+				   GSM0408_T3370_SECS, 0);
 		break;
 	default:
 		LOGP(DMM, LOGL_ERROR, "timer expired in unknown mode %u\n",
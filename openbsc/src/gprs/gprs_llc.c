@@ -22,6 +22,7 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <osmocore/msgb.h>
 #include <osmocore/linuxlist.h>
@@ -34,6 +35,7 @@
 #include <openbsc/gprs_gmm.h>
 #include <openbsc/gprs_bssgp.h>
 #include <openbsc/gprs_llc.h>
+#include <openbsc/sgsn.h>
 #include <openbsc/crc24.h>
 
 /* Section 8.9.9 LLC layer parameter default values */
@@ -107,18 +109,41 @@ static const struct gprs_llc_params llc_default_params[] = {
 LLIST_HEAD(gprs_llc_llmes);
 void *llc_tall_ctx;
 
+/* LLMEs by TLLI and by old TLLI, an unassigned old TLLI is not indexed */
+static struct hash_index llme_by_tlli;
+static struct hash_index llme_by_old_tlli;
+
 /* lookup LLC Entity based on DLCI (TLLI+SAPI tuple) */
 static struct gprs_llc_lle *lle_by_tlli_sapi(uint32_t tlli, uint8_t sapi)
 {
 	struct gprs_llc_llme *llme;
 
-	llist_for_each_entry(llme, &gprs_llc_llmes, list) {
-		if (llme->tlli == tlli || llme->old_tlli == tlli)
+	hash_index_for_each(llme, &llme_by_tlli, hash_index_u32(tlli), tlli_entry) {
+		if (llme->tlli == tlli)
+			return &llme->lle[sapi];
+	}
+	hash_index_for_each(llme, &llme_by_old_tlli, hash_index_u32(tlli), old_tlli_entry) {
+		if (llme->old_tlli == tlli)
 			return &llme->lle[sapi];
 	}
 	return NULL;
 }
 
+static void llme_set_tlli(struct gprs_llc_llme *llme, uint32_t tlli,
+			  uint32_t old_tlli)
+{
+	hash_index_del(&llme_by_tlli, &llme->tlli_entry);
+	hash_index_del(&llme_by_old_tlli, &llme->old_tlli_entry);
+
+	llme->tlli = tlli;
+	llme->old_tlli = old_tlli;
+	hash_index_add(llc_tall_ctx, &llme_by_tlli, &llme->tlli_entry,
+		       hash_index_u32(tlli));
+	if (old_tlli != 0xffffffff)
+		hash_index_add(llc_tall_ctx, &llme_by_old_tlli,
+			       &llme->old_tlli_entry, hash_index_u32(old_tlli));
+}
+
 static void lle_init(struct gprs_llc_llme *llme, uint8_t sapi)
 {
 	struct gprs_llc_lle *lle = &llme->lle[sapi];
@@ -140,6 +165,11 @@ static struct gprs_llc_llme *llme_alloc(uint32_t tlli)
 	if (!llme)
 		return NULL;
 
+	if (hash_index_add(llc_tall_ctx, &llme_by_tlli, &llme->tlli_entry,
+			   hash_index_u32(tlli)) != 0) {
+		talloc_free(llme);
+		return NULL;
+	}
 	llme->tlli = tlli;
 	llme->old_tlli = 0xffffffff;
 	llme->state = GPRS_LLMS_UNASSIGNED;
@@ -154,6 +184,8 @@ static struct gprs_llc_llme *llme_alloc(uint32_t tlli)
 
 static void llme_free(struct gprs_llc_llme *llme)
 {
+	hash_index_del(&llme_by_tlli, &llme->tlli_entry);
+	hash_index_del(&llme_by_old_tlli, &llme->old_tlli_entry);
 	llist_del(&llme->list);
 	talloc_free(llme);
 }
@@ -294,21 +326,131 @@ int gprs_llc_tx_u(struct msgb *msg, uint8_t sapi, int command,
 	return gprs_bssgp_tx_dl_ud(msg, NULL);
 }
 
-/* Send XID response to LLE */
-static int gprs_llc_tx_xid(struct gprs_llc_lle *lle, struct msgb *msg)
+/* Send XID command or response to LLE */
+static int gprs_llc_tx_xid(struct gprs_llc_lle *lle, struct msgb *msg,
+			   int command)
 {
 	/* copy identifiers from LLE to ensure lower layers can route */
 	msgb_tlli(msg) = lle->llme->tlli;
 	msgb_bvci(msg) = lle->llme->bvci;
 	msgb_nsei(msg) = lle->llme->nsei;
 
-	return gprs_llc_tx_u(msg, lle->sapi, 0, GPRS_LLC_U_XID, 1);
+	return gprs_llc_tx_u(msg, lle->sapi, command, GPRS_LLC_U_XID, 1);
+}
+
+/* Section 6.4.1.6 Table 6: XID parameter types */
+#define GPRS_LLC_XID_L3_PAR	11
+
+/* Figure 11: the type and length of a XID parameter, returns the length
+ * of the header */
+static int xid_param_hdr(const uint8_t *cur, const uint8_t *end,
+			 uint8_t *type, unsigned int *len)
+{
+	int hlen = 1;
+
+	*type = (cur[0] >> 2) & 0x1f;
+	if (cur[0] & 0x80) {
+		if (end - cur < 2)
+			return -EINVAL;
+		*len = ((cur[0] & 0x3) << 6) | (cur[1] >> 2);
+		hlen = 2;
+	} else
+		*len = cur[0] & 0x3;
+
+	if (*len > end - cur - hlen)
+		return -EINVAL;
+	return hlen;
+}
+
+/* append the Layer-3 parameters, always with the long length field */
+static void xid_put_l3(struct msgb *msg, const uint8_t *l3, uint8_t len)
+{
+	uint8_t *hdr = msgb_put(msg, 2 + len);
+
+	hdr[0] = 0x80 | (GPRS_LLC_XID_L3_PAR << 2) | (len >> 6);
+	hdr[1] = len << 2;
+	memcpy(hdr + 2, l3, len);
+}
+
+static int sapi_is_sndcp(uint8_t sapi)
+{
+	return sapi == GPRS_SAPI_SNDCP3 || sapi == GPRS_SAPI_SNDCP5 ||
+	       sapi == GPRS_SAPI_SNDCP9 || sapi == GPRS_SAPI_SNDCP11;
+}
+
+/* A XID command of the MS is answered with the LLC parameters as proposed
+ * and the Layer-3 parameters SNDCP agrees to, the Layer-3 parameters of
+ * a response go to SNDCP */
+static int gprs_llc_rx_xid(struct gprs_llc_hdr_parsed *gph,
+			   struct gprs_llc_lle *lle)
+{
+	uint8_t *cur = gph->data, *end = gph->data + gph->data_len;
+	struct msgb *resp = NULL;
+
+	if (gph->is_cmd) {
+		resp = msgb_alloc_headroom(4096, 1024, "LLC_XID");
+		if (!resp)
+			return -ENOMEM;
+	}
+
+	while (cur < end) {
+		unsigned int len;
+		uint8_t type;
+		int hlen;
+
+		hlen = xid_param_hdr(cur, end, &type, &len);
+		if (hlen < 0) {
+			LOGP(DLLC, LOGL_NOTICE, "TLLI=%08x malformed XID "
+				"parameter at %u\n", lle->llme->tlli,
+				(unsigned int) (cur - gph->data));
+			if (resp)
+				msgb_free(resp);
+			return -EINVAL;
+		}
+
+		if (type == GPRS_LLC_XID_L3_PAR && sapi_is_sndcp(lle->sapi)) {
+			if (resp) {
+				uint8_t l3[255];
+				int rc;
+
+				rc = sndcp_ll_xid_ind(lle, cur + hlen, len,
+						      l3, sizeof(l3));
+				if (rc > 0)
+					xid_put_l3(resp, l3, rc);
+			} else
+				sndcp_ll_xid_conf(lle, cur + hlen, len);
+		} else if (resp)
+			memcpy(msgb_put(resp, hlen + len), cur, hlen + len);
+
+		cur += hlen + len;
+	}
+
+	if (resp)
+		return gprs_llc_tx_xid(lle, resp, 0);
+	return 0;
+}
+
+int gprs_ll_xid_req(struct gprs_llc_lle *lle, const uint8_t *l3,
+		    unsigned int l3_len)
+{
+	struct msgb *msg;
+
+	if (l3_len > 255)
+		return -EINVAL;
+
+	msg = msgb_alloc_headroom(4096, 1024, "LLC_XID");
+	if (!msg)
+		return -ENOMEM;
+	xid_put_l3(msg, l3, l3_len);
+
+	return gprs_llc_tx_xid(lle, msg, 1);
 }
 
 /* Transmit a UI frame over the given SAPI */
 int gprs_llc_tx_ui(struct msgb *msg, uint8_t sapi, int command,
 		   void *mmctx)
 {
+	struct sgsn_mm_ctx *mm = mmctx;
 	struct gprs_llc_lle *lle;
 	uint8_t *fcs, *llch;
 	uint8_t addr, ctrl[2];
@@ -318,17 +460,27 @@ int gprs_llc_tx_ui(struct msgb *msg, uint8_t sapi, int command,
 
 	/* Identifiers from UP: (TLLI, SAPI) + (BVCI, NSEI) */
 
-	/* look-up or create the LL Entity for this (TLLI, SAPI) tuple */
-	lle = lle_by_tlli_sapi(msgb_tlli(msg), sapi);
+	/* look-up or create the LL Entity for this (TLLI, SAPI) tuple, the
+	 * MM context usually knows it already */
+	if (mm && mm->llme && (mm->llme->tlli == msgb_tlli(msg) ||
+			       mm->llme->old_tlli == msgb_tlli(msg)))
+		lle = &mm->llme->lle[sapi];
+	else
+		lle = lle_by_tlli_sapi(msgb_tlli(msg), sapi);
 	if (!lle) {
 		struct gprs_llc_llme *llme;
 		llme = llme_alloc(msgb_tlli(msg));
+		if (!llme) {
+			msgb_free(msg);
+			return -ENOMEM;
+		}
 		lle = &llme->lle[sapi];
 	}
 
 	if (msg->len > lle->params.n201_u) {
 		LOGP(DLLC, LOGL_ERROR, "Cannot Tx %u bytes (N201-U=%u)\n",
 			msg->len, lle->params.n201_u);
+		msgb_free(msg);
 		return -EFBIG;
 	}
 
@@ -386,6 +538,7 @@ int gprs_llc_tx_ui(struct msgb *msg, uint8_t sapi, int command,
 				     kc, iv, GPRS_CIPH_SGSN2MS);
 		if (rc < 0) {
 			LOGP(DLLC, LOGL_ERROR, "Error crypting UI frame: %d\n", rc);
+			msgb_free(msg);
 			return rc;
 		}
 
@@ -447,15 +600,9 @@ static int gprs_llc_hdr_rx(struct gprs_llc_hdr_parsed *gph,
 	case GPRS_LLC_FRMR: /* Section 6.4.1.5 */
 		break;
 	case GPRS_LLC_XID: /* Section 6.4.1.6 */
-		/* FIXME: implement XID negotiation using SNDCP */
-		{
-			struct msgb *resp;
-			uint8_t *xid;
-			resp = msgb_alloc_headroom(4096, 1024, "LLC_XID");
-			xid = msgb_put(resp, gph->data_len);
-			memcpy(xid, gph->data, gph->data_len);
-			gprs_llc_tx_xid(lle, resp);
-		}
+		gprs_llc_rx_xid(gph, lle);
+		/* the parameters are no data for the layer above */
+		gph->data = NULL;
 		break;
 	case GPRS_LLC_UI:
 		if (gph->seq_tx < lle->vu_recv) {
@@ -678,6 +825,8 @@ int gprs_llc_rcvmsg(struct msgb *msg, struct tlv_parsed *tv)
 			struct gprs_llc_llme *llme;
 			/* FIXME: don't use the TLLI but the 0xFFFF unassigned? */
 			llme = llme_alloc(msgb_tlli(msg));
+			if (!llme)
+				return -ENOMEM;
 			lle = &llme->lle[llhp.sapi];
 		} else {
 			LOGP(DLLC, LOGL_NOTICE,
@@ -787,13 +936,11 @@ int gprs_llgmm_assign(struct gprs_llc_llme *llme,
 		 * old is unassigned.  Only TLLI new shall be accepted when
 		 * received from peer. */
 		if (llme->old_tlli != 0xffffffff) {
-			llme->old_tlli = 0xffffffff;
-			llme->tlli = new_tlli;
+			llme_set_tlli(llme, new_tlli, 0xffffffff);
 		} else {
 			/* If TLLI old == 0xffffffff was assigned to LLME, then this is
 			 * TLLI assignmemt according to 8.3.1 */
-			llme->old_tlli = 0xffffffff;
-			llme->tlli = new_tlli;
+			llme_set_tlli(llme, new_tlli, 0xffffffff);
 			llme->state = GPRS_LLMS_ASSIGNED;
 			/* 8.5.3.1 For all LLE's */
 			for (i = 0; i < ARRAY_SIZE(llme->lle); i++) {
@@ -808,12 +955,10 @@ int gprs_llgmm_assign(struct gprs_llc_llme *llme,
 		/* TLLI Change 8.3.2 */
 		/* Both TLLI Old and TLLI New are assigned; use New when
 		 * (re)transmitting.  Accept toth Old and New on Rx */
-		llme->old_tlli = llme->tlli;
-		llme->tlli = new_tlli;
+		llme_set_tlli(llme, new_tlli, llme->tlli);
 		llme->state = GPRS_LLMS_ASSIGNED;
 	} else if (old_tlli != 0xffffffff && new_tlli == 0xffffffff) {
 		/* TLLI Unassignment 8.3.3) */
-		llme->tlli = llme->old_tlli = 0;
 		llme->state = GPRS_LLMS_UNASSIGNED;
 		for (i = 0; i < ARRAY_SIZE(llme->lle); i++) {
 			struct gprs_llc_lle *l = &llme->lle[i];
@@ -52,12 +52,15 @@
  *  o There are no BLOCK and UNBLOCK timers (yet?)
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdint.h>
 
 #include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include <openbsc/gsm_data.h>
 #include <osmocore/msgb.h>
@@ -71,6 +74,12 @@
 #include <openbsc/gprs_bssgp.h>
 #include <openbsc/gprs_ns_frgre.h>
 #include <openbsc/socket.h>
+#include <openbsc/timer_wheel.h>
+
+#include "../../bscconfig.h"
+#include <openbsc/mmsg.h>
+
+static struct bsc_timer_wheel ns_wheel = BSC_TIMER_WHEEL("ns");
 
 static const struct tlv_definition ns_att_tlvdef = {
 	.def = {
@@ -89,6 +98,7 @@ enum ns_ctr {
 	NS_CTR_BYTES_OUT,
 	NS_CTR_BLOCKED,
 	NS_CTR_DEAD,
+	NS_CTR_DROP_OUT,
 };
 
 static const struct rate_ctr_desc nsvc_ctr_description[] = {
@@ -98,6 +108,7 @@ static const struct rate_ctr_desc nsvc_ctr_description[] = {
 	{ "bytes.out",	"Bytes at NS Level   (Out)" },
 	{ "blocked",	"NS-VC Block count        " },
 	{ "dead",	"NS-VC gone dead count    " },
+	{ "dropped.out","Dropped Packets    (Out)" },
 };
 
 static const struct rate_ctr_group_desc nsvc_ctrg_desc = {
@@ -107,11 +118,18 @@ static const struct rate_ctr_group_desc nsvc_ctrg_desc = {
 	.ctr_desc = nsvc_ctr_description,
 };
 
+static uint32_t addr_hash(const struct sockaddr_in *sin)
+{
+	return hash_index_u32(sin->sin_addr.s_addr ^
+			      hash_index_u32(sin->sin_port));
+}
+
 /* Lookup struct gprs_nsvc based on NSVCI */
 struct gprs_nsvc *nsvc_by_nsvci(struct gprs_ns_inst *nsi, uint16_t nsvci)
 {
 	struct gprs_nsvc *nsvc;
-	llist_for_each_entry(nsvc, &nsi->gprs_nsvcs, list) {
+	hash_index_for_each(nsvc, &nsi->idx_nsvci, hash_index_u32(nsvci),
+			    nsvci_entry) {
 		if (nsvc->nsvci == nsvci)
 			return nsvc;
 	}
@@ -122,7 +140,8 @@ struct gprs_nsvc *nsvc_by_nsvci(struct gprs_ns_inst *nsi, uint16_t nsvci)
 struct gprs_nsvc *nsvc_by_nsei(struct gprs_ns_inst *nsi, uint16_t nsei)
 {
 	struct gprs_nsvc *nsvc;
-	llist_for_each_entry(nsvc, &nsi->gprs_nsvcs, list) {
+	hash_index_for_each(nsvc, &nsi->idx_nsei, hash_index_u32(nsei),
+			    nsei_entry) {
 		if (nsvc->nsei == nsei)
 			return nsvc;
 	}
@@ -134,7 +153,7 @@ static struct gprs_nsvc *nsvc_by_rem_addr(struct gprs_ns_inst *nsi,
 					  struct sockaddr_in *sin)
 {
 	struct gprs_nsvc *nsvc;
-	llist_for_each_entry(nsvc, &nsi->gprs_nsvcs, list) {
+	hash_index_for_each(nsvc, &nsi->idx_addr, addr_hash(sin), addr_entry) {
 		if (nsvc->ip.bts_addr.sin_addr.s_addr ==
 					sin->sin_addr.s_addr &&
 		    nsvc->ip.bts_addr.sin_port == sin->sin_port)
@@ -143,6 +162,66 @@ static struct gprs_nsvc *nsvc_by_rem_addr(struct gprs_ns_inst *nsi,
 	return NULL;
 }
 
+static void ns_dispatch_signal(struct gprs_nsvc *nsvc, unsigned int signal,
+			       uint8_t cause)
+{
+	struct ns_signal_data nssd;
+
+	nssd.nsvc = nsvc;
+	nssd.cause = cause;
+
+	dispatch_signal(SS_NS, signal, &nssd);
+}
+
+void nsvc_set_nsei(struct gprs_nsvc *nsvc, uint16_t nsei)
+{
+	if (nsvc->nsei == nsei)
+		return;
+
+	nsvc->nsei = nsei;
+	hash_index_rehash(nsvc->nsi, &nsvc->nsi->idx_nsei, &nsvc->nsei_entry,
+			  hash_index_u32(nsei));
+	ns_dispatch_signal(nsvc, S_NS_CHANGED, 0);
+}
+
+void nsvc_set_nsvci(struct gprs_nsvc *nsvc, uint16_t nsvci)
+{
+	nsvc->nsvci = nsvci;
+	hash_index_rehash(nsvc->nsi, &nsvc->nsi->idx_nsvci, &nsvc->nsvci_entry,
+			  hash_index_u32(nsvci));
+}
+
+/* the FR/GRE DLCI is kept as the port of the address */
+void nsvc_set_addr(struct gprs_nsvc *nsvc, const struct sockaddr_in *addr)
+{
+	if (nsvc->ip.bts_addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+	    nsvc->ip.bts_addr.sin_port == addr->sin_port)
+		return;
+
+	nsvc->ip.bts_addr = *addr;
+	hash_index_rehash(nsvc->nsi, &nsvc->nsi->idx_addr, &nsvc->addr_entry,
+			  addr_hash(addr));
+	ns_dispatch_signal(nsvc, S_NS_CHANGED, 0);
+}
+
+static void nsvc_set_state(struct gprs_nsvc *nsvc, uint32_t state)
+{
+	if (nsvc->state == state)
+		return;
+
+	nsvc->state = state;
+	ns_dispatch_signal(nsvc, S_NS_CHANGED, 0);
+}
+
+static void nsvc_unindex(struct gprs_nsvc *nsvc)
+{
+	struct gprs_ns_inst *nsi = nsvc->nsi;
+
+	hash_index_del(&nsi->idx_nsvci, &nsvc->nsvci_entry);
+	hash_index_del(&nsi->idx_nsei, &nsvc->nsei_entry);
+	hash_index_del(&nsi->idx_addr, &nsvc->addr_entry);
+}
+
 static void gprs_ns_timer_cb(void *data);
 
 struct gprs_nsvc *nsvc_create(struct gprs_ns_inst *nsi, uint16_t nsvci)
@@ -152,6 +231,8 @@ struct gprs_nsvc *nsvc_create(struct gprs_ns_inst *nsi, uint16_t nsvci)
 	LOGP(DNS, LOGL_INFO, "NSVCI=%u Creating NS-VC\n", nsvci);
 
 	nsvc = talloc_zero(nsi, struct gprs_nsvc);
+	if (!nsvc)
+		return NULL;
 	nsvc->nsvci = nsvci;
 	/* before RESET procedure: BLOCKED and DEAD */
 	nsvc->state = NSE_S_BLOCKED;
@@ -159,31 +240,36 @@ struct gprs_nsvc *nsvc_create(struct gprs_ns_inst *nsi, uint16_t nsvci)
 	nsvc->timer.cb = gprs_ns_timer_cb;
 	nsvc->timer.data = nsvc;
 	nsvc->ctrg = rate_ctr_group_alloc(nsvc, &nsvc_ctrg_desc, nsvci);
-
+	INIT_LLIST_HEAD(&nsvc->tx_queue);
+	INIT_LLIST_HEAD(&nsvc->tx_pending);
+
+	if (hash_index_add(nsi, &nsi->idx_nsvci, &nsvc->nsvci_entry,
+			   hash_index_u32(nsvc->nsvci)) != 0 ||
+	    hash_index_add(nsi, &nsi->idx_nsei, &nsvc->nsei_entry,
+			   hash_index_u32(nsvc->nsei)) != 0 ||
+	    hash_index_add(nsi, &nsi->idx_addr, &nsvc->addr_entry,
+			   addr_hash(&nsvc->ip.bts_addr)) != 0) {
+		nsvc_unindex(nsvc);
+		talloc_free(nsvc);
+		return NULL;
+	}
 	llist_add(&nsvc->list, &nsi->gprs_nsvcs);
 
 	return nsvc;
 }
 
+static void nsip_flush_queue(struct gprs_nsvc *nsvc);
+
 void nsvc_delete(struct gprs_nsvc *nsvc)
 {
-	if (bsc_timer_pending(&nsvc->timer))
-		bsc_del_timer(&nsvc->timer);
+	if (bsc_wheel_pending(&nsvc->timer))
+		bsc_wheel_del(&ns_wheel, &nsvc->timer);
+	nsip_flush_queue(nsvc);
+	nsvc_unindex(nsvc);
 	llist_del(&nsvc->list);
 	talloc_free(nsvc);
 }
 
-static void ns_dispatch_signal(struct gprs_nsvc *nsvc, unsigned int signal,
-			       uint8_t cause)
-{
-	struct ns_signal_data nssd;
-
-	nssd.nsvc = nsvc;
-	nssd.cause = cause;
-
-	dispatch_signal(SS_NS, signal, &nssd);
-}
-
 /* Section 10.3.2, Table 13 */
 static const struct value_string ns_cause_str[] = {
 	{ NS_CAUSE_TRANSIT_FAIL,	"Transit network failure" },
@@ -343,7 +429,7 @@ int gprs_ns_tx_block(struct gprs_nsvc *nsvc, uint8_t cause)
 		nsvc->nsei, nsvc->nsvci, gprs_ns_cause_str(cause));
 
 	/* be conservative and mark it as blocked even now! */
-	nsvc->state |= NSE_S_BLOCKED;
+	nsvc_set_state(nsvc, nsvc->state | NSE_S_BLOCKED);
 	rate_ctr_inc(&nsvc->ctrg->ctr[NS_CTR_BLOCKED]);
 
 	msg->l2h = msgb_put(msg, sizeof(*nsh));
@@ -406,11 +492,11 @@ static void nsvc_start_timer(struct gprs_nsvc *nsvc, enum nsvc_timer_mode mode)
 		nsvc->nsei, get_value_string(timer_mode_strs, mode),
 		seconds);
 		
-	if (bsc_timer_pending(&nsvc->timer))
-		bsc_del_timer(&nsvc->timer);
+	if (bsc_wheel_pending(&nsvc->timer))
+		bsc_wheel_del(&ns_wheel, &nsvc->timer);
 
 	nsvc->timer_mode = mode;
-	bsc_schedule_timer(&nsvc->timer, seconds, 0);
+	bsc_wheel_schedule(&ns_wheel, &nsvc->timer, seconds, 0);
 }
 
 static void gprs_ns_timer_cb(void *data)
@@ -431,7 +517,7 @@ static void gprs_ns_timer_cb(void *data)
 		if (nsvc->alive_retries >
 			nsvc->nsi->timeout[NS_TOUT_TNS_ALIVE_RETRIES]) {
 			/* mark as dead and blocked */
-			nsvc->state = NSE_S_BLOCKED;
+			nsvc_set_state(nsvc, NSE_S_BLOCKED);
 			rate_ctr_inc(&nsvc->ctrg->ctr[NS_CTR_BLOCKED]);
 			rate_ctr_inc(&nsvc->ctrg->ctr[NS_CTR_DEAD]);
 			LOGP(DNS, LOGL_NOTICE,
@@ -621,10 +707,10 @@ static int gprs_ns_rx_reset(struct gprs_nsvc *nsvc, struct msgb *msg)
 		nsvc->nsvci, nsvc->nsei, gprs_ns_cause_str(*cause));
 
 	/* Mark NS-VC as blocked and alive */
-	nsvc->state = NSE_S_BLOCKED | NSE_S_ALIVE;
+	nsvc_set_state(nsvc, NSE_S_BLOCKED | NSE_S_ALIVE);
 
-	nsvc->nsei = ntohs(*nsei);
-	nsvc->nsvci = ntohs(*nsvci);
+	nsvc_set_nsei(nsvc, ntohs(*nsei));
+	nsvc_set_nsvci(nsvc, ntohs(*nsvci));
 
 	/* start the test procedure */
 	gprs_ns_tx_simple(nsvc, NS_PDUT_ALIVE);
@@ -646,7 +732,7 @@ static int gprs_ns_rx_block(struct gprs_nsvc *nsvc, struct msgb *msg)
 
 	LOGP(DNS, LOGL_INFO, "NSEI=%u Rx NS BLOCK\n", nsvc->nsei);
 
-	nsvc->state |= NSE_S_BLOCKED;
+	nsvc_set_state(nsvc, nsvc->state | NSE_S_BLOCKED);
 
 	rc = tlv_parse(&tp, &ns_att_tlvdef, nsh->data,
 			msgb_l2len(msg) - sizeof(*nsh), 0, 0);
@@ -672,9 +758,8 @@ static int gprs_ns_rx_block(struct gprs_nsvc *nsvc, struct msgb *msg)
 	return gprs_ns_tx_simple(nsvc, NS_PDUT_BLOCK_ACK);
 }
 
-/* main entry point, here incoming NS frames enter */
-int gprs_ns_rcvmsg(struct gprs_ns_inst *nsi, struct msgb *msg,
-		   struct sockaddr_in *saddr, enum gprs_ns_ll ll)
+static int ns_rcvmsg(struct gprs_ns_inst *nsi, struct msgb *msg,
+		     struct sockaddr_in *saddr, enum gprs_ns_ll ll)
 {
 	struct gprs_ns_hdr *nsh = (struct gprs_ns_hdr *) msg->l2h;
 	struct gprs_nsvc *nsvc;
@@ -739,7 +824,7 @@ int gprs_ns_rcvmsg(struct gprs_ns_inst *nsi, struct msgb *msg,
 				inet_ntoa(saddr->sin_addr), ntohs(saddr->sin_port));
 		}
 		/* Update the remote peer IP address/port */
-		nsvc->ip.bts_addr = *saddr;
+		nsvc_set_addr(nsvc, saddr);
 	} else
 		msgb_nsei(msg) = nsvc->nsei;
 
@@ -782,12 +867,12 @@ int gprs_ns_rcvmsg(struct gprs_ns_inst *nsi, struct msgb *msg,
 	case NS_PDUT_RESET_ACK:
 		LOGP(DNS, LOGL_INFO, "NSEI=%u Rx NS RESET ACK\n", nsvc->nsei);
 		/* mark NS-VC as blocked + active */
-		nsvc->state = NSE_S_BLOCKED | NSE_S_ALIVE;
+		nsvc_set_state(nsvc, NSE_S_BLOCKED | NSE_S_ALIVE);
 		nsvc->remote_state = NSE_S_BLOCKED | NSE_S_ALIVE;
 		rate_ctr_inc(&nsvc->ctrg->ctr[NS_CTR_BLOCKED]);
 		if (nsvc->persistent || nsvc->remote_end_is_sgsn) {
 			/* stop RESET timer */
-			bsc_del_timer(&nsvc->timer);
+			bsc_wheel_del(&ns_wheel, &nsvc->timer);
 		}
 		/* Initiate TEST proc.: Send ALIVE and start timer */
 		rc = gprs_ns_tx_simple(nsvc, NS_PDUT_ALIVE);
@@ -796,14 +881,14 @@ int gprs_ns_rcvmsg(struct gprs_ns_inst *nsi, struct msgb *msg,
 	case NS_PDUT_UNBLOCK:
 		/* Section 7.2: unblocking procedure */
 		LOGP(DNS, LOGL_INFO, "NSEI=%u Rx NS UNBLOCK\n", nsvc->nsei);
-		nsvc->state &= ~NSE_S_BLOCKED;
+		nsvc_set_state(nsvc, nsvc->state & ~NSE_S_BLOCKED);
 		ns_dispatch_signal(nsvc, S_NS_UNBLOCK, 0);
 		rc = gprs_ns_tx_simple(nsvc, NS_PDUT_UNBLOCK_ACK);
 		break;
 	case NS_PDUT_UNBLOCK_ACK:
 		LOGP(DNS, LOGL_INFO, "NSEI=%u Rx NS UNBLOCK ACK\n", nsvc->nsei);
 		/* mark NS-VC as unblocked + active */
-		nsvc->state = NSE_S_ALIVE;
+		nsvc_set_state(nsvc, NSE_S_ALIVE);
 		nsvc->remote_state = NSE_S_ALIVE;
 		ns_dispatch_signal(nsvc, S_NS_UNBLOCK, 0);
 		break;
@@ -824,6 +909,29 @@ int gprs_ns_rcvmsg(struct gprs_ns_inst *nsi, struct msgb *msg,
 	return rc;
 }
 
+/* main entry point, here incoming NS frames enter */
+int gprs_ns_rcvmsg(struct gprs_ns_inst *nsi, struct msgb *msg,
+		   struct sockaddr_in *saddr, enum gprs_ns_ll ll)
+{
+	int rc;
+
+	nsi->rx_msg = msg;
+	rc = ns_rcvmsg(nsi, msg, saddr, ll);
+	if (nsi->rx_msg)
+		msgb_free(nsi->rx_msg);
+	nsi->rx_msg = NULL;
+
+	return rc;
+}
+
+/* keep the message of the UNIT DATA IND, e.g. to send it on */
+struct msgb *gprs_ns_msgb_take(struct gprs_ns_inst *nsi, struct msgb *msg)
+{
+	if (nsi->rx_msg == msg)
+		nsi->rx_msg = NULL;
+	return msg;
+}
+
 struct gprs_ns_inst *gprs_ns_instantiate(gprs_ns_cb_t *cb)
 {
 	struct gprs_ns_inst *nsi = talloc_zero(tall_bsc_ctx, struct gprs_ns_inst);
@@ -837,19 +945,28 @@ struct gprs_ns_inst *gprs_ns_instantiate(gprs_ns_cb_t *cb)
 	nsi->timeout[NS_TOUT_TNS_TEST] = 30;
 	nsi->timeout[NS_TOUT_TNS_ALIVE] = 3;
 	nsi->timeout[NS_TOUT_TNS_ALIVE_RETRIES] = 10;
+	INIT_LLIST_HEAD(&nsi->nsip.tx_pending);
+	nsi->nsip.tx_queue_max = 1000;
 
 	/* Create the dummy NSVC that we use for sending
 	 * messages to non-existant/unknown NS-VC's */
 	nsi->unknown_nsvc = nsvc_create(nsi, 0xfffe);
 	llist_del(&nsi->unknown_nsvc->list);
+	nsvc_unindex(nsi->unknown_nsvc);
 
 	return nsi;
 }
 
 void gprs_ns_destroy(struct gprs_ns_inst *nsi)
 {
+	int i;
+
 	/* FIXME: clear all timers */
 
+	for (i = 0; i < NSIP_RX_BATCH; ++i)
+		if (nsi->nsip.rx_msgs[i])
+			msgb_free(nsi->nsip.rx_msgs[i]);
+
 	/* recursively free the NSI and all its NSVCs */
 	talloc_free(nsi);
 }
@@ -858,60 +975,229 @@ void gprs_ns_destroy(struct gprs_ns_inst *nsi)
 /* NS-over-IP code, according to 3GPP TS 48.016 Chapter 6.2
  * We don't support Size Procedure, Configuration Procedure, ChangeWeight Procedure */
 
-/* Read a single NS-over-IP message */
-static struct msgb *read_nsip_msg(struct bsc_fd *bfd, int *error,
-				  struct sockaddr_in *saddr)
+/*
+ * The socket is read with recvmmsg() in batches of NSIP_RX_BATCH, the
+ * buffers that were not filled are kept for the next call. Messages
+ * are sent right away as long as the NS-VC has nothing queued. Once
+ * the socket is full they are queued per NS-VC up to tx_queue_max and
+ * written with sendmmsg() when the socket becomes writable again.
+ */
+
+static int nsip_would_block(int error)
 {
-	struct msgb *msg = gprs_ns_msgb_alloc();
-	int ret = 0;
-	socklen_t saddr_len = sizeof(*saddr);
+	return error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS;
+}
 
-	if (!msg) {
-		*error = -ENOMEM;
-		return NULL;
+/* the kernel counts the datagrams it had to drop since SO_RXQ_OVFL was set */
+static void nsip_rx_overflow(struct gprs_ns_inst *nsi, struct msghdr *hdr)
+{
+#ifdef SO_RXQ_OVFL
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t dropped;
+
+			memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+			if (dropped != nsi->nsip.rx_overflow)
+				LOGP(DNS, LOGL_ERROR, "NS/UDP socket dropped %u datagrams\n",
+				     dropped - nsi->nsip.rx_overflow);
+			nsi->nsip.rx_overflow = dropped;
+		}
 	}
+#endif
+}
 
-	ret = recvfrom(bfd->fd, msg->data, NS_ALLOC_SIZE - NS_ALLOC_HEADROOM, 0,
-			(struct sockaddr *)saddr, &saddr_len);
-	if (ret < 0) {
+static int handle_nsip_read(struct bsc_fd *bfd)
+{
+	struct gprs_ns_inst *nsi = bfd->data;
+	struct msgb **msgs = nsi->nsip.rx_msgs;
+	struct mmsghdr mmsg[NSIP_RX_BATCH];
+	struct iovec iov[NSIP_RX_BATCH];
+	struct sockaddr_in saddr[NSIP_RX_BATCH];
+	char control[NSIP_RX_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+	int i, j, nr, rc;
+
+	memset(mmsg, 0, sizeof(mmsg));
+	for (nr = 0; nr < NSIP_RX_BATCH; ++nr) {
+		if (!msgs[nr])
+			msgs[nr] = gprs_ns_msgb_alloc();
+		if (!msgs[nr])
+			break;
+
+		iov[nr].iov_base = msgs[nr]->data;
+		iov[nr].iov_len = NS_ALLOC_SIZE - NS_ALLOC_HEADROOM;
+		mmsg[nr].msg_hdr.msg_iov = &iov[nr];
+		mmsg[nr].msg_hdr.msg_iovlen = 1;
+		mmsg[nr].msg_hdr.msg_name = &saddr[nr];
+		mmsg[nr].msg_hdr.msg_namelen = sizeof(saddr[nr]);
+		mmsg[nr].msg_hdr.msg_control = control[nr];
+		mmsg[nr].msg_hdr.msg_controllen = sizeof(control[nr]);
+	}
+
+	if (nr == 0)
+		return -ENOMEM;
+
+	rc = recvmmsg(bfd->fd, mmsg, nr, MSG_DONTWAIT, NULL);
+	if (rc < 0) {
+		if (nsip_would_block(errno))
+			return 0;
 		LOGP(DNS, LOGL_ERROR, "recv error %s during NSIP recv\n",
 			strerror(errno));
-		msgb_free(msg);
-		*error = ret;
-		return NULL;
-	} else if (ret == 0) {
-		msgb_free(msg);
-		*error = ret;
-		return NULL;
+		return rc;
 	}
 
-	msg->l2h = msg->data;
-	msgb_put(msg, ret);
+	for (i = 0; i < rc; ++i) {
+		struct msgb *msg = msgs[i];
 
-	return msg;
+		if (mmsg[i].msg_len == 0)
+			continue;
+
+		msgs[i] = NULL;
+		msg->l2h = msg->data;
+		msgb_put(msg, mmsg[i].msg_len);
+		nsip_rx_overflow(nsi, &mmsg[i].msg_hdr);
+
+		gprs_ns_rcvmsg(nsi, msg, &saddr[i], GPRS_NS_LL_UDP);
+	}
+
+	/* move the unused buffers to the front */
+	for (i = 0, j = 0; i < NSIP_RX_BATCH; ++i) {
+		if (!msgs[i])
+			continue;
+		if (i != j) {
+			msgs[j] = msgs[i];
+			msgs[i] = NULL;
+		}
+		j += 1;
+	}
+
+	return 0;
 }
 
-static int handle_nsip_read(struct bsc_fd *bfd)
+static void nsip_dequeue(struct gprs_nsvc *nsvc)
 {
-	int error;
-	struct sockaddr_in saddr;
-	struct gprs_ns_inst *nsi = bfd->data;
-	struct msgb *msg = read_nsip_msg(bfd, &error, &saddr);
+	struct msgb *msg = msgb_dequeue(&nsvc->tx_queue);
 
-	if (!msg)
-		return error;
+	msgb_free(msg);
+	nsvc->tx_queue_len -= 1;
+	if (nsvc->tx_queue_len == 0)
+		llist_del_init(&nsvc->tx_pending);
+}
 
-	error = gprs_ns_rcvmsg(nsi, msg, &saddr, GPRS_NS_LL_UDP);
+static void nsip_flush_queue(struct gprs_nsvc *nsvc)
+{
+	while (nsvc->tx_queue_len > 0)
+		nsip_dequeue(nsvc);
+}
 
-	msgb_free(msg);
+/*
+ * Fill the batch one message per NS-VC and round, a long queue does not
+ * hold back the others. The messages of one NS-VC stay in order and the
+ * NS-VCs that were served move to the end of the list.
+ */
+static int nsip_fill_batch(struct gprs_ns_inst *nsi, struct mmsghdr *mmsg,
+			   struct iovec *iov, struct gprs_nsvc **owner)
+{
+	struct gprs_nsvc *vcs[NSIP_TX_BATCH];
+	struct msgb *next[NSIP_TX_BATCH];
+	struct gprs_nsvc *nsvc;
+	int i, nr = 0, nr_vcs = 0, added;
+
+	llist_for_each_entry(nsvc, &nsi->nsip.tx_pending, tx_pending) {
+		if (nr_vcs == NSIP_TX_BATCH)
+			break;
+		vcs[nr_vcs] = nsvc;
+		next[nr_vcs++] = llist_entry(nsvc->tx_queue.next, struct msgb, list);
+	}
 
-	return error;
+	memset(mmsg, 0, NSIP_TX_BATCH * sizeof(*mmsg));
+	do {
+		added = 0;
+		for (i = 0; i < nr_vcs && nr < NSIP_TX_BATCH; ++i) {
+			struct msgb *msg = next[i];
+
+			nsvc = vcs[i];
+			if (!msg)
+				continue;
+
+			iov[nr].iov_base = msg->data;
+			iov[nr].iov_len = msg->len;
+			mmsg[nr].msg_hdr.msg_iov = &iov[nr];
+			mmsg[nr].msg_hdr.msg_iovlen = 1;
+			mmsg[nr].msg_hdr.msg_name = &nsvc->ip.bts_addr;
+			mmsg[nr].msg_hdr.msg_namelen = sizeof(nsvc->ip.bts_addr);
+			owner[nr++] = nsvc;
+			added += 1;
+
+			if (msg->list.next == &nsvc->tx_queue)
+				next[i] = NULL;
+			else
+				next[i] = llist_entry(msg->list.next, struct msgb, list);
+		}
+	} while (added > 0 && nr < NSIP_TX_BATCH);
+
+	for (i = 0; i < nr_vcs; ++i)
+		llist_move_tail(&vcs[i]->tx_pending, &nsi->nsip.tx_pending);
+
+	return nr;
 }
 
 static int handle_nsip_write(struct bsc_fd *bfd)
 {
-	/* FIXME: actually send the data here instead of nsip_sendmsg() */
-	return -EIO;
+	struct gprs_ns_inst *nsi = bfd->data;
+	struct mmsghdr mmsg[NSIP_TX_BATCH];
+	struct iovec iov[NSIP_TX_BATCH];
+	struct gprs_nsvc *owner[NSIP_TX_BATCH];
+	int i, nr, rc;
+
+	while (!llist_empty(&nsi->nsip.tx_pending)) {
+		nr = nsip_fill_batch(nsi, mmsg, iov, owner);
+
+		rc = sendmmsg(bfd->fd, mmsg, nr, MSG_DONTWAIT);
+		if (rc < 0) {
+			if (nsip_would_block(errno))
+				return 0;
+
+			/* the first message can not be sent, do not retry it */
+			LOGP(DNS, LOGL_ERROR, "NSEI=%u error %s during NSIP send\n",
+			     owner[0]->nsei, strerror(errno));
+			rate_ctr_inc(&owner[0]->ctrg->ctr[NS_CTR_DROP_OUT]);
+			nsip_dequeue(owner[0]);
+			continue;
+		}
+
+		/* a sent prefix of the batch is the head of every owner's queue */
+		for (i = 0; i < rc; ++i)
+			nsip_dequeue(owner[i]);
+
+		/* the socket is full again */
+		if (rc < nr)
+			return 0;
+	}
+
+	bfd->when &= ~BSC_FD_WRITE;
+	return 0;
+}
+
+static int nsip_enqueue(struct gprs_nsvc *nsvc, struct msgb *msg)
+{
+	struct gprs_ns_inst *nsi = nsvc->nsi;
+
+	/* the unknown NS-VC changes its address for every message */
+	if (nsvc == nsi->unknown_nsvc ||
+	    nsvc->tx_queue_len >= nsi->nsip.tx_queue_max) {
+		rate_ctr_inc(&nsvc->ctrg->ctr[NS_CTR_DROP_OUT]);
+		msgb_free(msg);
+		return -ENOBUFS;
+	}
+
+	msgb_enqueue(&nsvc->tx_queue, msg);
+	nsvc->tx_queue_len += 1;
+	if (llist_empty(&nsvc->tx_pending))
+		llist_add_tail(&nsvc->tx_pending, &nsi->nsip.tx_pending);
+	nsi->nsip.fd.when |= BSC_FD_WRITE;
+	return 0;
 }
 
 static int nsip_sendmsg(struct gprs_nsvc *nsvc, struct msgb *msg)
@@ -920,10 +1206,16 @@ static int nsip_sendmsg(struct gprs_nsvc *nsvc, struct msgb *msg)
 	struct gprs_ns_inst *nsi = nsvc->nsi;
 	struct sockaddr_in *daddr = &nsvc->ip.bts_addr;
 
-	rc = sendto(nsi->nsip.fd.fd, msg->data, msg->len, 0,
+	/* stay behind the messages that wait for the socket */
+	if (nsvc->tx_queue_len > 0)
+		return nsip_enqueue(nsvc, msg);
+
+	rc = sendto(nsi->nsip.fd.fd, msg->data, msg->len, MSG_DONTWAIT,
 		  (struct sockaddr *)daddr, sizeof(*daddr));
+	if (rc < 0 && nsip_would_block(errno))
+		return nsip_enqueue(nsvc, msg);
 
-	talloc_free(msg);
+	msgb_free(msg);
 
 	return rc;
 }
@@ -941,19 +1233,98 @@ static int nsip_fd_cb(struct bsc_fd *bfd, unsigned int what)
 	return rc;
 }
 
+/* a socket bound to the NS/UDP port, it joins the SO_REUSEPORT group */
+static int nsip_bind(struct gprs_ns_inst *nsi, uint16_t port)
+{
+	struct sockaddr_in addr;
+	int fd, rc, on = 1;
+
+	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0) {
+		LOGP(DNS, LOGL_ERROR, "could not create the NS/UDP socket.\n");
+		return -EIO;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (nsi->nsip.reuse_port) {
+#ifdef SO_REUSEPORT
+		rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#else
+		rc = -1;
+		errno = ENOPROTOOPT;
+#endif
+		if (rc != 0) {
+			rc = -errno;
+			LOGP(DNS, LOGL_ERROR, "could not share the NS/UDP port: %s\n",
+			     strerror(errno));
+			close(fd);
+			return rc;
+		}
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (nsi->nsip.local_ip)
+		addr.sin_addr.s_addr = htonl(nsi->nsip.local_ip);
+	else
+		addr.sin_addr.s_addr = INADDR_ANY;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		LOGP(DNS, LOGL_ERROR, "could not bind the NS/UDP socket: %s\n",
+		     strerror(errno));
+		close(fd);
+		return -EIO;
+	}
+
+	return fd;
+}
+
 /* Listen for incoming GPRS packets */
 int gprs_ns_nsip_listen(struct gprs_ns_inst *nsi)
 {
-	int ret;
+	int ret, on = 1;
 
-	ret = make_sock(&nsi->nsip.fd, IPPROTO_UDP, nsi->nsip.local_ip,
-			nsi->nsip.local_port, nsip_fd_cb);
+	ret = nsip_bind(nsi, nsi->nsip.local_port);
 	if (ret < 0)
 		return ret;
 
+	nsi->nsip.fd.fd = ret;
+	nsi->nsip.fd.cb = nsip_fd_cb;
+	nsi->nsip.fd.when = BSC_FD_READ;
 	nsi->nsip.fd.data = nsi;
 
-	return ret;
+#ifdef SO_RXQ_OVFL
+	/* report the datagrams dropped by the kernel */
+	setsockopt(nsi->nsip.fd.fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#endif
+
+	ret = bsc_register_fd(&nsi->nsip.fd);
+	if (ret < 0) {
+		close(nsi->nsip.fd.fd);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * One more socket on the port of gprs_ns_nsip_listen(), reuse_port
+ * must have been set before. The kernel keeps the datagrams of one
+ * remote address on one socket of the group.
+ */
+int gprs_ns_nsip_socket(struct gprs_ns_inst *nsi)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	if (!nsi->nsip.reuse_port)
+		return -EINVAL;
+
+	if (getsockname(nsi->nsip.fd.fd, (struct sockaddr *) &addr, &len) != 0)
+		return -errno;
+
+	return nsip_bind(nsi, ntohs(addr.sin_port));
 }
 
 /* Initiate a RESET procedure */
@@ -963,7 +1334,7 @@ void gprs_nsvc_reset(struct gprs_nsvc *nsvc, uint8_t cause)
 		nsvc->nsei);
 
 	/* Mark NS-VC locally as blocked and dead */
-	nsvc->state = NSE_S_BLOCKED;
+	nsvc_set_state(nsvc, NSE_S_BLOCKED);
 	/* Send NS-RESET PDU */
 	if (gprs_ns_tx_reset(nsvc, cause) < 0) {
 		LOGP(DNS, LOGL_ERROR, "NSEI=%u, error resetting NS-VC\n",
@@ -983,9 +1354,9 @@ struct gprs_nsvc *nsip_connect(struct gprs_ns_inst *nsi,
 	nsvc = nsvc_by_rem_addr(nsi, dest);
 	if (!nsvc)
 		nsvc = nsvc_create(nsi, nsvci);
-	nsvc->ip.bts_addr = *dest;
-	nsvc->nsei = nsei;
-	nsvc->nsvci = nsvci;
+	nsvc_set_addr(nsvc, dest);
+	nsvc_set_nsei(nsvc, nsei);
+	nsvc_set_nsvci(nsvc, nsvci);
 	nsvc->remote_end_is_sgsn = 1;
 
 	gprs_nsvc_reset(nsvc, NS_CAUSE_OM_INTERVENTION);
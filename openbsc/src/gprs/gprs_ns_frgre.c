@@ -201,9 +201,6 @@ out_err:
 	return NULL;
 }
 
-int gprs_ns_rcvmsg(struct gprs_ns_inst *nsi, struct msgb *msg,
-		   struct sockaddr_in *saddr, enum gprs_ns_ll ll);
-
 static int handle_nsfrgre_read(struct bsc_fd *bfd)
 {
 	int rc;
@@ -220,15 +217,11 @@ static int handle_nsfrgre_read(struct bsc_fd *bfd)
 	if (dlci == 0 || dlci == 1023) {
 		LOGP(DNS, LOGL_INFO, "Received FR on LMI DLCI %u - ignoring\n",
 			dlci);
-		rc = 0;
-		goto out;
+		msgb_free(msg);
+		return 0;
 	}
 
-	rc = gprs_ns_rcvmsg(nsi, msg, &saddr, GPRS_NS_LL_FR_GRE);
-out:
-	msgb_free(msg);
-
-	return rc;
+	return gprs_ns_rcvmsg(nsi, msg, &saddr, GPRS_NS_LL_FR_GRE);
 }
 
 static int handle_nsfrgre_write(struct bsc_fd *bfd)
@@ -121,6 +121,8 @@ static int config_write_ns(struct vty *vty)
 	if (vty_nsi->nsip.local_port)
 		vty_out(vty, " encapsulation udp local-port %u%s",
 			vty_nsi->nsip.local_port, VTY_NEWLINE);
+	vty_out(vty, " encapsulation udp tx-queue %u%s",
+		vty_nsi->nsip.tx_queue_max, VTY_NEWLINE);
 
 	vty_out(vty, " encapsulation framerelay-gre enabled %u%s",
 		vty_nsi->frgre.enabled ? 1 : 0, VTY_NEWLINE);
@@ -154,8 +156,12 @@ static void dump_nse(struct vty *vty, struct gprs_nsvc *nsvc, int stats)
 			inet_ntoa(nsvc->ip.bts_addr.sin_addr),
 			ntohs(nsvc->ip.bts_addr.sin_port));
 	vty_out(vty, "%s", VTY_NEWLINE);
-	if (stats)
+	if (stats) {
 		vty_out_rate_ctr_group(vty, " ", nsvc->ctrg);
+		if (nsvc->ll == GPRS_NS_LL_UDP)
+			vty_out(vty, " Tx queue: %u%s", nsvc->tx_queue_len,
+				VTY_NEWLINE);
+	}
 }
 
 static void dump_ns(struct vty *vty, struct gprs_ns_inst *nsi, int stats)
@@ -166,6 +172,10 @@ static void dump_ns(struct vty *vty, struct gprs_ns_inst *nsi, int stats)
 	ia.s_addr = htonl(vty_nsi->nsip.local_ip);
 	vty_out(vty, "Encapsulation NS-UDP-IP     Local IP: %s, UDP Port: %u%s",
 		inet_ntoa(ia), vty_nsi->nsip.local_port, VTY_NEWLINE);
+	if (stats)
+		vty_out(vty, "  Tx queue limit: %u, Rx dropped by the socket: %u%s",
+			vty_nsi->nsip.tx_queue_max, vty_nsi->nsip.rx_overflow,
+			VTY_NEWLINE);
 
 	ia.s_addr = htonl(vty_nsi->frgre.local_ip);
 	vty_out(vty, "Encapsulation NS-FR-GRE-IP  Local IP: %s%s",
@@ -241,9 +251,9 @@ DEFUN(cfg_nse_nsvc, cfg_nse_nsvci_cmd,
 	nsvc = nsvc_by_nsei(vty_nsi, nsei);
 	if (!nsvc) {
 		nsvc = nsvc_create(vty_nsi, nsvci);
-		nsvc->nsei = nsei;
+		nsvc_set_nsei(nsvc, nsei);
 	}
-	nsvc->nsvci = nsvci;
+	nsvc_set_nsvci(nsvc, nsvci);
 	/* All NSVCs that are explicitly configured by VTY are
 	 * marked as persistent so we can write them to the config
 	 * file at some later point */
@@ -260,13 +270,16 @@ DEFUN(cfg_nse_remoteip, cfg_nse_remoteip_cmd,
 {
 	uint16_t nsei = atoi(argv[0]);
 	struct gprs_nsvc *nsvc;
+	struct sockaddr_in addr;
 
 	nsvc = nsvc_by_nsei(vty_nsi, nsei);
 	if (!nsvc) {
 		vty_out(vty, "No such NSE (%u)%s", nsei, VTY_NEWLINE);
 		return CMD_WARNING;
 	}
-	inet_aton(argv[1], &nsvc->ip.bts_addr.sin_addr);
+	addr = nsvc->ip.bts_addr;
+	inet_aton(argv[1], &addr.sin_addr);
+	nsvc_set_addr(nsvc, &addr);
 
 	return CMD_SUCCESS;
 
@@ -281,6 +294,7 @@ DEFUN(cfg_nse_remoteport, cfg_nse_remoteport_cmd,
 	uint16_t nsei = atoi(argv[0]);
 	uint16_t port = atoi(argv[1]);
 	struct gprs_nsvc *nsvc;
+	struct sockaddr_in addr;
 
 	nsvc = nsvc_by_nsei(vty_nsi, nsei);
 	if (!nsvc) {
@@ -294,7 +308,9 @@ DEFUN(cfg_nse_remoteport, cfg_nse_remoteport_cmd,
 		return CMD_WARNING;
 	}
 
-	nsvc->ip.bts_addr.sin_port = htons(port);
+	addr = nsvc->ip.bts_addr;
+	addr.sin_port = htons(port);
+	nsvc_set_addr(nsvc, &addr);
 
 	return CMD_SUCCESS;
 }
@@ -308,6 +324,7 @@ DEFUN(cfg_nse_fr_dlci, cfg_nse_fr_dlci_cmd,
 	uint16_t nsei = atoi(argv[0]);
 	uint16_t dlci = atoi(argv[1]);
 	struct gprs_nsvc *nsvc;
+	struct sockaddr_in addr;
 
 	nsvc = nsvc_by_nsei(vty_nsi, nsei);
 	if (!nsvc) {
@@ -321,7 +338,9 @@ DEFUN(cfg_nse_fr_dlci, cfg_nse_fr_dlci_cmd,
 		return CMD_WARNING;
 	}
 
-	nsvc->frgre.bts_addr.sin_port = htons(dlci);
+	addr = nsvc->frgre.bts_addr;
+	addr.sin_port = htons(dlci);
+	nsvc_set_addr(nsvc, &addr);
 
 	return CMD_SUCCESS;
 }
@@ -444,6 +463,17 @@ DEFUN(cfg_nsip_local_port, cfg_nsip_local_port_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_nsip_tx_queue, cfg_nsip_tx_queue_cmd,
+      "encapsulation udp tx-queue <1-65535>",
+	ENCAPS_STR "NS over UDP Encapsulation\n"
+	"Set the number of messages queued per NS-VC when the socket is full\n"
+	"Number of messages\n")
+{
+	vty_nsi->nsip.tx_queue_max = atoi(argv[0]);
+
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_frgre_local_ip, cfg_frgre_local_ip_cmd,
       "encapsulation framerelay-gre local-ip A.B.C.D",
 	ENCAPS_STR "NS over Frame Relay over GRE Encapsulation\n"
@@ -562,6 +592,7 @@ int gprs_ns_vty_init(struct gprs_ns_inst *nsi)
 	install_element(NS_NODE, &cfg_ns_timer_cmd);
 	install_element(NS_NODE, &cfg_nsip_local_ip_cmd);
 	install_element(NS_NODE, &cfg_nsip_local_port_cmd);
+	install_element(NS_NODE, &cfg_nsip_tx_queue_cmd);
 	install_element(NS_NODE, &cfg_frgre_enable_cmd);
 	install_element(NS_NODE, &cfg_frgre_local_ip_cmd);
 
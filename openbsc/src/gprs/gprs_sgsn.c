@@ -21,6 +21,7 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 
 #include <osmocore/linuxlist.h>
 #include <osmocore/talloc.h>
@@ -40,6 +41,12 @@ LLIST_HEAD(sgsn_ggsn_ctxts);
 LLIST_HEAD(sgsn_apn_ctxts);
 LLIST_HEAD(sgsn_pdp_ctxts);
 
+/* MM contexts by TLLI, by P-TMSI, old P-TMSI and IMSI */
+static struct hash_index mmctx_by_tlli;
+static struct hash_index mmctx_by_ptmsi;
+static struct hash_index mmctx_by_ptmsi_old;
+static struct hash_index mmctx_by_imsi;
+
 static const struct rate_ctr_desc mmctx_ctr_description[] = {
 	{ "sign.packets.in",	"Signalling Messages ( In)" },
 	{ "sign.packets.out",	"Signalling Messages (Out)" },
@@ -66,6 +73,7 @@ static const struct rate_ctr_desc pdpctx_ctr_description[] = {
 	{ "udata.packets.out",	"User Data  Messages (Out)" },
 	{ "udata.bytes.in",	"User Data  Bytes    ( In)" },
 	{ "udata.bytes.out",	"User Data  Bytes    (Out)" },
+	{ "udata.packets.drop",	"User Data  Messages dropped" },
 };
 
 static const struct rate_ctr_group_desc pdpctx_ctrg_desc = {
@@ -82,40 +90,58 @@ static int ra_id_equals(const struct gprs_ra_id *id1,
 		id1->lac == id2->lac && id1->rac == id2->rac);
 }
 
+/* a P-TMSI and its local TLLI end up in the same bucket */
+static uint32_t ptmsi_hash(uint32_t p_tmsi)
+{
+	return hash_index_u32(p_tmsi | 0xC0000000);
+}
+
+static uint32_t imsi_hash(const char *imsi)
+{
+	return hash_index_bytes(imsi, strlen(imsi));
+}
+
 /* look-up a SGSN MM context based on TLLI + RAI */
 struct sgsn_mm_ctx *sgsn_mm_ctx_by_tlli(uint32_t tlli,
 					const struct gprs_ra_id *raid)
 {
 	struct sgsn_mm_ctx *ctx;
-	int tlli_type;
 
-	llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
+	hash_index_for_each(ctx, &mmctx_by_tlli, hash_index_u32(tlli), tlli_entry) {
 		if (tlli == ctx->tlli &&
 		    ra_id_equals(raid, &ctx->ra))
 			return ctx;
 	}
 
-	tlli_type = gprs_tlli_type(tlli);
-	if (tlli_type == TLLI_LOCAL) {
-		llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
-			if ((ctx->p_tmsi | 0xC0000000) == tlli ||
-			     (ctx->p_tmsi_old && (ctx->p_tmsi_old | 0xC0000000) == tlli)) {
-				ctx->tlli = tlli;
-				return ctx;
-			}
-		}
-	}
+	if (gprs_tlli_type(tlli) != TLLI_LOCAL)
+		return NULL;
 
+	/* a local TLLI derived from the current or the old P-TMSI */
+	hash_index_for_each(ctx, &mmctx_by_ptmsi, ptmsi_hash(tlli), ptmsi_entry) {
+		if ((ctx->p_tmsi | 0xC0000000) == tlli)
+			goto found;
+	}
+	hash_index_for_each(ctx, &mmctx_by_ptmsi_old, ptmsi_hash(tlli), ptmsi_old_entry) {
+		if ((ctx->p_tmsi_old | 0xC0000000) == tlli)
+			goto found;
+	}
 	return NULL;
+
+found:
+	sgsn_mm_ctx_set_tlli(ctx, tlli);
+	return ctx;
 }
 
 struct sgsn_mm_ctx *sgsn_mm_ctx_by_ptmsi(uint32_t p_tmsi)
 {
 	struct sgsn_mm_ctx *ctx;
 
-	llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
-		if (p_tmsi == ctx->p_tmsi ||
-		    (ctx->p_tmsi_old && ctx->p_tmsi_old == p_tmsi))
+	hash_index_for_each(ctx, &mmctx_by_ptmsi, ptmsi_hash(p_tmsi), ptmsi_entry) {
+		if (p_tmsi == ctx->p_tmsi)
+			return ctx;
+	}
+	hash_index_for_each(ctx, &mmctx_by_ptmsi_old, ptmsi_hash(p_tmsi), ptmsi_old_entry) {
+		if (p_tmsi == ctx->p_tmsi_old)
 			return ctx;
 	}
 	return NULL;
@@ -125,7 +151,7 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_by_imsi(const char *imsi)
 {
 	struct sgsn_mm_ctx *ctx;
 
-	llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
+	hash_index_for_each(ctx, &mmctx_by_imsi, imsi_hash(imsi), imsi_entry) {
 		if (!strcmp(imsi, ctx->imsi))
 			return ctx;
 	}
@@ -133,6 +159,40 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_by_imsi(const char *imsi)
 
 }
 
+void sgsn_mm_ctx_set_tlli(struct sgsn_mm_ctx *ctx, uint32_t tlli)
+{
+	ctx->tlli = tlli;
+	hash_index_rehash(tall_bsc_ctx, &mmctx_by_tlli, &ctx->tlli_entry,
+			  hash_index_u32(tlli));
+}
+
+/* a P-TMSI of 0 is not assigned and not indexed */
+void sgsn_mm_ctx_set_ptmsi(struct sgsn_mm_ctx *ctx, uint32_t p_tmsi,
+			   uint32_t p_tmsi_old)
+{
+	hash_index_del(&mmctx_by_ptmsi, &ctx->ptmsi_entry);
+	hash_index_del(&mmctx_by_ptmsi_old, &ctx->ptmsi_old_entry);
+
+	ctx->p_tmsi = p_tmsi;
+	ctx->p_tmsi_old = p_tmsi_old;
+	if (p_tmsi)
+		hash_index_add(tall_bsc_ctx, &mmctx_by_ptmsi, &ctx->ptmsi_entry,
+			       ptmsi_hash(p_tmsi));
+	if (p_tmsi_old)
+		hash_index_add(tall_bsc_ctx, &mmctx_by_ptmsi_old,
+			       &ctx->ptmsi_old_entry, ptmsi_hash(p_tmsi_old));
+}
+
+void sgsn_mm_ctx_set_imsi(struct sgsn_mm_ctx *ctx, const char *imsi)
+{
+	hash_index_del(&mmctx_by_imsi, &ctx->imsi_entry);
+
+	strncpy(ctx->imsi, imsi, sizeof(ctx->imsi) - 1);
+	if (strlen(ctx->imsi))
+		hash_index_add(tall_bsc_ctx, &mmctx_by_imsi, &ctx->imsi_entry,
+			       imsi_hash(ctx->imsi));
+}
+
 /* Allocate a new SGSN MM context */
 struct sgsn_mm_ctx *sgsn_mm_ctx_alloc(uint32_t tlli,
 					const struct gprs_ra_id *raid)
@@ -143,6 +203,12 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_alloc(uint32_t tlli,
 	if (!ctx)
 		return NULL;
 
+	if (hash_index_add(tall_bsc_ctx, &mmctx_by_tlli, &ctx->tlli_entry,
+			   hash_index_u32(tlli)) != 0) {
+		talloc_free(ctx);
+		return NULL;
+	}
+
 	memcpy(&ctx->ra, raid, sizeof(ctx->ra));
 	ctx->tlli = tlli;
 	ctx->mm_state = GMM_DEREGISTERED;
@@ -291,15 +357,11 @@ struct apn_ctx *apn_ctx_find_alloc(const char *name)
 
 uint32_t sgsn_alloc_ptmsi(void)
 {
-	struct sgsn_mm_ctx *mm;
 	uint32_t ptmsi;
 
-restart:
-	ptmsi = rand();
-	llist_for_each_entry(mm, &sgsn_mm_ctxts, list) {
-		if (mm->p_tmsi == ptmsi)
-			goto restart;
-	}
+	do {
+		ptmsi = rand();
+	} while (!ptmsi || sgsn_mm_ctx_by_ptmsi(ptmsi));
 
 	return ptmsi;
 }
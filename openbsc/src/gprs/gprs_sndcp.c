@@ -23,17 +23,20 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <osmocore/msgb.h>
 #include <osmocore/linuxlist.h>
 #include <osmocore/timer.h>
 #include <osmocore/talloc.h>
+#include <osmocore/rate_ctr.h>
 
 #include <openbsc/gsm_data.h>
 #include <openbsc/debug.h>
 #include <openbsc/gprs_bssgp.h>
 #include <openbsc/gprs_llc.h>
 #include <openbsc/sgsn.h>
+#include <openbsc/slhc.h>
 
 #include "gprs_sndcp.h"
 
@@ -63,125 +66,301 @@ struct sndcp_udata_hdr {
 } __attribute__((packed));
 
 
+/* Section 6.8: SNDCP XID parameter types */
+enum sndcp_xid_type {
+	SNDCP_XID_VERSION	= 0,
+	SNDCP_XID_DCOMP		= 1,
+	SNDCP_XID_PCOMP		= 2,
+};
+
+/* Section 6.8.1: the entity is proposed, with algorithm and values */
+#define SNDCP_XID_P		0x80
+#define SNDCP_PCOMP_RFC1144	0
+
 static void *tall_sndcp_ctx;
 
-/* A fragment queue entry, containing one framgent of a N-PDU */
-struct defrag_queue_entry {
-	struct llist_head list;
-	/* segment number of this fragment */
-	uint32_t seg_nr;
-	/* length of the data area of this fragment */
-	uint32_t data_len;
-	/* pointer to the data of this fragment */
-	uint8_t *data;
+LLIST_HEAD(gprs_sndcp_entities);
+LLIST_HEAD(gprs_sndcp_comp_entities);
+
+static const struct rate_ctr_desc comp_ctr_description[] = {
+	{ "dl.octets.in",	"Downlink octets before compression" },
+	{ "dl.octets.out",	"Downlink octets after compression" },
+	{ "dl.packets.comp",	"Downlink packets with compressed header" },
+	{ "ul.octets.in",	"Uplink octets before decompression" },
+	{ "ul.octets.out",	"Uplink octets after decompression" },
+	{ "ul.packets.discard",	"Uplink packets discarded by decompression" },
 };
 
-LLIST_HEAD(gprs_sndcp_entities);
+static const struct rate_ctr_group_desc comp_ctrg_desc = {
+	.group_name_prefix = "sndcp.pcomp",
+	.group_description = "SNDCP RFC 1144 Compression Entity Statistics",
+	.num_ctr = ARRAY_SIZE(comp_ctr_description),
+	.ctr_desc = comp_ctr_description,
+};
 
-/* Enqueue a fragment into the defragment queue */
-static int defrag_enqueue(struct gprs_sndcp_entity *sne, uint8_t seg_nr,
-			  uint8_t *data, uint32_t data_len)
+static struct sndcp_comp_entity *comp_entity_by_lle(const struct gprs_llc_lle *lle,
+						    uint8_t entity)
 {
-	struct defrag_queue_entry *dqe;
+	struct sndcp_comp_entity *ce;
 
-	dqe = talloc_zero(tall_sndcp_ctx, struct defrag_queue_entry);
-	if (!dqe)
-		return -ENOMEM;
-	dqe->data = talloc_zero_size(dqe, data_len);
-	if (!dqe->data) {
-		talloc_free(dqe);
-		return -ENOMEM;
+	llist_for_each_entry(ce, &gprs_sndcp_comp_entities, list) {
+		if (ce->lle == lle && ce->entity == entity)
+			return ce;
 	}
-	dqe->seg_nr = seg_nr;
-	dqe->data_len = data_len;
+	return NULL;
+}
 
-	llist_add(&dqe->list, &sne->defrag.frag_list);
+static struct sndcp_comp_entity *comp_entity_alloc(struct gprs_llc_lle *lle,
+						   uint8_t entity, uint8_t pcomp1,
+						   uint8_t pcomp2, uint16_t nsapis,
+						   uint8_t s01)
+{
+	static unsigned int ctrg_idx;
+	struct sndcp_comp_entity *ce;
 
-	if (seg_nr > sne->defrag.highest_seg)
-		sne->defrag.highest_seg = seg_nr;
+	ce = talloc_zero(tall_sndcp_ctx, struct sndcp_comp_entity);
+	if (!ce)
+		return NULL;
 
-	sne->defrag.seg_have |= (1 << seg_nr);
-	sne->defrag.tot_len += data_len;
+	ce->ctrg = rate_ctr_group_alloc(ce, &comp_ctrg_desc, ctrg_idx++);
+	if (!ce->ctrg) {
+		talloc_free(ce);
+		return NULL;
+	}
+	ce->lle = lle;
+	ce->entity = entity;
+	ce->pcomp[0] = pcomp1;
+	ce->pcomp[1] = pcomp2;
+	ce->nsapis = nsapis;
+	ce->s01 = s01;
 
-	memcpy(dqe->data, data, data_len);
+	llist_add(&ce->list, &gprs_sndcp_comp_entities);
 
-	return 0;
+	return ce;
 }
 
-/* return if we have all segments of this N-PDU */
-static int defrag_have_all_segments(struct gprs_sndcp_entity *sne)
+static void comp_entity_free(struct sndcp_comp_entity *ce)
 {
-	uint32_t seg_needed = 0;
-	unsigned int i;
+	struct gprs_sndcp_entity *sne;
+
+	llist_for_each_entry(sne, &gprs_sndcp_entities, list) {
+		if (sne->pcomp == ce)
+			sne->pcomp = NULL;
+	}
 
-	/* create a bitmask of needed segments */
-	for (i = 0; i <= sne->defrag.highest_seg; i++)
-		seg_needed |= (1 << i);
+	llist_del(&ce->list);
+	rate_ctr_group_free(ce->ctrg);
+	talloc_free(ce);
+}
 
-	if (seg_needed == sne->defrag.seg_have)
-		return 1;
+static void comp_entities_free(const struct gprs_llc_lle *lle)
+{
+	struct sndcp_comp_entity *ce, *tmp;
 
+	llist_for_each_entry_safe(ce, tmp, &gprs_sndcp_comp_entities, list) {
+		if (ce->lle == lle)
+			comp_entity_free(ce);
+	}
+}
+
+/* the NSAPIs of the LLE the entity applies to start to use it */
+static int comp_entity_activate(struct sndcp_comp_entity *ce)
+{
+	struct gprs_sndcp_entity *sne;
+
+	ce->slhc = slhc_alloc(ce, ce->s01 + 1, ce->s01 + 1);
+	if (!ce->slhc)
+		return -ENOMEM;
+	ce->proposed = 0;
+
+	llist_for_each_entry(sne, &gprs_sndcp_entities, list) {
+		if (sne->lle == ce->lle && (ce->nsapis & (1 << sne->nsapi)))
+			sne->pcomp = ce;
+	}
+
+	LOGP(DSNDCP, LOGL_INFO, "TLLI=0x%08x SAPI=%u: RFC 1144 entity %u "
+		"PCOMP=%u/%u S0-1=%u for NSAPIs 0x%04x\n", ce->lle->llme->tlli,
+		ce->lle->sapi, ce->entity, ce->pcomp[0], ce->pcomp[1], ce->s01,
+		ce->nsapis);
 	return 0;
 }
 
-static struct defrag_queue_entry *defrag_get_seg(struct gprs_sndcp_entity *sne,
-						 uint32_t seg_nr)
+/* Compress the TCP/IP header of the N-PDU, returns the PCOMP value. The
+ * connection number is always sent as UI frames get lost without SNDCP
+ * noticing it. */
+static uint8_t sndcp_compress(struct gprs_sndcp_entity *sne, struct msgb *msg)
+{
+	struct sndcp_comp_entity *ce = sne->pcomp;
+	uint8_t *pkt = msg->data;
+	unsigned int len = msg->len;
+	enum slhc_type type;
+
+	rate_ctr_add(&ce->ctrg->ctr[SNDCP_COMP_CTR_DL_OCTETS_IN], len);
+	type = slhc_compress(ce->slhc, &pkt, &len, 0);
+	msgb_pull(msg, pkt - msg->data);
+	rate_ctr_add(&ce->ctrg->ctr[SNDCP_COMP_CTR_DL_OCTETS_OUT], msg->len);
+
+	switch (type) {
+	case SLHC_TYPE_UNCOMPRESSED_TCP:
+		return ce->pcomp[0];
+	case SLHC_TYPE_COMPRESSED_TCP:
+		rate_ctr_inc(&ce->ctrg->ctr[SNDCP_COMP_CTR_DL_PKTS_COMPRESSED]);
+		return ce->pcomp[1];
+	default:
+		return 0;
+	}
+}
+
+/* Restore the N-PDU at *npdu which needs SLHC_MAX_HDR octets of room in
+ * front of it, returns its length or <= 0 if it is to be discarded */
+static int sndcp_decompress(struct gprs_sndcp_entity *sne, uint8_t pcomp,
+			    uint8_t **npdu, unsigned int len)
 {
-	struct defrag_queue_entry *dqe;
+	struct sndcp_comp_entity *ce = sne->pcomp;
+	enum slhc_type type;
+	int rc;
 
-	llist_for_each_entry(dqe, &sne->defrag.frag_list, list) {
-		if (dqe->seg_nr == seg_nr) {
-			llist_del(&dqe->list);
-			return dqe;
-		}
+	if (ce && pcomp == ce->pcomp[0])
+		type = SLHC_TYPE_UNCOMPRESSED_TCP;
+	else if (ce && pcomp == ce->pcomp[1])
+		type = SLHC_TYPE_COMPRESSED_TCP;
+	else {
+		LOGP(DSNDCP, LOGL_ERROR, "TLLI=0x%08x NSAPI=%u: Unknown "
+			"PCOMP %u\n", sne->lle->llme->tlli, sne->nsapi, pcomp);
+		return -EIO;
 	}
-	return NULL;
+
+	rate_ctr_add(&ce->ctrg->ctr[SNDCP_COMP_CTR_UL_OCTETS_IN], len);
+	rc = slhc_uncompress(ce->slhc, type, npdu, len);
+	if (rc <= 0) {
+		LOGP(DSNDCP, LOGL_INFO, "TLLI=0x%08x NSAPI=%u: Discarding "
+			"N-PDU with PCOMP %u (%d)\n", sne->lle->llme->tlli,
+			sne->nsapi, pcomp, rc);
+		rate_ctr_inc(&ce->ctrg->ctr[SNDCP_COMP_CTR_UL_PKTS_DISCARDED]);
+		return rc;
+	}
+	rate_ctr_add(&ce->ctrg->ctr[SNDCP_COMP_CTR_UL_OCTETS_OUT], rc);
+
+	return rc;
+}
+
+/* Forget the segments received so far, the buffer is kept */
+static void defrag_reset(struct gprs_sndcp_entity *sne)
+{
+	sne->defrag.no_more = sne->defrag.highest_seg = sne->defrag.seg_have = 0;
+	sne->defrag.tot_len = 0;
+	if (sne->defrag.msg) {
+		msgb_reset(sne->defrag.msg);
+		msgb_reserve(sne->defrag.msg, SNDCP_DEFRAG_HEADROOM);
+	}
+}
+
+/* Append a segment to the defragmentation buffer, they are put into
+ * order by defrag_segments() */
+static int defrag_enqueue(struct gprs_sndcp_entity *sne, uint8_t seg_nr,
+			  uint8_t *data, uint32_t data_len)
+{
+	struct msgb *msg = sne->defrag.msg;
+
+	if (!msg) {
+		msg = msgb_alloc_headroom(SNDCP_DEFRAG_HEADROOM + SNDCP_MAX_NPDU_LEN,
+					  SNDCP_DEFRAG_HEADROOM, "SNDCP Defrag");
+		if (!msg)
+			return -ENOMEM;
+		sne->defrag.msg = msg;
+	}
+
+	if (sne->defrag.seg_have & (1 << seg_nr)) {
+		LOGP(DSNDCP, LOGL_INFO, "TLLI=0x%08x NSAPI=%u: Dropping duplicate "
+			"segment %u of SN-PDU %u\n", sne->lle->llme->tlli,
+			sne->nsapi, seg_nr, sne->defrag.npdu);
+		return -EEXIST;
+	}
+
+	if (data_len > msgb_tailroom(msg)) {
+		LOGP(DSNDCP, LOGL_ERROR, "TLLI=0x%08x NSAPI=%u: Dropping SN-PDU "
+			"%u longer than %u octets\n", sne->lle->llme->tlli,
+			sne->nsapi, sne->defrag.npdu, SNDCP_MAX_NPDU_LEN);
+		defrag_reset(sne);
+		return -EMSGSIZE;
+	}
+
+	sne->defrag.seg[seg_nr].offset = msg->len;
+	sne->defrag.seg[seg_nr].len = data_len;
+	memcpy(msgb_put(msg, data_len), data, data_len);
+
+	if (seg_nr > sne->defrag.highest_seg)
+		sne->defrag.highest_seg = seg_nr;
+
+	sne->defrag.seg_have |= (1 << seg_nr);
+	sne->defrag.tot_len += data_len;
+
+	return 0;
+}
+
+/* return if we have all segments of this N-PDU */
+static int defrag_have_all_segments(struct gprs_sndcp_entity *sne)
+{
+	uint32_t seg_needed = (1 << (sne->defrag.highest_seg + 1)) - 1;
+
+	return seg_needed == sne->defrag.seg_have;
 }
 
 /* Perform actual defragmentation and create an output packet */
 static int defrag_segments(struct gprs_sndcp_entity *sne)
 {
-	struct msgb *msg;
-	unsigned int seg_nr;
-	uint8_t *npdu;
+	struct msgb *msg = sne->defrag.msg;
+	unsigned int seg_nr, offset = 0;
+	uint8_t *npdu = msg->data;
+	int rc, npdu_len = sne->defrag.tot_len;
 
 	LOGP(DSNDCP, LOGL_DEBUG, "TLLI=0x%08x NSAPI=%u: Defragment output PDU %u "
 		"num_seg=%u tot_len=%u\n", sne->lle->llme->tlli, sne->nsapi,
 		sne->defrag.npdu, sne->defrag.highest_seg, sne->defrag.tot_len);
-	msg = msgb_alloc_headroom(sne->defrag.tot_len+256, 128, "SNDCP Defrag");
-	if (!msg)
-		return -ENOMEM;
-
-	/* FIXME: message headers + identifiers */
-
-	npdu = msg->data;
 
+	/* the segments are usually received in order and already are the
+	 * N-PDU, otherwise sort them through a copy */
 	for (seg_nr = 0; seg_nr <= sne->defrag.highest_seg; seg_nr++) {
-		struct defrag_queue_entry *dqe;
-		uint8_t *data;
+		if (sne->defrag.seg[seg_nr].offset != offset)
+			break;
+		offset += sne->defrag.seg[seg_nr].len;
+	}
+	if (seg_nr <= sne->defrag.highest_seg) {
+		uint8_t npdu[SNDCP_MAX_NPDU_LEN];
 
-		dqe = defrag_get_seg(sne, seg_nr);
-		if (!dqe) {
-			LOGP(DSNDCP, LOGL_ERROR, "Segment %u missing\n", seg_nr);
-			talloc_free(msg);
-			return -EIO;
-		}
-		/* actually append the segment to the N-PDU */
-		data = msgb_put(msg, dqe->data_len);
-		memcpy(data, dqe->data, dqe->data_len);
+		offset = 0;
+		for (seg_nr = 0; seg_nr <= sne->defrag.highest_seg; seg_nr++) {
+			struct defrag_seg *seg = &sne->defrag.seg[seg_nr];
 
-		/* release memory for the fragment queue entry */
-		talloc_free(dqe);
+			memcpy(npdu + offset, msg->data + seg->offset, seg->len);
+			offset += seg->len;
+		}
+		memcpy(msg->data, npdu, offset);
 	}
 
+	/* FIXME: message headers + identifiers */
+
 	/* FIXME: cancel timer */
 
+	/* the buffer has room for the header in front of the N-PDU */
+	if (sne->defrag.pcomp) {
+		npdu_len = sndcp_decompress(sne, sne->defrag.pcomp, &npdu,
+					    npdu_len);
+		if (npdu_len <= 0) {
+			defrag_reset(sne);
+			return npdu_len;
+		}
+	}
+
 	/* actually send the N-PDU to the SGSN core code, which then
 	 * hands it off to the correct GTP tunnel + GGSN via gtp_data_req() */
-	return sgsn_rx_sndcp_ud_ind(&sne->ra_id, sne->lle->llme->tlli,
-				    sne->nsapi, msg, sne->defrag.tot_len, npdu);
+	rc = sgsn_rx_sndcp_ud_ind(&sne->ra_id, sne->lle->llme->tlli,
+				  sne->nsapi, msg, npdu_len, npdu);
+	defrag_reset(sne);
+	return rc;
 }
 
+
 static int defrag_input(struct gprs_sndcp_entity *sne, struct msgb *msg, uint8_t *hdr,
 			unsigned int len)
 {
@@ -210,23 +389,25 @@ static int defrag_input(struct gprs_sndcp_entity *sne, struct msgb *msg, uint8_t
 	if (sch->first) {
 		/* first segment of a new packet.  Discard all leftover fragments of
 		 * previous packet */
-		if (!llist_empty(&sne->defrag.frag_list)) {
-			struct defrag_queue_entry *dqe, *dqe2;
+		if (sne->defrag.seg_have) {
 			LOGP(DSNDCP, LOGL_INFO, "TLLI=0x%08x NSAPI=%u: Dropping "
 			     "SN-PDU %u due to insufficient segments (%04x)\n",
 			     sne->lle->llme->tlli, sne->nsapi, sne->defrag.npdu,
 			     sne->defrag.seg_have);
-			llist_for_each_entry_safe(dqe, dqe2, &sne->defrag.frag_list, list) {
-				llist_del(&dqe->list);
-				talloc_free(dqe);
-			}
+			if (sne->pcomp)
+				slhc_toss(sne->pcomp->slhc);
 		}
 		/* store the currently de-fragmented PDU number */
 		sne->defrag.npdu = npdu_num;
 
 		/* Re-set fragmentation state */
-		sne->defrag.no_more = sne->defrag.highest_seg = sne->defrag.seg_have = 0;
-		sne->defrag.tot_len = 0;
+		defrag_reset(sne);
+		sne->defrag.pcomp = scomph->pcomp;
+		if (scomph->dcomp) {
+			LOGP(DSNDCP, LOGL_ERROR, "We don't support data "
+				"compression\n");
+			return -EIO;
+		}
 		/* FIXME: (re)start timer */
 	}
 
@@ -236,7 +417,6 @@ static int defrag_input(struct gprs_sndcp_entity *sne, struct msgb *msg, uint8_t
 		/* FIXME */
 	}
 
-	/* FIXME: check if seg_nr already exists */
 	/* make sure to subtract length of SNDCP header from 'len' */
 	rc = defrag_enqueue(sne, suh->seg_nr, data, len - (data - hdr));
 	if (rc < 0)
@@ -258,8 +438,8 @@ static int defrag_input(struct gprs_sndcp_entity *sne, struct msgb *msg, uint8_t
 	return 0;
 }
 
-static struct gprs_sndcp_entity *gprs_sndcp_entity_by_lle(const struct gprs_llc_lle *lle,
-						uint8_t nsapi)
+struct gprs_sndcp_entity *gprs_sndcp_entity_by_lle(const struct gprs_llc_lle *lle,
+						   uint8_t nsapi)
 {
 	struct gprs_sndcp_entity *sne;
 
@@ -274,6 +454,7 @@ static struct gprs_sndcp_entity *gprs_sndcp_entity_alloc(struct gprs_llc_lle *ll
 						uint8_t nsapi)
 {
 	struct gprs_sndcp_entity *sne;
+	struct sndcp_comp_entity *ce;
 
 	sne = talloc_zero(tall_sndcp_ctx, struct gprs_sndcp_entity);
 	if (!sne)
@@ -284,16 +465,322 @@ static struct gprs_sndcp_entity *gprs_sndcp_entity_alloc(struct gprs_llc_lle *ll
 	sne->defrag.timer.data = sne;
 	//sne->fqueue.timer.cb = FIXME;
 	sne->rx_state = SNDCP_RX_S_FIRST;
-	INIT_LLIST_HEAD(&sne->defrag.frag_list);
+
+	/* the compression might have been negotiated before */
+	llist_for_each_entry(ce, &gprs_sndcp_comp_entities, list) {
+		if (ce->lle == lle && !ce->proposed &&
+		    (ce->nsapis & (1 << nsapi)))
+			sne->pcomp = ce;
+	}
 
 	llist_add(&sne->list, &gprs_sndcp_entities);
 
 	return sne;
 }
 
+/* Section 6.8.1: a DCOMP or PCOMP entity of a XID parameter */
+struct xid_entity {
+	int proposed;
+	uint8_t entity;
+	uint8_t algo;
+	/* the values and parameters of the algorithm */
+	const uint8_t *par;
+	unsigned int len;
+};
+
+/* returns the length of the entity */
+static int xid_parse_entity(const uint8_t *cur, const uint8_t *end,
+			    struct xid_entity *ent)
+{
+	unsigned int hlen;
+
+	ent->proposed = cur[0] & SNDCP_XID_P;
+	ent->entity = cur[0] & 0x1f;
+	hlen = ent->proposed ? 3 : 2;
+	if (end - cur < hlen)
+		return -EINVAL;
+	ent->algo = ent->proposed ? cur[1] & 0x1f : 0;
+	ent->len = cur[hlen - 1];
+	if (ent->len > end - cur - hlen)
+		return -EINVAL;
+	ent->par = cur + hlen;
+
+	return hlen + ent->len;
+}
+
+/* Tables 5 and 7: the number of PCOMP or DCOMP values of an algorithm */
+static unsigned int xid_num_comp(uint8_t type, uint8_t algo)
+{
+	/* RFC 1144, RFC 2507, RFC 3095 */
+	static const uint8_t num_pcomp[] = { 2, 5, 2 };
+	/* V.42bis, V.44 */
+	static const uint8_t num_dcomp[] = { 1, 2 };
+
+	if (type == SNDCP_XID_PCOMP && algo < ARRAY_SIZE(num_pcomp))
+		return num_pcomp[algo];
+	if (type == SNDCP_XID_DCOMP && algo < ARRAY_SIZE(num_dcomp))
+		return num_dcomp[algo];
+	return 0;
+}
+
+/* Accept a RFC 1144 entity proposed by the MS: the PCOMP values, the
+ * applicable NSAPIs and S0-1 */
+static struct sndcp_comp_entity *xid_accept_rfc1144(struct gprs_llc_lle *lle,
+						    const struct xid_entity *ent)
+{
+	struct sndcp_comp_entity *ce;
+	uint8_t pcomp1, pcomp2;
+	uint16_t nsapis;
+
+	if (sgsn->cfg.pcomp_rfc1144 == SGSN_PCOMP_OFF || ent->len != 4)
+		return NULL;
+
+	pcomp1 = ent->par[0] >> 4;
+	pcomp2 = ent->par[0] & 0xf;
+	/* NSAPIs 0 to 4 are reserved */
+	nsapis = ((ent->par[1] << 8) | ent->par[2]) & 0xffe0;
+	if (!pcomp1 || !pcomp2 || pcomp1 == pcomp2 || !nsapis)
+		return NULL;
+
+	/* a new proposal replaces the entity */
+	ce = comp_entity_by_lle(lle, ent->entity);
+	if (ce)
+		comp_entity_free(ce);
+
+	ce = comp_entity_alloc(lle, ent->entity, pcomp1, pcomp2, nsapis,
+			       ent->par[3]);
+	if (!ce)
+		return NULL;
+	if (comp_entity_activate(ce) < 0) {
+		comp_entity_free(ce);
+		return NULL;
+	}
+	return ce;
+}
+
+/* Answer the entities of a DCOMP or PCOMP parameter. The ones we don't
+ * accept are answered with the parameters as proposed and no applicable
+ * NSAPIs, which rejects them. */
+static int xid_answer_entities(struct gprs_llc_lle *lle, uint8_t type,
+			       const uint8_t *cur, unsigned int len,
+			       uint8_t *out, unsigned int out_max)
+{
+	const uint8_t *end = cur + len;
+	uint8_t *o = out;
+
+	while (cur < end) {
+		struct sndcp_comp_entity *ce = NULL;
+		struct xid_entity ent;
+		unsigned int ncomp;
+		int rc;
+
+		rc = xid_parse_entity(cur, end, &ent);
+		if (rc < 0)
+			return rc;
+		cur += rc;
+
+		if (out + out_max - o < 4 + ent.len)
+			return -ENOSPC;
+
+		if (type == SNDCP_XID_PCOMP && ent.proposed &&
+		    ent.algo == SNDCP_PCOMP_RFC1144)
+			ce = xid_accept_rfc1144(lle, &ent);
+		else if (type == SNDCP_XID_PCOMP && !ent.proposed)
+			ce = comp_entity_by_lle(lle, ent.entity);
+
+		/* the response never proposes, P is not set */
+		o[0] = ent.entity;
+		if (ce && !ce->proposed) {
+			o[1] = 3;
+			o[2] = ce->nsapis >> 8;
+			o[3] = ce->nsapis;
+			o[4] = ce->s01;
+			o += 5;
+			continue;
+		}
+
+		ncomp = ent.proposed ? (xid_num_comp(type, ent.algo) + 1) / 2 : 0;
+		if (ent.proposed && ncomp && ent.len >= ncomp + 2) {
+			o[1] = ent.len - ncomp;
+			memcpy(o + 2, ent.par + ncomp, ent.len - ncomp);
+		} else
+			o[1] = 2;
+		o[2] = o[3] = 0;
+		o += 2 + o[1];
+
+		LOGP(DSNDCP, LOGL_INFO, "TLLI=0x%08x SAPI=%u: Rejecting %s "
+			"entity %u algorithm %u\n", lle->llme->tlli, lle->sapi,
+			type == SNDCP_XID_PCOMP ? "PCOMP" : "DCOMP", ent.entity,
+			ent.algo);
+	}
+
+	return o - out;
+}
+
+int sndcp_ll_xid_ind(struct gprs_llc_lle *lle, const uint8_t *xid,
+		     unsigned int len, uint8_t *resp, unsigned int resp_max)
+{
+	const uint8_t *cur = xid, *end = xid + len;
+	uint8_t *out = resp;
+	int rc;
+
+	while (cur < end) {
+		if (end - cur < 2 || cur[1] > end - cur - 2)
+			goto malformed;
+
+		switch (cur[0]) {
+		case SNDCP_XID_VERSION:
+			/* there is only version 0 */
+			if (resp + resp_max - out < 3)
+				return -ENOSPC;
+			out[0] = SNDCP_XID_VERSION;
+			out[1] = 1;
+			out[2] = 0;
+			out += 3;
+			break;
+		case SNDCP_XID_DCOMP:
+		case SNDCP_XID_PCOMP:
+			if (resp + resp_max - out < 2)
+				return -ENOSPC;
+			rc = xid_answer_entities(lle, cur[0], cur + 2, cur[1],
+						 out + 2, resp + resp_max - out - 2);
+			if (rc == -EINVAL)
+				goto malformed;
+			if (rc < 0 || rc > 255)
+				return -ENOSPC;
+			out[0] = cur[0];
+			out[1] = rc;
+			out += 2 + rc;
+			break;
+		default:
+			/* not known, not answered */
+			break;
+		}
+		cur += 2 + cur[1];
+	}
+
+	return out - resp;
+
+malformed:
+	LOGP(DSNDCP, LOGL_NOTICE, "TLLI=0x%08x SAPI=%u: Malformed SNDCP XID "
+		"parameters\n", lle->llme->tlli, lle->sapi);
+	return -EINVAL;
+}
+
+int sndcp_ll_xid_conf(struct gprs_llc_lle *lle, const uint8_t *xid,
+		      unsigned int len)
+{
+	const uint8_t *cur = xid, *end = xid + len;
+	struct sndcp_comp_entity *ce, *tmp;
+	int rc = 0;
+
+	while (cur < end) {
+		const uint8_t *ent_cur, *ent_end;
+
+		if (end - cur < 2 || cur[1] > end - cur - 2) {
+			rc = -EINVAL;
+			break;
+		}
+
+		ent_cur = cur + 2;
+		ent_end = ent_cur + cur[1];
+		while (cur[0] == SNDCP_XID_PCOMP && ent_cur < ent_end) {
+			struct xid_entity ent;
+			uint16_t nsapis;
+
+			rc = xid_parse_entity(ent_cur, ent_end, &ent);
+			if (rc < 0)
+				break;
+			ent_cur += rc;
+			rc = 0;
+
+			ce = comp_entity_by_lle(lle, ent.entity);
+			if (!ce || !ce->proposed || ent.proposed || ent.len < 3)
+				continue;
+
+			/* the MS may restrict the NSAPIs and the slots */
+			nsapis = ((ent.par[0] << 8) | ent.par[1]) & ce->nsapis;
+			if (!nsapis) {
+				LOGP(DSNDCP, LOGL_INFO, "TLLI=0x%08x SAPI=%u: "
+					"MS rejected RFC 1144 entity %u\n",
+					lle->llme->tlli, lle->sapi, ce->entity);
+				comp_entity_free(ce);
+				continue;
+			}
+			ce->nsapis = nsapis;
+			if (ent.par[2] < ce->s01)
+				ce->s01 = ent.par[2];
+			if (comp_entity_activate(ce) < 0)
+				comp_entity_free(ce);
+		}
+		if (rc < 0)
+			break;
+		cur = ent_end;
+	}
+
+	/* proposals the MS did not answer are not used */
+	llist_for_each_entry_safe(ce, tmp, &gprs_sndcp_comp_entities, list) {
+		if (ce->lle == lle && ce->proposed)
+			comp_entity_free(ce);
+	}
+
+	return rc;
+}
+
+/* Propose RFC 1144 for the NSAPI in an entity of its own with the lowest
+ * free entity number and PCOMP values of the LLE */
+static int sndcp_propose_pcomp(struct gprs_sndcp_entity *sne)
+{
+	struct sndcp_comp_entity *ce;
+	uint32_t used_entities = 0;
+	uint16_t used_pcomp = 1;
+	uint8_t entity, pcomp[2], xid[9];
+	unsigned int i, n = 0;
+	int rc;
+
+	llist_for_each_entry(ce, &gprs_sndcp_comp_entities, list) {
+		if (ce->lle != sne->lle)
+			continue;
+		used_entities |= 1 << ce->entity;
+		used_pcomp |= (1 << ce->pcomp[0]) | (1 << ce->pcomp[1]);
+	}
+
+	for (entity = 0; entity < 32; ++entity)
+		if (!(used_entities & (1 << entity)))
+			break;
+	for (i = 1; i < 16 && n < 2; ++i)
+		if (!(used_pcomp & (1 << i)))
+			pcomp[n++] = i;
+	if (entity == 32 || n < 2)
+		return -ENOSPC;
+
+	ce = comp_entity_alloc(sne->lle, entity, pcomp[0], pcomp[1],
+			       1 << sne->nsapi, 15);
+	if (!ce)
+		return -ENOMEM;
+	ce->proposed = 1;
+
+	xid[0] = SNDCP_XID_PCOMP;
+	xid[1] = 7;
+	xid[2] = SNDCP_XID_P | entity;
+	xid[3] = SNDCP_PCOMP_RFC1144;
+	xid[4] = 4;
+	xid[5] = (pcomp[0] << 4) | pcomp[1];
+	xid[6] = ce->nsapis >> 8;
+	xid[7] = ce->nsapis;
+	xid[8] = ce->s01;
+
+	rc = gprs_ll_xid_req(sne->lle, xid, sizeof(xid));
+	if (rc < 0)
+		comp_entity_free(ce);
+	return rc;
+}
+
 /* Entry point for the SNSM-ACTIVATE.indication */
 int sndcp_sm_activate_ind(struct gprs_llc_lle *lle, uint8_t nsapi)
 {
+	struct gprs_sndcp_entity *sne;
+
 	LOGP(DSNDCP, LOGL_INFO, "SNSM-ACTIVATE.ind (lle=%p TLLI=%08x, "
 	     "SAPI=%u, NSAPI=%u)\n", lle, lle->llme->tlli, lle->sapi, nsapi);
 
@@ -304,11 +791,15 @@ int sndcp_sm_activate_ind(struct gprs_llc_lle *lle, uint8_t nsapi)
 		return -EEXIST;
 	}
 
-	if (!gprs_sndcp_entity_alloc(lle, nsapi)) {
+	sne = gprs_sndcp_entity_alloc(lle, nsapi);
+	if (!sne) {
 		LOGP(DSNDCP, LOGL_ERROR, "Out of memory during ACTIVATE\n");
 		return -ENOMEM;
 	}
 
+	if (sgsn->cfg.pcomp_rfc1144 == SGSN_PCOMP_ACTIVE && !sne->pcomp)
+		sndcp_propose_pcomp(sne);
+
 	return 0;
 }
 
@@ -328,114 +819,122 @@ int sndcp_sm_deactivate_ind(struct gprs_llc_lle *lle, uint8_t nsapi)
 		return -ENOENT;
 	}
 	llist_del(&sne->list);
-	/* frag queue entries are hierarchically allocated, so no need to
-	 * free them explicitly here */
+	if (sne->defrag.msg)
+		msgb_free(sne->defrag.msg);
 	talloc_free(sne);
 
+	/* the compression entities go with the last NSAPI of the LLE */
+	llist_for_each_entry(sne, &gprs_sndcp_entities, list) {
+		if (sne->lle == lle)
+			return 0;
+	}
+	comp_entities_free(lle);
+
 	return 0;
 }
 
-/* Fragmenter state */
-struct sndcp_frag_state {
-	uint8_t frag_nr;
-	struct msgb *msg;	/* original message */
-	uint8_t *next_byte;	/* first byte of next fragment */
-
-	struct gprs_sndcp_entity *sne;
-	void *mmcontext;
-};
-
-/* returns '1' if there are more fragments to send, '0' if none */
-static int sndcp_send_ud_frag(struct sndcp_frag_state *fs)
+/* prepend the SN-UNITDATA header, the compression header is only part of
+ * the first segment */
+static void sndcp_push_ud_hdr(struct msgb *msg, struct gprs_sndcp_entity *sne,
+			      uint8_t seg_nr, int more, uint8_t pcomp)
 {
-	struct gprs_sndcp_entity *sne = fs->sne;
-	struct gprs_llc_lle *lle = sne->lle;
 	struct sndcp_common_hdr *sch;
 	struct sndcp_comp_hdr *scomph;
 	struct sndcp_udata_hdr *suh;
-	struct msgb *fmsg;
-	unsigned int max_payload_len;
-	unsigned int len;
-	uint8_t *data;
-	int rc, more;
 
-	fmsg = msgb_alloc_headroom(fs->sne->lle->params.n201_u+256, 128,
-				   "SNDCP Frag");
-	if (!fmsg)
-		return -ENOMEM;
-
-	/* make sure lower layers route the fragment like the original */
-	msgb_tlli(fmsg) = msgb_tlli(fs->msg);
-	msgb_bvci(fmsg) = msgb_bvci(fs->msg);
-	msgb_nsei(fmsg) = msgb_nsei(fs->msg);
-
-	/* prepend common SNDCP header */
-	sch = (struct sndcp_common_hdr *) msgb_put(fmsg, sizeof(*sch));
-	sch->nsapi = sne->nsapi;
-	/* Set FIRST bit if we are the first fragment in a series */
-	if (fs->frag_nr == 0)
-		sch->first = 1;
-	sch->type = 1;
+	suh = (struct sndcp_udata_hdr *) msgb_push(msg, sizeof(*suh));
+	suh->npdu_low = sne->tx_npdu_nr & 0xff;
+	suh->npdu_high = (sne->tx_npdu_nr >> 8) & 0xf;
+	suh->seg_nr = seg_nr & 0xf;
 
-	/* append the compression header for first fragment */
-	if (sch->first) {
-		scomph = (struct sndcp_comp_hdr *)
-				msgb_put(fmsg, sizeof(*scomph));
-		scomph->pcomp = 0;
+	if (seg_nr == 0) {
+		scomph = (struct sndcp_comp_hdr *) msgb_push(msg, sizeof(*scomph));
+		scomph->pcomp = pcomp;
 		scomph->dcomp = 0;
 	}
 
-	/* append the user-data header */
-	suh = (struct sndcp_udata_hdr *) msgb_put(fmsg, sizeof(*suh));
-	suh->npdu_low = sne->tx_npdu_nr & 0xff;
-	suh->npdu_high = (sne->tx_npdu_nr >> 8) & 0xf;
-	suh->seg_nr = fs->frag_nr % 0xf;
-
-	/* calculate remaining length to be sent */
-	len = (fs->msg->data + fs->msg->len) - fs->next_byte;
-	/* how much payload can we actually send via LLC? */
-	max_payload_len = lle->params.n201_u - (sizeof(*sch) + sizeof(*suh));
-	if (sch->first)
-		max_payload_len -= sizeof(*scomph);
-	/* check if we're exceeding the max */
-	if (len > max_payload_len)
-		len = max_payload_len;
-
-	/* copy the actual fragment data into our fmsg */
-	data = msgb_put(fmsg, len);
-	memcpy(data, fs->next_byte, len);
-
-	/* Increment fragment number and data pointer to next fragment */
-	fs->frag_nr++;
-	fs->next_byte += len;
-
-	/* determine if we have more fragemnts to send */
-	if ((fs->msg->data + fs->msg->len) <= fs->next_byte)
-		more = 0;
-	else
-		more = 1;
-
-	/* set the MORE bit of the SNDCP header accordingly */
+	sch = (struct sndcp_common_hdr *) msgb_push(msg, sizeof(*sch));
+	sch->spare = 0;
+	sch->first = seg_nr == 0;
+	sch->type = 1;
 	sch->more = more;
+	sch->nsapi = sne->nsapi;
+}
 
-	rc = gprs_llc_tx_ui(fmsg, lle->sapi, 0, fs->mmcontext);
-	if (rc < 0) {
-		/* abort in case of error, do not advance frag_nr / next_byte */
-		msgb_free(fmsg);
-		return rc;
+/* Send the N-PDU in segments of N201-U octets. Each segment but the last
+ * is copied into a msgb of its own as the layers below prepend their
+ * headers, the last segment is sent in the msgb of the N-PDU. */
+static int sndcp_send_ud_frag(struct gprs_sndcp_entity *sne, struct msgb *msg,
+			      uint8_t pcomp, void *mmcontext)
+{
+	struct gprs_llc_lle *lle = sne->lle;
+	unsigned int max_payload_len;
+	uint8_t *next_byte = msg->data;
+	uint8_t *end = msg->data + msg->len;
+	uint8_t frag_nr;
+	int rc;
+
+	max_payload_len = lle->params.n201_u - (sizeof(struct sndcp_common_hdr) +
+						sizeof(struct sndcp_udata_hdr));
+	if (msg->len + sizeof(struct sndcp_comp_hdr) >
+				SNDCP_MAX_SEG * max_payload_len) {
+		LOGP(DSNDCP, LOGL_ERROR, "N-PDU of %u octets needs more than "
+			"%u segments (N201-U=%u)\n", msg->len, SNDCP_MAX_SEG,
+			lle->params.n201_u);
+		msgb_free(msg);
+		return -EMSGSIZE;
 	}
 
-	if (!more) {
-		/* we've sent all fragments */
-		msgb_free(fs->msg);
-		memset(fs, 0, sizeof(*fs));
-		/* increment NPDU number for next frame */
-		sne->tx_npdu_nr = (sne->tx_npdu_nr + 1) % 0xfff;
-		return 0;
+	for (frag_nr = 0; ; frag_nr++) {
+		unsigned int len = end - next_byte;
+		unsigned int max_len = max_payload_len;
+		struct msgb *fmsg;
+		int more = 0;
+
+		if (frag_nr == 0)
+			max_len -= sizeof(struct sndcp_comp_hdr);
+		if (len > max_len) {
+			len = max_len;
+			more = 1;
+		}
+
+		if (more) {
+			fmsg = msgb_alloc_headroom(SGSN_GB_HEADROOM + lle->params.n201_u +
+						   SGSN_GB_TAILROOM, SGSN_GB_HEADROOM,
+						   "SNDCP Frag");
+			if (!fmsg) {
+				msgb_free(msg);
+				return -ENOMEM;
+			}
+			memcpy(msgb_put(fmsg, len), next_byte, len);
+
+			/* make sure lower layers route the fragment like the original */
+			msgb_tlli(fmsg) = msgb_tlli(msg);
+			msgb_bvci(fmsg) = msgb_bvci(msg);
+			msgb_nsei(fmsg) = msgb_nsei(msg);
+		} else {
+			/* the segments before are gone, they are headroom now */
+			msgb_pull(msg, next_byte - msg->data);
+			fmsg = msg;
+		}
+
+		sndcp_push_ud_hdr(fmsg, sne, frag_nr, more, pcomp);
+		rc = gprs_llc_tx_ui(fmsg, lle->sapi, 0, mmcontext);
+		if (rc < 0) {
+			/* abort in case of error, LLC has freed the fragment */
+			if (more)
+				msgb_free(msg);
+			return rc;
+		}
+
+		if (!more)
+			break;
+		next_byte += len;
 	}
 
-	/* default: more fragments to send */
-	return 1;
+	/* increment NPDU number for next frame */
+	sne->tx_npdu_nr = (sne->tx_npdu_nr + 1) % 0xfff;
+	return 0;
 }
 
 /* Request transmission of a SN-PDU over specified LLC Entity + SAPI */
@@ -443,62 +942,64 @@ int sndcp_unitdata_req(struct msgb *msg, struct gprs_llc_lle *lle, uint8_t nsapi
 			void *mmcontext)
 {
 	struct gprs_sndcp_entity *sne;
-	struct sndcp_common_hdr *sch;
-	struct sndcp_comp_hdr *scomph;
-	struct sndcp_udata_hdr *suh;
-	struct sndcp_frag_state fs;
 
 	/* Identifiers from UP: (TLLI, SAPI) + (BVCI, NSEI) */
 
 	sne = gprs_sndcp_entity_by_lle(lle, nsapi);
 	if (!sne) {
 		LOGP(DSNDCP, LOGL_ERROR, "Cannot find SNDCP Entity\n");
+		msgb_free(msg);
 		return -EIO;
 	}
 
+	return sndcp_unitdata_req_sne(msg, sne, mmcontext);
+}
+
+int sndcp_unitdata_req_sne(struct msgb *msg, struct gprs_sndcp_entity *sne,
+			   void *mmcontext)
+{
+	struct gprs_llc_lle *lle = sne->lle;
+	uint8_t pcomp = 0;
+
+	if (sne->pcomp)
+		pcomp = sndcp_compress(sne, msg);
+
 	/* Check if we need to fragment this N-PDU into multiple SN-PDUs */
-	if (msg->len > lle->params.n201_u - 
-			(sizeof(*sch) + sizeof(*suh) + sizeof(*scomph))) {
-		/* initialize the fragmenter state */
-		fs.msg = msg;
-		fs.frag_nr = 0;
-		fs.next_byte = msg->data;
-		fs.sne = sne;
-		fs.mmcontext = mmcontext;
-
-		/* call function to generate and send fragments until all
-		 * of the N-PDU has been sent */
-		while (1) {
-			int rc = sndcp_send_ud_frag(&fs);
-			if (rc == 0)
-				return 0;
-			if (rc < 0)
-				return rc;
-		}
-		/* not reached */
-		return 0;
-	}
+	if (msg->len > lle->params.n201_u - (sizeof(struct sndcp_common_hdr) +
+					     sizeof(struct sndcp_udata_hdr) +
+					     sizeof(struct sndcp_comp_hdr)))
+		return sndcp_send_ud_frag(sne, msg, pcomp, mmcontext);
 
 	/* this is the non-fragmenting case where we only build 1 SN-PDU */
-
-	/* prepend the user-data header */
-	suh = (struct sndcp_udata_hdr *) msgb_push(msg, sizeof(*suh));
-	suh->npdu_low = sne->tx_npdu_nr & 0xff;
-	suh->npdu_high = (sne->tx_npdu_nr >> 8) & 0xf;
-	suh->seg_nr = 0;
+	sndcp_push_ud_hdr(msg, sne, 0, 0, pcomp);
 	sne->tx_npdu_nr = (sne->tx_npdu_nr + 1) % 0xfff;
 
-	scomph = (struct sndcp_comp_hdr *) msgb_push(msg, sizeof(*scomph));
-	scomph->pcomp = 0;
-	scomph->dcomp = 0;
+	return gprs_llc_tx_ui(msg, lle->sapi, 0, mmcontext);
+}
 
-	/* prepend common SNDCP header */
-	sch = (struct sndcp_common_hdr *) msgb_push(msg, sizeof(*sch));
-	sch->first = 1;
-	sch->type = 1;
-	sch->nsapi = nsapi;
 
-	return gprs_llc_tx_ui(msg, lle->sapi, 0, mmcontext);
+/* An unsegmented N-PDU with a PCOMP value, compressed ones are copied as
+ * the header does not fit into the frame in front of it. These are ACKs
+ * and short segments of interactive traffic most of the time. */
+static int sndcp_rx_pcomp(struct gprs_sndcp_entity *sne, struct msgb *msg,
+			  uint8_t pcomp, uint8_t *npdu, unsigned int npdu_len)
+{
+	uint8_t buf[SLHC_MAX_HDR + SNDCP_MAX_NPDU_LEN];
+	int rc;
+
+	if (sne->pcomp && pcomp == sne->pcomp->pcomp[1]) {
+		if (npdu_len > SNDCP_MAX_NPDU_LEN)
+			return -EMSGSIZE;
+		memcpy(buf + SLHC_MAX_HDR, npdu, npdu_len);
+		npdu = buf + SLHC_MAX_HDR;
+	}
+
+	rc = sndcp_decompress(sne, pcomp, &npdu, npdu_len);
+	if (rc <= 0)
+		return rc;
+
+	return sgsn_rx_sndcp_ud_ind(&sne->ra_id, sne->lle->llme->tlli,
+				    sne->nsapi, msg, rc, npdu);
 }
 
 /* Section 5.1.2.17 LL-UNITDATA.ind */
@@ -545,8 +1046,8 @@ int sndcp_llunitdata_ind(struct msgb *msg, struct gprs_llc_lle *lle,
 	if (!sch->first || sch->more)
 		return defrag_input(sne, msg, hdr, len);
 
-	if (scomph && (scomph->pcomp || scomph->dcomp)) {
-		LOGP(DSNDCP, LOGL_ERROR, "We don't support compression yet\n");
+	if (scomph && scomph->dcomp) {
+		LOGP(DSNDCP, LOGL_ERROR, "We don't support data compression\n");
 		return -EIO;
 	}
 
@@ -557,6 +1058,8 @@ int sndcp_llunitdata_ind(struct msgb *msg, struct gprs_llc_lle *lle,
 		LOGP(DSNDCP, LOGL_ERROR, "Short SNDCP N-PDU: %d\n", npdu_len);
 		return -EIO;
 	}
+	if (scomph && scomph->pcomp)
+		return sndcp_rx_pcomp(sne, msg, scomph->pcomp, npdu, npdu_len);
 	/* actually send the N-PDU to the SGSN core code, which then
 	 * hands it off to the correct GTP tunnel + GGSN via gtp_data_req() */
 	return sgsn_rx_sndcp_ud_ind(&sne->ra_id, lle->llme->tlli, sne->nsapi, msg, npdu_len, npdu);
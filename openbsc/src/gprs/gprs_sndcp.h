@@ -3,8 +3,23 @@
 
 #include <stdint.h>
 #include <osmocore/linuxlist.h>
+#include <osmocore/msgb.h>
+#include <osmocore/timer.h>
 
-/* A fragment queue header, maintaining list of fragments for one N-PDU */
+/* segment numbers are four bit */
+#define SNDCP_MAX_SEG		16
+/* the longest N-PDU that is reassembled */
+#define SNDCP_MAX_NPDU_LEN	1503
+/* a decompressed TCP/IP header grows into it, see SLHC_MAX_HDR */
+#define SNDCP_DEFRAG_HEADROOM	128
+
+/* where a segment is in the defragmentation buffer */
+struct defrag_seg {
+	uint16_t offset;
+	uint16_t len;
+};
+
+/* The defragmentation state of one N-PDU */
 struct defrag_state {
 	/* PDU number for which the defragmentation state applies */
 	uint16_t npdu;
@@ -17,8 +32,13 @@ struct defrag_state {
 	/* total length of all segments together */
 	unsigned int tot_len;
 
-	/* linked list of defrag_queue_entry: one for each fragment  */
-	struct llist_head frag_list;
+	/* the segments by segment number */
+	struct defrag_seg seg[SNDCP_MAX_SEG];
+	/* the segments in the order received, allocated with the first one
+	 * and kept for the following N-PDUs */
+	struct msgb *msg;
+	/* PCOMP of the first segment */
+	uint8_t pcomp;
 
 	struct timer_list timer;
 };
@@ -30,6 +50,36 @@ enum sndcp_rx_state {
 	SNDCP_RX_S_DISCARD,
 };
 
+enum sndcp_comp_ctr {
+	SNDCP_COMP_CTR_DL_OCTETS_IN,
+	SNDCP_COMP_CTR_DL_OCTETS_OUT,
+	SNDCP_COMP_CTR_DL_PKTS_COMPRESSED,
+	SNDCP_COMP_CTR_UL_OCTETS_IN,
+	SNDCP_COMP_CTR_UL_OCTETS_OUT,
+	SNDCP_COMP_CTR_UL_PKTS_DISCARDED,
+};
+
+/* Section 6.5: a RFC 1144 PCI compression entity of a LLE, shared by the
+ * NSAPIs it applies to */
+struct sndcp_comp_entity {
+	struct llist_head list;
+
+	struct gprs_llc_lle *lle;
+	/* entity number of the XID negotiation */
+	uint8_t entity;
+	/* bit n is NSAPI n */
+	uint16_t nsapis;
+	/* PCOMP values of uncompressed and of compressed TCP */
+	uint8_t pcomp[2];
+	/* S0-1, the highest slot identifier */
+	uint8_t s01;
+	/* proposed by us, the MS did not respond yet */
+	int proposed;
+
+	struct slhc *slhc;
+	struct rate_ctr_group *ctrg;
+};
+
 struct gprs_sndcp_entity {
 	struct llist_head list;
 
@@ -46,8 +96,11 @@ struct gprs_sndcp_entity {
 	enum sndcp_rx_state rx_state;
 	/* The defragmentation queue */
 	struct defrag_state defrag;
+	/* the negotiated PCI compression or NULL */
+	struct sndcp_comp_entity *pcomp;
 };
 
 extern struct llist_head gprs_sndcp_entities;
+extern struct llist_head gprs_sndcp_comp_entities;
 
 #endif	/* INT_SNDCP_H */
@@ -51,6 +51,44 @@ static void vty_dump_sne(struct vty *vty, struct gprs_sndcp_entity *sne)
 	vty_out(vty, "  Defrag: npdu=%u highest_seg=%u seg_have=0x%08x tot_len=%u%s",
 		sne->defrag.npdu, sne->defrag.highest_seg, sne->defrag.seg_have,
 		sne->defrag.tot_len, VTY_NEWLINE);
+	if (sne->pcomp)
+		vty_out(vty, "  PCOMP entity %u%s", sne->pcomp->entity,
+			VTY_NEWLINE);
+}
+
+/* the octets after compression in percent of the ones before */
+static unsigned int comp_ratio(struct rate_ctr *in, struct rate_ctr *out)
+{
+	if (!in->current)
+		return 100;
+	return out->current * 100 / in->current;
+}
+
+static void vty_dump_comp(struct vty *vty, struct sndcp_comp_entity *ce)
+{
+	struct rate_ctr *ctr = ce->ctrg->ctr;
+
+	vty_out(vty, " TLLI %08x SAPI=%u PCOMP entity %u: RFC 1144%s%s",
+		ce->lle->llme->tlli, ce->lle->sapi, ce->entity,
+		ce->proposed ? " (proposed)" : "", VTY_NEWLINE);
+	vty_out(vty, "  NSAPIs 0x%04x PCOMP=%u/%u S0-1=%u%s", ce->nsapis,
+		ce->pcomp[0], ce->pcomp[1], ce->s01, VTY_NEWLINE);
+	vty_out(vty, "  Downlink: %llu -> %llu octets (%u%%), %llu packets "
+		"compressed%s",
+		(unsigned long long) ctr[SNDCP_COMP_CTR_DL_OCTETS_IN].current,
+		(unsigned long long) ctr[SNDCP_COMP_CTR_DL_OCTETS_OUT].current,
+		comp_ratio(&ctr[SNDCP_COMP_CTR_DL_OCTETS_IN],
+			   &ctr[SNDCP_COMP_CTR_DL_OCTETS_OUT]),
+		(unsigned long long) ctr[SNDCP_COMP_CTR_DL_PKTS_COMPRESSED].current,
+		VTY_NEWLINE);
+	vty_out(vty, "  Uplink: %llu -> %llu octets (%u%%), %llu packets "
+		"discarded%s",
+		(unsigned long long) ctr[SNDCP_COMP_CTR_UL_OCTETS_OUT].current,
+		(unsigned long long) ctr[SNDCP_COMP_CTR_UL_OCTETS_IN].current,
+		comp_ratio(&ctr[SNDCP_COMP_CTR_UL_OCTETS_OUT],
+			   &ctr[SNDCP_COMP_CTR_UL_OCTETS_IN]),
+		(unsigned long long) ctr[SNDCP_COMP_CTR_UL_PKTS_DISCARDED].current,
+		VTY_NEWLINE);
 }
 
 
@@ -59,11 +97,16 @@ DEFUN(show_sndcp, show_sndcp_cmd,
 	SHOW_STR "Display information about the SNDCP protocol")
 {
 	struct gprs_sndcp_entity *sne;
+	struct sndcp_comp_entity *ce;
 
 	vty_out(vty, "State of SNDCP Entities%s", VTY_NEWLINE);
 	llist_for_each_entry(sne, &gprs_sndcp_entities, list)
 		vty_dump_sne(vty, sne);
 
+	vty_out(vty, "State of SNDCP Compression Entities%s", VTY_NEWLINE);
+	llist_for_each_entry(ce, &gprs_sndcp_comp_entities, list)
+		vty_dump_comp(vty, ce);
+
 	return CMD_SUCCESS;
 }
 
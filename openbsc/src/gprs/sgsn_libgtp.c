@@ -32,6 +32,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -90,6 +91,29 @@ const struct value_string gtp_cause_strs[] = {
 	{ 0, NULL }
 };
 
+/* GTP header of a T-PDU, 09.60 Section 6 */
+struct gtp0_tpdu_hdr {
+	uint8_t flags;
+	uint8_t type;
+	uint16_t length;
+	uint16_t seq;
+	uint16_t flow;
+	uint8_t number;
+	uint8_t spare[3];
+	uint64_t tid;
+} __attribute__((packed));
+
+/* GTP-U header of a T-PDU with sequence number, 29.060 Section 6 */
+struct gtp1_tpdu_hdr {
+	uint8_t flags;
+	uint8_t type;
+	uint16_t length;
+	uint32_t teid;
+	uint16_t seq;
+	uint8_t npdu;
+	uint8_t next;
+} __attribute__((packed));
+
 /* Generate the GTP IMSI IE according to 09.60 Section 7.9.2 */
 static uint64_t imsi_str2gtp(char *str)
 {
@@ -255,6 +279,93 @@ static const struct cause_map gtp2sm_cause_map[] = {
 	{ 0, 0 }
 };
 
+/* Cache what the user plane of this PDP needs, the GTP header is the
+ * one gtp_data_req() of libgtp would send */
+static void pdp_fp_setup(struct sgsn_pdp_ctx *pctx)
+{
+	struct pdp_t *pdp = pctx->lib;
+
+	memset(&pctx->fp, 0, sizeof(pctx->fp));
+	pctx->fp.lle = &pctx->mm->llme->lle[pctx->sapi];
+	pctx->fp.sne = gprs_sndcp_entity_by_lle(pctx->fp.lle, pctx->nsapi);
+
+	/* only IPv4 GTP peers, the others go through libgtp */
+	if (pdp->gsnru.l != sizeof(pctx->fp.gtpu_addr.sin_addr))
+		return;
+	pctx->fp.gtpu_addr.sin_family = AF_INET;
+	memcpy(&pctx->fp.gtpu_addr.sin_addr, pdp->gsnru.v, pdp->gsnru.l);
+
+	if (pdp->version == 0) {
+		struct gtp0_tpdu_hdr *h = (struct gtp0_tpdu_hdr *) pctx->fp.gtpu_hdr;
+
+		pctx->fp.gtpu_addr.sin_port = htons(GTP0_PORT);
+		pctx->fp.gtpu_fd = sgsn->gsn->fd0;
+		h->flags = 0x1e;
+		h->type = GTP_GPDU;
+		h->flow = htons(pdp->flru);
+		h->number = 0xff;
+		memset(h->spare, 0xff, sizeof(h->spare));
+		h->tid = (pdp->imsi & 0x0fffffffffffffffULL) +
+			 ((uint64_t) pdp->nsapi << 60);
+		pctx->fp.gtpu_hdr_len = sizeof(*h);
+	} else {
+		struct gtp1_tpdu_hdr *h = (struct gtp1_tpdu_hdr *) pctx->fp.gtpu_hdr;
+
+		pctx->fp.gtpu_addr.sin_port = htons(GTP1U_PORT);
+		pctx->fp.gtpu_fd = sgsn->gsn->fd1u;
+		h->flags = 0x32;
+		h->type = GTP_GPDU;
+		h->teid = htonl(pdp->teid_gn);
+		pctx->fp.gtpu_hdr_len = sizeof(*h);
+	}
+}
+
+/* Send a T-PDU to the GGSN, unlike gtp_data_req() this does not copy
+ * the N-PDU behind the header */
+static int pdp_fp_tx_gtpu(struct sgsn_pdp_ctx *pctx, uint8_t *npdu,
+			  uint32_t npdu_len)
+{
+	struct pdp_t *pdp = pctx->lib;
+	uint8_t hdr[sizeof(pctx->fp.gtpu_hdr)];
+	struct iovec iov[2];
+	struct msghdr mh;
+
+	memcpy(hdr, pctx->fp.gtpu_hdr, pctx->fp.gtpu_hdr_len);
+	if (pdp->version == 0) {
+		struct gtp0_tpdu_hdr *h = (struct gtp0_tpdu_hdr *) hdr;
+
+		h->length = htons(npdu_len);
+		h->seq = htons(pdp->gtpsntx++);
+	} else {
+		struct gtp1_tpdu_hdr *h = (struct gtp1_tpdu_hdr *) hdr;
+
+		/* the length starts behind the TEID */
+		h->length = htons(npdu_len + 4);
+		h->seq = htons(pdp->gtpsntx++);
+	}
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = pctx->fp.gtpu_hdr_len;
+	iov[1].iov_base = npdu;
+	iov[1].iov_len = npdu_len;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &pctx->fp.gtpu_addr;
+	mh.msg_namelen = sizeof(pctx->fp.gtpu_addr);
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+
+	if (sendmsg(pctx->fp.gtpu_fd, &mh, MSG_DONTWAIT) < 0) {
+		int rc = -errno;
+
+		LOGP(DGPRS, LOGL_ERROR, "Failed to send GTP-U to %s: %s\n",
+			inet_ntoa(pctx->fp.gtpu_addr.sin_addr), strerror(-rc));
+		rate_ctr_inc(&pctx->ctrg->ctr[PDP_CTR_PKTS_UDATA_DROP]);
+		return rc;
+	}
+	return 0;
+}
+
 /* The GGSN has confirmed the creation of a PDP Context */
 static int create_pdp_conf(struct pdp_t *pdp, void *cbp, int cause)
 {
@@ -287,6 +398,7 @@ static int create_pdp_conf(struct pdp_t *pdp, void *cbp, int cause)
 
 	/* Activate the SNDCP layer */
 	sndcp_sm_activate_ind(&pctx->mm->llme->lle[pctx->sapi], pctx->nsapi);
+	pdp_fp_setup(pctx);
 
 	/* Send PDP CTX ACT to MS */
 	return gsm48_tx_gsm_act_pdp_acc(pctx);
@@ -313,6 +425,7 @@ static int delete_pdp_conf(struct pdp_t *pdp, void *cbp, int cause)
 		cause, get_value_string(gtp_cause_strs, cause));
 
 	/* Deactivate the SNDCP layer */
+	memset(&pctx->fp, 0, sizeof(pctx->fp));
 	sndcp_sm_deactivate_ind(&pctx->mm->llme->lle[pctx->sapi], pctx->nsapi);
 
 	/* Confirm deactivation of PDP context to MS */
@@ -402,7 +515,13 @@ static int cb_data_ind(struct pdp_t *lib, void *packet, unsigned int len)
 	}
 	mm = pdp->mm;
 
-	msg = msgb_alloc_headroom(len+256, 128, "GTP->SNDCP");
+	/* the Gb headers are prepended in this msgb */
+	msg = msgb_alloc_headroom(SGSN_GB_HEADROOM + len + SGSN_GB_TAILROOM,
+				  SGSN_GB_HEADROOM, "GTP->SNDCP");
+	if (!msg) {
+		rate_ctr_inc(&pdp->ctrg->ctr[PDP_CTR_PKTS_UDATA_DROP]);
+		return -ENOMEM;
+	}
 	ud = msgb_put(msg, len);
 	memcpy(ud, packet, len);
 
@@ -439,6 +558,9 @@ static int cb_data_ind(struct pdp_t *lib, void *packet, unsigned int len)
 	rate_ctr_inc(&mm->ctrg->ctr[GMM_CTR_PKTS_UDATA_OUT]);
 	rate_ctr_add(&mm->ctrg->ctr[GMM_CTR_BYTES_UDATA_OUT], len);
 
+	/* the SNDCP entity is known unless the MS got a new LLME */
+	if (pdp->fp.sne && pdp->fp.lle == &mm->llme->lle[pdp->sapi])
+		return sndcp_unitdata_req_sne(msg, pdp->fp.sne, mm);
 	return sndcp_unitdata_req(msg, &mm->llme->lle[pdp->sapi],
 				  pdp->nsapi, mm);
 }
@@ -474,8 +596,8 @@ int sgsn_rx_sndcp_ud_ind(struct gprs_ra_id *ra_id, int32_t tlli, uint8_t nsapi,
 	rate_ctr_inc(&mmctx->ctrg->ctr[GMM_CTR_PKTS_UDATA_IN]);
 	rate_ctr_add(&mmctx->ctrg->ctr[GMM_CTR_BYTES_UDATA_IN], npdu_len);
 
-	return gtp_data_req(pdp->ggsn->gsn, pdp->lib, npdu, npdu_len);
-
+	if (pdp->fp.gtpu_hdr_len)
+		return pdp_fp_tx_gtpu(pdp, npdu, npdu_len);
 	return gtp_data_req(pdp->ggsn->gsn, pdp->lib, npdu, npdu_len);
 }
 
@@ -75,6 +75,7 @@ static struct sgsn_instance sgsn_inst = {
 	.config_file = "osmo_sgsn.cfg",
 	.cfg = {
 		.gtp_statedir = "./",
+		.pcomp_rfc1144 = SGSN_PCOMP_PASSIVE,
 	},
 };
 struct sgsn_instance *sgsn = &sgsn_inst;
@@ -207,6 +208,7 @@ int main(int argc, char **argv)
 
 	tall_bsc_ctx = talloc_named_const(NULL, 0, "osmo_sgsn");
 	tall_msgb_ctx = talloc_named_const(tall_bsc_ctx, 0, "msgb");
+	bssgp_tall_ctx = talloc_named_const(tall_bsc_ctx, 0, "bssgp");
 
 	signal(SIGINT, &signal_handler);
 	signal(SIGABRT, &signal_handler);
@@ -19,6 +19,7 @@
  *
  */
 
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -34,6 +35,7 @@
 #include <openbsc/gprs_sgsn.h>
 #include <openbsc/vty.h>
 #include <openbsc/gsm_04_08_gprs.h>
+#include <openbsc/timer_wheel.h>
 
 #include <osmocom/vty/command.h>
 #include <osmocom/vty/vty.h>
@@ -105,6 +107,20 @@ static char *gprs_pdpaddr2str(uint8_t *pdpa, uint8_t len)
 	return "invalid";
 }
 
+static const char *pcomp_mode_str(enum sgsn_pcomp_mode mode)
+{
+	switch (mode) {
+	case SGSN_PCOMP_OFF:
+		return "off";
+	case SGSN_PCOMP_PASSIVE:
+		return "passive";
+	case SGSN_PCOMP_ACTIVE:
+		return "active";
+	}
+
+	return "invalid";
+}
+
 static struct cmd_node sgsn_node = {
 	SGSN_NODE,
 	"%s(sgsn)#",
@@ -127,6 +143,9 @@ static int config_write_sgsn(struct vty *vty)
 			gctx->gtp_version, VTY_NEWLINE);
 	}
 
+	vty_out(vty, " compression rfc1144 %s%s",
+		pcomp_mode_str(g_cfg->pcomp_rfc1144), VTY_NEWLINE);
+
 	return CMD_SUCCESS;
 }
 
@@ -189,6 +208,24 @@ DEFUN(cfg_ggsn_gtp_version, cfg_ggsn_gtp_version_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_compression_rfc1144, cfg_compression_rfc1144_cmd,
+	"compression rfc1144 (off|passive|active)",
+	"SNDCP compression\n"
+	"RFC 1144 TCP/IP header compression\n"
+	"Reject it when the MS proposes it\n"
+	"Accept it when the MS proposes it\n"
+	"Also propose it for each activated PDP context\n")
+{
+	if (!strcmp(argv[0], "off"))
+		g_cfg->pcomp_rfc1144 = SGSN_PCOMP_OFF;
+	else if (!strcmp(argv[0], "passive"))
+		g_cfg->pcomp_rfc1144 = SGSN_PCOMP_PASSIVE;
+	else
+		g_cfg->pcomp_rfc1144 = SGSN_PCOMP_ACTIVE;
+
+	return CMD_SUCCESS;
+}
+
 #if 0
 DEFUN(cfg_apn_ggsn, cfg_apn_ggsn_cmd,
 	"apn APNAME ggsn <0-255>",
@@ -210,6 +247,8 @@ const struct value_string gprs_mm_st_strs[] = {
 static void vty_dump_pdp(struct vty *vty, const char *pfx,
 			 struct sgsn_pdp_ctx *pdp)
 {
+	struct rate_ctr *ctr = pdp->ctrg->ctr;
+
 	vty_out(vty, "%sPDP Context IMSI: %s, SAPI: %u, NSAPI: %u%s",
 		pfx, pdp->mm->imsi, pdp->sapi, pdp->nsapi, VTY_NEWLINE);
 	vty_out(vty, "%s  APN: %s%s", pfx,
@@ -218,6 +257,10 @@ static void vty_dump_pdp(struct vty *vty, const char *pfx,
 	vty_out(vty, "%s  PDP Address: %s%s", pfx,
 		gprs_pdpaddr2str(pdp->lib->eua.v, pdp->lib->eua.l),
 		VTY_NEWLINE);
+	vty_out(vty, "%s  Throughput: in %llu bit/s, out %llu bit/s%s", pfx,
+		(unsigned long long) ctr[PDP_CTR_BYTES_UDATA_IN].intv[RATE_CTR_INTV_SEC].rate * 8,
+		(unsigned long long) ctr[PDP_CTR_BYTES_UDATA_OUT].intv[RATE_CTR_INTV_SEC].rate * 8,
+		VTY_NEWLINE);
 	vty_out_rate_ctr_group(vty, " ", pdp->ctrg);
 }
 
@@ -329,6 +372,7 @@ int sgsn_vty_init(void)
 	install_element_ve(&show_mmctx_imsi_cmd);
 	install_element_ve(&show_mmctx_all_cmd);
 	install_element_ve(&show_pdpctx_all_cmd);
+	bsc_timer_wheel_vty_init();
 
 	install_element(CONFIG_NODE, &cfg_sgsn_cmd);
 	install_node(&sgsn_node, config_write_sgsn);
@@ -339,6 +383,7 @@ int sgsn_vty_init(void)
 	install_element(SGSN_NODE, &cfg_ggsn_remote_ip_cmd);
 	//install_element(SGSN_NODE, &cfg_ggsn_remote_port_cmd);
 	install_element(SGSN_NODE, &cfg_ggsn_gtp_version_cmd);
+	install_element(SGSN_NODE, &cfg_compression_rfc1144_cmd);
 
 	return 0;
 }
@@ -0,0 +1,490 @@
+/* TCP/IP header compression as per RFC 1144 */
+
+/* (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * This follows the reference implementation of the RFC (Appendix A) but
+ * works on the octets of the headers instead of struct ip and struct
+ * tcphdr. A compressed packet starts with the change mask, the connection
+ * number if NEW_C is set, the TCP checksum and the changed fields as
+ * differences to the previous header of the connection.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <netinet/in.h>
+
+#include <osmocore/talloc.h>
+
+#include <openbsc/slhc.h>
+
+/* the change mask */
+#define NEW_C		0x40
+#define NEW_I		0x20
+#define TCP_PUSH_BIT	0x10
+#define NEW_S		0x08
+#define NEW_A		0x04
+#define NEW_W		0x02
+#define NEW_U		0x01
+
+/* reserved combinations of the mask for two common cases */
+#define SPECIAL_I	(NEW_S|NEW_W|NEW_U)		/* echoed interactive */
+#define SPECIAL_D	(NEW_S|NEW_A|NEW_W|NEW_U)	/* unidirectional data */
+#define SPECIALS_MASK	(NEW_S|NEW_A|NEW_W|NEW_U)
+
+/* IPv4 header */
+#define IPH_HL(ip)	(((ip)[0] & 0xf) << 2)
+#define IPH_LEN		2
+#define IPH_ID		4
+#define IPH_OFF		6
+#define IPH_TTL		8
+#define IPH_PROTO	9
+#define IPH_SUM		10
+#define IPH_ADDRS	12
+
+/* TCP header */
+#define TH_OFF(th)	(((th)[12] >> 4) << 2)
+#define TH_SEQ		4
+#define TH_ACK		8
+#define TH_FLAGS	13
+#define TH_WIN		14
+#define TH_SUM		16
+#define TH_URP		18
+
+#define TH_FIN		0x01
+#define TH_SYN		0x02
+#define TH_RST		0x04
+#define TH_PUSH		0x08
+#define TH_ACK_BIT	0x10
+#define TH_URG		0x20
+
+static inline uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void put16(uint8_t *p, uint16_t val)
+{
+	p[0] = val >> 8;
+	p[1] = val;
+}
+
+static inline void put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+/* a difference of 1..255 is one octet, otherwise a zero and 16 bit */
+#define ENCODE(n) do {					\
+	if ((uint16_t) (n) >= 256) {			\
+		*cp++ = 0;				\
+		cp[1] = (n);				\
+		cp[0] = (n) >> 8;			\
+		cp += 2;				\
+	} else						\
+		*cp++ = (n);				\
+} while (0)
+
+/* the same for a value that may be zero */
+#define ENCODEZ(n) do {					\
+	if ((uint16_t) (n) >= 256 || (uint16_t) (n) == 0) {	\
+		*cp++ = 0;				\
+		cp[1] = (n);				\
+		cp[0] = (n) >> 8;			\
+		cp += 2;				\
+	} else						\
+		*cp++ = (n);				\
+} while (0)
+
+static int decode(uint8_t **cpp, const uint8_t *end, uint16_t *val)
+{
+	uint8_t *cp = *cpp;
+
+	if (cp >= end)
+		return -EINVAL;
+	if (*cp == 0) {
+		if (end - cp < 3)
+			return -EINVAL;
+		*val = get16(cp + 1);
+		cp += 3;
+	} else
+		*val = *cp++;
+
+	*cpp = cp;
+	return 0;
+}
+
+struct slhc *slhc_alloc(void *ctx, unsigned int tslots, unsigned int rslots)
+{
+	struct slhc *comp;
+	unsigned int i;
+
+	if (tslots < 1 || tslots > SLHC_MAX_STATES ||
+	    rslots < 1 || rslots > SLHC_MAX_STATES)
+		return NULL;
+
+	comp = talloc_zero(ctx, struct slhc);
+	if (!comp)
+		return NULL;
+
+	comp->tstate = talloc_zero_array(comp, struct slhc_cstate, tslots);
+	comp->rstate = talloc_zero_array(comp, struct slhc_cstate, rslots);
+	if (!comp->tstate || !comp->rstate) {
+		talloc_free(comp);
+		return NULL;
+	}
+	comp->tslots = tslots;
+	comp->rslots = rslots;
+
+	/* a circular list, the last state is the least recently used */
+	for (i = 0; i < tslots; ++i) {
+		comp->tstate[i].id = i;
+		comp->tstate[i].next = &comp->tstate[i ? i - 1 : tslots - 1];
+	}
+	comp->last_cs = &comp->tstate[0];
+	for (i = 0; i < rslots; ++i)
+		comp->rstate[i].id = i;
+
+	comp->last_xmit = comp->last_recv = ~0U;
+	comp->toss = 1;
+
+	return comp;
+}
+
+void slhc_free(struct slhc *comp)
+{
+	talloc_free(comp);
+}
+
+void slhc_toss(struct slhc *comp)
+{
+	comp->toss = 1;
+}
+
+/* same addresses and ports */
+static int cs_match(const struct slhc_cstate *cs, const uint8_t *ip,
+		    const uint8_t *th)
+{
+	const uint8_t *oip = cs->hdr;
+
+	return cs->hlen &&
+	       memcmp(ip + IPH_ADDRS, oip + IPH_ADDRS, 8) == 0 &&
+	       memcmp(th, oip + IPH_HL(oip), 4) == 0;
+}
+
+enum slhc_type slhc_compress(struct slhc *comp, uint8_t **pkt,
+			     unsigned int *len, int compress_cid)
+{
+	uint8_t *ip = *pkt, *th, *oip, *oth, *cp;
+	struct slhc_cstate *cs, *lcs, *lastcs;
+	unsigned int iphlen, hlen, changes = 0;
+	uint32_t deltaS, deltaA;
+	uint8_t new_seq[16];
+	uint16_t sum;
+
+	/* only unfragmented TCP segments that are no more than an ACK */
+	if (*len < 40 || (ip[0] >> 4) != 4 || ip[IPH_PROTO] != IPPROTO_TCP ||
+	    (get16(ip + IPH_OFF) & 0x3fff))
+		return SLHC_TYPE_IP;
+	iphlen = IPH_HL(ip);
+	if (iphlen < 20 || iphlen + 20 > *len)
+		return SLHC_TYPE_IP;
+	th = ip + iphlen;
+	hlen = iphlen + TH_OFF(th);
+	if (TH_OFF(th) < 20 || hlen > *len)
+		return SLHC_TYPE_IP;
+	if ((th[TH_FLAGS] & (TH_SYN|TH_FIN|TH_RST|TH_ACK_BIT)) != TH_ACK_BIT)
+		return SLHC_TYPE_IP;
+
+	/* the most recently used connection is the most likely one */
+	cs = comp->last_cs->next;
+	if (!cs_match(cs, ip, th)) {
+		lastcs = comp->last_cs;
+		do {
+			lcs = cs;
+			cs = cs->next;
+			if (cs_match(cs, ip, th))
+				goto found;
+		} while (cs != lastcs);
+
+		/* not found, the oldest state becomes the most recent one
+		 * and the other side learns the connection number */
+		comp->last_cs = lcs;
+		goto uncompressed;
+
+	found:
+		/* move it to the front of the list */
+		if (cs == lastcs)
+			comp->last_cs = lcs;
+		else {
+			lcs->next = cs->next;
+			cs->next = lastcs->next;
+			lastcs->next = cs;
+		}
+	}
+
+	/* anything but the fields below changed, send it uncompressed */
+	oip = cs->hdr;
+	oth = oip + IPH_HL(oip);
+	if (get16(ip) != get16(oip) ||
+	    get16(ip + IPH_OFF) != get16(oip + IPH_OFF) ||
+	    get16(ip + IPH_TTL) != get16(oip + IPH_TTL) ||
+	    TH_OFF(th) != TH_OFF(oth) ||
+	    (iphlen > 20 && memcmp(ip + 20, oip + 20, iphlen - 20)) ||
+	    (TH_OFF(th) > 20 && memcmp(th + 20, oth + 20, TH_OFF(th) - 20)))
+		goto uncompressed;
+
+	cp = new_seq;
+	if (th[TH_FLAGS] & TH_URG) {
+		deltaS = get16(th + TH_URP);
+		ENCODEZ(deltaS);
+		changes |= NEW_U;
+	} else if (get16(th + TH_URP) != get16(oth + TH_URP))
+		goto uncompressed;
+
+	deltaS = (uint16_t) (get16(th + TH_WIN) - get16(oth + TH_WIN));
+	if (deltaS) {
+		ENCODE(deltaS);
+		changes |= NEW_W;
+	}
+
+	deltaA = get32(th + TH_ACK) - get32(oth + TH_ACK);
+	if (deltaA) {
+		if (deltaA > 0xffff)
+			goto uncompressed;
+		ENCODE(deltaA);
+		changes |= NEW_A;
+	}
+
+	deltaS = get32(th + TH_SEQ) - get32(oth + TH_SEQ);
+	if (deltaS) {
+		if (deltaS > 0xffff)
+			goto uncompressed;
+		ENCODE(deltaS);
+		changes |= NEW_S;
+	}
+
+	switch (changes) {
+	case 0:
+		/* data after a pure ACK is normal on an interactive
+		 * connection, otherwise nothing changed because of a
+		 * retransmission or a window probe which is sent
+		 * uncompressed in case the other side missed the last one */
+		if (get16(ip + IPH_LEN) != get16(oip + IPH_LEN) &&
+		    get16(oip + IPH_LEN) == hlen)
+			break;
+		/* fall through */
+	case SPECIAL_I:
+	case SPECIAL_D:
+		/* the changes look like one of the special encodings */
+		goto uncompressed;
+	case NEW_S|NEW_A:
+		if (deltaS == deltaA &&
+		    deltaS == get16(oip + IPH_LEN) - cs->hlen) {
+			/* echoed terminal traffic */
+			changes = SPECIAL_I;
+			cp = new_seq;
+		}
+		break;
+	case NEW_S:
+		if (deltaS == get16(oip + IPH_LEN) - cs->hlen) {
+			/* data transfer */
+			changes = SPECIAL_D;
+			cp = new_seq;
+		}
+		break;
+	}
+
+	deltaS = (uint16_t) (get16(ip + IPH_ID) - get16(oip + IPH_ID));
+	if (deltaS != 1) {
+		ENCODEZ(deltaS);
+		changes |= NEW_I;
+	}
+	if (th[TH_FLAGS] & TH_PUSH)
+		changes |= TCP_PUSH_BIT;
+
+	/* the checksum is sent as is, then the header is the new state */
+	sum = get16(th + TH_SUM);
+	memcpy(cs->hdr, ip, hlen);
+	cs->hlen = hlen;
+
+	/* the compressed header replaces the end of the TCP/IP header */
+	deltaS = cp - new_seq;
+	if (!compress_cid || comp->last_xmit != cs->id) {
+		comp->last_xmit = cs->id;
+		cp = ip + hlen - deltaS - 4;
+		*pkt = cp;
+		*cp++ = changes | NEW_C;
+		*cp++ = cs->id;
+	} else {
+		cp = ip + hlen - deltaS - 3;
+		*pkt = cp;
+		*cp++ = changes;
+	}
+	*len -= *pkt - ip;
+	put16(cp, sum);
+	memcpy(cp + 2, new_seq, deltaS);
+
+	return SLHC_TYPE_COMPRESSED_TCP;
+
+uncompressed:
+	memcpy(cs->hdr, ip, hlen);
+	cs->hlen = hlen;
+	ip[IPH_PROTO] = cs->id;
+	comp->last_xmit = cs->id;
+
+	return SLHC_TYPE_UNCOMPRESSED_TCP;
+}
+
+int slhc_uncompress(struct slhc *comp, enum slhc_type type, uint8_t **pkt,
+		    unsigned int len)
+{
+	uint8_t *cp = *pkt, *end = *pkt + len;
+	uint8_t *ip, *th;
+	struct slhc_cstate *cs;
+	unsigned int changes, hlen, i;
+	uint32_t sum;
+	uint16_t val;
+
+	switch (type) {
+	case SLHC_TYPE_IP:
+		return len;
+	case SLHC_TYPE_UNCOMPRESSED_TCP:
+		ip = cp;
+		if (len < 40 || ip[IPH_PROTO] >= comp->rslots)
+			goto bad;
+		hlen = IPH_HL(ip);
+		if (hlen < 20 || hlen + 20 > len)
+			goto bad;
+		if (TH_OFF(ip + hlen) < 20 || hlen + TH_OFF(ip + hlen) > len)
+			goto bad;
+		hlen += TH_OFF(ip + hlen);
+
+		comp->last_recv = ip[IPH_PROTO];
+		comp->toss = 0;
+		ip[IPH_PROTO] = IPPROTO_TCP;
+
+		cs = &comp->rstate[comp->last_recv];
+		memcpy(cs->hdr, ip, hlen);
+		cs->hlen = hlen;
+		return len;
+	case SLHC_TYPE_COMPRESSED_TCP:
+		break;
+	default:
+		goto bad;
+	}
+
+	if (len < 3)
+		goto bad;
+	changes = *cp++;
+	if (changes & NEW_C) {
+		if (*cp >= comp->rslots)
+			goto bad;
+		comp->toss = 0;
+		comp->last_recv = *cp++;
+	} else if (comp->toss)
+		return 0;
+
+	cs = &comp->rstate[comp->last_recv];
+	if (!cs->hlen || end - cp < 2)
+		goto bad;
+	ip = cs->hdr;
+	th = ip + IPH_HL(ip);
+
+	th[TH_SUM] = cp[0];
+	th[TH_SUM + 1] = cp[1];
+	cp += 2;
+	if (changes & TCP_PUSH_BIT)
+		th[TH_FLAGS] |= TH_PUSH;
+	else
+		th[TH_FLAGS] &= ~TH_PUSH;
+
+	switch (changes & SPECIALS_MASK) {
+	case SPECIAL_I:
+		i = get16(ip + IPH_LEN) - cs->hlen;
+		put32(th + TH_ACK, get32(th + TH_ACK) + i);
+		put32(th + TH_SEQ, get32(th + TH_SEQ) + i);
+		break;
+	case SPECIAL_D:
+		i = get16(ip + IPH_LEN) - cs->hlen;
+		put32(th + TH_SEQ, get32(th + TH_SEQ) + i);
+		break;
+	default:
+		if (changes & NEW_U) {
+			th[TH_FLAGS] |= TH_URG;
+			if (decode(&cp, end, &val) < 0)
+				goto bad;
+			put16(th + TH_URP, val);
+		} else
+			th[TH_FLAGS] &= ~TH_URG;
+		if (changes & NEW_W) {
+			if (decode(&cp, end, &val) < 0)
+				goto bad;
+			put16(th + TH_WIN, get16(th + TH_WIN) + val);
+		}
+		if (changes & NEW_A) {
+			if (decode(&cp, end, &val) < 0)
+				goto bad;
+			put32(th + TH_ACK, get32(th + TH_ACK) + val);
+		}
+		if (changes & NEW_S) {
+			if (decode(&cp, end, &val) < 0)
+				goto bad;
+			put32(th + TH_SEQ, get32(th + TH_SEQ) + val);
+		}
+		break;
+	}
+
+	if (changes & NEW_I) {
+		if (decode(&cp, end, &val) < 0)
+			goto bad;
+		put16(ip + IPH_ID, get16(ip + IPH_ID) + val);
+	} else
+		put16(ip + IPH_ID, get16(ip + IPH_ID) + 1);
+
+	/* the rest is the data, the header goes in front of it */
+	len = end - cp;
+	put16(ip + IPH_LEN, len + cs->hlen);
+	put16(ip + IPH_SUM, 0);
+	for (sum = 0, i = 0; i < IPH_HL(ip); i += 2)
+		sum += get16(ip + i);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum += sum >> 16;
+	put16(ip + IPH_SUM, ~sum);
+
+	*pkt = cp - cs->hlen;
+	memcpy(*pkt, cs->hdr, cs->hlen);
+	return len + cs->hlen;
+
+bad:
+	comp->toss = 1;
+	return -EINVAL;
+}
@@ -56,6 +56,7 @@
 #include <openbsc/silent_call.h>
 #include <openbsc/bsc_api.h>
 #include <openbsc/osmo_msc.h>
+#include <openbsc/timer_wheel.h>
 
 void *tall_locop_ctx;
 void *tall_authciphop_ctx;
@@ -1301,11 +1302,13 @@ static int gsm48_tx_simple(struct gsm_subscriber_connection *conn,
 	return gsm48_conn_sendmsg(msg, conn, NULL);
 }
 
+static struct bsc_timer_wheel cc_wheel = BSC_TIMER_WHEEL("cc");
+
 static void gsm48_stop_cc_timer(struct gsm_trans *trans)
 {
-	if (bsc_timer_pending(&trans->cc.timer)) {
+	if (bsc_wheel_pending(&trans->cc.timer)) {
 		DEBUGP(DCC, "stopping pending timer T%x\n", trans->cc.Tcurrent);
-		bsc_del_timer(&trans->cc.timer);
+		bsc_wheel_del(&cc_wheel, &trans->cc.timer);
 		trans->cc.Tcurrent = 0;
 	}
 }
@@ -1688,7 +1691,7 @@ static void gsm48_start_cc_timer(struct gsm_trans *trans, int current,
 	DEBUGP(DCC, "starting timer T%x with %d seconds\n", current, sec);
 	trans->cc.timer.cb = gsm48_cc_timeout;
 	trans->cc.timer.data = trans;
-	bsc_schedule_timer(&trans->cc.timer, sec, micro);
+	bsc_wheel_schedule(&cc_wheel, &trans->cc.timer, sec, micro);
 	trans->cc.Tcurrent = current;
 }
 
@@ -0,0 +1,103 @@
+/* Hash index for the lookup tables of the Gb stack */
+
+/* (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <osmocore/linuxlist.h>
+#include <osmocore/talloc.h>
+
+#include <openbsc/hash_index.h>
+
+#define HASH_INDEX_MIN_SIZE	16
+
+static int index_resize(void *ctx, struct hash_index *idx, unsigned int size)
+{
+	struct llist_head *buckets;
+	unsigned int i;
+
+	buckets = talloc_array(ctx, struct llist_head, size);
+	if (!buckets)
+		return -ENOMEM;
+	for (i = 0; i < size; ++i)
+		INIT_LLIST_HEAD(&buckets[i]);
+
+	/* add to the tail to keep the order within a bucket */
+	for (i = 0; i < idx->size; ++i) {
+		struct hash_entry *entry, *tmp;
+
+		llist_for_each_entry_safe(entry, tmp, &idx->buckets[i], list)
+			llist_move_tail(&entry->list,
+					&buckets[entry->hash & (size - 1)]);
+	}
+
+	talloc_free(idx->buckets);
+	idx->buckets = buckets;
+	idx->size = size;
+	return 0;
+}
+
+int hash_index_add(void *ctx, struct hash_index *idx,
+		   struct hash_entry *entry, uint32_t hash)
+{
+	if (idx->count >= idx->size) {
+		unsigned int size = idx->size ? idx->size * 2 : HASH_INDEX_MIN_SIZE;
+
+		/* a full table is still usable, only an empty one is not */
+		if (index_resize(ctx, idx, size) != 0 && !idx->size)
+			return -ENOMEM;
+	}
+
+	entry->hash = hash;
+	llist_add(&entry->list, &idx->buckets[hash & (idx->size - 1)]);
+	idx->count += 1;
+	return 0;
+}
+
+void hash_index_del(struct hash_index *idx, struct hash_entry *entry)
+{
+	if (!hash_index_linked(entry))
+		return;
+
+	llist_del(&entry->list);
+	INIT_LLIST_HEAD(&entry->list);
+	idx->count -= 1;
+}
+
+/* move an entry after its key changed, unindexed entries stay so */
+void hash_index_rehash(void *ctx, struct hash_index *idx,
+		       struct hash_entry *entry, uint32_t hash)
+{
+	if (!hash_index_linked(entry))
+		return;
+
+	hash_index_del(idx, entry);
+	hash_index_add(ctx, idx, entry, hash);
+}
+
+void hash_index_free(struct hash_index *idx)
+{
+	talloc_free(idx->buckets);
+	idx->buckets = NULL;
+	idx->size = 0;
+	idx->count = 0;
+}
@@ -40,6 +40,7 @@
 #include <osmocore/select.h>
 #include <openbsc/mgcp.h>
 #include <openbsc/mgcp_internal.h>
+#include <openbsc/select_epoll.h>
 #include <osmocom/vty//telnet_interface.h>
 #include <openbsc/vty.h>
 
@@ -58,6 +59,7 @@ void subscr_put() { abort(); }
 static struct mgcp_config *cfg;
 static int reset_endpoints = 0;
 static int daemonize = 0;
+static int use_epoll = 0;
 
 const char *openbsc_copyright =
 	"Copyright (C) 2009-2010 Holger Freyther and On-Waves\r\n"
@@ -77,6 +79,7 @@ static void print_help()
 	printf("Some useful help...\n");
 	printf(" -h --help is printing this text.\n");
 	printf(" -c --config-file filename The config file to use.\n");
+	printf(" -e --epoll Use epoll for the RTP sockets.\n");
 }
 
 static void handle_options(int argc, char **argv)
@@ -88,10 +91,11 @@ static void handle_options(int argc, char **argv)
 			{"config-file", 1, 0, 'c'},
 			{"daemonize", 0, 0, 'D'},
 			{"version", 0, 0, 'V'},
+			{"epoll", 0, 0, 'e'},
 			{0, 0, 0, 0},
 		};
 
-		c = getopt_long(argc, argv, "hc:VD", long_options, &option_index);
+		c = getopt_long(argc, argv, "hc:VDe", long_options, &option_index);
 
 		if (c == -1)
 			break;
@@ -111,6 +115,9 @@ static void handle_options(int argc, char **argv)
 		case 'D':
 			daemonize = 1;
 			break;
+		case 'e':
+			use_epoll = 1;
+			break;
 		default:
 			/* ignore */
 			break;
@@ -213,6 +220,9 @@ int main(int argc, char **argv)
 
 	handle_options(argc, argv);
 
+	if (use_epoll && bsc_epoll_init() != 0)
+		return -1;
+
         rc = mgcp_parse_config(config_file, cfg);
 	if (rc < 0)
 		return rc;
@@ -259,6 +269,9 @@ int main(int argc, char **argv)
 			return -1;
 		}
 
+		if (mgcp_shards_start(cfg) != 0)
+			return -1;
+
 		LOGP(DMGCP, LOGL_NOTICE, "Configured for MGCP.\n");
 	}
 
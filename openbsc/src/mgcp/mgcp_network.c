@@ -37,6 +37,7 @@
 #include <openbsc/debug.h>
 #include <openbsc/mgcp.h>
 #include <openbsc/mgcp_internal.h>
+#include <openbsc/select_epoll.h>
 
 #warning "Make use of the rtp proxy code"
 
@@ -75,6 +76,23 @@ enum {
 
 #define DUMMY_LOAD 0x23
 
+/*
+ * The forwarding below also runs on the media threads. They must not
+ * log, they count the event for the select loop to report instead.
+ */
+#define LOGP_MEDIA(endp, event, level, fmt, args...)			\
+	do {								\
+		if ((endp)->cfg->media_shard)				\
+			(endp)->cfg->media_shard->events[event] += 1;	\
+		else							\
+			LOGP(DMGCP, level, fmt, ## args);		\
+	} while (0)
+
+static const char *addr_str(const struct in_addr *addr, char *buf)
+{
+	return inet_ntop(AF_INET, addr, buf, INET_ADDRSTRLEN);
+}
+
 
 static int udp_send(int fd, struct in_addr *addr, int port, char *buf, int len)
 {
@@ -100,6 +118,7 @@ static void patch_and_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *s
 	uint16_t seq;
 	uint32_t timestamp;
 	struct rtp_hdr *rtp_hdr;
+	char ip[INET_ADDRSTRLEN];
 
 	if (len < sizeof(*rtp_hdr))
 		return;
@@ -118,10 +137,10 @@ static void patch_and_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *s
 		state->seq_offset = (state->seq_no + 1) - seq;
 		state->timestamp_offset = state->last_timestamp - timestamp;
 		state->patch = endp->allow_patch;
-		LOGP(DMGCP, LOGL_NOTICE,
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_SSRC_CHANGE, LOGL_NOTICE,
 			"The SSRC changed on 0x%x SSRC: %u offset: %d from %s:%d in %d\n",
 			ENDPOINT_NUMBER(endp), state->ssrc, state->seq_offset,
-			inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), endp->conn_mode);
+			addr_str(&addr->sin_addr, ip), ntohs(addr->sin_port), endp->conn_mode);
 	}
 
 	/* apply the offset and store it back to the packet */
@@ -169,7 +188,8 @@ static int send_transcoder(struct mgcp_endpoint *endp, int is_rtp,
 	struct sockaddr_in addr;
 
 	if (endp->transcoder_end.rtp_port == 0) {
-		LOGP(DMGCP, LOGL_ERROR, "Transcoder port not known on 0x%x\n",
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_NO_TRANSCODER, LOGL_ERROR,
+			"Transcoder port not known on 0x%x\n",
 			ENDPOINT_NUMBER(endp));
 		return -1;
 	}
@@ -188,7 +208,7 @@ static int send_transcoder(struct mgcp_endpoint *endp, int is_rtp,
 		(struct sockaddr *) &addr, sizeof(addr));
 
 	if (rc != len)
-		LOGP(DMGCP, LOGL_ERROR,
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_SEND_FAIL, LOGL_ERROR,
 			"Failed to send data to the transcoder: %s\n",
 			strerror(errno));
 
@@ -245,7 +265,8 @@ static int recevice_from(struct mgcp_endpoint *endp, int fd, struct sockaddr_in
 	rc = recvfrom(fd, buf, bufsize, 0,
 			    (struct sockaddr *) addr, &slen);
 	if (rc < 0) {
-		LOGP(DMGCP, LOGL_ERROR, "Failed to receive message on: 0x%x errno: %d/%s\n",
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_RECV_FAIL, LOGL_ERROR,
+			"Failed to receive message on: 0x%x errno: %d/%s\n",
 			ENDPOINT_NUMBER(endp), errno, strerror(errno));
 		return -1;
 	}
@@ -262,6 +283,7 @@ static int recevice_from(struct mgcp_endpoint *endp, int fd, struct sockaddr_in
 static int rtp_data_net(struct bsc_fd *fd, unsigned int what)
 {
 	char buf[4096];
+	char ip[INET_ADDRSTRLEN];
 	struct sockaddr_in addr;
 	struct mgcp_endpoint *endp;
 	int rc, proto;
@@ -273,15 +295,15 @@ static int rtp_data_net(struct bsc_fd *fd, unsigned int what)
 		return -1;
 
 	if (memcmp(&addr.sin_addr, &endp->net_end.addr, sizeof(addr.sin_addr)) != 0) {
-		LOGP(DMGCP, LOGL_ERROR,
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_WRONG_SOURCE, LOGL_ERROR,
 			"Data from wrong address %s on 0x%x\n",
-			inet_ntoa(addr.sin_addr), ENDPOINT_NUMBER(endp));
+			addr_str(&addr.sin_addr, ip), ENDPOINT_NUMBER(endp));
 		return -1;
 	}
 
 	if (endp->net_end.rtp_port != addr.sin_port &&
 	    endp->net_end.rtcp_port != addr.sin_port) {
-		LOGP(DMGCP, LOGL_ERROR,
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_WRONG_SOURCE, LOGL_ERROR,
 			"Data from wrong source port %d on 0x%x\n",
 			ntohs(addr.sin_port), ENDPOINT_NUMBER(endp));
 		return -1;
@@ -289,7 +311,8 @@ static int rtp_data_net(struct bsc_fd *fd, unsigned int what)
 
 	/* throw away the dummy message */
 	if (rc == 1 && buf[0] == DUMMY_LOAD) {
-		LOGP(DMGCP, LOGL_NOTICE, "Filtered dummy from network on 0x%x\n",
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_DUMMY, LOGL_NOTICE,
+			"Filtered dummy from network on 0x%x\n",
 			ENDPOINT_NUMBER(endp));
 		return 0;
 	}
@@ -304,6 +327,7 @@ static int rtp_data_net(struct bsc_fd *fd, unsigned int what)
 static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_in *addr)
 {
 	struct mgcp_config *cfg = endp->cfg;
+	char ip[INET_ADDRSTRLEN];
 
 	if (proto == PROTO_RTP && endp->bts_end.rtp_port == 0) {
 		if (!cfg->bts_ip ||
@@ -315,10 +339,10 @@ static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_
 			endp->bts_end.rtp_port = addr->sin_port;
 			endp->bts_end.addr = addr->sin_addr;
 
-			LOGP(DMGCP, LOGL_NOTICE,
+			LOGP_MEDIA(endp, MGCP_SHARD_EV_BTS_FOUND, LOGL_NOTICE,
 				"Found BTS for endpoint: 0x%x on port: %d/%d of %s\n",
 				ENDPOINT_NUMBER(endp), ntohs(endp->bts_end.rtp_port),
-				ntohs(endp->bts_end.rtcp_port), inet_ntoa(addr->sin_addr));
+				ntohs(endp->bts_end.rtcp_port), addr_str(&addr->sin_addr, ip));
 		}
 	} else if (proto == PROTO_RTCP && endp->bts_end.rtcp_port == 0) {
 		if (memcmp(&endp->bts_end.addr, &addr->sin_addr,
@@ -331,6 +355,7 @@ static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_
 static int rtp_data_bts(struct bsc_fd *fd, unsigned int what)
 {
 	char buf[4096];
+	char ip[INET_ADDRSTRLEN];
 	struct sockaddr_in addr;
 	struct mgcp_endpoint *endp;
 	struct mgcp_config *cfg;
@@ -350,15 +375,15 @@ static int rtp_data_bts(struct bsc_fd *fd, unsigned int what)
 	discover_bts(endp, proto, &addr);
 
 	if (memcmp(&endp->bts_end.addr, &addr.sin_addr, sizeof(addr.sin_addr)) != 0) {
-		LOGP(DMGCP, LOGL_ERROR,
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_WRONG_SOURCE, LOGL_ERROR,
 			"Data from wrong bts %s on 0x%x\n",
-			inet_ntoa(addr.sin_addr), ENDPOINT_NUMBER(endp));
+			addr_str(&addr.sin_addr, ip), ENDPOINT_NUMBER(endp));
 		return -1;
 	}
 
 	if (endp->bts_end.rtp_port != addr.sin_port &&
 	    endp->bts_end.rtcp_port != addr.sin_port) {
-		LOGP(DMGCP, LOGL_ERROR,
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_WRONG_SOURCE, LOGL_ERROR,
 			"Data from wrong bts source port %d on 0x%x\n",
 			ntohs(addr.sin_port), ENDPOINT_NUMBER(endp));
 		return -1;
@@ -366,7 +391,8 @@ static int rtp_data_bts(struct bsc_fd *fd, unsigned int what)
 
 	/* throw away the dummy message */
 	if (rc == 1 && buf[0] == DUMMY_LOAD) {
-		LOGP(DMGCP, LOGL_NOTICE, "Filtered dummy from bts on 0x%x\n",
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_DUMMY, LOGL_NOTICE,
+			"Filtered dummy from bts on 0x%x\n",
 			ENDPOINT_NUMBER(endp));
 		return 0;
 	}
@@ -384,6 +410,7 @@ static int rtp_data_bts(struct bsc_fd *fd, unsigned int what)
 static int rtp_data_transcoder(struct bsc_fd *fd, unsigned int what)
 {
 	char buf[4096];
+	char ip[INET_ADDRSTRLEN];
 	struct sockaddr_in addr;
 	struct mgcp_endpoint *endp;
 	struct mgcp_config *cfg;
@@ -399,15 +426,15 @@ static int rtp_data_transcoder(struct bsc_fd *fd, unsigned int what)
 	proto = fd == &endp->transcoder_end.rtp ? PROTO_RTP : PROTO_RTCP;
 
 	if (memcmp(&addr.sin_addr, &cfg->transcoder_in, sizeof(addr.sin_addr)) != 0) {
-		LOGP(DMGCP, LOGL_ERROR,
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_WRONG_SOURCE, LOGL_ERROR,
 			"Data not coming from transcoder: %s on 0x%x\n",
-			inet_ntoa(addr.sin_addr), ENDPOINT_NUMBER(endp));
+			addr_str(&addr.sin_addr, ip), ENDPOINT_NUMBER(endp));
 		return -1;
 	}
 
 	if (endp->transcoder_end.rtp_port != addr.sin_port &&
 	    endp->transcoder_end.rtcp_port != addr.sin_port) {
-		LOGP(DMGCP, LOGL_ERROR,
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_WRONG_SOURCE, LOGL_ERROR,
 			"Data from wrong transcoder source port %d on 0x%x\n",
 			ntohs(addr.sin_port), ENDPOINT_NUMBER(endp));
 		return -1;
@@ -415,7 +442,8 @@ static int rtp_data_transcoder(struct bsc_fd *fd, unsigned int what)
 
 	/* throw away the dummy message */
 	if (rc == 1 && buf[0] == DUMMY_LOAD) {
-		LOGP(DMGCP, LOGL_NOTICE, "Filtered dummy from transcoder on 0x%x\n",
+		LOGP_MEDIA(endp, MGCP_SHARD_EV_DUMMY, LOGL_NOTICE,
+			"Filtered dummy from transcoder on 0x%x\n",
 			ENDPOINT_NUMBER(endp));
 		return 0;
 	}
@@ -476,14 +504,19 @@ static int bind_rtp(struct mgcp_config *cfg, struct mgcp_rtp_end *rtp_end, int e
 	set_ip_tos(rtp_end->rtcp.fd, cfg->endp_dscp);
 
 	rtp_end->rtp.when = BSC_FD_READ;
-	if (bsc_register_fd(&rtp_end->rtp) != 0) {
+	rtp_end->rtcp.when = BSC_FD_READ;
+
+	/* the media threads will pick them up with the next sync */
+	if (cfg->shards)
+		return 0;
+
+	if (bsc_epoll_register_fd(&rtp_end->rtp) != 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to register RTP port %d on 0x%x\n",
 			rtp_end->local_port, endpno);
 		goto cleanup2;
 	}
 
-	rtp_end->rtcp.when = BSC_FD_READ;
-	if (bsc_register_fd(&rtp_end->rtcp) != 0) {
+	if (bsc_epoll_register_fd(&rtp_end->rtcp) != 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to register RTCP port %d on 0x%x\n",
 			rtp_end->local_port + 1, endpno);
 		goto cleanup3;
@@ -492,7 +525,7 @@ static int bind_rtp(struct mgcp_config *cfg, struct mgcp_rtp_end *rtp_end, int e
 	return 0;
 
 cleanup3:
-	bsc_unregister_fd(&rtp_end->rtp);
+	bsc_epoll_unregister_fd(&rtp_end->rtp);
 cleanup2:
 	close(rtp_end->rtcp.fd);
 	rtp_end->rtcp.fd = -1;
@@ -551,19 +584,28 @@ int mgcp_bind_transcoder_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 	return bind_rtp(endp->cfg, &endp->transcoder_end, ENDPOINT_NUMBER(endp));
 }
 
-int mgcp_free_rtp_port(struct mgcp_rtp_end *end)
+static void free_port(struct bsc_fd *bfd)
 {
-	if (end->rtp.fd != -1) {
-		close(end->rtp.fd);
-		end->rtp.fd = -1;
-		bsc_unregister_fd(&end->rtp);
-	}
+	struct mgcp_endpoint *endp = bfd->data;
 
-	if (end->rtcp.fd != -1) {
-		close(end->rtcp.fd);
-		end->rtcp.fd = -1;
-		bsc_unregister_fd(&end->rtcp);
+	if (bfd->fd == -1)
+		return;
+
+	/* the owning media thread closes it */
+	if (endp->cfg->shards) {
+		mgcp_shard_close_fd(endp, bfd->fd);
+		bfd->fd = -1;
+		return;
 	}
 
+	bsc_epoll_unregister_fd(bfd);
+	close(bfd->fd);
+	bfd->fd = -1;
+}
+
+int mgcp_free_rtp_port(struct mgcp_rtp_end *end)
+{
+	free_port(&end->rtp);
+	free_port(&end->rtcp);
 	return 0;
 }
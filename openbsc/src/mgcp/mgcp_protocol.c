@@ -38,56 +38,23 @@
 #include <openbsc/mgcp.h>
 #include <openbsc/mgcp_internal.h>
 
-/**
- * Macro for tokenizing MGCP messages and SDP in one go.
- *
- */
-#define MSG_TOKENIZE_START \
-	line_start = 0;						\
-	for (i = 0; i < msgb_l3len(msg); ++i) {			\
-		/* we have a line end */			\
-		if (msg->l3h[i] == '\n') {			\
-			/* skip the first line */		\
-			if (line_start == 0) {			\
-				line_start = i + 1;		\
-				continue;			\
-			}					\
-								\
-			/* check if we have a proper param */	\
-			if (i - line_start == 1 && msg->l3h[line_start] == '\r') { \
-			} else if (i - line_start > 2		\
-			    && islower(msg->l3h[line_start])	\
-			    && msg->l3h[line_start + 1] == '=') { \
-			} else if (i - line_start < 3		\
-			    || msg->l3h[line_start + 1] != ':'	\
-			    || msg->l3h[line_start + 2] != ' ')	\
-				goto error;			\
-								\
-			msg->l3h[i] = '\0';			\
-			if (msg->l3h[i-1] == '\r')		\
-				msg->l3h[i-1] = '\0';
-
-#define MSG_TOKENIZE_END \
-			line_start = i + 1; \
-		}			    \
-	}
-
-static void mgcp_rtp_end_reset(struct mgcp_rtp_end *end);
+static void mgcp_rtp_end_reset(struct mgcp_rtp_end *end,
+			       struct mgcp_port_range *range);
 
 struct mgcp_request {
 	char *name;
-	struct msgb *(*handle_request) (struct mgcp_config *cfg, struct msgb *msg);
+	struct msgb *(*handle_request) (struct mgcp_config *cfg, struct mgcp_parse_data *data);
 	char *debug_name;
 };
 
 #define MGCP_REQUEST(NAME, REQ, DEBUG_NAME) \
 	{ .name = NAME, .handle_request = REQ, .debug_name = DEBUG_NAME },
 
-static struct msgb *handle_audit_endpoint(struct mgcp_config *cfg, struct msgb *msg);
-static struct msgb *handle_create_con(struct mgcp_config *cfg, struct msgb *msg);
-static struct msgb *handle_delete_con(struct mgcp_config *cfg, struct msgb *msg);
-static struct msgb *handle_modify_con(struct mgcp_config *cfg, struct msgb *msg);
-static struct msgb *handle_rsip(struct mgcp_config *cfg, struct msgb *msg);
+static struct msgb *handle_audit_endpoint(struct mgcp_config *cfg, struct mgcp_parse_data *data);
+static struct msgb *handle_create_con(struct mgcp_config *cfg, struct mgcp_parse_data *data);
+static struct msgb *handle_delete_con(struct mgcp_config *cfg, struct mgcp_parse_data *data);
+static struct msgb *handle_modify_con(struct mgcp_config *cfg, struct mgcp_parse_data *data);
+static struct msgb *handle_rsip(struct mgcp_config *cfg, struct mgcp_parse_data *data);
 
 static void create_transcoder(struct mgcp_endpoint *endp);
 static void delete_transcoder(struct mgcp_endpoint *endp);
@@ -184,6 +151,11 @@ static struct msgb *create_response_with_sdp(struct mgcp_endpoint *endp,
 	return mgcp_create_response_with_data(200, msg, trans_id, sdp_record);
 }
 
+static struct msgb *trans_cache_lookup(struct mgcp_config *cfg,
+				       const struct mgcp_parse_data *p, int *hit);
+static void trans_cache_store(struct mgcp_config *cfg,
+			      const struct mgcp_parse_data *p, struct msgb *resp);
+
 /*
  * handle incoming messages:
  *   - this can be a command (four letters, space, transaction id)
@@ -191,135 +163,278 @@ static struct msgb *create_response_with_sdp(struct mgcp_endpoint *endp,
  */
 struct msgb *mgcp_handle_message(struct mgcp_config *cfg, struct msgb *msg)
 {
-        int code;
+	struct mgcp_parse_data p;
 	struct msgb *resp = NULL;
+	int i, hit, handled = 0;
 
 	if (msgb_l2len(msg) < 4) {
 		LOGP(DMGCP, LOGL_ERROR, "mgs too short: %d\n", msg->len);
 		return NULL;
 	}
 
-        /* attempt to treat it as a response */
-        if (sscanf((const char *)&msg->l2h[0], "%3d %*s", &code) == 1) {
-		LOGP(DMGCP, LOGL_DEBUG, "Response: Code: %d\n", code);
-	} else {
-		int i, handled = 0;
-		msg->l3h = &msg->l2h[4];
-		for (i = 0; i < ARRAY_SIZE(mgcp_requests); ++i)
-			if (strncmp(mgcp_requests[i].name, (const char *) &msg->l2h[0], 4) == 0) {
-				handled = 1;
-				resp = mgcp_requests[i].handle_request(cfg, msg);
-				break;
-			}
-		if (!handled) {
-			LOGP(DMGCP, LOGL_NOTICE, "MSG with type: '%.4s' not handled\n", &msg->l2h[0]);
+	mgcp_parse_msg(&p, (const char *) msg->l2h, msgb_l2len(msg));
+	if (p.code >= 0) {
+		LOGP(DMGCP, LOGL_DEBUG, "Response: Code: %d\n", p.code);
+		return NULL;
+	}
+
+	/* a retransmission gets the answer of the first attempt */
+	resp = trans_cache_lookup(cfg, &p, &hit);
+	if (hit)
+		return resp;
+
+	for (i = 0; i < ARRAY_SIZE(mgcp_requests); ++i)
+		if (strncmp(mgcp_requests[i].name, (const char *) &msg->l2h[0], 4) == 0) {
+			handled = 1;
+			resp = mgcp_requests[i].handle_request(cfg, &p);
+			break;
 		}
+	if (!handled) {
+		LOGP(DMGCP, LOGL_NOTICE, "MSG with type: '%.4s' not handled\n", &msg->l2h[0]);
+		return NULL;
 	}
 
+	trans_cache_store(cfg, &p, resp);
 	return resp;
 }
 
-/* string tokenizer for the poor */
-static int find_msg_pointers(struct msgb *msg, struct mgcp_msg_ptr *ptrs, int ptrs_length)
+static int is_line_end(char c)
 {
-	int i, found = 0;
-
-	int whitespace = 1;
-	for (i = 0; i < msgb_l3len(msg) && ptrs_length > 0; ++i) {
-		/* if we have a space we found an end */
-		if (msg->l3h[i]	== ' ' || msg->l3h[i] == '\r' || msg->l3h[i] == '\n') {
-			if (!whitespace) {
-				++found;
-				whitespace = 1;
-				ptrs->length = i - ptrs->start - 1;
-				++ptrs;
-				--ptrs_length;
-			} else {
-			    /* skip any number of whitespace */
-			}
-
-			/* line end... stop */
-			if (msg->l3h[i] == '\r' || msg->l3h[i] == '\n')
-				break;
-		} else if (msg->l3h[i] == '\r' || msg->l3h[i] == '\n') {
-			/* line end, be done */
-			break;
-		} else if (whitespace) {
-			whitespace = 0;
-			ptrs->start = i;
-		}
-	}
+	return c == '\r' || c == '\n';
+}
 
-	if (ptrs_length == 0)
-		return -1;
-	return found;
+static int ptr_equals(const struct mgcp_parse_data *p,
+		      const struct mgcp_msg_ptr *ptr, const char *str)
+{
+	return ptr->length == strlen(str) &&
+		memcmp(&p->data[ptr->start], str, ptr->length) == 0;
 }
 
-static struct mgcp_endpoint *find_endpoint(struct mgcp_config *cfg, const char *mgcp)
+/* parse a decimal number of up to nine digits */
+static int ptr_to_uint(const char *str, unsigned int length, unsigned int *out)
 {
-	char *endptr = NULL;
-	unsigned int gw = INT_MAX;
+	unsigned int i, val = 0;
 
-	gw = strtoul(mgcp, &endptr, 16);
-	if (gw == 0 || gw >= cfg->number_endpoints || strcmp(endptr, "@mgw") != 0) {
-		LOGP(DMGCP, LOGL_ERROR, "Not able to find endpoint: '%s'\n", mgcp);
-		return NULL;
+	if (length == 0 || length > 9)
+		return -1;
+
+	for (i = 0; i < length; ++i) {
+		if (str[i] < '0' || str[i] > '9')
+			return -1;
+		val = val * 10 + (str[i] - '0');
 	}
 
-	return &cfg->endpoints[gw];
+	*out = val;
+	return 0;
 }
 
-int mgcp_analyze_header(struct mgcp_config *cfg, struct msgb *msg,
-			struct mgcp_msg_ptr *ptr, int size,
-			const char **transaction_id, struct mgcp_endpoint **endp)
+/*
+ * Split the first line into its tokens and remember where every
+ * parameter and the interesting SDP lines are. The message is not
+ * modified and nothing is allocated, all positions are offsets into
+ * the message.
+ */
+int mgcp_parse_msg(struct mgcp_parse_data *p, const char *data, unsigned int len)
 {
-	int found;
-
-	*transaction_id = "000000";
+	struct mgcp_msg_ptr tokens[5];
+	unsigned int i, start, nr = 0;
+
+	memset(p, 0, sizeof(*p));
+	p->data = data;
+	p->len = len;
+	p->code = -1;
+	p->bad_line = -1;
+	strcpy(p->trans_id, "000000");
+
+	/* the first line */
+	for (i = 0; i < len && !is_line_end(data[i]);) {
+		if (data[i] == ' ') {
+			++i;
+			continue;
+		}
 
-	if (size < 3) {
-		LOGP(DMGCP, LOGL_ERROR, "Not enough space in ptr\n");
-		return -1;
+		start = i;
+		while (i < len && data[i] != ' ' && !is_line_end(data[i]))
+			++i;
+		if (nr < ARRAY_SIZE(tokens)) {
+			tokens[nr].start = start;
+			tokens[nr].length = i - start;
+		}
+		++nr;
 	}
 
-	found = find_msg_pointers(msg, ptr, size);
+	/* three digits make a response */
+	if (nr >= 2 && tokens[0].length == 3 &&
+	    ptr_to_uint(&data[tokens[0].start], 3, (unsigned int *) &p->code) != 0)
+		p->code = -1;
 
-	if (found <= 3) {
-		LOGP(DMGCP, LOGL_ERROR, "Gateway: Not enough params. Found: %d\n", found);
+	if (p->code < 0 && nr <= 4) {
+		LOGP(DMGCP, LOGL_ERROR, "Gateway: Not enough params. Found: %d\n",
+		     nr > 0 ? nr - 1 : 0);
 		return -1;
 	}
 
-	/*
-	 * replace the space with \0. the main method gurantess that
-	 * we still have + 1 for null termination
-	 */
-	msg->l3h[ptr[3].start + ptr[3].length + 1] = '\0';
-	msg->l3h[ptr[2].start + ptr[2].length + 1] = '\0';
-	msg->l3h[ptr[1].start + ptr[1].length + 1] = '\0';
-	msg->l3h[ptr[0].start + ptr[0].length + 1] = '\0';
-
-	if (strncmp("1.0", (const char *)&msg->l3h[ptr[3].start], 3) != 0
-	    || strncmp("MGCP", (const char *)&msg->l3h[ptr[2].start], 4) != 0) {
-		LOGP(DMGCP, LOGL_ERROR, "Wrong MGCP version. Not handling: '%s' '%s'\n",
-			(const char *)&msg->l3h[ptr[3].start],
-			(const char *)&msg->l3h[ptr[2].start]);
+	if (tokens[1].length >= sizeof(p->trans_id)) {
+		LOGP(DMGCP, LOGL_ERROR, "Transaction id is too long.\n");
 		return -1;
 	}
 
-	*transaction_id = (const char *)&msg->l3h[ptr[0].start];
-	if (endp) {
-		*endp = find_endpoint(cfg, (const char *)&msg->l3h[ptr[1].start]);
-		return *endp == NULL;
+	p->trans = tokens[1];
+	memcpy(p->trans_id, &data[p->trans.start], p->trans.length);
+	p->trans_id[p->trans.length] = '\0';
+	if (ptr_to_uint(p->trans_id, p->trans.length, &p->trans_nr) != 0)
+		p->trans_nr = 0;
+
+	if (p->code < 0) {
+		p->verb = tokens[0];
+		p->endp = tokens[2];
+
+		if (!ptr_equals(p, &tokens[3], "MGCP") || tokens[4].length < 3 ||
+		    strncmp("1.0", &data[tokens[4].start], 3) != 0) {
+			LOGP(DMGCP, LOGL_ERROR, "Wrong MGCP version. Not handling: '%.*s' '%.*s'\n",
+			     tokens[4].length, &data[tokens[4].start],
+			     tokens[3].length, &data[tokens[3].start]);
+			return -1;
+		}
 	}
+
+	/* the parameter lines and the SDP */
+	while (i < len) {
+		unsigned int end;
+
+		/* skip the end of the previous line */
+		while (i < len && data[i] != '\n')
+			++i;
+		if (i++ >= len)
+			break;
+
+		start = i;
+		for (end = start; end < len && data[end] != '\n'; ++end)
+			;
+		i = end;
+		if (end > start && data[end - 1] == '\r')
+			--end;
+
+		if (end == start) {
+			/* the SDP follows the empty line */
+			if (!p->sdp)
+				p->sdp = i + 1;
+		} else if (end - start > 2 && islower(data[start]) &&
+			   data[start + 1] == '=') {
+			if (data[start] == 'c' && !p->sdp_conn.start) {
+				p->sdp_conn.start = start;
+				p->sdp_conn.length = end - start;
+			} else if (data[start] == 'm' && !p->sdp_audio.start &&
+				   end - start > 8 &&
+				   memcmp(&data[start], "m=audio ", 8) == 0) {
+				p->sdp_audio.start = start;
+				p->sdp_audio.length = end - start;
+			}
+		} else if (end - start >= 3 && data[start + 1] == ':' &&
+			   data[start + 2] == ' ') {
+			int name = toupper(data[start]);
+
+			if (name < 'A' || name > 'Z')
+				continue;
+
+			p->params_mask |= 1 << (name - 'A');
+			p->params[name - 'A'].start = start + 3;
+			p->params[name - 'A'].length = end - start - 3;
+		} else if (p->bad_line < 0) {
+			p->bad_line = start;
+		}
+	}
+
+	p->valid = 1;
 	return 0;
 }
 
+/* a parameter value, NULL if it was not present */
+static const char *mgcp_param(const struct mgcp_parse_data *p, char name,
+			      unsigned int *length)
+{
+	const struct mgcp_msg_ptr *ptr = &p->params[name - 'A'];
+
+	if (!(p->params_mask & (1 << (name - 'A'))))
+		return NULL;
+
+	*length = ptr->length;
+	return &p->data[ptr->start];
+}
+
+static void log_unhandled(const struct mgcp_parse_data *p,
+			  const struct mgcp_endpoint *endp, const char *handled)
+{
+	uint32_t mask = p->params_mask;
+	int i;
+
+	for (; *handled; ++handled)
+		mask &= ~(1 << (*handled - 'A'));
+
+	for (i = 0; mask && i < 26; ++i)
+		if (mask & (1 << i))
+			LOGP(DMGCP, LOGL_NOTICE, "Unhandled option: '%c' on 0x%x\n",
+			     'A' + i, ENDPOINT_NUMBER(endp));
+}
+
+static void log_malformed(const struct mgcp_parse_data *p,
+			  const struct mgcp_endpoint *endp)
+{
+	const char *line = &p->data[p->bad_line];
+	int length = 0;
+
+	while (p->bad_line + length < p->len && !is_line_end(line[length]))
+		++length;
+
+	LOGP(DMGCP, LOGL_ERROR, "Malformed line: '%.*s' on 0x%x\n",
+	     length, line, ENDPOINT_NUMBER(endp));
+}
+
+static const int8_t hex_value[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/*
+ * The endpoint name is the index into the endpoint array. Decode it
+ * in place and stop as soon as it can not be a valid endpoint.
+ */
+static struct mgcp_endpoint *find_endpoint(struct mgcp_config *cfg,
+					   const struct mgcp_parse_data *p)
+{
+	const uint8_t *str = (const uint8_t *) &p->data[p->endp.start];
+	unsigned int i, gw = 0;
+
+	if (!p->valid)
+		return NULL;
+
+	for (i = 0; i < p->endp.length && hex_value[str[i]] != 0; ++i) {
+		gw = (gw << 4) | (hex_value[str[i]] - 1);
+		if (gw >= cfg->number_endpoints)
+			goto error;
+	}
+
+	if (i == 0 || gw == 0 || p->endp.length - i != 4 ||
+	    memcmp(&str[i], "@mgw", 4) != 0)
+		goto error;
+
+	return &cfg->endpoints[gw];
+
+error:
+	LOGP(DMGCP, LOGL_ERROR, "Not able to find endpoint: '%.*s'\n",
+	     (int) p->endp.length, (const char *) str);
+	return NULL;
+}
+
 static int verify_call_id(const struct mgcp_endpoint *endp,
-			  const char *callid)
+			  const char *callid, unsigned int length)
 {
-	if (strcmp(endp->callid, callid) != 0) {
-		LOGP(DMGCP, LOGL_ERROR, "CallIDs does not match on 0x%x. '%s' != '%s'\n",
-			ENDPOINT_NUMBER(endp), endp->callid, callid);
+	if (!endp->callid || strlen(endp->callid) != length ||
+	    memcmp(endp->callid, callid, length) != 0) {
+		LOGP(DMGCP, LOGL_ERROR, "CallIDs does not match on 0x%x. '%s' != '%.*s'\n",
+			ENDPOINT_NUMBER(endp), endp->callid, (int) length, callid);
 		return -1;
 	}
 
@@ -327,59 +442,124 @@ static int verify_call_id(const struct mgcp_endpoint *endp,
 }
 
 static int verify_ci(const struct mgcp_endpoint *endp,
-		     const char *_ci)
+		     const char *_ci, unsigned int length)
 {
-	uint32_t ci = strtoul(_ci, NULL, 10);
+	unsigned int ci;
 
-	if (ci != endp->ci) {
-		LOGP(DMGCP, LOGL_ERROR, "ConnectionIdentifiers do not match on 0x%x. %u != %s\n",
-			ENDPOINT_NUMBER(endp), endp->ci, _ci);
+	if (ptr_to_uint(_ci, length, &ci) != 0 || ci != endp->ci) {
+		LOGP(DMGCP, LOGL_ERROR, "ConnectionIdentifiers do not match on 0x%x. %u != %.*s\n",
+			ENDPOINT_NUMBER(endp), endp->ci, (int) length, _ci);
 		return -1;
 	}
 
 	return 0;
 }
 
-static struct msgb *handle_audit_endpoint(struct mgcp_config *cfg, struct msgb *msg)
+static struct msgb *handle_audit_endpoint(struct mgcp_config *cfg, struct mgcp_parse_data *p)
 {
-	struct mgcp_msg_ptr data_ptrs[6];
-	int found, response;
-	const char *trans_id;
-	struct mgcp_endpoint *endp;
+	int response;
 
-	found = mgcp_analyze_header(cfg, msg, data_ptrs, ARRAY_SIZE(data_ptrs), &trans_id, &endp);
-	if (found != 0)
+	if (!find_endpoint(cfg, p))
 	    response = 500;
 	else
 	    response = 200;
 
-	return create_response(response, "AUEP", trans_id);
+	return create_response(response, "AUEP", p->trans_id);
 }
 
-static int parse_conn_mode(const char *msg, int *conn_mode)
+static int parse_conn_mode(const char *msg, unsigned int length, int *conn_mode)
 {
 	int ret = 0;
-	if (strcmp(msg, "recvonly") == 0)
+	if (length == 8 && memcmp(msg, "recvonly", 8) == 0)
 		*conn_mode = MGCP_CONN_RECV_ONLY;
-	else if (strcmp(msg, "sendrecv") == 0)
+	else if (length == 8 && memcmp(msg, "sendrecv", 8) == 0)
 		*conn_mode = MGCP_CONN_RECV_SEND;
-	else if (strcmp(msg, "sendonly") == 0)
+	else if (length == 8 && memcmp(msg, "sendonly", 8) == 0)
 		*conn_mode = MGCP_CONN_SEND_ONLY;
-	else if (strcmp(msg, "loopback") == 0)
+	else if (length == 8 && memcmp(msg, "loopback", 8) == 0)
 		*conn_mode = MGCP_CONN_LOOPBACK;
 	else {
-		LOGP(DMGCP, LOGL_ERROR, "Unknown connection mode: '%s'\n", msg);
+		LOGP(DMGCP, LOGL_ERROR, "Unknown connection mode: '%.*s'\n",
+		     (int) length, msg);
 		ret = -1;
 	}
 
 	return ret;
 }
 
+static int range_slots(struct mgcp_port_range *range)
+{
+	if (range->range_end <= range->range_start)
+		return 0;
+	return (range->range_end - range->range_start + 1) / 2;
+}
+
+static int range_init(struct mgcp_config *cfg, struct mgcp_port_range *range)
+{
+	int slots = range_slots(range);
+
+	if (slots == 0)
+		return -1;
+
+	range->used = talloc_zero_array(cfg, uint32_t, (slots + 31) / 32);
+	if (!range->used)
+		return -1;
+
+	range->nr_used = 0;
+	if (range->last_port < range->range_start || range->last_port >= range->range_end)
+		range->last_port = range->range_start;
+	return 0;
+}
+
+/* find the next unused slot starting at start, -1 if all are in use */
+static int range_next_free(struct mgcp_port_range *range, int start)
+{
+	int slots = range_slots(range);
+	int words = (slots + 31) / 32;
+	int i, word;
+
+	word = start / 32;
+	for (i = 0; i <= words; ++i, word = (word + 1) % words) {
+		uint32_t free = ~range->used[word];
+		int bit;
+
+		/* ignore the bits before start in the first word */
+		if (i == 0)
+			free &= ~0U << (start % 32);
+
+		if (!free)
+			continue;
+
+		bit = word * 32 + __builtin_ctz(free);
+		if (bit < slots)
+			return bit;
+	}
+
+	return -1;
+}
+
+static void range_release(struct mgcp_port_range *range, int port)
+{
+	int slot;
+
+	if (!range || !range->used || port < range->range_start)
+		return;
+
+	slot = (port - range->range_start) / 2;
+	if (slot >= range_slots(range))
+		return;
+	if (!(range->used[slot / 32] & (1U << (slot % 32))))
+		return;
+
+	range->used[slot / 32] &= ~(1U << (slot % 32));
+	range->nr_used -= 1;
+}
+
 static int allocate_port(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
 			 struct mgcp_port_range *range,
 			 int (*alloc)(struct mgcp_endpoint *endp, int port))
 {
-	int i;
+	int i, slot, slots;
 
 	if (range->mode == PORT_ALLOC_STATIC) {
 		end->local_port = rtp_calculate_port(ENDPOINT_NUMBER(endp), range->base_port);
@@ -387,25 +567,39 @@ static int allocate_port(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
 		return 0;
 	}
 
-	/* attempt to find a port */
-	for (i = 0; i < 200; ++i) {
-		int rc;
+	if (!range->used && range_init(endp->cfg, range) != 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Invalid port range %d-%d.\n",
+		     range->range_start, range->range_end);
+		return -1;
+	}
 
-		if (range->last_port >= range->range_end)
-			range->last_port = range->range_start;
+	/*
+	 * Pick the next free port after the last one. Ports failing to bind
+	 * are used by someone else and remain free in the bitmap.
+	 */
+	slots = range_slots(range);
+	slot = (range->last_port - range->range_start) / 2;
+	for (i = 0; i < 200 && i < slots; ++i) {
+		int port;
 
-		rc = alloc(endp, range->last_port);
+		slot = range_next_free(range, slot % slots);
+		if (slot < 0)
+			break;
 
-		range->last_port += 2;
-		if (rc == 0) {
+		port = range->range_start + slot * 2;
+		range->last_port = port + 2;
+		if (alloc(endp, port) == 0) {
+			range->used[slot / 32] |= 1U << (slot % 32);
+			range->nr_used += 1;
 			end->local_alloc = PORT_ALLOC_DYNAMIC;
 			return 0;
 		}
 
+		slot += 1;
 	}
 
-	LOGP(DMGCP, LOGL_ERROR, "Allocating a RTP/RTCP port failed 200 times 0x%x.\n",
-	     ENDPOINT_NUMBER(endp));
+	LOGP(DMGCP, LOGL_ERROR, "Allocating a RTP/RTCP port failed 0x%x, %d of %d in use.\n",
+	     ENDPOINT_NUMBER(endp), range->nr_used, slots);
 	return -1;
 }
 
@@ -417,33 +611,38 @@ static int allocate_ports(struct mgcp_endpoint *endp)
 
 	if (allocate_port(endp, &endp->bts_end, &endp->cfg->bts_ports,
 			  mgcp_bind_bts_rtp_port) != 0) {
-		mgcp_rtp_end_reset(&endp->net_end);
+		mgcp_rtp_end_reset(&endp->net_end, &endp->cfg->net_ports);
 		return -1;
 	}
 
 	if (endp->cfg->transcoder_ip &&
 	    allocate_port(endp, &endp->transcoder_end, &endp->cfg->transcoder_ports,
 			  mgcp_bind_transcoder_rtp_port) != 0) {
-		mgcp_rtp_end_reset(&endp->net_end);
-		mgcp_rtp_end_reset(&endp->bts_end);
+		mgcp_rtp_end_reset(&endp->net_end, &endp->cfg->net_ports);
+		mgcp_rtp_end_reset(&endp->bts_end, &endp->cfg->bts_ports);
 		return -1;
 	}
 
 	return 0;
 }
 
-static struct msgb *handle_create_con(struct mgcp_config *cfg, struct msgb *msg)
+static struct msgb *handle_create_con(struct mgcp_config *cfg, struct mgcp_parse_data *p)
 {
-	struct mgcp_msg_ptr data_ptrs[6];
-	int found, i, line_start;
-	const char *trans_id;
+	const char *trans_id = p->trans_id;
 	struct mgcp_endpoint *endp;
 	int error_code = 400;
+	const char *val;
+	unsigned int len;
 
-	found = mgcp_analyze_header(cfg, msg, data_ptrs, ARRAY_SIZE(data_ptrs), &trans_id, &endp);
-	if (found != 0)
+	endp = find_endpoint(cfg, p);
+	if (!endp)
 		return create_response(510, "CRCX", trans_id);
 
+	if (p->bad_line >= 0) {
+		log_malformed(p, endp);
+		return create_response(error_code, "CRCX", trans_id);
+	}
+
 	if (endp->allocated) {
 		if (cfg->force_realloc) {
 			LOGP(DMGCP, LOGL_NOTICE, "Endpoint 0x%x already allocated. Forcing realloc.\n",
@@ -459,32 +658,22 @@ static struct msgb *handle_create_con(struct mgcp_config *cfg, struct msgb *msg)
 	}
 
 	/* parse CallID C: and LocalParameters L: */
-	MSG_TOKENIZE_START
-	switch (msg->l3h[line_start]) {
-	case 'L':
-		endp->local_options = talloc_strdup(cfg->endpoints,
-			(const char *)&msg->l3h[line_start + 3]);
-		break;
-	case 'C':
-		endp->callid = talloc_strdup(cfg->endpoints,
-			(const char *)&msg->l3h[line_start + 3]);
-		break;
-	case 'M':
-		if (parse_conn_mode((const char *)&msg->l3h[line_start + 3],
-			    &endp->conn_mode) != 0) {
+	log_unhandled(p, endp, "CLM");
+	val = mgcp_param(p, 'L', &len);
+	if (val)
+		endp->local_options = talloc_strndup(cfg->endpoints, val, len);
+	val = mgcp_param(p, 'C', &len);
+	if (val)
+		endp->callid = talloc_strndup(cfg->endpoints, val, len);
+	val = mgcp_param(p, 'M', &len);
+	if (val) {
+		if (parse_conn_mode(val, len, &endp->conn_mode) != 0) {
 		    error_code = 517;
 		    goto error2;
 		}
 
 		endp->orig_mode = endp->conn_mode;
-		break;
-	default:
-		LOGP(DMGCP, LOGL_NOTICE, "Unhandled option: '%c'/%d on 0x%x\n",
-			msg->l3h[line_start], msg->l3h[line_start],
-			ENDPOINT_NUMBER(endp));
-		break;
 	}
-	MSG_TOKENIZE_END
 
 	/* initialize */
 	endp->net_end.rtp_port = endp->net_end.rtcp_port = endp->bts_end.rtp_port = endp->bts_end.rtcp_port = 0;
@@ -516,6 +705,7 @@ static struct msgb *handle_create_con(struct mgcp_config *cfg, struct msgb *msg)
 		case MGCP_POLICY_DEFER:
 			/* stop processing */
 			create_transcoder(endp);
+			mgcp_shard_sync(endp);
 			return NULL;
 			break;
 		case MGCP_POLICY_CONT:
@@ -531,12 +721,8 @@ static struct msgb *handle_create_con(struct mgcp_config *cfg, struct msgb *msg)
 		cfg->change_cb(cfg, ENDPOINT_NUMBER(endp), MGCP_ENDP_CRCX);
 
 	create_transcoder(endp);
+	mgcp_shard_sync(endp);
 	return create_response_with_sdp(endp, "CRCX", trans_id);
-error:
-	LOGP(DMGCP, LOGL_ERROR, "Malformed line: %s on 0x%x with: line_start: %d %d\n",
-		    hexdump(msg->l3h, msgb_l3len(msg)),
-		    ENDPOINT_NUMBER(endp), line_start, i);
-	return create_response(error_code, "CRCX", trans_id);
 
 error2:
 	mgcp_free_endp(endp);
@@ -544,17 +730,57 @@ error2:
 	return create_response(error_code, "CRCX", trans_id);
 }
 
-static struct msgb *handle_modify_con(struct mgcp_config *cfg, struct msgb *msg)
+/* the remote RTP end from the SDP */
+static void parse_sdp(struct mgcp_endpoint *endp, const struct mgcp_parse_data *p)
+{
+	const char *line;
+	unsigned int i, port, payload;
+
+	/* m=audio <port> RTP/AVP <payload> */
+	if (p->sdp_audio.start) {
+		line = &p->data[p->sdp_audio.start];
+		for (i = 8; i < p->sdp_audio.length && line[i] != ' '; ++i)
+			;
+		if (ptr_to_uint(&line[8], i - 8, &port) == 0 &&
+		    p->sdp_audio.length > i + 9 &&
+		    memcmp(&line[i], " RTP/AVP ", 9) == 0) {
+			unsigned int start = i + 9;
+
+			for (i = start; i < p->sdp_audio.length && line[i] != ' '; ++i)
+				;
+			if (ptr_to_uint(&line[start], i - start, &payload) == 0) {
+				endp->net_end.rtp_port = htons(port);
+				endp->net_end.rtcp_port = htons(port + 1);
+				endp->net_end.payload_type = payload;
+			}
+		}
+	}
+
+	/* c=IN IP4 <address> */
+	if (p->sdp_conn.start && p->sdp_conn.length > 9 &&
+	    memcmp(&p->data[p->sdp_conn.start], "c=IN IP4 ", 9) == 0) {
+		char ipv4[16];
+
+		line = &p->data[p->sdp_conn.start + 9];
+		for (i = 0; i < p->sdp_conn.length - 9 && i < sizeof(ipv4) - 1 && line[i] != ' '; ++i)
+			ipv4[i] = line[i];
+		ipv4[i] = '\0';
+		inet_aton(ipv4, &endp->net_end.addr);
+	}
+}
+
+static struct msgb *handle_modify_con(struct mgcp_config *cfg, struct mgcp_parse_data *p)
 {
-	struct mgcp_msg_ptr data_ptrs[6];
-	int found, i, line_start;
-	const char *trans_id;
+	const char *trans_id = p->trans_id;
 	struct mgcp_endpoint *endp;
 	int error_code = 500;
 	int silent = 0;
+	int policy = MGCP_POLICY_CONT;
+	const char *val;
+	unsigned int len;
 
-	found = mgcp_analyze_header(cfg, msg, data_ptrs, ARRAY_SIZE(data_ptrs), &trans_id, &endp);
-	if (found != 0)
+	endp = find_endpoint(cfg, p);
+	if (!endp)
 		return create_response(510, "MDCX", trans_id);
 
 	if (endp->ci == CI_UNUSED) {
@@ -562,89 +788,54 @@ static struct msgb *handle_modify_con(struct mgcp_config *cfg, struct msgb *msg)
 		return create_response(400, "MDCX", trans_id);
 	}
 
-	MSG_TOKENIZE_START
-	switch (msg->l3h[line_start]) {
-	case 'C': {
-		if (verify_call_id(endp, (const char *)&msg->l3h[line_start + 3]) != 0)
-			goto error3;
-		break;
-	}
-	case 'I': {
-		if (verify_ci(endp, (const char *)&msg->l3h[line_start + 3]) != 0)
-			goto error3;
-		break;
+	if (p->bad_line >= 0) {
+		log_malformed(p, endp);
+		return create_response(error_code, "MDCX", trans_id);
 	}
-	case 'L':
-		/* skip */
-		break;
-	case 'M':
-		if (parse_conn_mode((const char *)&msg->l3h[line_start + 3],
-			    &endp->conn_mode) != 0) {
+
+	log_unhandled(p, endp, "CILMZ");
+	val = mgcp_param(p, 'C', &len);
+	if (val && verify_call_id(endp, val, len) != 0)
+		goto error3;
+	val = mgcp_param(p, 'I', &len);
+	if (val && verify_ci(endp, val, len) != 0)
+		goto error3;
+	val = mgcp_param(p, 'M', &len);
+	if (val) {
+		if (parse_conn_mode(val, len, &endp->conn_mode) != 0) {
 		    error_code = 517;
 		    goto error3;
 		}
 		endp->orig_mode = endp->conn_mode;
-		break;
-	case 'Z':
-		silent = strcmp("noanswer", (const char *)&msg->l3h[line_start + 3]) == 0;
-		break;
-	case '\0':
-		/* SDP file begins */
-		break;
-	case 'a':
-	case 'o':
-	case 's':
-	case 't':
-	case 'v':
-		/* skip these SDP attributes */
-		break;
-	case 'm': {
-		int port;
-		int payload;
-		const char *param = (const char *)&msg->l3h[line_start];
-
-		if (sscanf(param, "m=audio %d RTP/AVP %d", &port, &payload) == 2) {
-			endp->net_end.rtp_port = htons(port);
-			endp->net_end.rtcp_port = htons(port + 1);
-			endp->net_end.payload_type = payload;
-		}
-		break;
 	}
-	case 'c': {
-		char ipv4[16];
-		const char *param = (const char *)&msg->l3h[line_start];
+	val = mgcp_param(p, 'Z', &len);
+	if (val)
+		silent = len == 8 && memcmp(val, "noanswer", 8) == 0;
 
-		if (sscanf(param, "c=IN IP4 %15s", ipv4) == 1) {
-			inet_aton(ipv4, &endp->net_end.addr);
-		}
-		break;
-	}
-	default:
-		LOGP(DMGCP, LOGL_NOTICE, "Unhandled option: '%c'/%d on 0x%x\n",
-			msg->l3h[line_start], msg->l3h[line_start],
-			ENDPOINT_NUMBER(endp));
-		break;
-	}
-	MSG_TOKENIZE_END
+	parse_sdp(endp, p);
 
 	/* policy CB */
-	if (cfg->policy_cb) {
-		switch (cfg->policy_cb(cfg, ENDPOINT_NUMBER(endp), MGCP_ENDP_MDCX, trans_id)) {
-		case MGCP_POLICY_REJECT:
-			LOGP(DMGCP, LOGL_NOTICE, "MDCX rejected by policy on 0x%x\n",
-			     ENDPOINT_NUMBER(endp));
-			if (silent)
-				goto out_silent;
-			return create_response(400, "MDCX", trans_id);
-			break;
-		case MGCP_POLICY_DEFER:
-			/* stop processing */
-			return NULL;
-			break;
-		case MGCP_POLICY_CONT:
-			/* just continue */
-			break;
-		}
+	if (cfg->policy_cb)
+		policy = cfg->policy_cb(cfg, ENDPOINT_NUMBER(endp), MGCP_ENDP_MDCX, trans_id);
+
+	/* the media thread gets the endpoint as the policy left it */
+	mgcp_shard_sync(endp);
+
+	switch (policy) {
+	case MGCP_POLICY_REJECT:
+		LOGP(DMGCP, LOGL_NOTICE, "MDCX rejected by policy on 0x%x\n",
+		     ENDPOINT_NUMBER(endp));
+		if (silent)
+			goto out_silent;
+		return create_response(400, "MDCX", trans_id);
+		break;
+	case MGCP_POLICY_DEFER:
+		/* stop processing */
+		return NULL;
+		break;
+	case MGCP_POLICY_CONT:
+		/* just continue */
+		break;
 	}
 
 	/* modify */
@@ -657,12 +848,6 @@ static struct msgb *handle_modify_con(struct mgcp_config *cfg, struct msgb *msg)
 
 	return create_response_with_sdp(endp, "MDCX", trans_id);
 
-error:
-	LOGP(DMGCP, LOGL_ERROR, "Malformed line: %s on 0x%x with: line_start: %d %d %d\n",
-		    hexdump(msg->l3h, msgb_l3len(msg)),
-		    ENDPOINT_NUMBER(endp), line_start, i, msg->l3h[line_start]);
-	return create_response(error_code, "MDCX", trans_id);
-
 error3:
 	return create_response(error_code, "MDCX", trans_id);
 
@@ -671,17 +856,17 @@ out_silent:
 	return NULL;
 }
 
-static struct msgb *handle_delete_con(struct mgcp_config *cfg, struct msgb *msg)
+static struct msgb *handle_delete_con(struct mgcp_config *cfg, struct mgcp_parse_data *p)
 {
-	struct mgcp_msg_ptr data_ptrs[6];
-	int found, i, line_start;
-	const char *trans_id;
+	const char *trans_id = p->trans_id;
 	struct mgcp_endpoint *endp;
 	int error_code = 400;
 	int silent = 0;
+	const char *val;
+	unsigned int len;
 
-	found = mgcp_analyze_header(cfg, msg, data_ptrs, ARRAY_SIZE(data_ptrs), &trans_id, &endp);
-	if (found != 0)
+	endp = find_endpoint(cfg, p);
+	if (!endp)
 		return create_response(error_code, "DLCX", trans_id);
 
 	if (!endp->allocated) {
@@ -689,28 +874,21 @@ static struct msgb *handle_delete_con(struct mgcp_config *cfg, struct msgb *msg)
 		return create_response(400, "DLCX", trans_id);
 	}
 
-	MSG_TOKENIZE_START
-	switch (msg->l3h[line_start]) {
-	case 'C': {
-		if (verify_call_id(endp, (const char *)&msg->l3h[line_start + 3]) != 0)
-			goto error3;
-		break;
-	}
-	case 'I': {
-		if (verify_ci(endp, (const char *)&msg->l3h[line_start + 3]) != 0)
-			goto error3;
-		break;
-	case 'Z':
-		silent = strcmp("noanswer", (const char *)&msg->l3h[line_start + 3]) == 0;
-		break;
-	}
-	default:
-		LOGP(DMGCP, LOGL_NOTICE, "Unhandled option: '%c'/%d on 0x%x\n",
-			msg->l3h[line_start], msg->l3h[line_start],
-			ENDPOINT_NUMBER(endp));
-		break;
+	if (p->bad_line >= 0) {
+		log_malformed(p, endp);
+		return create_response(error_code, "DLCX", trans_id);
 	}
-	MSG_TOKENIZE_END
+
+	log_unhandled(p, endp, "CIZ");
+	val = mgcp_param(p, 'C', &len);
+	if (val && verify_call_id(endp, val, len) != 0)
+		goto error3;
+	val = mgcp_param(p, 'I', &len);
+	if (val && verify_ci(endp, val, len) != 0)
+		goto error3;
+	val = mgcp_param(p, 'Z', &len);
+	if (val)
+		silent = len == 8 && memcmp(val, "noanswer", 8) == 0;
 
 	/* policy CB */
 	if (cfg->policy_cb) {
@@ -746,12 +924,6 @@ static struct msgb *handle_delete_con(struct mgcp_config *cfg, struct msgb *msg)
 		goto out_silent;
 	return create_response(250, "DLCX", trans_id);
 
-error:
-	LOGP(DMGCP, LOGL_ERROR, "Malformed line: %s on 0x%x with: line_start: %d %d\n",
-		    hexdump(msg->l3h, msgb_l3len(msg)),
-		    ENDPOINT_NUMBER(endp), line_start, i);
-	return create_response(error_code, "DLCX", trans_id);
-
 error3:
 	return create_response(error_code, "DLCX", trans_id);
 
@@ -759,13 +931,119 @@ out_silent:
 	return NULL;
 }
 
-static struct msgb *handle_rsip(struct mgcp_config *cfg, struct msgb *msg)
+static struct msgb *handle_rsip(struct mgcp_config *cfg, struct mgcp_parse_data *p)
 {
 	if (cfg->reset_cb)
 		cfg->reset_cb(cfg);
 	return NULL;
 }
 
+/*
+ * RFC 3435 wants a retransmitted command to be answered with the
+ * response of the first attempt. The last MGCP_TRANS_CACHE responses
+ * are kept in a direct mapped table indexed by the transaction id
+ * and for MGCP_TRANS_HIST seconds.
+ */
+static time_t monotonic_seconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static struct mgcp_trans_entry *trans_cache_entry(struct mgcp_config *cfg,
+						  uint32_t trans_nr)
+{
+	if (!cfg->trans_cache) {
+		cfg->trans_cache = talloc_zero(cfg, struct mgcp_trans_cache);
+		if (!cfg->trans_cache)
+			return NULL;
+	}
+
+	return &cfg->trans_cache->entries[trans_nr % MGCP_TRANS_CACHE];
+}
+
+static struct msgb *trans_cache_lookup(struct mgcp_config *cfg,
+				       const struct mgcp_parse_data *p, int *hit)
+{
+	struct mgcp_trans_entry *entry;
+	struct msgb *resp;
+
+	*hit = 0;
+	if (!p->valid || p->trans_nr == 0)
+		return NULL;
+
+	entry = trans_cache_entry(cfg, p->trans_nr);
+	if (!entry || entry->trans_nr != p->trans_nr)
+		return NULL;
+	if (monotonic_seconds() - entry->stamp > MGCP_TRANS_HIST)
+		return NULL;
+	if (memcmp(entry->verb, &p->data[p->verb.start], 4) != 0) {
+		LOGP(DMGCP, LOGL_NOTICE, "Transaction %u reused for '%.4s'.\n",
+		     p->trans_nr, &p->data[p->verb.start]);
+		return NULL;
+	}
+
+	*hit = 1;
+	cfg->trans_cache->hits += 1;
+	LOGP(DMGCP, LOGL_NOTICE, "Retransmission of transaction %u.\n", p->trans_nr);
+
+	/* no response was sent the first time */
+	if (entry->length < 0)
+		return NULL;
+
+	resp = mgcp_msgb_alloc();
+	if (!resp)
+		return NULL;
+	resp->l2h = msgb_put(resp, entry->length);
+	memcpy(resp->l2h, entry->data, entry->length);
+	return resp;
+}
+
+static void trans_cache_store(struct mgcp_config *cfg,
+			      const struct mgcp_parse_data *p, struct msgb *resp)
+{
+	struct mgcp_trans_entry *entry;
+
+	if (!p->valid || p->trans_nr == 0)
+		return;
+
+	entry = trans_cache_entry(cfg, p->trans_nr);
+	if (!entry)
+		return;
+
+	entry->trans_nr = p->trans_nr;
+	entry->stamp = monotonic_seconds();
+	memcpy(entry->verb, &p->data[p->verb.start], 4);
+	entry->length = -1;
+	cfg->trans_cache->stored += 1;
+
+	if (resp && msgb_l2len(resp) <= sizeof(entry->data)) {
+		entry->length = msgb_l2len(resp);
+		memcpy(entry->data, resp->l2h, entry->length);
+	}
+}
+
+void mgcp_trans_cache_response(struct mgcp_config *cfg, const char *trans_id,
+			       struct msgb *resp)
+{
+	struct mgcp_trans_entry *entry;
+	unsigned int trans_nr;
+
+	if (ptr_to_uint(trans_id, strlen(trans_id), &trans_nr) != 0 || trans_nr == 0)
+		return;
+
+	entry = trans_cache_entry(cfg, trans_nr);
+	if (!entry || entry->trans_nr != trans_nr)
+		return;
+
+	if (msgb_l2len(resp) <= sizeof(entry->data)) {
+		entry->length = msgb_l2len(resp);
+		memcpy(entry->data, resp->l2h, entry->length);
+	}
+}
+
 struct mgcp_config *mgcp_config_alloc(void)
 {
 	struct mgcp_config *cfg;
@@ -788,10 +1066,13 @@ struct mgcp_config *mgcp_config_alloc(void)
 	return cfg;
 }
 
-static void mgcp_rtp_end_reset(struct mgcp_rtp_end *end)
+static void mgcp_rtp_end_reset(struct mgcp_rtp_end *end,
+			       struct mgcp_port_range *range)
 {
-	if (end->local_alloc == PORT_ALLOC_DYNAMIC)
+	if (end->local_alloc == PORT_ALLOC_DYNAMIC) {
 		mgcp_free_rtp_port(end);
+		range_release(range, end->local_port);
+	}
 
 	end->packets = 0;
 	memset(&end->addr, 0, sizeof(end->addr));
@@ -802,7 +1083,7 @@ static void mgcp_rtp_end_reset(struct mgcp_rtp_end *end)
 
 static void mgcp_rtp_end_init(struct mgcp_rtp_end *end)
 {
-	mgcp_rtp_end_reset(end);
+	mgcp_rtp_end_reset(end, NULL);
 	end->rtp.fd = -1;
 	end->rtcp.fd = -1;
 }
@@ -845,9 +1126,9 @@ void mgcp_free_endp(struct mgcp_endpoint *endp)
 		endp->local_options = NULL;
 	}
 
-	mgcp_rtp_end_reset(&endp->bts_end);
-	mgcp_rtp_end_reset(&endp->net_end);
-	mgcp_rtp_end_reset(&endp->transcoder_end);
+	mgcp_rtp_end_reset(&endp->bts_end, &endp->cfg->bts_ports);
+	mgcp_rtp_end_reset(&endp->net_end, &endp->cfg->net_ports);
+	mgcp_rtp_end_reset(&endp->transcoder_end, &endp->cfg->transcoder_ports);
 
 	memset(&endp->net_state, 0, sizeof(endp->net_state));
 	memset(&endp->bts_state, 0, sizeof(endp->bts_state));
@@ -856,6 +1137,7 @@ void mgcp_free_endp(struct mgcp_endpoint *endp)
 	endp->allow_patch = 0;
 
 	memset(&endp->taps, 0, sizeof(endp->taps));
+	mgcp_shard_sync(endp);
 }
 
 /* For transcoding we need to manage an in and an output that are connected */
@@ -0,0 +1,550 @@
+/* A Media Gateway Control Protocol Media Gateway: RFC 3435 */
+/* Media plane worker threads */
+
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * The select loop owns the MGCP signalling and the endpoint array of
+ * the mgcp_config. A shard never looks at that array. Every change to
+ * an endpoint is copied into a command and pushed to the ring of the
+ * owning shard, which applies it to its private copy of the endpoint
+ * and (re)registers the sockets with its epoll set. Closing a socket
+ * is handed to the shard as well so a file descriptor number can not
+ * be reused while the worker might still be looking at it. The VTY
+ * hands a changed config over the same way.
+ *
+ * The worker never calls the logging code, it is not thread safe. It
+ * counts the events in the shard and a timer of the select loop logs
+ * the difference.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <osmocore/talloc.h>
+#include <osmocore/select.h>
+#include <osmocore/timer.h>
+#include <osmocore/utils.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/mgcp.h>
+#include <openbsc/mgcp_internal.h>
+#include <openbsc/select_epoll.h>
+
+#define SHARD_REPORT_INTERVAL	10
+
+static const char *shard_event_names[_MGCP_SHARD_EV_MAX] = {
+	[MGCP_SHARD_EV_RECV_FAIL]	= "failed receives",
+	[MGCP_SHARD_EV_WRONG_SOURCE]	= "packets from a wrong source",
+	[MGCP_SHARD_EV_DUMMY]		= "dummy packets filtered",
+	[MGCP_SHARD_EV_SSRC_CHANGE]	= "SSRC changes",
+	[MGCP_SHARD_EV_BTS_FOUND]	= "BTS discovered",
+	[MGCP_SHARD_EV_NO_TRANSCODER]	= "packets without a transcoder port",
+	[MGCP_SHARD_EV_SEND_FAIL]	= "failed sends to the transcoder",
+	[MGCP_SHARD_EV_WATCH_FAIL]	= "sockets that could not be watched",
+	[MGCP_SHARD_EV_WAKEUP_FAIL]	= "failed wakeups",
+};
+
+static struct timer_list report_timer;
+
+const char *mgcp_shard_event_name(int event)
+{
+	return shard_event_names[event];
+}
+
+static struct mgcp_shard *shard_for(struct mgcp_endpoint *endp)
+{
+	struct mgcp_config *cfg = endp->cfg;
+
+	if (!cfg->shards)
+		return NULL;
+	return &cfg->shards[ENDPOINT_NUMBER(endp) % cfg->num_shards];
+}
+
+static void shard_wakeup(struct mgcp_shard *shard)
+{
+	uint64_t one = 1;
+
+	if (write(shard->event_fd, &one, sizeof(one)) != sizeof(one))
+		LOGP(DMGCP, LOGL_ERROR, "Failed to wake up media thread %d.\n",
+		     shard->nr);
+}
+
+/*
+ * Called from the select loop only, there is exactly one producer.
+ * When the ring is full the select loop sleeps until the worker has
+ * freed a slot. Returns NULL when the worker is gone.
+ */
+static struct mgcp_shard_cmd *shard_cmd_get(struct mgcp_shard *shard)
+{
+	uint64_t count;
+
+	if (shard->head - shard->tail >= MGCP_SHARD_RING)
+		shard->ring_full += 1;
+
+	while (shard->head - shard->tail >= MGCP_SHARD_RING) {
+		if (shard->failed)
+			return NULL;
+
+		shard->producer_waiting = 1;
+		/* the worker must see the flag before we check the tail */
+		__sync_synchronize();
+		if (shard->head - shard->tail < MGCP_SHARD_RING)
+			break;
+		shard_wakeup(shard);
+		if (read(shard->space_fd, &count, sizeof(count)) < 0 &&
+		    errno != EINTR) {
+			LOGP(DMGCP, LOGL_ERROR, "Failed to wait for media thread %d.\n",
+			     shard->nr);
+			shard->producer_waiting = 0;
+			return NULL;
+		}
+	}
+	shard->producer_waiting = 0;
+
+	return &shard->ring[shard->head % MGCP_SHARD_RING];
+}
+
+static void shard_cmd_put(struct mgcp_shard *shard)
+{
+	/* the command must be visible before the new head */
+	__sync_synchronize();
+	shard->head += 1;
+	shard_wakeup(shard);
+}
+
+void mgcp_shard_sync(struct mgcp_endpoint *endp)
+{
+	struct mgcp_shard *shard = shard_for(endp);
+	struct mgcp_shard_cmd *cmd;
+
+	if (!shard)
+		return;
+
+	cmd = shard_cmd_get(shard);
+	if (!cmd)
+		return;
+	cmd->type = MGCP_SHARD_SYNC;
+	cmd->endpoint = ENDPOINT_NUMBER(endp);
+	cmd->fd = -1;
+	cmd->u.endp = *endp;
+	shard_cmd_put(shard);
+}
+
+void mgcp_shard_close_fd(struct mgcp_endpoint *endp, int fd)
+{
+	struct mgcp_shard *shard = shard_for(endp);
+	struct mgcp_shard_cmd *cmd;
+
+	if (!shard)
+		return;
+
+	cmd = shard_cmd_get(shard);
+	if (!cmd) {
+		close(fd);
+		return;
+	}
+	cmd->type = MGCP_SHARD_CLOSE;
+	cmd->endpoint = ENDPOINT_NUMBER(endp);
+	cmd->fd = fd;
+	shard_cmd_put(shard);
+}
+
+/*
+ * Hand the config over to every media thread. The VTY calls it after
+ * changing anything the media plane reads. The strings in the copy
+ * still belong to the select loop, the worker only tests them for NULL.
+ */
+void mgcp_shards_reconfigure(struct mgcp_config *cfg)
+{
+	struct mgcp_shard_cmd *cmd;
+	int i;
+
+	for (i = 0; cfg->shards && i < cfg->num_shards; ++i) {
+		cmd = shard_cmd_get(&cfg->shards[i]);
+		if (!cmd)
+			continue;
+		cmd->type = MGCP_SHARD_CONFIG;
+		cmd->endpoint = 0;
+		cmd->fd = -1;
+		cmd->u.cfg = *cfg;
+		shard_cmd_put(&cfg->shards[i]);
+	}
+}
+
+/* for statistics only, the values might be slightly out of date */
+struct mgcp_endpoint *mgcp_shard_media_endp(struct mgcp_endpoint *endp)
+{
+	struct mgcp_shard *shard = shard_for(endp);
+
+	if (!shard)
+		return endp;
+	return &shard->endpoints[ENDPOINT_NUMBER(endp)];
+}
+
+/*
+ * Below is running inside the worker thread.
+ */
+static void shard_watch(struct mgcp_shard *shard, struct bsc_fd *bfd)
+{
+	struct epoll_event ev;
+
+	if (bfd->fd == -1)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = bfd;
+
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, bfd->fd, &ev) == 0)
+		return;
+	if (errno == EEXIST &&
+	    epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, bfd->fd, &ev) == 0)
+		return;
+
+	shard->events[MGCP_SHARD_EV_WATCH_FAIL] += 1;
+}
+
+static void shard_take_end(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end)
+{
+	end->rtp.data = endp;
+	end->rtcp.data = endp;
+}
+
+static void shard_apply_sync(struct mgcp_shard *shard, struct mgcp_shard_cmd *cmd)
+{
+	struct mgcp_endpoint *endp = &shard->endpoints[cmd->endpoint];
+	struct mgcp_endpoint *new = &cmd->u.endp;
+
+	/*
+	 * The same connection is updated. Keep what the media plane
+	 * learned on its own: the discovered BTS and the counters.
+	 */
+	if (endp->ci == new->ci && new->ci != CI_UNUSED) {
+		if (new->bts_end.rtp_port == 0) {
+			new->bts_end.addr = endp->bts_end.addr;
+			new->bts_end.rtp_port = endp->bts_end.rtp_port;
+		}
+		if (new->bts_end.rtcp_port == 0)
+			new->bts_end.rtcp_port = endp->bts_end.rtcp_port;
+
+		new->bts_end.packets = endp->bts_end.packets;
+		new->net_end.packets = endp->net_end.packets;
+		new->transcoder_end.packets = endp->transcoder_end.packets;
+		new->net_state = endp->net_state;
+		new->bts_state = endp->bts_state;
+	}
+
+	*endp = *new;
+	endp->cfg = &shard->cfg;
+	endp->callid = NULL;
+	endp->local_options = NULL;
+
+	shard_take_end(endp, &endp->bts_end);
+	shard_take_end(endp, &endp->net_end);
+	shard_take_end(endp, &endp->transcoder_end);
+
+	shard_watch(shard, &endp->bts_end.rtp);
+	shard_watch(shard, &endp->bts_end.rtcp);
+	shard_watch(shard, &endp->net_end.rtp);
+	shard_watch(shard, &endp->net_end.rtcp);
+	shard_watch(shard, &endp->transcoder_end.rtp);
+	shard_watch(shard, &endp->transcoder_end.rtcp);
+}
+
+static void shard_forget_fd(struct mgcp_rtp_end *end, int fd)
+{
+	if (end->rtp.fd == fd)
+		end->rtp.fd = -1;
+	if (end->rtcp.fd == fd)
+		end->rtcp.fd = -1;
+}
+
+static void shard_apply_close(struct mgcp_shard *shard, struct mgcp_shard_cmd *cmd)
+{
+	struct mgcp_endpoint *endp = &shard->endpoints[cmd->endpoint];
+
+	shard_forget_fd(&endp->bts_end, cmd->fd);
+	shard_forget_fd(&endp->net_end, cmd->fd);
+	shard_forget_fd(&endp->transcoder_end, cmd->fd);
+
+	epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, cmd->fd, NULL);
+	close(cmd->fd);
+}
+
+static void shard_apply_config(struct mgcp_shard *shard, struct mgcp_shard_cmd *cmd)
+{
+	shard->cfg = cmd->u.cfg;
+	shard->cfg.shards = NULL;
+	shard->cfg.media_shard = shard;
+	shard->cfg.endpoints = shard->endpoints;
+}
+
+static void shard_drain(struct mgcp_shard *shard)
+{
+	uint64_t count, one = 1;
+
+	if (read(shard->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		shard->events[MGCP_SHARD_EV_WAKEUP_FAIL] += 1;
+
+	while (shard->tail != shard->head) {
+		struct mgcp_shard_cmd *cmd;
+
+		/* read the command only after we have seen the new head */
+		__sync_synchronize();
+		cmd = &shard->ring[shard->tail % MGCP_SHARD_RING];
+
+		switch (cmd->type) {
+		case MGCP_SHARD_SYNC:
+			shard_apply_sync(shard, cmd);
+			break;
+		case MGCP_SHARD_CLOSE:
+			shard_apply_close(shard, cmd);
+			break;
+		case MGCP_SHARD_CONFIG:
+			shard_apply_config(shard, cmd);
+			break;
+		}
+
+		shard->commands += 1;
+
+		/* done with the slot before handing it back */
+		__sync_synchronize();
+		shard->tail += 1;
+
+		/* the tail must be visible before we look at the flag */
+		__sync_synchronize();
+		if (shard->producer_waiting &&
+		    write(shard->space_fd, &one, sizeof(one)) != sizeof(one))
+			shard->events[MGCP_SHARD_EV_WAKEUP_FAIL] += 1;
+	}
+}
+
+static void *shard_main(void *data)
+{
+	struct mgcp_shard *shard = data;
+	struct epoll_event events[64];
+	int i, rc, pending;
+
+	while (1) {
+		rc = epoll_wait(shard->epoll_fd, events, ARRAY_SIZE(events), -1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			shard->failed = errno;
+			break;
+		}
+
+		shard->wakeups += 1;
+		pending = 0;
+
+		/*
+		 * Forward everything from this batch first. Applying the
+		 * commands could close sockets referenced further down.
+		 */
+		for (i = 0; i < rc; ++i) {
+			struct bsc_fd *bfd = events[i].data.ptr;
+
+			if (!bfd) {
+				pending = 1;
+				continue;
+			}
+
+			if (bfd->fd != -1)
+				bfd->cb(bfd, BSC_FD_READ);
+		}
+
+		if (pending)
+			shard_drain(shard);
+	}
+
+	return NULL;
+}
+
+static int shard_init(struct mgcp_config *cfg, struct mgcp_shard *shard, int nr)
+{
+	struct epoll_event ev;
+	int i;
+
+	shard->nr = nr;
+	shard->cfg = *cfg;
+	shard->cfg.shards = NULL;
+	shard->cfg.media_shard = shard;
+	shard->endpoints = _talloc_zero_array(cfg->shards,
+				sizeof(struct mgcp_endpoint),
+				cfg->number_endpoints, "shard-endpoints");
+	if (!shard->endpoints)
+		return -1;
+	shard->cfg.endpoints = shard->endpoints;
+
+	for (i = 0; i < cfg->number_endpoints; ++i) {
+		shard->endpoints[i].ci = CI_UNUSED;
+		shard->endpoints[i].cfg = &shard->cfg;
+		shard->endpoints[i].bts_end.rtp.fd = -1;
+		shard->endpoints[i].bts_end.rtcp.fd = -1;
+		shard->endpoints[i].net_end.rtp.fd = -1;
+		shard->endpoints[i].net_end.rtcp.fd = -1;
+		shard->endpoints[i].transcoder_end.rtp.fd = -1;
+		shard->endpoints[i].transcoder_end.rtcp.fd = -1;
+	}
+
+	shard->epoll_fd = epoll_create(cfg->number_endpoints * 6 + 1);
+	if (shard->epoll_fd < 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to create the epoll set: %s\n",
+		     strerror(errno));
+		return -1;
+	}
+
+	shard->event_fd = eventfd(0, EFD_NONBLOCK);
+	if (shard->event_fd < 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to create the eventfd: %s\n",
+		     strerror(errno));
+		close(shard->epoll_fd);
+		return -1;
+	}
+
+	shard->space_fd = eventfd(0, 0);
+	if (shard->space_fd < 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to create the eventfd: %s\n",
+		     strerror(errno));
+		close(shard->event_fd);
+		close(shard->epoll_fd);
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->event_fd, &ev) != 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to watch the eventfd: %s\n",
+		     strerror(errno));
+		close(shard->space_fd);
+		close(shard->event_fd);
+		close(shard->epoll_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* log what the media threads counted since the last time */
+static void shard_report(void *data)
+{
+	struct mgcp_config *cfg = data;
+	int i, ev;
+
+	for (i = 0; i < cfg->num_shards; ++i) {
+		struct mgcp_shard *shard = &cfg->shards[i];
+
+		if (shard->failed && !shard->failure_reported) {
+			LOGP(DMGCP, LOGL_FATAL, "Media thread %d failed: %s\n",
+			     i, strerror(shard->failed));
+			shard->failure_reported = 1;
+		}
+
+		for (ev = 0; ev < _MGCP_SHARD_EV_MAX; ++ev) {
+			unsigned long now = shard->events[ev];
+			int level = LOGL_ERROR;
+
+			if (now == shard->reported[ev])
+				continue;
+			if (ev == MGCP_SHARD_EV_DUMMY || ev == MGCP_SHARD_EV_BTS_FOUND)
+				level = LOGL_NOTICE;
+			LOGP(DMGCP, level, "Media thread %d: %lu %s.\n", i,
+			     now - shard->reported[ev], shard_event_names[ev]);
+			shard->reported[ev] = now;
+		}
+	}
+
+	bsc_schedule_timer(&report_timer, SHARD_REPORT_INTERVAL, 0);
+}
+
+static void unregister_end(struct mgcp_rtp_end *end)
+{
+	if (end->rtp.fd != -1)
+		bsc_epoll_unregister_fd(&end->rtp);
+	if (end->rtcp.fd != -1)
+		bsc_epoll_unregister_fd(&end->rtcp);
+}
+
+/*
+ * Start the media plane threads. This must be called after the
+ * config has been parsed and the endpoints have been allocated.
+ * Ports that were bound early are moved out of the select loop.
+ */
+int mgcp_shards_start(struct mgcp_config *cfg)
+{
+	sigset_t all, old;
+	int i, rc;
+
+	if (cfg->num_shards <= 0 || cfg->shards)
+		return 0;
+
+	cfg->shards = _talloc_zero_array(cfg, sizeof(struct mgcp_shard),
+					 cfg->num_shards, "shards");
+	if (!cfg->shards)
+		return -1;
+
+	for (i = 0; i < cfg->num_shards; ++i) {
+		if (shard_init(cfg, &cfg->shards[i], i) != 0) {
+			LOGP(DMGCP, LOGL_FATAL, "Failed to create media thread %d.\n", i);
+			return -1;
+		}
+	}
+
+	/* signals stay with the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < cfg->num_shards; ++i) {
+		rc = pthread_create(&cfg->shards[i].thread, NULL,
+				    shard_main, &cfg->shards[i]);
+		if (rc != 0) {
+			LOGP(DMGCP, LOGL_FATAL, "Failed to start media thread %d: %s\n",
+			     i, strerror(rc));
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			return -1;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	for (i = 1; i < cfg->number_endpoints; ++i) {
+		struct mgcp_endpoint *endp = &cfg->endpoints[i];
+
+		unregister_end(&endp->bts_end);
+		unregister_end(&endp->net_end);
+		unregister_end(&endp->transcoder_end);
+		mgcp_shard_sync(endp);
+	}
+
+	report_timer.cb = shard_report;
+	report_timer.data = cfg;
+	bsc_schedule_timer(&report_timer, SHARD_REPORT_INTERVAL, 0);
+
+	LOGP(DMGCP, LOGL_NOTICE, "Started %d media threads.\n", cfg->num_shards);
+	return 0;
+}
@@ -76,6 +76,8 @@ static int config_write_mgcp(struct vty *vty)
 		vty_out(vty, "  sdp audio payload name %s%s", g_cfg->audio_name, VTY_NEWLINE);
 	vty_out(vty, "  loop %u%s", !!g_cfg->audio_loop, VTY_NEWLINE);
 	vty_out(vty, "  number endpoints %u%s", g_cfg->number_endpoints - 1, VTY_NEWLINE);
+	if (g_cfg->num_shards > 0)
+		vty_out(vty, "  number media-threads %d%s", g_cfg->num_shards, VTY_NEWLINE);
 	if (g_cfg->call_agent_addr)
 		vty_out(vty, "  call agent ip %s%s", g_cfg->call_agent_addr, VTY_NEWLINE);
 	if (g_cfg->transcoder_ip)
@@ -94,11 +96,11 @@ static int config_write_mgcp(struct vty *vty)
 DEFUN(show_mcgp, show_mgcp_cmd, "show mgcp",
       SHOW_STR "Display information about the MGCP Media Gateway")
 {
-	int i;
+	int i, ev;
 
 	vty_out(vty, "MGCP is up and running with %u endpoints:%s", g_cfg->number_endpoints - 1, VTY_NEWLINE);
 	for (i = 1; i < g_cfg->number_endpoints; ++i) {
-		struct mgcp_endpoint *endp = &g_cfg->endpoints[i];
+		struct mgcp_endpoint *endp = mgcp_shard_media_endp(&g_cfg->endpoints[i]);
 		vty_out(vty, " Endpoint 0x%.2x: CI: %d net: %u/%u bts: %u/%u on %s traffic received bts: %u/%u  remote: %u/%u transcoder: %u%s",
 			i, endp->ci,
 			ntohs(endp->net_end.rtp_port), ntohs(endp->net_end.rtcp_port),
@@ -110,6 +112,22 @@ DEFUN(show_mcgp, show_mgcp_cmd, "show mgcp",
 			VTY_NEWLINE);
 	}
 
+	for (i = 0; g_cfg->shards && i < g_cfg->num_shards; ++i) {
+		struct mgcp_shard *shard = &g_cfg->shards[i];
+		vty_out(vty, " Media thread %d: wakeups: %lu commands: %lu queued: %u ring full: %lu%s",
+			i, shard->wakeups, shard->commands,
+			shard->head - shard->tail, shard->ring_full, VTY_NEWLINE);
+		for (ev = 0; ev < _MGCP_SHARD_EV_MAX; ++ev)
+			if (shard->events[ev])
+				vty_out(vty, "  %s: %lu%s", mgcp_shard_event_name(ev),
+					shard->events[ev], VTY_NEWLINE);
+	}
+
+	if (g_cfg->trans_cache)
+		vty_out(vty, " Transactions: %lu retransmissions answered: %lu%s",
+			g_cfg->trans_cache->stored, g_cfg->trans_cache->hits,
+			VTY_NEWLINE);
+
 	return CMD_SUCCESS;
 }
 
@@ -142,6 +160,7 @@ DEFUN(cfg_mgcp_bts_ip,
 		talloc_free(g_cfg->bts_ip);
 	g_cfg->bts_ip = talloc_strdup(g_cfg, argv[0]);
 	inet_aton(g_cfg->bts_ip, &g_cfg->bts_in);
+	mgcp_shards_reconfigure(g_cfg);
 	return CMD_SUCCESS;
 }
 
@@ -187,7 +206,12 @@ static void parse_range(struct mgcp_port_range *range, const char **argv)
 	range->mode = PORT_ALLOC_DYNAMIC;
 	range->range_start = atoi(argv[0]);
 	range->range_end = atoi(argv[1]);
-	range->last_port = g_cfg->bts_ports.range_start;
+	range->last_port = range->range_start;
+
+	/* recreated for the new range on the next allocation */
+	talloc_free(range->used);
+	range->used = NULL;
+	range->nr_used = 0;
 }
 
 
@@ -293,6 +317,7 @@ DEFUN(cfg_mgcp_loop,
       "Loop the audio")
 {
 	g_cfg->audio_loop = atoi(argv[0]);
+	mgcp_shards_reconfigure(g_cfg);
 	return CMD_SUCCESS;
 }
 
@@ -306,6 +331,15 @@ DEFUN(cfg_mgcp_number_endp,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_mgcp_number_shards,
+      cfg_mgcp_number_shards_cmd,
+      "number media-threads <0-64>",
+      "Forward RTP/RTCP from the given number of threads. This is not dynamic.")
+{
+	g_cfg->num_shards = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_mgcp_agent_addr,
       cfg_mgcp_agent_addr_cmd,
       "call agent ip IP",
@@ -327,6 +361,7 @@ DEFUN(cfg_mgcp_transcoder,
 		talloc_free(g_cfg->transcoder_ip);
 	g_cfg->transcoder_ip = talloc_strdup(g_cfg, argv[0]);
 	inet_aton(g_cfg->transcoder_ip, &g_cfg->transcoder_in);
+	mgcp_shards_reconfigure(g_cfg);
 
 	return CMD_SUCCESS;
 }
@@ -337,6 +372,7 @@ DEFUN(cfg_mgcp_transcoder_remote_base,
       "Set the base port for the transcoder\n" "The RTP base port on the transcoder")
 {
 	g_cfg->transcoder_remote_base = atoi(argv[0]);
+	mgcp_shards_reconfigure(g_cfg);
 	return CMD_SUCCESS;
 }
 
@@ -365,6 +401,7 @@ DEFUN(loop_endp,
 	else
 		endp->conn_mode = endp->orig_mode;
 	endp->allow_patch = 1;
+	mgcp_shard_sync(endp);
 
 	return CMD_SUCCESS;
 }
@@ -411,6 +448,7 @@ DEFUN(tap_call,
 	inet_aton(argv[2], &tap->forward.sin_addr);
 	tap->forward.sin_port = htons(atoi(argv[3]));
 	tap->enabled = 1;
+	mgcp_shard_sync(endp);
 	return CMD_SUCCESS;
 }
 
@@ -463,6 +501,7 @@ int mgcp_vty_init(void)
 	install_element(MGCP_NODE, &cfg_mgcp_sdp_payload_name_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_loop_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_number_endp_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_number_shards_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_agent_addr_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_transcoder_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_transcoder_remote_base_cmd);
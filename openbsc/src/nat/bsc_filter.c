@@ -27,10 +27,13 @@
 #include <openbsc/debug.h>
 
 #include <osmocore/talloc.h>
+#include <osmocore/gsm0808.h>
 #include <osmocore/protocol/gsm_08_08.h>
 
 #include <osmocom/sccp/sccp.h>
 
+#include <stddef.h>
+
 /*
  * The idea is to have a simple struct describing a IPA packet with
  * SCCP SSN and the GSM 08.08 payload and decide. We will both have
@@ -73,21 +76,210 @@ static struct bsc_pkt_filter white_list[] = {
 	{ NAT_IPAC_PROTO_MGCP, ALLOW_ANY, ALLOW_ANY, ALLOW_ANY, FILTER_TO_BOTH },
 };
 
-struct bsc_nat_parsed *bsc_nat_parse(struct msgb *msg)
+/*
+ * The SCCP header is parsed here instead of sccp_parse_header() of
+ * libosmo-sccp which logs its errors, the BSC threads must not log. It
+ * accepts the same message types and does the same bounds checks.
+ */
+static int sccp_address_ssn(struct msgb *msg, unsigned int offset, uint8_t *ssn)
+{
+	struct sccp_called_party_address *party;
+	unsigned int room, read = 0;
+	uint8_t length;
+
+	if (offset + 2 > msgb_l2len(msg))
+		return -1;
+	room = msgb_l2len(msg) - offset;
+	length = msg->l2h[offset];
+	if (room <= length)
+		return -1;
+
+	party = (struct sccp_called_party_address *) &msg->l2h[offset + 1];
+	if (party->point_code_indicator) {
+		if (length <= read + 2)
+			return -1;
+		read += 2;
+	}
+	if (party->ssn_indicator) {
+		if (length <= read + 1)
+			return -1;
+		*ssn = party->data[read];
+	}
+	return 0;
+}
+
+/* find the data parameter in the optional part */
+static int sccp_optional_data(struct msgb *msg, unsigned int offset)
+{
+	unsigned int room, read = 0;
+
+	if (offset > msgb_l2len(msg))
+		return -1;
+	room = msgb_l2len(msg) - offset;
+
+	while (room > read) {
+		uint8_t type = msg->l2h[offset + read];
+		uint8_t length;
+
+		if (type == SCCP_PNC_END_OF_OPTIONAL || read + 1 >= room)
+			return 0;
+
+		length = msg->l2h[offset + read + 1];
+		read += 2 + length;
+		if (room <= read)
+			return 0;
+
+		if (type == SCCP_PNC_DATA)
+			msg->l3h = &msg->l2h[offset + read - length];
+	}
+
+	return -1;
+}
+
+static int sccp_parse_quiet(struct msgb *msg, struct sccp_parse_result *result)
+{
+	unsigned int len = msgb_l2len(msg);
+	unsigned int off;
+
+	msg->l3h = NULL;
+	if (len < 1)
+		return -1;
+
+	switch (msg->l2h[0]) {
+	case SCCP_MSG_TYPE_CR: {
+		struct sccp_connection_request *req = (void *) msg->l2h;
+
+		if (len < sizeof(*req))
+			return -1;
+		off = offsetof(struct sccp_connection_request, variable_called);
+		if (sccp_address_ssn(msg, off + req->variable_called, &result->called.ssn) != 0)
+			return -1;
+		result->source_local_reference = &req->source_local_reference;
+		off = offsetof(struct sccp_connection_request, optional_start);
+		if (req->optional_start)
+			return sccp_optional_data(msg, off + req->optional_start);
+		return 0;
+	}
+	case SCCP_MSG_TYPE_CC: {
+		struct sccp_connection_confirm *cc = (void *) msg->l2h;
+
+		if (len < sizeof(*cc))
+			return -1;
+		result->destination_local_reference = &cc->destination_local_reference;
+		result->source_local_reference = &cc->source_local_reference;
+		off = offsetof(struct sccp_connection_confirm, optional_start);
+		if (cc->optional_start)
+			return sccp_optional_data(msg, off + cc->optional_start);
+		return 0;
+	}
+	case SCCP_MSG_TYPE_CREF: {
+		struct sccp_connection_refused *ref = (void *) msg->l2h;
+
+		if (len < sizeof(*ref))
+			return -1;
+		result->destination_local_reference = &ref->destination_local_reference;
+		off = offsetof(struct sccp_connection_refused, optional_start);
+		if (ref->optional_start)
+			return sccp_optional_data(msg, off + ref->optional_start);
+		return 0;
+	}
+	case SCCP_MSG_TYPE_RLSD: {
+		struct sccp_connection_released *rls = (void *) msg->l2h;
+
+		if (len < sizeof(*rls))
+			return -1;
+		result->destination_local_reference = &rls->destination_local_reference;
+		result->source_local_reference = &rls->source_local_reference;
+		return 0;
+	}
+	case SCCP_MSG_TYPE_RLC: {
+		struct sccp_connection_release_complete *rlc = (void *) msg->l2h;
+
+		if (len < sizeof(*rlc))
+			return -1;
+		result->destination_local_reference = &rlc->destination_local_reference;
+		result->source_local_reference = &rlc->source_local_reference;
+		return 0;
+	}
+	case SCCP_MSG_TYPE_DT1: {
+		struct sccp_data_form1 *dt1 = (void *) msg->l2h;
+
+		if (len < sizeof(*dt1) || dt1->segmenting != 0)
+			return -1;
+		result->destination_local_reference = &dt1->destination_local_reference;
+		off = offsetof(struct sccp_data_form1, variable_start) + dt1->variable_start;
+		if (len < off + 1)
+			return -1;
+		result->data_len = msg->l2h[off];
+		msg->l3h = &msg->l2h[off + 1];
+		return msgb_l3len(msg) < result->data_len ? -1 : 0;
+	}
+	case SCCP_MSG_TYPE_UDT: {
+		struct sccp_data_unitdata *udt = (void *) msg->l2h;
+
+		if (len < sizeof(*udt))
+			return -1;
+		off = offsetof(struct sccp_data_unitdata, variable_called);
+		if (sccp_address_ssn(msg, off + udt->variable_called, &result->called.ssn) != 0)
+			return -1;
+		off = offsetof(struct sccp_data_unitdata, variable_calling);
+		if (sccp_address_ssn(msg, off + udt->variable_calling, &result->calling.ssn) != 0)
+			return -1;
+		off = offsetof(struct sccp_data_unitdata, variable_data) + udt->variable_data;
+		if (len < off + 1)
+			return -1;
+		result->data_len = msg->l2h[off];
+		msg->l3h = &msg->l2h[off + 1];
+		return msgb_l3len(msg) < result->data_len ? -1 : 0;
+	}
+	case SCCP_MSG_TYPE_IT: {
+		struct sccp_data_it *it = (void *) msg->l2h;
+
+		if (len < sizeof(*it))
+			return -1;
+		result->destination_local_reference = &it->destination_local_reference;
+		result->source_local_reference = &it->source_local_reference;
+		return 0;
+	}
+	case SCCP_MSG_TYPE_ERR: {
+		struct sccp_proto_err *err = (void *) msg->l2h;
+
+		if (len < sizeof(*err))
+			return -1;
+		result->destination_local_reference = &err->destination_local_reference;
+		return 0;
+	}
+	}
+
+	return -1;
+}
+
+static const char *parse_error_names[_NAT_PARSE_ERR_MAX] = {
+	[NAT_PARSE_ERR_SHORT]	= "Message too short",
+	[NAT_PARSE_ERR_LENGTH]	= "Wrong input length",
+	[NAT_PARSE_ERR_SCCP]	= "Broken or unsupported SCCP header",
+	[NAT_PARSE_ERR_PAYLOAD]	= "Not enough space or GSM payload",
+};
+
+const char *bsc_nat_parse_strerror(int rc)
+{
+	if (rc >= 0 || -rc >= _NAT_PARSE_ERR_MAX)
+		return "Unknown error";
+	return parse_error_names[-rc];
+}
+
+/* does not log, the BSC threads use it; returns -enum bsc_nat_parse_error */
+int bsc_nat_parse_quiet(struct msgb *msg, struct bsc_nat_parsed *parsed)
 {
 	struct sccp_parse_result result;
-	struct bsc_nat_parsed *parsed;
 	struct ipaccess_head *hh;
 
 	/* quick fail */
 	if (msg->len < 4)
-		return NULL;
-
-	parsed = talloc_zero(msg, struct bsc_nat_parsed);
-	if (!parsed)
-		return NULL;
+		return -NAT_PARSE_ERR_SHORT;
 
 	/* more init */
+	memset(parsed, 0, sizeof(*parsed));
 	parsed->ipa_proto = parsed->called_ssn = parsed->calling_ssn = -1;
 	parsed->sccp_type = parsed->bssap = parsed->gsm_type = -1;
 
@@ -98,27 +290,19 @@ struct bsc_nat_parsed *bsc_nat_parse(struct msgb *msg)
 	msg->l2h = &hh->data[0];
 
 	/* do a size check on the input */
-	if (ntohs(hh->len) != msgb_l2len(msg)) {
-		LOGP(DINP, LOGL_ERROR, "Wrong input length?\n");
-		talloc_free(parsed);
-		return NULL;
-	}
+	if (ntohs(hh->len) != msgb_l2len(msg))
+		return -NAT_PARSE_ERR_LENGTH;
 
 	/* analyze sccp down here */
 	if (parsed->ipa_proto == IPAC_PROTO_SCCP) {
 		memset(&result, 0, sizeof(result));
-		if (sccp_parse_header(msg, &result) != 0) {
-			talloc_free(parsed);
-			return 0;
-		}
+		if (sccp_parse_quiet(msg, &result) != 0)
+			return -NAT_PARSE_ERR_SCCP;
 
-		if (msg->l3h && msgb_l3len(msg) < 3) {
-			LOGP(DNAT, LOGL_ERROR, "Not enough space or GSM payload\n");
-			talloc_free(parsed);
-			return 0;
-		}
+		if (msg->l3h && msgb_l3len(msg) < 3)
+			return -NAT_PARSE_ERR_PAYLOAD;
 
-		parsed->sccp_type = sccp_determine_msg_type(msg);
+		parsed->sccp_type = msg->l2h[0];
 		parsed->src_local_ref = result.source_local_reference;
 		parsed->dest_local_ref = result.destination_local_reference;
 		parsed->called_ssn = result.called.ssn;
@@ -128,10 +312,69 @@ struct bsc_nat_parsed *bsc_nat_parse(struct msgb *msg)
 		if (msg->l3h) {
 			parsed->bssap = msg->l3h[0];
 			parsed->gsm_type = msg->l3h[2];
+			parsed->payload = &msg->l3h[3];
+			parsed->payload_len = msgb_l3len(msg) - 3;
+			msg->l4h = parsed->payload;
+		}
+	}
+
+	return 0;
+}
+
+int bsc_nat_parse(struct msgb *msg, struct bsc_nat_parsed *parsed)
+{
+	int rc = bsc_nat_parse_quiet(msg, parsed);
+
+	if (rc != 0) {
+		LOGP(DNAT, LOGL_ERROR, "%s.\n", bsc_nat_parse_strerror(rc));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The message was parsed in a different buffer. Move the pointers
+ * into the message over to the copy at new.
+ */
+void bsc_nat_parsed_rebase(struct bsc_nat_parsed *parsed, const uint8_t *old, uint8_t *new)
+{
+	if (parsed->src_local_ref)
+		parsed->src_local_ref = (struct sccp_source_reference *)
+			(new + ((uint8_t *) parsed->src_local_ref - old));
+	if (parsed->dest_local_ref)
+		parsed->dest_local_ref = (struct sccp_source_reference *)
+			(new + ((uint8_t *) parsed->dest_local_ref - old));
+	if (parsed->payload)
+		parsed->payload = new + (parsed->payload - old);
+}
+
+/*
+ * Find the first IE with the tag in the BSSMAP IEs. The IEs are only
+ * walked until it is found, there is no struct tlv_parsed to clear.
+ */
+const uint8_t *bsc_nat_find_ie(const uint8_t *data, int len, uint8_t tag, uint16_t *ie_len)
+{
+	while (len > 0) {
+		const uint8_t *val;
+		uint8_t cur_tag;
+		uint16_t cur_len;
+		int rc;
+
+		rc = tlv_parse_one(&cur_tag, &cur_len, &val,
+				   gsm0808_att_tlvdef(), data, len);
+		if (rc <= 0 || rc > len)
+			return NULL;
+
+		if (cur_tag == tag) {
+			*ie_len = cur_len;
+			return val;
 		}
+
+		data += rc;
+		len -= rc;
 	}
 
-	return parsed;
+	return NULL;
 }
 
 int bsc_nat_filter_ipa(int dir, struct msgb *msg, struct bsc_nat_parsed *parsed)
@@ -35,6 +35,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
 
@@ -67,10 +68,13 @@ static uint16_t create_cic(int endpoint)
 	return (multiplex << 5) | (timeslot & 0x1f);
 }
 
-int bsc_mgcp_assign_patch(struct sccp_connections *con, struct msgb *msg)
+int bsc_mgcp_assign_patch(struct sccp_connections *con, struct msgb *msg,
+			  struct bsc_nat_parsed *parsed)
 {
+	struct bsc_nat *nat = con->bsc->nat;
 	struct sccp_connections *mcon;
-	struct tlv_parsed tp;
+	uint8_t *cic_ie;
+	uint16_t cic_len;
 	uint16_t cic;
 	uint8_t timeslot;
 	uint8_t multiplex;
@@ -81,37 +85,42 @@ int bsc_mgcp_assign_patch(struct sccp_connections *con, struct msgb *msg)
 		return -1;
 	}
 
-	if (msgb_l3len(msg) < 3) {
+	if (!parsed->payload) {
 		LOGP(DNAT, LOGL_ERROR, "Assignment message has not enough space for GSM0808.\n");
 		return -1;
 	}
 
-	tlv_parse(&tp, gsm0808_att_tlvdef(), msg->l3h + 3, msgb_l3len(msg) - 3, 0, 0);
-	if (!TLVP_PRESENT(&tp, GSM0808_IE_CIRCUIT_IDENTITY_CODE)) {
+	cic_ie = (uint8_t *) bsc_nat_find_ie(parsed->payload, parsed->payload_len,
+					     GSM0808_IE_CIRCUIT_IDENTITY_CODE, &cic_len);
+	if (!cic_ie || cic_len < sizeof(cic)) {
 		LOGP(DNAT, LOGL_ERROR, "Circuit identity code not found in assignment message.\n");
 		return -1;
 	}
 
-	cic = ntohs(*(uint16_t *)TLVP_VAL(&tp, GSM0808_IE_CIRCUIT_IDENTITY_CODE));
+	cic = ntohs(*(uint16_t *) cic_ie);
 	timeslot = cic & 0x1f;
 	multiplex = (cic & ~0x1f) >> 5;
 
 
 	endp = mgcp_timeslot_to_endpoint(multiplex, timeslot);
+	if (nat->mgcp_cfg && endp >= nat->mgcp_cfg->number_endpoints) {
+		LOGP(DNAT, LOGL_ERROR, "MSC assigned unknown endpoint 0x%x.\n", endp);
+		return -1;
+	}
 
-	/* find stale connections using that endpoint */
-	llist_for_each_entry(mcon, &con->bsc->nat->sccp_connections, list_entry) {
-		if (mcon->msc_endp == endp) {
-			LOGP(DNAT, LOGL_ERROR,
-			     "Endpoint %d was assigned to 0x%x and now 0x%x\n",
-			     endp,
-			     sccp_src_ref_to_int(&mcon->patched_ref),
-			     sccp_src_ref_to_int(&con->patched_ref));
-			bsc_mgcp_dlcx(mcon);
-		}
+	/* find a stale connection using that endpoint */
+	mcon = nat->bsc_endpoints[endp].con;
+	if (mcon) {
+		LOGP(DNAT, LOGL_ERROR,
+		     "Endpoint %d was assigned to 0x%x and now 0x%x\n",
+		     endp,
+		     sccp_src_ref_to_int(&mcon->patched_ref),
+		     sccp_src_ref_to_int(&con->patched_ref));
+		bsc_mgcp_dlcx(mcon);
 	}
 
 	con->msc_endp = endp;
+	nat->bsc_endpoints[endp].con = con;
 	if (bsc_assign_endpoint(con->bsc, con) != 0)
 		return -1;
 
@@ -120,8 +129,7 @@ int bsc_mgcp_assign_patch(struct sccp_connections *con, struct msgb *msg)
 	 * still assumed to be one multiplex only
 	 */
 	cic = htons(create_cic(con->bsc_endp));
-	memcpy((uint8_t *) TLVP_VAL(&tp, GSM0808_IE_CIRCUIT_IDENTITY_CODE),
-		&cic, sizeof(cic));
+	memcpy(cic_ie, &cic, sizeof(cic));
 
 	return 0;
 }
@@ -203,24 +211,19 @@ void bsc_mgcp_dlcx(struct sccp_connections *con)
 		bsc_mgcp_free_endpoint(con->bsc->nat, con->msc_endp);
 	}
 
+	if (con->msc_endp != -1 &&
+	    con->bsc->nat->bsc_endpoints[con->msc_endp].con == con)
+		con->bsc->nat->bsc_endpoints[con->msc_endp].con = NULL;
+
 	bsc_mgcp_init(con);
 }
 
 
 struct sccp_connections *bsc_mgcp_find_con(struct bsc_nat *nat, int endpoint)
 {
-	struct sccp_connections *con = NULL;
-	struct sccp_connections *sccp;
-
-	llist_for_each_entry(sccp, &nat->sccp_connections, list_entry) {
-		if (sccp->msc_endp == -1)
-			continue;
-		if (sccp->msc_endp != endpoint)
-			continue;
-
-		con = sccp;
-	}
+	struct sccp_connections *con;
 
+	con = nat->bsc_endpoints[endpoint].con;
 	if (con)
 		return con;
 
@@ -341,6 +344,31 @@ static void free_chan_downstream(struct mgcp_endpoint *endp, struct bsc_endpoint
 	mgcp_free_endp(endp);
 }
 
+/* the "I: " of the parsed response, CI_UNUSED if there is none */
+static uint32_t parse_ci(const struct mgcp_parse_data *parse)
+{
+	const struct mgcp_msg_ptr *ptr = &parse->params['I' - 'A'];
+	const char *str = &parse->data[ptr->start];
+	uint32_t ci = 0;
+	unsigned int i;
+
+	if (!(parse->params_mask & (1 << ('I' - 'A')))) {
+		LOGP(DMGCP, LOGL_ERROR, "No CI in msg '%.*s'\n", parse->len, parse->data);
+		return CI_UNUSED;
+	}
+
+	for (i = 0; i < ptr->length && str[i] >= '0' && str[i] <= '9'; ++i)
+		ci = ci * 10 + str[i] - '0';
+
+	if (i == 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to parse CI in msg '%.*s'\n",
+		     parse->len, parse->data);
+		return CI_UNUSED;
+	}
+
+	return ci;
+}
+
 /*
  * We have received a msg from the BSC. We will see if we know
  * this transaction and if it belongs to the BSC. Then we will
@@ -352,18 +380,18 @@ void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg)
 	struct msgb *output;
 	struct bsc_endpoint *bsc_endp = NULL;
 	struct mgcp_endpoint *endp = NULL;
-	int i, code;
-	char transaction_id[60];
+	struct mgcp_parse_data parse;
+	int i;
 
-	/* Some assumption that our buffer is big enough.. and null terminate */
+	/* Some assumption that our buffer is big enough.. */
 	if (msgb_l2len(msg) > 2000) {
 		LOGP(DMGCP, LOGL_ERROR, "MGCP message too long.\n");
 		return;
 	}
 
-	msg->l2h[msgb_l2len(msg)] = '\0';
-
-	if (bsc_mgcp_parse_response((const char *) msg->l2h, &code, transaction_id) != 0) {
+	/* one scan for the code, the transaction and the CI */
+	if (mgcp_parse_msg(&parse, (const char *) msg->l2h, msgb_l2len(msg)) != 0 ||
+	    parse.code < 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to parse response code.\n");
 		return;
 	}
@@ -374,7 +402,7 @@ void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg)
 		/* no one listening? a bug? */
 		if (!bsc->nat->bsc_endpoints[i].transaction_id)
 			continue;
-		if (strcmp(transaction_id, bsc->nat->bsc_endpoints[i].transaction_id) != 0)
+		if (strcmp(parse.trans_id, bsc->nat->bsc_endpoints[i].transaction_id) != 0)
 			continue;
 
 		endp = &bsc->nat->mgcp_cfg->endpoints[i];
@@ -383,12 +411,12 @@ void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg)
 	}
 
 	if (!bsc_endp) {
-		LOGP(DMGCP, LOGL_ERROR, "Could not find active endpoint: %s for msg: '%s'\n",
-		     transaction_id, (const char *) msg->l2h);
+		LOGP(DMGCP, LOGL_ERROR, "Could not find active endpoint: %s for msg: '%.*s'\n",
+		     parse.trans_id, msgb_l2len(msg), (const char *) msg->l2h);
 		return;
 	}
 
-	endp->ci = bsc_mgcp_extract_ci((const char *) msg->l2h);
+	endp->ci = parse_ci(&parse);
 	if (endp->ci == CI_UNUSED) {
 		free_chan_downstream(endp, bsc_endp, bsc);
 		return;
@@ -404,7 +432,7 @@ void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg)
 	 * there should be nothing for us to rewrite so putting endp->rtp_port
 	 * with the value of 0 should be no problem.
 	 */
-	output = bsc_mgcp_rewrite((char * ) msg->l2h, msgb_l2len(msg), -1,
+	output = bsc_mgcp_rewrite((const char *) msg->l2h, msgb_l2len(msg), -1,
 				  bsc->nat->mgcp_cfg->source_addr, endp->net_end.local_port);
 
 	if (!output) {
@@ -412,6 +440,9 @@ void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg)
 		return;
 	}
 
+	/* answer retransmissions of the deferred command with it */
+	mgcp_trans_cache_response(bsc->nat->mgcp_cfg, parse.trans_id, output);
+
 	if (write_queue_enqueue(&bsc->nat->mgcp_cfg->gw_fd, output) != 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to queue MGCP msg.\n");
 		msgb_free(output);
@@ -441,95 +472,204 @@ uint32_t bsc_mgcp_extract_ci(const char *str)
 	return ci;
 }
 
-static void patch_mgcp(struct msgb *output, const char *op, const char *tok,
-		       int endp, int len, int cr)
+/*
+ * The rewritten message is built in one scan of the input. Lines that
+ * are not patched are copied in runs, the result is copied into a msgb
+ * of the right size. There is only one select loop using this buffer.
+ */
+struct mgcp_rewrite {
+	char buf[4096 - 128];
+	unsigned int len;
+};
+
+static struct mgcp_rewrite rewrite;
+
+static int rw_put(struct mgcp_rewrite *rw, const char *data, unsigned int len)
 {
-	int slen;
-	int ret;
-	char buf[40];
+	if (len > sizeof(rw->buf) - rw->len)
+		return -1;
 
-	buf[0] = buf[39] = '\0';
-	ret = sscanf(tok, "%*s %s", buf);
+	memcpy(&rw->buf[rw->len], data, len);
+	rw->len += len;
+	return 0;
+}
 
-	slen = sprintf((char *) output->l3h, "%s %s %x@mgw MGCP 1.0%s",
-			op, buf, endp, cr ? "\r\n" : "\n");
-	output->l3h = msgb_put(output, slen);
+static int uint_to_str(char *str, unsigned int val, unsigned int base)
+{
+	char tmp[12];
+	int i = 0, len;
+
+	do {
+		tmp[i++] = "0123456789abcdef"[val % base];
+		val /= base;
+	} while (val);
+
+	for (len = 0; i > 0; ++len)
+		str[len] = tmp[--i];
+	return len;
+}
+
+static int is_verb(const char *line, unsigned int len)
+{
+	if (len < 5 || line[4] != ' ')
+		return 0;
+
+	return memcmp(line, "CRCX", 4) == 0 || memcmp(line, "DLCX", 4) == 0 ||
+		memcmp(line, "MDCX", 4) == 0;
 }
 
-/* we need to replace some strings... */
-struct msgb *bsc_mgcp_rewrite(char *input, int length, int endpoint, const char *ip, int port)
+/* "VERB trans endp MGCP 1.0" with the endpoint replaced */
+static int patch_verb(struct mgcp_rewrite *rw, const char *line, unsigned int len,
+		      const char *endp, int endp_len)
 {
-	static const char *crcx_str = "CRCX ";
-	static const char *dlcx_str = "DLCX ";
-	static const char *mdcx_str = "MDCX ";
+	unsigned int start = 5, end;
 
-	static const char *ip_str = "c=IN IP4 ";
-	static const char *aud_str = "m=audio ";
+	while (start < len && isspace(line[start]))
+		++start;
+	for (end = start; end < len && !isspace(line[end]); ++end)
+		;
 
-	char buf[128];
-	char *running, *token;
+	if (rw_put(rw, line, 5) != 0 ||
+	    rw_put(rw, &line[start], end - start) != 0 ||
+	    rw_put(rw, " ", 1) != 0 ||
+	    rw_put(rw, endp, endp_len) != 0)
+		return -1;
+	return rw_put(rw, "@mgw MGCP 1.0", 13);
+}
+
+/* the end of the port of "m=audio PORT ..." or -1 */
+static int audio_port_end(const char *line, unsigned int len)
+{
+	unsigned int digits = 8;
+
+	while (digits < len && line[digits] >= '0' && line[digits] <= '9')
+		++digits;
+	if (digits == 8 || digits == len || line[digits] != ' ')
+		return -1;
+	return digits;
+}
+
+enum {
+	RW_COPY,
+	RW_VERB,
+	RW_CONN,
+	RW_AUDIO,
+};
+
+static int line_type(const char *line, unsigned int len)
+{
+	switch (line[0]) {
+	case 'c':
+		if (len >= 9 && memcmp(line, "c=IN IP4 ", 9) == 0)
+			return RW_CONN;
+		break;
+	case 'm':
+		if (len >= 8 && memcmp(line, "m=audio ", 8) == 0)
+			return RW_AUDIO;
+		break;
+	case 'C':
+	case 'D':
+	case 'M':
+		if (is_verb(line, len))
+			return RW_VERB;
+		break;
+	}
+
+	return RW_COPY;
+}
+
+/*
+ * Patch the endpoint of a command, the IP of every connection line
+ * and the port of the audio lines. The line ends are kept as they
+ * are, the last line does not need to have one.
+ */
+struct msgb *bsc_mgcp_rewrite(const char *input, int length, int endpoint, const char *ip, int port)
+{
+	struct mgcp_rewrite *rw = &rewrite;
+	unsigned int pos, next, copied = 0;
+	char endp_str[12], port_str[12];
+	int endp_len, port_len, ip_len;
 	struct msgb *output;
 
-	if (length > 4096 - 128) {
+	if (length > sizeof(rw->buf)) {
 		LOGP(DMGCP, LOGL_ERROR, "Input is too long.\n");
 		return NULL;
 	}
 
-	output = msgb_alloc_headroom(4096, 128, "MGCP rewritten");
-	if (!output) {
-		LOGP(DMGCP, LOGL_ERROR, "Failed to allocate new MGCP msg.\n");
-		return NULL;
-	}
+	endp_len = uint_to_str(endp_str, endpoint, 16);
+	port_len = uint_to_str(port_str, port, 10);
+	ip_len = strlen(ip);
+	rw->len = 0;
 
-	running = input;
-	output->l2h = output->data;
-	output->l3h = output->l2h;
-	for (token = strsep(&running, "\n"); running; token = strsep(&running, "\n")) {
-		int len = strlen(token);
-		int cr = len > 0 && token[len - 1] == '\r';
-
-		if (strncmp(crcx_str, token, (sizeof crcx_str) - 1) == 0) {
-			patch_mgcp(output, "CRCX", token, endpoint, len, cr);
-		} else if (strncmp(dlcx_str, token, (sizeof dlcx_str) - 1) == 0) {
-			patch_mgcp(output, "DLCX", token, endpoint, len, cr);
-		} else if (strncmp(mdcx_str, token, (sizeof mdcx_str) - 1) == 0) {
-			patch_mgcp(output, "MDCX", token, endpoint, len, cr);
-		} else if (strncmp(ip_str, token, (sizeof ip_str) - 1) == 0) {
-			output->l3h = msgb_put(output, strlen(ip_str));
-			memcpy(output->l3h, ip_str, strlen(ip_str));
-			output->l3h = msgb_put(output, strlen(ip));
-			memcpy(output->l3h, ip, strlen(ip));
-
-			if (cr) {
-				output->l3h = msgb_put(output, 2);
-				output->l3h[0] = '\r';
-				output->l3h[1] = '\n';
-			} else {
-				output->l3h = msgb_put(output, 1);
-				output->l3h[0] = '\n';
-			}
-		} else if (strncmp(aud_str, token, (sizeof aud_str) - 1) == 0) {
-			int payload;
-			if (sscanf(token, "m=audio %*d RTP/AVP %d", &payload) != 1) {
-				LOGP(DMGCP, LOGL_ERROR, "Could not parsed audio line.\n");
-				msgb_free(output);
+	for (pos = 0; pos < length; pos = next) {
+		const char *line = &input[pos];
+		const char *nl = memchr(line, '\n', length - pos);
+		unsigned int len;
+		int type, digits = 0, rc;
+
+		next = nl ? nl - input + 1 : length;
+		len = nl ? nl - line : length - pos;
+		if (len > 0 && line[len - 1] == '\r')
+			--len;
+		if (len == 0)
+			continue;
+
+		type = line_type(line, len);
+		if (type == RW_COPY)
+			continue;
+
+		if (type == RW_AUDIO) {
+			digits = audio_port_end(line, len);
+			if (digits < 0) {
+				LOGP(DMGCP, LOGL_ERROR, "Could not parse the audio line.\n");
 				return NULL;
 			}
+		}
 
-			snprintf(buf, sizeof(buf)-1, "m=audio %d RTP/AVP %d%s",
-				 port, payload, cr ? "\r\n" : "\n");
-			buf[sizeof(buf)-1] = '\0';
+		/* everything up to this line is taken as it is */
+		if (rw_put(rw, &input[copied], pos - copied) != 0)
+			goto too_long;
 
-			output->l3h = msgb_put(output, strlen(buf));
-			memcpy(output->l3h, buf, strlen(buf));
-		} else {
-			output->l3h = msgb_put(output, len + 1);
-			memcpy(output->l3h, token, len);
-			output->l3h[len] = '\n';
+		switch (type) {
+		case RW_VERB:
+			rc = patch_verb(rw, line, len, endp_str, endp_len);
+			break;
+		case RW_CONN:
+			rc = rw_put(rw, line, 9);
+			if (rc == 0)
+				rc = rw_put(rw, ip, ip_len);
+			break;
+		default:
+			rc = rw_put(rw, line, 8);
+			if (rc == 0)
+				rc = rw_put(rw, port_str, port_len);
+			if (rc == 0)
+				rc = rw_put(rw, &line[digits], len - digits);
+			break;
 		}
+
+		if (rc != 0 || rw_put(rw, &line[len], next - pos - len) != 0)
+			goto too_long;
+		copied = next;
+	}
+
+	if (rw_put(rw, &input[copied], length - copied) != 0)
+		goto too_long;
+
+	output = msgb_alloc_headroom(rw->len + 128 + 1, 128, "MGCP rewritten");
+	if (!output) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to allocate new MGCP msg.\n");
+		return NULL;
 	}
 
+	output->l2h = msgb_put(output, rw->len);
+	memcpy(output->l2h, rw->buf, rw->len);
+	output->l2h[rw->len] = '\0';
 	return output;
+
+too_long:
+	LOGP(DMGCP, LOGL_ERROR, "The rewritten MGCP message is too long.\n");
+	return NULL;
 }
 
 static int mgcp_do_read(struct bsc_fd *fd)
@@ -43,6 +43,8 @@
 #include <openbsc/ipaccess.h>
 #include <openbsc/abis_nm.h>
 #include <openbsc/vty.h>
+#include <openbsc/select_epoll.h>
+#include <openbsc/timer_wheel.h>
 
 #include <osmocore/gsm0808.h>
 #include <osmocore/talloc.h>
@@ -66,7 +68,9 @@ static struct in_addr local_addr;
 static struct bsc_fd bsc_listen;
 static const char *msc_ip = NULL;
 static struct timer_list sccp_close;
+static struct bsc_timer_wheel nat_wheel = BSC_TIMER_WHEEL("nat");
 static int daemonize = 0;
+static int use_epoll = 0;
 
 const char *openbsc_copyright =
 	"Copyright (C) 2010 Holger Hans Peter Freyther and On-Waves\r\n"
@@ -76,7 +80,6 @@ const char *openbsc_copyright =
 
 static struct bsc_nat *nat;
 static void bsc_send_data(struct bsc_connection *bsc, const uint8_t *data, unsigned int length, int);
-static void msc_send_reset(struct bsc_msc_connection *con);
 
 struct bsc_config *bsc_config_num(struct bsc_nat *nat, int num)
 {
@@ -105,10 +108,13 @@ void input_event(int event, enum e1inp_sign_type type, struct gsm_bts_trx *trx)
 static void queue_for_msc(struct bsc_msc_connection *con, struct msgb *msg) __attribute__((nonnull (1, 2)));
 static void queue_for_msc(struct bsc_msc_connection *con, struct msgb *msg)
 {
-	if (write_queue_enqueue(&con->write_queue, msg) != 0) {
-		LOGP(DINP, LOGL_ERROR, "Failed to enqueue the write.\n");
-		msgb_free(msg);
-	}
+	struct bsc_nat_msc *msc = con->write_queue.bfd.data;
+
+	if (bsc_nat_queue_enqueue(&msc->queue, msg) != 0)
+		return;
+
+	if (con->write_queue.current_length > msc->wq_hwm)
+		msc->wq_hwm = con->write_queue.current_length;
 }
 
 static void send_reset_ack(struct bsc_connection *bsc)
@@ -158,10 +164,12 @@ static void bsc_ping_timeout(void *_bsc)
 	send_ping(bsc);
 
 	/* send another ping in 20 seconds */
-	bsc_schedule_timer(&bsc->ping_timeout, bsc->nat->ping_timeout, 0);
+	bsc_wheel_schedule(&nat_wheel, &bsc->ping_timeout,
+			   bsc->nat->ping_timeout, 0);
 
 	/* also start a pong timer */
-	bsc_schedule_timer(&bsc->pong_timeout, bsc->nat->pong_timeout, 0);
+	bsc_wheel_schedule(&nat_wheel, &bsc->pong_timeout,
+			   bsc->nat->pong_timeout, 0);
 }
 
 static void start_ping_pong(struct bsc_connection *bsc)
@@ -263,11 +271,18 @@ static void send_mgcp_reset(struct bsc_connection *bsc)
  */
 static void initialize_msc_if_needed(struct bsc_msc_connection *msc_con)
 {
+	struct bsc_nat_msc *msc = msc_con->write_queue.bfd.data;
+
 	if (msc_con->first_contact)
 		return;
 
 	msc_con->first_contact = 1;
-	msc_send_reset(msc_con);
+
+	/* a reset would release the connections of the snapshot */
+	if (bsc_nat_snapshot_defer_reset(msc))
+		return;
+
+	bsc_nat_msc_send_reset(msc);
 }
 
 static void send_id_get_response(struct bsc_msc_connection *msc_con)
@@ -283,25 +298,49 @@ static void send_id_get_response(struct bsc_msc_connection *msc_con)
 /*
  * Currently we are lacking refcounting so we need to copy each message.
  */
-static void bsc_send_data(struct bsc_connection *bsc, const uint8_t *data, unsigned int length, int proto)
+static struct msgb *bsc_copy_data(const uint8_t *data, unsigned int length)
 {
 	struct msgb *msg;
 
 	if (length > 4096 - 128) {
 		LOGP(DINP, LOGL_ERROR, "Can not send message of that size.\n");
-		return;
+		return NULL;
 	}
 
 	msg = msgb_alloc_headroom(4096, 128, "to-bsc");
 	if (!msg) {
 		LOGP(DINP, LOGL_ERROR, "Failed to allocate memory for BSC msg.\n");
-		return;
+		return NULL;
 	}
 
 	msg->l2h = msgb_put(msg, length);
 	memcpy(msg->data, data, length);
+	return msg;
+}
+
+static void bsc_send_data(struct bsc_connection *bsc, const uint8_t *data, unsigned int length, int proto)
+{
+	struct msgb *msg = bsc_copy_data(data, length);
+
+	if (msg)
+		bsc_write(bsc, msg, proto);
+}
+
+/* forward a message of the MSC, the copy keeps the time it was read */
+static void bsc_forward_data(struct bsc_connection *bsc, struct msgb *msg,
+			     struct bsc_nat_parsed *parsed)
+{
+	struct msgb *copy = bsc_copy_data(msg->l2h, msgb_l2len(msg));
+
+	if (!copy)
+		return;
 
-	bsc_write(bsc, msg, proto);
+	NAT_MSGB_CB(copy)->stamp = NAT_MSGB_CB(msg)->stamp;
+	NAT_MSGB_CB(copy)->type = bsc_nat_lat_type(parsed->sccp_type);
+	if (parsed->sccp_type == SCCP_MSG_TYPE_UDT &&
+	    parsed->gsm_type == BSS_MAP_MSG_PAGING)
+		NAT_MSGB_CB(copy)->prio = NAT_PRIO_PAGING;
+	bsc_write(bsc, copy, parsed->ipa_proto);
 }
 
 /*
@@ -362,11 +401,30 @@ static void bsc_send_con_release(struct bsc_connection *bsc, struct sccp_connect
 	bsc_write(bsc, rlsd, IPAC_PROTO_SCCP);
 }
 
+/*
+ * Refuse the CR with a plain SCCP CREF. The MS will retry, a MM reject
+ * would make it bar the PLMN for a problem of the NAT.
+ */
+static void bsc_send_sccp_refuse(struct bsc_connection *bsc,
+				 struct bsc_nat_parsed *parsed, int cause)
+{
+	struct msgb *refuse;
+
+	refuse = sccp_create_refuse(parsed->src_local_ref, cause, NULL, 0);
+	if (!refuse) {
+		LOGP(DNAT, LOGL_ERROR,
+		     "Creating refuse msg failed for SCCP 0x%x on BSC Nr: %d.\n",
+		      sccp_src_ref_to_int(parsed->src_local_ref), bsc->cfg->nr);
+		return;
+	}
+
+	bsc_write(bsc, refuse, IPAC_PROTO_SCCP);
+}
+
 static void bsc_send_con_refuse(struct bsc_connection *bsc,
 				struct bsc_nat_parsed *parsed, int con_type)
 {
 	struct msgb *payload;
-	struct msgb *refuse;
 
 	if (con_type == NAT_CON_TYPE_LU)
 		payload = gsm48_create_loc_upd_rej(GSM48_REJECT_PLMN_NOT_ALLOWED);
@@ -386,15 +444,16 @@ static void bsc_send_con_refuse(struct bsc_connection *bsc,
 	if (payload) {
 		struct msgb *cc, *udt, *rlsd;
 		struct sccp_connections *con;
-		con = create_sccp_src_ref(bsc, parsed);
+
+		/* the reference of a local connection is never sent to an MSC */
+		con = create_sccp_src_ref(bsc, bsc_nat_msc_num(bsc->nat, 0), parsed);
 		if (!con)
 			goto send_refuse;
 
 		/* declare it local and assign a unique remote_ref */
 		con->con_type = NAT_CON_TYPE_LOCAL_REJECT;
 		con->con_local = 1;
-		con->has_remote_ref = 1;
-		con->remote_ref = con->patched_ref;
+		sccp_connection_set_remote(con, &con->patched_ref);
 
 		/* 1. create a confirmation */
 		cc = sccp_create_cc(&con->remote_ref, &con->real_ref);
@@ -430,29 +489,35 @@ send_refuse:
 	if (payload)
 		msgb_free(payload);
 
-	refuse = sccp_create_refuse(parsed->src_local_ref,
-				    SCCP_REFUSAL_SCCP_FAILURE, NULL, 0);
-	if (!refuse) {
-		LOGP(DNAT, LOGL_ERROR,
-		     "Creating refuse msg failed for SCCP 0x%x on BSC Nr: %d.\n",
-		      sccp_src_ref_to_int(parsed->src_local_ref), bsc->cfg->nr);
-		return;
-	}
-
-	bsc_write(bsc, refuse, IPAC_PROTO_SCCP);
+	bsc_send_sccp_refuse(bsc, parsed, SCCP_REFUSAL_SCCP_FAILURE);
 }
 
 
-static int forward_sccp_to_bts(struct bsc_msc_connection *msc_con, struct msgb *msg)
+struct paging_data {
+	struct msgb *msg;
+	struct bsc_nat_parsed *parsed;
+};
+
+static void forward_paging(struct bsc_connection *bsc, void *data)
+{
+	struct paging_data *paging = data;
+
+	if (bsc->cfg->forbid_paging)
+		LOGP(DNAT, LOGL_DEBUG, "Paging forbidden for BTS: %d\n", bsc->cfg->nr);
+	else
+		bsc_forward_data(bsc, paging->msg, paging->parsed);
+}
+
+static int forward_sccp_to_bts(struct bsc_nat_msc *msc, struct msgb *msg)
 {
 	struct sccp_connections *con = NULL;
 	struct bsc_connection *bsc;
-	struct bsc_nat_parsed *parsed;
+	struct bsc_nat_parsed parsed_msg;
+	struct bsc_nat_parsed *parsed = &parsed_msg;
 	int proto;
 
 	/* filter, drop, patch the message? */
-	parsed = bsc_nat_parse(msg);
-	if (!parsed) {
+	if (bsc_nat_parse(msg, parsed) != 0) {
 		LOGP(DNAT, LOGL_ERROR, "Can not parse msg from BSC.\n");
 		return -1;
 	}
@@ -473,7 +538,7 @@ static int forward_sccp_to_bts(struct bsc_msc_connection *msc_con, struct msgb *
 		case SCCP_MSG_TYPE_CREF:
 		case SCCP_MSG_TYPE_DT1:
 		case SCCP_MSG_TYPE_IT:
-			con = patch_sccp_src_ref_to_bsc(msg, parsed, nat);
+			con = patch_sccp_src_ref_to_bsc(msg, parsed, msc);
 			if (parsed->gsm_type == BSS_MAP_MSG_ASSIGMENT_RQST) {
 				counter_inc(nat->stats.sccp.calls);
 
@@ -481,14 +546,14 @@ static int forward_sccp_to_bts(struct bsc_msc_connection *msc_con, struct msgb *
 					struct rate_ctr_group *ctrg;
 					ctrg = con->bsc->cfg->stats.ctrg;
 					rate_ctr_inc(&ctrg->ctr[BCFG_CTR_SCCP_CALLS]);
-					if (bsc_mgcp_assign_patch(con, msg) != 0)
+					if (bsc_mgcp_assign_patch(con, msg, parsed) != 0)
 						LOGP(DNAT, LOGL_ERROR, "Failed to assign...\n");
 				} else
 					LOGP(DNAT, LOGL_ERROR, "Assignment command but no BSC.\n");
 			}
 			break;
 		case SCCP_MSG_TYPE_CC:
-			con = patch_sccp_src_ref_to_bsc(msg, parsed, nat);
+			con = patch_sccp_src_ref_to_bsc(msg, parsed, msc);
 			if (!con || update_sccp_src_ref(con, parsed) != 0)
 				goto exit;
 			break;
@@ -505,12 +570,11 @@ static int forward_sccp_to_bts(struct bsc_msc_connection *msc_con, struct msgb *
 		if (!con && parsed->sccp_type == SCCP_MSG_TYPE_RLSD) {
 			LOGP(DNAT, LOGL_NOTICE, "Sending fake RLC on RLSD message to network.\n");
 			/* Exchange src/dest for the reply */
-			nat_send_rlc(msc_con, parsed->dest_local_ref, parsed->src_local_ref);
+			nat_send_rlc(msc->con, parsed->dest_local_ref, parsed->src_local_ref);
 		} else if (!con)
 			LOGP(DNAT, LOGL_ERROR, "Unknown connection for msg type: 0x%x from the MSC.\n", parsed->sccp_type);
 	}
 
-	talloc_free(parsed);
 	if (!con)
 		return -1;
 	if (!con->bsc->authenticated) {
@@ -518,7 +582,7 @@ static int forward_sccp_to_bts(struct bsc_msc_connection *msc_con, struct msgb *
 		return -1;
 	}
 
-	bsc_send_data(con->bsc, msg->l2h, msgb_l2len(msg), proto);
+	bsc_forward_data(con->bsc, msg, parsed);
 	return 0;
 
 send_to_all:
@@ -528,13 +592,11 @@ send_to_all:
 	 * message and then send it to the authenticated messages...
 	 */
 	if (parsed->ipa_proto == IPAC_PROTO_SCCP && parsed->gsm_type == BSS_MAP_MSG_PAGING) {
+		struct paging_data paging = { msg, parsed };
 		int lac;
-		bsc = bsc_nat_find_bsc(nat, msg, &lac);
-		if (bsc && bsc->cfg->forbid_paging)
-			LOGP(DNAT, LOGL_DEBUG, "Paging forbidden for BTS: %d\n", bsc->cfg->nr);
-		else if (bsc)
-			bsc_send_data(bsc, msg->l2h, msgb_l2len(msg), parsed->ipa_proto);
-		else if (lac != -1)
+
+		if (bsc_nat_find_paging(nat, msg, &lac, forward_paging, &paging) == 0 &&
+		    lac != -1)
 			LOGP(DNAT, LOGL_ERROR, "Could not determine BSC for paging on lac: %d/0x%x\n",
 			     lac, lac);
 
@@ -545,65 +607,87 @@ send_to_all:
 		if (!bsc->authenticated)
 			continue;
 
-		bsc_send_data(bsc, msg->l2h, msgb_l2len(msg), parsed->ipa_proto);
+		bsc_forward_data(bsc, msg, parsed);
 	}
 
 exit:
-	talloc_free(parsed);
 	return 0;
 }
 
-static void msc_connection_was_lost(struct bsc_msc_connection *con)
+/*
+ * Release the SCCP connections of a lost MSC towards the BSCs. The
+ * connections handled by the other MSCs of the pool continue.
+ */
+static void msc_release_connections(struct bsc_nat_msc *msc)
 {
-	struct bsc_connection *bsc, *tmp;
+	struct sccp_connections *con, *tmp;
+	struct msgb *msg;
 
-	LOGP(DMSC, LOGL_ERROR, "Closing all connections downstream.\n");
-	llist_for_each_entry_safe(bsc, tmp, &nat->bsc_connections, list_entry)
-		bsc_close_connection(bsc);
+	llist_for_each_entry_safe(con, tmp, &nat->sccp_connections, list_entry) {
+		if (con->msc != msc || con->con_local)
+			continue;
 
-	bsc_mgcp_free_endpoints(nat);
-	bsc_msc_schedule_connect(con);
-}
+		rate_ctr_inc(&msc->ctrg->ctr[MSC_CTR_SCCP_RELEASED]);
+		rate_ctr_inc(&con->bsc->cfg->stats.ctrg->ctr[BCFG_CTR_DROPPED_SCCP]);
 
-static void msc_connection_connected(struct bsc_msc_connection *con)
-{
-	counter_inc(nat->stats.msc.reconn);
+		/* not confirmed yet, refuse it and forget about it */
+		if (!con->has_remote_ref) {
+			msg = sccp_create_refuse(&con->real_ref,
+						 SCCP_REFUSAL_SCCP_FAILURE, NULL, 0);
+			if (msg)
+				bsc_write(con->bsc, msg, IPAC_PROTO_SCCP);
+			sccp_connection_destroy(con);
+			continue;
+		}
+
+		/* the RLC of the BSC will remove the connection */
+		msg = sccp_create_rlsd(&con->remote_ref, &con->real_ref,
+				       SCCP_RELEASE_CAUSE_SCCP_FAILURE);
+		if (msg)
+			bsc_write(con->bsc, msg, IPAC_PROTO_SCCP);
+		bsc_mgcp_dlcx(con);
+		con->con_local = 1;
+		con->msc_con = NULL;
+	}
 }
 
-static void msc_send_reset(struct bsc_msc_connection *msc_con)
+static void msc_connection_was_lost(struct bsc_msc_connection *con)
 {
-	static const uint8_t reset[] = {
-		0x00, 0x12, 0xfd,
-		0x09, 0x00, 0x03, 0x05, 0x07, 0x02, 0x42, 0xfe,
-		0x02, 0x42, 0xfe, 0x06, 0x00, 0x04, 0x30, 0x04,
-		0x01, 0x20
-	};
+	struct bsc_nat_msc *msc = con->write_queue.bfd.data;
+	struct bsc_connection *bsc, *tmp;
 
-	struct msgb *msg;
+	rate_ctr_inc(&msc->ctrg->ctr[MSC_CTR_LOST]);
 
-	msg = msgb_alloc_headroom(4096, 128, "08.08 reset");
-	if (!msg) {
-		LOGP(DMSC, LOGL_ERROR, "Failed to allocate reset msg.\n");
-		return;
+	if (bsc_nat_msc_is_connected(nat)) {
+		LOGP(DMSC, LOGL_ERROR, "Releasing the connections of MSC %d.\n", msc->nr);
+		msc_release_connections(msc);
+	} else {
+		LOGP(DMSC, LOGL_ERROR, "Closing all connections downstream.\n");
+		llist_for_each_entry_safe(bsc, tmp, &nat->bsc_connections, list_entry)
+			bsc_close_connection(bsc);
+
+		bsc_mgcp_free_endpoints(nat);
 	}
 
-	msg->l2h = msgb_put(msg, sizeof(reset));
-	memcpy(msg->l2h, reset, msgb_l2len(msg));
+	bsc_msc_schedule_connect(con);
+}
 
-	queue_for_msc(msc_con, msg);
+static void msc_connection_connected(struct bsc_msc_connection *con)
+{
+	struct bsc_nat_msc *msc = con->write_queue.bfd.data;
 
-	LOGP(DMSC, LOGL_NOTICE, "Scheduled GSM0808 reset msg for the MSC.\n");
+	counter_inc(nat->stats.msc.reconn);
+	rate_ctr_inc(&msc->ctrg->ctr[MSC_CTR_RECONN]);
 }
 
 static int ipaccess_msc_read_cb(struct bsc_fd *bfd)
 {
 	int error;
-	struct bsc_msc_connection *msc_con;
+	struct bsc_nat_msc *msc = bfd->data;
+	struct bsc_msc_connection *msc_con = msc->con;
 	struct msgb *msg = ipaccess_read_msg(bfd, &error);
 	struct ipaccess_head *hh;
 
-	msc_con = (struct bsc_msc_connection *) bfd->data;
-
 	if (!msg) {
 		if (error == 0)
 			LOGP(DNAT, LOGL_FATAL, "The connection the MSC was lost, exiting\n");
@@ -614,6 +698,7 @@ static int ipaccess_msc_read_cb(struct bsc_fd *bfd)
 		return -1;
 	}
 
+	NAT_MSGB_CB(msg)->stamp = bsc_nat_lat_now();
 	LOGP(DNAT, LOGL_DEBUG, "MSG from MSC: %s proto: %d\n", hexdump(msg->data, msg->len), msg->l2h[0]);
 
 	/* handle base message handling */
@@ -627,7 +712,7 @@ static int ipaccess_msc_read_cb(struct bsc_fd *bfd)
 		else if (msg->l2h[0] == IPAC_MSGT_ID_GET)
 			send_id_get_response(msc_con);
 	} else if (hh->proto == IPAC_PROTO_SCCP)
-		forward_sccp_to_bts(msc_con, msg);
+		forward_sccp_to_bts(msc, msg);
 
 	msgb_free(msg);
 	return 0;
@@ -635,7 +720,10 @@ static int ipaccess_msc_read_cb(struct bsc_fd *bfd)
 
 static int ipaccess_msc_write_cb(struct bsc_fd *bfd, struct msgb *msg)
 {
+	struct bsc_nat_msc *msc = bfd->data;
 	int rc;
+
+	bsc_nat_queue_written(&msc->queue, msg);
 	rc = write(bfd->fd, msg->data, msg->len);
 
 	if (rc != msg->len) {
@@ -643,6 +731,7 @@ static int ipaccess_msc_write_cb(struct bsc_fd *bfd, struct msgb *msg)
 		return -1;
 	}
 
+	bsc_nat_lat_record(NAT_MSGB_CB(msg)->cfg, NAT_LAT_TO_MSC, msg);
 	return rc;
 }
 
@@ -663,9 +752,9 @@ void bsc_close_connection(struct bsc_connection *connection)
 	struct rate_ctr *ctr = NULL;
 
 	/* stop the timeout timer */
-	bsc_del_timer(&connection->id_timeout);
-	bsc_del_timer(&connection->ping_timeout);
-	bsc_del_timer(&connection->pong_timeout);
+	bsc_wheel_del(&nat_wheel, &connection->id_timeout);
+	bsc_wheel_del(&nat_wheel, &connection->ping_timeout);
+	bsc_wheel_del(&nat_wheel, &connection->pong_timeout);
 
 	if (connection->cfg)
 		ctr = &connection->cfg->stats.ctrg->ctr[BCFG_CTR_DROPPED_SCCP];
@@ -685,11 +774,18 @@ void bsc_close_connection(struct bsc_connection *connection)
 	/* close endpoints allocated by this BSC */
 	bsc_mgcp_clear_endpoints_for(connection);
 
-	bsc_unregister_fd(&connection->write_queue.bfd);
-	close(connection->write_queue.bfd.fd);
+	bsc_epoll_unregister_fd(&connection->write_queue.bfd);
 	write_queue_clear(&connection->write_queue);
 	llist_del(&connection->list_entry);
+	bsc_nat_lac_del(connection);
+
+	/* the reader thread closes the socket, the free waits for it */
+	if (connection->reader) {
+		bsc_nat_worker_close(connection);
+		return;
+	}
 
+	close(connection->write_queue.bfd.fd);
 	talloc_free(connection);
 }
 
@@ -722,9 +818,11 @@ static void ipaccess_auth_bsc(struct tlv_parsed *tvp, struct bsc_connection *bsc
 			rate_ctr_inc(&conf->stats.ctrg->ctr[BCFG_CTR_NET_RECONN]);
 			bsc->authenticated = 1;
 			bsc->cfg = conf;
-			bsc_del_timer(&bsc->id_timeout);
+			bsc_nat_lac_add(bsc);
+			bsc_wheel_del(&nat_wheel, &bsc->id_timeout);
 			LOGP(DNAT, LOGL_NOTICE, "Authenticated bsc nr: %d lac: %d on fd %d\n",
 			     conf->nr, conf->lac, bsc->write_queue.bfd.fd);
+			bsc_nat_snapshot_adopt(bsc);
 			start_ping_pong(bsc);
 			return;
 		}
@@ -734,16 +832,18 @@ static void ipaccess_auth_bsc(struct tlv_parsed *tvp, struct bsc_connection *bsc
 	     bsc->write_queue.bfd.fd);
 }
 
-static int forward_sccp_to_msc(struct bsc_connection *bsc, struct msgb *msg)
+/* the message was parsed already, parsed is NULL if that failed */
+static int forward_sccp_to_msc(struct bsc_connection *bsc, struct msgb *msg,
+			       struct bsc_nat_parsed *parsed)
 {
 	int con_filter = 0;
+	struct bsc_nat_msc *msc;
 	struct bsc_msc_connection *con_msc = NULL;
 	struct bsc_connection *con_bsc = NULL;
 	int con_type;
-	struct bsc_nat_parsed *parsed;
+	int refuse_cause;
 
-	/* Parse and filter messages */
-	parsed = bsc_nat_parse(msg);
+	/* filter messages */
 	if (!parsed) {
 		LOGP(DNAT, LOGL_ERROR, "Can not parse msg from BSC.\n");
 		msgb_free(msg);
@@ -774,10 +874,25 @@ static int forward_sccp_to_msc(struct bsc_connection *bsc, struct msgb *msg)
 			filter = bsc_nat_filter_sccp_cr(bsc, msg, parsed, &con_type);
 			if (filter < 0)
 				goto exit3;
-			if (!create_sccp_src_ref(bsc, parsed))
+			msc = bsc_nat_msc_select(bsc->nat, parsed);
+			if (!msc) {
+				LOGP(DNAT, LOGL_ERROR, "No MSC for the CR of BSC Nr: %d.\n",
+				     bsc->cfg->nr);
+				refuse_cause = SCCP_REFUSAL_SCCP_FAILURE;
+				goto exit4;
+			}
+			/* refuse it while the MSC can not keep up */
+			if (!bsc_nat_queue_admit(&msc->queue, NAT_PRIO_CR, msg->len)) {
+				LOGP(DNAT, LOGL_ERROR, "MSC %d is overloaded, refusing the CR of BSC Nr: %d.\n",
+				     msc->nr, bsc->cfg->nr);
+				msc->queue.dropped[NAT_PRIO_CR] += 1;
+				refuse_cause = SCCP_REFUSAL_END_USER_CONGESTION;
+				goto exit4;
+			}
+			if (!create_sccp_src_ref(bsc, msc, parsed))
 				goto exit2;
 			con = patch_sccp_src_ref_to_msc(msg, parsed, bsc);
-			con->msc_con = bsc->nat->msc_con;
+			con->msc_con = msc->con;
 			con_msc = con->msc_con;
 			con->con_type = con_type;
 			con->imsi_checked = filter;
@@ -848,8 +963,11 @@ static int forward_sccp_to_msc(struct bsc_connection *bsc, struct msgb *msg)
 	}
 
 	/* send the non-filtered but maybe modified msg */
+	NAT_MSGB_CB(msg)->type = bsc_nat_lat_type(parsed->sccp_type);
+	NAT_MSGB_CB(msg)->cfg = bsc->cfg;
+	if (parsed->sccp_type == SCCP_MSG_TYPE_CR)
+		NAT_MSGB_CB(msg)->prio = NAT_PRIO_CR;
 	queue_for_msc(con_msc, msg);
-	talloc_free(parsed);
 	return 0;
 
 exit:
@@ -872,40 +990,27 @@ exit:
 	}
 
 exit2:
-	talloc_free(parsed);
 	msgb_free(msg);
 	return -1;
 
 exit3:
 	/* send a SCCP Connection Refused */
 	bsc_send_con_refuse(bsc, parsed, con_type);
-	talloc_free(parsed);
+	msgb_free(msg);
+	return -1;
+
+exit4:
+	/* refuse it without rejecting the MS */
+	bsc_send_sccp_refuse(bsc, parsed, refuse_cause);
 	msgb_free(msg);
 	return -1;
 }
 
-static int ipaccess_bsc_read_cb(struct bsc_fd *bfd)
+static void bsc_handle_msg(struct bsc_connection *bsc, struct msgb *msg,
+			   struct bsc_nat_parsed *parsed)
 {
-	int error;
-	struct bsc_connection *bsc = bfd->data;
-	struct msgb *msg = ipaccess_read_msg(bfd, &error);
 	struct ipaccess_head *hh;
 
-	if (!msg) {
-		if (error == 0)
-			LOGP(DNAT, LOGL_ERROR,
-			     "The connection to the BSC Nr: %d was lost. Cleaning it\n",
-			     bsc->cfg ? bsc->cfg->nr : -1);
-		else
-			LOGP(DNAT, LOGL_ERROR,
-			     "Stream error on BSC Nr: %d. Failed to parse ip access message: %d\n",
-			     bsc->cfg ? bsc->cfg->nr : -1, error);
-
-		bsc_close_connection(bsc);
-		return -1;
-	}
-
-
 	LOGP(DNAT, LOGL_DEBUG, "MSG from BSC: %s proto: %d\n", hexdump(msg->data, msg->len), msg->l2h[0]);
 
 	/* Handle messages from the BSC */
@@ -914,30 +1019,66 @@ static int ipaccess_bsc_read_cb(struct bsc_fd *bfd)
 	/* stop the pong timeout */
 	if (hh->proto == IPAC_PROTO_IPACCESS) {
 		if (msg->l2h[0] == IPAC_MSGT_PONG) {
-			bsc_del_timer(&bsc->pong_timeout);
+			bsc_wheel_del(&nat_wheel, &bsc->pong_timeout);
 			msgb_free(msg);
-			return 0;
+			return;
 		} else if (msg->l2h[0] == IPAC_MSGT_PING) {
 			send_pong(bsc);
 			msgb_free(msg);
-			return 0;
+			return;
 		}
 	}
 
 	/* FIXME: Currently no PONG is sent to the BSC */
 	/* FIXME: Currently no ID ACK is sent to the BSC */
-	forward_sccp_to_msc(bsc, msg);
+	forward_sccp_to_msc(bsc, msg, parsed);
+}
+
+static void bsc_lost(struct bsc_connection *bsc, int error)
+{
+	if (error == 0)
+		LOGP(DNAT, LOGL_ERROR,
+		     "The connection to the BSC Nr: %d was lost. Cleaning it\n",
+		     bsc->cfg ? bsc->cfg->nr : -1);
+	else
+		LOGP(DNAT, LOGL_ERROR,
+		     "Stream error on BSC Nr: %d. Failed to parse ip access message: %d\n",
+		     bsc->cfg ? bsc->cfg->nr : -1, error);
 
+	bsc_close_connection(bsc);
+}
+
+static int ipaccess_bsc_read_cb(struct bsc_fd *bfd)
+{
+	int error;
+	struct bsc_connection *bsc = bfd->data;
+	struct msgb *msg = ipaccess_read_msg(bfd, &error);
+	struct bsc_nat_parsed parsed;
+
+	if (!msg) {
+		bsc_lost(bsc, error);
+		return -1;
+	}
+
+	NAT_MSGB_CB(msg)->stamp = bsc_nat_lat_now();
+	if (bsc_nat_parse(msg, &parsed) != 0)
+		bsc_handle_msg(bsc, msg, NULL);
+	else
+		bsc_handle_msg(bsc, msg, &parsed);
 	return 0;
 }
 
 static int ipaccess_bsc_write_cb(struct bsc_fd *bfd, struct msgb *msg)
 {
+	struct bsc_connection *bsc = bfd->data;
 	int rc;
 
+	bsc_nat_queue_written(&bsc->queue, msg);
 	rc = write(bfd->fd, msg->data, msg->len);
 	if (rc != msg->len)
 		LOGP(DNAT, LOGL_ERROR, "Failed to write message to the BSC.\n");
+	else
+		bsc_nat_lat_record(bsc->cfg, NAT_LAT_TO_BSC, msg);
 
 	return rc;
 }
@@ -997,14 +1138,23 @@ static int ipaccess_listen_bsc_cb(struct bsc_fd *bfd, unsigned int what)
 	bsc->write_queue.bfd.fd = fd;
 	bsc->write_queue.read_cb = ipaccess_bsc_read_cb;
 	bsc->write_queue.write_cb = ipaccess_bsc_write_cb;
-	bsc->write_queue.bfd.when = BSC_FD_READ;
-	if (bsc_register_fd(&bsc->write_queue.bfd) < 0) {
+	bsc->write_queue.bfd.when = nat->workers ? 0 : BSC_FD_READ;
+	if (bsc_epoll_register_fd(&bsc->write_queue.bfd) < 0) {
 		LOGP(DNAT, LOGL_ERROR, "Failed to register BSC fd.\n");
 		close(fd);
 		talloc_free(bsc);
 		return -2;
 	}
 
+	/* the reading is done by a BSC thread */
+	if (nat->workers && bsc_nat_worker_add(nat, bsc) != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to hand the BSC fd to a thread.\n");
+		bsc_epoll_unregister_fd(&bsc->write_queue.bfd);
+		close(fd);
+		talloc_free(bsc);
+		return -3;
+	}
+
 	LOGP(DNAT, LOGL_NOTICE, "BSC connection on %d with IP: %s\n",
 		fd, inet_ntoa(sa.sin_addr));
 	llist_add(&bsc->list_entry, &nat->bsc_connections);
@@ -1017,7 +1167,7 @@ static int ipaccess_listen_bsc_cb(struct bsc_fd *bfd, unsigned int what)
 	 */
 	bsc->id_timeout.data = bsc;
 	bsc->id_timeout.cb = ipaccess_close_bsc;
-	bsc_schedule_timer(&bsc->id_timeout, nat->auth_timeout, 0);
+	bsc_wheel_schedule(&nat_wheel, &bsc->id_timeout, nat->auth_timeout, 0);
 	return 0;
 }
 
@@ -1073,6 +1223,7 @@ static void print_help()
 	printf("  -c --config-file filename The config file to use.\n");
 	printf("  -m --msc=IP. The address of the MSC.\n");
 	printf("  -l --local=IP. The local address of this BSC.\n");
+	printf("  -e --epoll Use epoll for the BSC connections and RTP.\n");
 }
 
 static void handle_options(int argc, char **argv)
@@ -1087,10 +1238,11 @@ static void handle_options(int argc, char **argv)
 			{"timestamp", 0, 0, 'T'},
 			{"msc", 1, 0, 'm'},
 			{"local", 1, 0, 'l'},
+			{"epoll", 0, 0, 'e'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "hd:sTPc:m:l:",
+		c = getopt_long(argc, argv, "hd:sTPc:m:l:e",
 				long_options, &option_index);
 		if (c == -1)
 			break;
@@ -1118,6 +1270,9 @@ static void handle_options(int argc, char **argv)
 		case 'l':
 			inet_aton(optarg, &local_addr);
 			break;
+		case 'e':
+			use_epoll = 1;
+			break;
 		default:
 			/* ignore */
 			break;
@@ -1159,7 +1314,7 @@ static void sccp_close_unconfirmed(void *_data)
 		sccp_connection_destroy(conn);
 	}
 
-	bsc_schedule_timer(&sccp_close, SCCP_CLOSE_TIME, 0);
+	bsc_wheel_schedule(&nat_wheel, &sccp_close, SCCP_CLOSE_TIME, 0);
 }
 
 extern void *tall_msgb_ctx;
@@ -1182,6 +1337,7 @@ static struct vty_app_info vty_info = {
 
 int main(int argc, char **argv)
 {
+	struct bsc_nat_msc *msc;
 	int rc;
 
 	talloc_init_ctx();
@@ -1215,6 +1371,10 @@ int main(int argc, char **argv)
 
 	rate_ctr_init(tall_bsc_ctx);
 
+	/* before the early bind of the RTP ports */
+	if (use_epoll && bsc_epoll_init() != 0)
+		return -5;
+
 	/* init vty and parse */
 	telnet_init(tall_bsc_ctx, NULL, 4244);
 	if (mgcp_parse_config(config_file, nat->mgcp_cfg) < 0) {
@@ -1222,7 +1382,7 @@ int main(int argc, char **argv)
 		return -3;
 	}
 
-	/* over rule the VTY config */
+	/* over rule the VTY config of the first MSC */
 	if (msc_ip)
 		bsc_nat_set_msc_ip(nat, msc_ip);
 
@@ -1235,19 +1395,32 @@ int main(int argc, char **argv)
 	if (bsc_mgcp_nat_init(nat) != 0)
 		return -4;
 
-	/* connect to the MSC */
-	nat->msc_con = bsc_msc_create(nat->msc_ip, nat->msc_port, 0);
-	if (!nat->msc_con) {
-		fprintf(stderr, "Creating a bsc_msc_connection failed.\n");
-		exit(1);
+	/* connect to the MSCs */
+	llist_for_each_entry(msc, &nat->mscs, entry) {
+		msc->con = bsc_msc_create(msc->ip, msc->port, 0);
+		if (!msc->con) {
+			fprintf(stderr, "Creating a bsc_msc_connection failed.\n");
+			exit(1);
+		}
+
+		msc->con->connection_loss = msc_connection_was_lost;
+		msc->con->connected = msc_connection_connected;
+		msc->con->write_queue.read_cb = ipaccess_msc_read_cb;
+		msc->con->write_queue.write_cb = ipaccess_msc_write_cb;
+		msc->con->write_queue.bfd.data = msc;
+		bsc_nat_queue_init(&msc->queue, &msc->con->write_queue,
+				   &nat->msc_queue_limit);
+		bsc_msc_connect(msc->con);
 	}
 
-	nat->msc_con->connection_loss = msc_connection_was_lost;
-	nat->msc_con->connected = msc_connection_connected;
-	nat->msc_con->write_queue.read_cb = ipaccess_msc_read_cb;
-	nat->msc_con->write_queue.write_cb = ipaccess_msc_write_cb;;
-	nat->msc_con->write_queue.bfd.data = nat->msc_con;
-	bsc_msc_connect(nat->msc_con);
+	/* the connections of the last run wait for their BSC */
+	bsc_nat_snapshot_load(nat);
+
+	/* read and parse the BSC connections on threads */
+	if (bsc_nat_workers_start(nat, bsc_handle_msg, bsc_lost) != 0) {
+		fprintf(stderr, "Failed to start the BSC threads.\n");
+		exit(1);
+	}
 
 	/* wait for the BSC */
 	if (listen_for_bsc(&bsc_listen, &local_addr, 5000) < 0) {
@@ -1271,7 +1444,7 @@ int main(int argc, char **argv)
 	sccp_set_log_area(DSCCP);
 	sccp_close.cb = sccp_close_unconfirmed;
 	sccp_close.data = NULL;
-	bsc_schedule_timer(&sccp_close, SCCP_CLOSE_TIME, 0);
+	bsc_wheel_schedule(&nat_wheel, &sccp_close, SCCP_CLOSE_TIME, 0);
 
 	while (1) {
 		bsc_select_main(0);
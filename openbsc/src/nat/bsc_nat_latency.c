@@ -0,0 +1,255 @@
+/* Forwarding latency of the NAT */
+
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * A bucket of the histogram is found from the highest set bit of the
+ * latency and the three bits below it. The values below 16 usec get a
+ * bucket each, after that every power of two is split into eight.
+ * Recording a message is a couple of shifts and no search.
+ */
+
+#include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_msc.h>
+#include <openbsc/debug.h>
+
+#include <osmocore/talloc.h>
+
+#include <osmocom/sccp/sccp.h>
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#define LAT_SUB		(1 << NAT_LAT_SUB_BITS)
+
+static const char *lat_dir_names[NAT_LAT_DIRS] = {
+	[NAT_LAT_TO_MSC] = "to-msc",
+	[NAT_LAT_TO_BSC] = "to-bsc",
+};
+
+static const char *lat_type_names[NAT_LAT_TYPES] = {
+	[NAT_LAT_CR] = "CR",
+	[NAT_LAT_CC] = "CC",
+	[NAT_LAT_DT1] = "DT1",
+	[NAT_LAT_RLSD] = "RLSD",
+	[NAT_LAT_UDT] = "UDT",
+	[NAT_LAT_OTHER] = "other",
+};
+
+/* zero is used for a message that was not stamped */
+uint32_t bsc_nat_lat_now(void)
+{
+	struct timespec now;
+	uint32_t usec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	return usec ? usec : 1;
+}
+
+int bsc_nat_lat_type(int sccp_type)
+{
+	switch (sccp_type) {
+	case SCCP_MSG_TYPE_CR:
+		return NAT_LAT_CR;
+	case SCCP_MSG_TYPE_CC:
+		return NAT_LAT_CC;
+	case SCCP_MSG_TYPE_DT1:
+		return NAT_LAT_DT1;
+	case SCCP_MSG_TYPE_RLSD:
+		return NAT_LAT_RLSD;
+	case SCCP_MSG_TYPE_UDT:
+		return NAT_LAT_UDT;
+	default:
+		return NAT_LAT_OTHER;
+	}
+}
+
+const char *bsc_nat_lat_type_name(int type)
+{
+	if (type < 0 || type >= NAT_LAT_TYPES)
+		return "unknown";
+	return lat_type_names[type];
+}
+
+int bsc_nat_lat_bucket(uint32_t usec)
+{
+	int msb, bucket;
+
+	if (usec < LAT_SUB)
+		return usec;
+
+	msb = 31 - __builtin_clz(usec);
+	bucket = (msb - NAT_LAT_SUB_BITS + 1) * LAT_SUB +
+		 (usec >> (msb - NAT_LAT_SUB_BITS)) - LAT_SUB;
+	return bucket < NAT_LAT_BUCKETS ? bucket : NAT_LAT_BUCKETS - 1;
+}
+
+uint32_t bsc_nat_lat_bucket_start(int bucket)
+{
+	if (bucket < LAT_SUB)
+		return bucket;
+
+	return (LAT_SUB + bucket % LAT_SUB) << (bucket / LAT_SUB - 1);
+}
+
+void bsc_nat_lat_add(struct bsc_nat_lat_hist *hist, uint32_t usec)
+{
+	hist->buckets[bsc_nat_lat_bucket(usec)] += 1;
+	hist->count += 1;
+	hist->sum += usec;
+	if (usec > hist->max)
+		hist->max = usec;
+}
+
+void bsc_nat_lat_merge(struct bsc_nat_lat_hist *dst, const struct bsc_nat_lat_hist *src)
+{
+	int i;
+
+	if (src->count == 0)
+		return;
+
+	for (i = 0; i < NAT_LAT_BUCKETS; ++i)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* the upper end of the bucket holding the percentile, not above the max */
+uint32_t bsc_nat_lat_percentile(const struct bsc_nat_lat_hist *hist, int permille)
+{
+	unsigned long rank, seen = 0;
+	uint32_t end;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = (hist->count * permille + 999) / 1000;
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < NAT_LAT_BUCKETS - 1; ++i) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i == NAT_LAT_BUCKETS - 1)
+		return hist->max;
+
+	end = bsc_nat_lat_bucket_start(i + 1) - 1;
+	return end < hist->max ? end : hist->max;
+}
+
+/* called by the write queues once the message was written */
+void bsc_nat_lat_record(struct bsc_config *cfg, int dir, struct msgb *msg)
+{
+	struct bsc_nat_msg_cb *cb = NAT_MSGB_CB(msg);
+
+	if (!cfg || cb->stamp == 0)
+		return;
+
+	bsc_nat_lat_add(&cfg->stats.lat[dir][cb->type],
+			bsc_nat_lat_now() - cb->stamp);
+}
+
+static void dump_hist(FILE *file, const char *prefix, const char *type,
+		      const struct bsc_nat_lat_hist *hist)
+{
+	fprintf(file, "%s %s count: %lu avg: %llu p50: %u p90: %u p99: %u max: %u\n",
+		prefix, type, hist->count,
+		(unsigned long long) (hist->sum / hist->count),
+		bsc_nat_lat_percentile(hist, 500),
+		bsc_nat_lat_percentile(hist, 900),
+		bsc_nat_lat_percentile(hist, 990), hist->max);
+}
+
+int bsc_nat_lat_dump(struct bsc_nat *nat, FILE *file)
+{
+	struct bsc_config *conf;
+	struct bsc_nat_msc *msc;
+	char prefix[64];
+	int dir, type;
+
+	fprintf(file, "latency at %lu\n", (unsigned long) time(NULL));
+
+	llist_for_each_entry(conf, &nat->bsc_configs, entry) {
+		for (dir = 0; dir < NAT_LAT_DIRS; ++dir) {
+			snprintf(prefix, sizeof(prefix), " bsc %d %s",
+				 conf->nr, lat_dir_names[dir]);
+			for (type = 0; type < NAT_LAT_TYPES; ++type) {
+				const struct bsc_nat_lat_hist *hist;
+
+				hist = &conf->stats.lat[dir][type];
+				if (hist->count == 0)
+					continue;
+				dump_hist(file, prefix, lat_type_names[type], hist);
+			}
+		}
+
+		fprintf(file, " bsc %d write-queue max: %u\n",
+			conf->nr, conf->stats.wq_hwm);
+	}
+
+	llist_for_each_entry(msc, &nat->mscs, entry)
+		fprintf(file, " msc %d write-queue max: %u\n",
+			msc->nr, msc->wq_hwm);
+
+	return ferror(file) ? -1 : 0;
+}
+
+static void lat_dump_cb(void *_nat)
+{
+	struct bsc_nat *nat = _nat;
+	FILE *file;
+
+	file = fopen(nat->lat_dump_file, "a");
+	if (!file) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to open %s: %s\n",
+		     nat->lat_dump_file, strerror(errno));
+	} else {
+		if (bsc_nat_lat_dump(nat, file) != 0)
+			LOGP(DNAT, LOGL_ERROR, "Failed to write %s.\n",
+			     nat->lat_dump_file);
+		fclose(file);
+	}
+
+	bsc_schedule_timer(&nat->lat_dump_timer, nat->lat_dump_interval, 0);
+}
+
+/* (re)arm the periodic dump after the config changed */
+void bsc_nat_lat_dump_schedule(struct bsc_nat *nat)
+{
+	nat->lat_dump_timer.cb = lat_dump_cb;
+	nat->lat_dump_timer.data = nat;
+
+	if (!nat->lat_dump_file || nat->lat_dump_interval <= 0) {
+		bsc_del_timer(&nat->lat_dump_timer);
+		return;
+	}
+
+	bsc_schedule_timer(&nat->lat_dump_timer, nat->lat_dump_interval, 0);
+}
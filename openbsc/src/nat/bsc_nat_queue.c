@@ -0,0 +1,152 @@
+/* Bounded write queues of the NAT */
+
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * The messages are put into the msg_queue of the libosmocore write
+ * queue directly, the write_queue_bfd_cb still writes them from the
+ * head. A message is inserted behind the last one of the same or a
+ * higher class, the queue stays sorted and the paging is at its tail.
+ *
+ * A class may only use a part of the limit. Paging gets half of it,
+ * new connections three quarters and the rest the whole queue. Paging
+ * is thrown out of the tail to make room for the other classes.
+ */
+
+#include <openbsc/bsc_nat.h>
+#include <openbsc/debug.h>
+
+#include <osmocore/msgb.h>
+
+#include <string.h>
+
+static const char *prio_names[NAT_PRIO_CLASSES] = {
+	[NAT_PRIO_CON] = "connection",
+	[NAT_PRIO_CR] = "new connection",
+	[NAT_PRIO_PAGING] = "paging",
+};
+
+void bsc_nat_queue_init(struct bsc_nat_queue *queue, struct write_queue *wq,
+			const struct bsc_nat_queue_limit *limit)
+{
+	memset(queue, 0, sizeof(*queue));
+	queue->wq = wq;
+	queue->limit = limit;
+}
+
+/* write_queue_clear() frees the messages behind our back */
+static void queue_sync(struct bsc_nat_queue *queue)
+{
+	if (!llist_empty(&queue->wq->msg_queue))
+		return;
+
+	queue->bytes = 0;
+	memset(queue->queued, 0, sizeof(queue->queued));
+}
+
+static int queue_fits(struct bsc_nat_queue *queue, int prio, unsigned int len)
+{
+	unsigned int msgs = queue->limit->msgs;
+	unsigned int bytes = queue->limit->bytes;
+
+	switch (prio) {
+	case NAT_PRIO_CR:
+		msgs = msgs * 3 / 4;
+		bytes = bytes * 3 / 4;
+		break;
+	case NAT_PRIO_PAGING:
+		msgs = msgs / 2;
+		bytes = bytes / 2;
+		break;
+	}
+
+	return queue->wq->current_length < msgs && queue->bytes + len <= bytes;
+}
+
+static void queue_unlink(struct bsc_nat_queue *queue, struct msgb *msg)
+{
+	int prio = NAT_MSGB_CB(msg)->prio;
+
+	queue->bytes -= msg->len < queue->bytes ? msg->len : queue->bytes;
+	if (queue->queued[prio] > 0)
+		queue->queued[prio] -= 1;
+}
+
+/* make room for the message by dropping the paging */
+int bsc_nat_queue_admit(struct bsc_nat_queue *queue, int prio, unsigned int len)
+{
+	struct llist_head *list = &queue->wq->msg_queue;
+
+	queue_sync(queue);
+
+	while (!queue_fits(queue, prio, len)) {
+		struct msgb *tail;
+
+		if (prio == NAT_PRIO_PAGING || llist_empty(list))
+			return 0;
+
+		tail = llist_entry(list->prev, struct msgb, list);
+		if (NAT_MSGB_CB(tail)->prio != NAT_PRIO_PAGING)
+			return 0;
+
+		llist_del(&tail->list);
+		queue->wq->current_length -= 1;
+		queue_unlink(queue, tail);
+		queue->dropped[NAT_PRIO_PAGING] += 1;
+		msgb_free(tail);
+	}
+
+	return 1;
+}
+
+int bsc_nat_queue_enqueue(struct bsc_nat_queue *queue, struct msgb *msg)
+{
+	struct llist_head *list = &queue->wq->msg_queue;
+	struct llist_head *pos;
+	int prio = NAT_MSGB_CB(msg)->prio;
+
+	if (!bsc_nat_queue_admit(queue, prio, msg->len)) {
+		LOGP(DNAT, prio == NAT_PRIO_PAGING ? LOGL_DEBUG : LOGL_ERROR,
+		     "Write queue full, dropping %s message.\n", prio_names[prio]);
+		queue->dropped[prio] += 1;
+		msgb_free(msg);
+		return -1;
+	}
+
+	/* behind the last message of the same or a more important class */
+	for (pos = list->prev; pos != list; pos = pos->prev)
+		if (NAT_MSGB_CB(llist_entry(pos, struct msgb, list))->prio <= prio)
+			break;
+	llist_add(&msg->list, pos);
+
+	queue->wq->current_length += 1;
+	queue->wq->bfd.when |= BSC_FD_WRITE;
+	queue->bytes += msg->len;
+	queue->queued[prio] += 1;
+	return 0;
+}
+
+/* called from the write_cb, the message was taken off the queue */
+void bsc_nat_queue_written(struct bsc_nat_queue *queue, struct msgb *msg)
+{
+	queue_unlink(queue, msg);
+}
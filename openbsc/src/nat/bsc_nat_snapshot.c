@@ -0,0 +1,679 @@
+/* Snapshot of the NAT connections for a warm restart */
+
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * The snapshot is a header followed by one fixed size record for every
+ * SCCP connection. It is written into a temporary file, synced and
+ * renamed over the old one, a crash leaves the old snapshot.
+ *
+ * On start the records are sorted by the BSC and the patched references
+ * are reserved on their MSC, new connections can not take them. When a
+ * BSC authenticates its records are turned into connections again. The
+ * rest is released towards the MSC once the grace time is over. The
+ * MSC is not reset while connections are waiting for their BSC, the
+ * reset is sent when none is left. It also clears the connections that
+ * were opened after the last snapshot, the NAT does not know them.
+ *
+ * The periodic snapshot is copied on the select loop and written by a
+ * helper thread, signalling does not wait for the disk.
+ */
+
+#include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_nat_sccp.h>
+#include <openbsc/bsc_msc.h>
+#include <openbsc/ipaccess.h>
+#include <openbsc/debug.h>
+
+#include <osmocore/talloc.h>
+
+#include <osmocom/sccp/sccp.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC		0x4e415453
+#define SNAPSHOT_VERSION	1
+
+struct snapshot_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t record_size;
+	int64_t time;
+};
+
+static uint32_t ref_to_int(const struct sccp_source_reference *ref)
+{
+	return ref->octet1 | ref->octet2 << 8 | ref->octet3 << 16;
+}
+
+static void int_to_ref(uint32_t val, struct sccp_source_reference *ref)
+{
+	ref->octet1 = (val >>  0) & 0xff;
+	ref->octet2 = (val >>  8) & 0xff;
+	ref->octet3 = (val >> 16) & 0xff;
+}
+
+static int snapshot_con(struct sccp_connections *con, struct bsc_nat_snapshot_con *rec)
+{
+	if (con->con_local || !con->bsc || !con->bsc->cfg || !con->msc)
+		return 0;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->bsc_nr = con->bsc->cfg->nr;
+	rec->lac = con->bsc->cfg->lac;
+	rec->msc_nr = con->msc->nr;
+	rec->con_type = con->con_type;
+	rec->real_ref = ref_to_int(&con->real_ref);
+	rec->patched_ref = ref_to_int(&con->patched_ref);
+	if (con->has_remote_ref) {
+		rec->flags |= NAT_SNAP_REMOTE;
+		rec->remote_ref = ref_to_int(&con->remote_ref);
+	}
+	if (con->imsi_checked)
+		rec->flags |= NAT_SNAP_IMSI_CHECKED;
+	rec->msc_endp = con->msc_endp;
+	rec->bsc_endp = con->bsc_endp;
+	return 1;
+}
+
+/* the snapshot to write, it does not point back into the NAT */
+struct snapshot_job {
+	char *file;
+	void *data;
+	size_t size;
+};
+
+/*
+ * The periodic snapshot is written by a helper thread, the select loop
+ * only copies the records. The thread does not log, the main loop
+ * reports the outcome when the next snapshot is due.
+ */
+struct snapshot_writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* the next snapshot, a newer one replaces it */
+	struct snapshot_job *job;
+	int busy;
+
+	/* results of the thread */
+	unsigned long written;
+	unsigned long errors;
+	unsigned long skipped;
+	const char *failed_op;
+	int failed_errno;
+
+	/* what the main loop has seen of them */
+	unsigned long reported_written;
+	unsigned long reported_errors;
+	unsigned long reported_skipped;
+};
+
+static void job_free(struct snapshot_job *job)
+{
+	if (!job)
+		return;
+	free(job->file);
+	free(job->data);
+	free(job);
+}
+
+/* copy the connections, this is all that is done on the select loop */
+static struct snapshot_job *snapshot_collect(struct bsc_nat *nat)
+{
+	struct bsc_nat_snapshot_con *recs;
+	struct sccp_connections *con;
+	struct snapshot_job *job;
+	struct snapshot_hdr *hdr;
+	unsigned int count = 0, max = 0;
+
+	llist_for_each_entry(con, &nat->sccp_connections, list_entry)
+		max += 1;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+
+	job->file = strdup(nat->snapshot.file);
+	job->data = malloc(sizeof(*hdr) + max * sizeof(*recs));
+	if (!job->file || !job->data) {
+		job_free(job);
+		return NULL;
+	}
+
+	hdr = job->data;
+	recs = (struct bsc_nat_snapshot_con *) (hdr + 1);
+	llist_for_each_entry(con, &nat->sccp_connections, list_entry)
+		count += snapshot_con(con, &recs[count]);
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = SNAPSHOT_MAGIC;
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->count = count;
+	hdr->record_size = sizeof(*recs);
+	hdr->time = time(NULL);
+	job->size = sizeof(*hdr) + count * sizeof(*recs);
+	return job;
+}
+
+/*
+ * Write the snapshot into a temporary file and rename it over the old
+ * one. This does not log and it does not touch the NAT, it is run by the
+ * helper thread. On failure the failed call is put into op.
+ */
+static int snapshot_store(const struct snapshot_job *job, const char **op)
+{
+	const char *data = job->data;
+	size_t left = job->size;
+	char tmp[PATH_MAX];
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", job->file) >= sizeof(tmp)) {
+		*op = "name";
+		return -ENAMETOOLONG;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		*op = "create";
+		return -errno;
+	}
+
+	while (left > 0) {
+		ssize_t rc = write(fd, data, left);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			*op = "write";
+			goto error_close;
+		}
+		data += rc;
+		left -= rc;
+	}
+
+	if (fsync(fd) != 0) {
+		*op = "sync";
+		goto error_close;
+	}
+
+	if (close(fd) != 0) {
+		*op = "close";
+		goto error;
+	}
+
+	if (rename(tmp, job->file) != 0) {
+		*op = "rename";
+		goto error;
+	}
+
+	return 0;
+
+error_close:
+	close(fd);
+error:
+	fd = errno;
+	unlink(tmp);
+	return -fd;
+}
+
+static void *writer_main(void *_writer)
+{
+	struct snapshot_writer *writer = _writer;
+
+	pthread_mutex_lock(&writer->lock);
+	while (1) {
+		struct snapshot_job *job;
+		const char *op = NULL;
+		int rc;
+
+		while (!writer->job)
+			pthread_cond_wait(&writer->cond, &writer->lock);
+
+		job = writer->job;
+		writer->job = NULL;
+		writer->busy = 1;
+		pthread_mutex_unlock(&writer->lock);
+
+		rc = snapshot_store(job, &op);
+		job_free(job);
+
+		pthread_mutex_lock(&writer->lock);
+		writer->busy = 0;
+		if (rc == 0) {
+			writer->written += 1;
+		} else {
+			writer->errors += 1;
+			writer->failed_op = op;
+			writer->failed_errno = -rc;
+		}
+	}
+
+	return NULL;
+}
+
+static struct snapshot_writer *writer_start(void)
+{
+	struct snapshot_writer *writer;
+	pthread_attr_t attr;
+	int rc;
+
+	writer = calloc(1, sizeof(*writer));
+	if (!writer)
+		return NULL;
+
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&writer->thread, &attr, writer_main, writer);
+	pthread_attr_destroy(&attr);
+	if (rc != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to start the snapshot writer: %s\n",
+		     strerror(rc));
+		pthread_cond_destroy(&writer->cond);
+		pthread_mutex_destroy(&writer->lock);
+		free(writer);
+		return NULL;
+	}
+
+	return writer;
+}
+
+/* take over what the writer did since the last time */
+static void writer_report(struct bsc_nat_snapshot *snap)
+{
+	struct snapshot_writer *writer = snap->writer;
+	unsigned long written, errors, skipped;
+	const char *op;
+	int err;
+
+	pthread_mutex_lock(&writer->lock);
+	written = writer->written;
+	errors = writer->errors;
+	skipped = writer->skipped;
+	op = writer->failed_op;
+	err = writer->failed_errno;
+	pthread_mutex_unlock(&writer->lock);
+
+	if (errors != writer->reported_errors)
+		LOGP(DNAT, LOGL_ERROR, "Failed to %s the snapshot %s: %s (%lu times).\n",
+		     op, snap->file, strerror(err), errors - writer->reported_errors);
+	if (skipped != writer->reported_skipped)
+		LOGP(DNAT, LOGL_NOTICE, "The disk is slow, %lu snapshots were skipped.\n",
+		     skipped - writer->reported_skipped);
+
+	snap->written += written - writer->reported_written;
+	snap->write_errors += errors - writer->reported_errors;
+	writer->reported_written = written;
+	writer->reported_errors = errors;
+	writer->reported_skipped = skipped;
+}
+
+/* hand the snapshot to the writer, it is written in the background */
+static int snapshot_queue(struct bsc_nat *nat)
+{
+	struct bsc_nat_snapshot *snap = &nat->snapshot;
+	struct snapshot_job *job, *old;
+
+	if (!snap->writer)
+		snap->writer = writer_start();
+	if (!snap->writer)
+		return bsc_nat_snapshot_write(nat);
+
+	writer_report(snap);
+
+	job = snapshot_collect(nat);
+	if (!job) {
+		snap->write_errors += 1;
+		return -1;
+	}
+
+	pthread_mutex_lock(&snap->writer->lock);
+	old = snap->writer->job;
+	snap->writer->job = job;
+	if (old)
+		snap->writer->skipped += 1;
+	pthread_cond_signal(&snap->writer->cond);
+	pthread_mutex_unlock(&snap->writer->lock);
+
+	job_free(old);
+	return 0;
+}
+
+/* write the snapshot now, this blocks until it is on the disk */
+int bsc_nat_snapshot_write(struct bsc_nat *nat)
+{
+	struct bsc_nat_snapshot *snap = &nat->snapshot;
+	struct snapshot_job *job;
+	const char *op = NULL;
+	int rc;
+
+	job = snapshot_collect(nat);
+	if (!job) {
+		snap->write_errors += 1;
+		return -1;
+	}
+
+	rc = snapshot_store(job, &op);
+	job_free(job);
+	if (rc != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to %s the snapshot %s: %s\n",
+		     op, snap->file, strerror(-rc));
+		snap->write_errors += 1;
+		return -1;
+	}
+
+	snap->written += 1;
+	return 0;
+}
+
+static void snapshot_cb(void *_nat)
+{
+	struct bsc_nat *nat = _nat;
+
+	snapshot_queue(nat);
+	bsc_schedule_timer(&nat->snapshot.timer, nat->snapshot.interval, 0);
+}
+
+/* (re)arm the periodic snapshot after the config changed */
+void bsc_nat_snapshot_schedule(struct bsc_nat *nat)
+{
+	struct bsc_nat_snapshot *snap = &nat->snapshot;
+
+	snap->timer.cb = snapshot_cb;
+	snap->timer.data = nat;
+
+	if (!snap->file || snap->interval <= 0) {
+		bsc_del_timer(&snap->timer);
+		return;
+	}
+
+	bsc_schedule_timer(&snap->timer, snap->interval, 0);
+}
+
+static int rec_cmp(const void *_a, const void *_b)
+{
+	const struct bsc_nat_snapshot_con *a = _a, *b = _b;
+
+	return (int) a->bsc_nr - (int) b->bsc_nr;
+}
+
+static void grace_cb(void *_nat)
+{
+	bsc_nat_snapshot_expire(_nat);
+}
+
+/* take the records of a readable and recent snapshot */
+int bsc_nat_snapshot_load(struct bsc_nat *nat)
+{
+	struct bsc_nat_snapshot *snap = &nat->snapshot;
+	const struct snapshot_hdr *hdr;
+	const struct bsc_nat_snapshot_con *recs;
+	struct stat st;
+	void *map;
+	int fd, i;
+
+	if (!snap->file)
+		return 0;
+
+	fd = open(snap->file, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			LOGP(DNAT, LOGL_ERROR, "Failed to open %s: %s\n",
+			     snap->file, strerror(errno));
+		return 0;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to map %s: %s\n", snap->file, strerror(errno));
+		return 0;
+	}
+
+	hdr = map;
+	recs = (const struct bsc_nat_snapshot_con *) (hdr + 1);
+	if (hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION ||
+	    hdr->record_size != sizeof(*recs) ||
+	    hdr->count > (st.st_size - sizeof(*hdr)) / sizeof(*recs)) {
+		LOGP(DNAT, LOGL_ERROR, "Ignoring the broken snapshot %s.\n", snap->file);
+		goto out;
+	}
+
+	if (time(NULL) - hdr->time > snap->grace) {
+		LOGP(DNAT, LOGL_NOTICE, "The snapshot %s is too old.\n", snap->file);
+		goto out;
+	}
+
+	snap->pending = talloc_array(nat, struct bsc_nat_snapshot_con, hdr->count);
+	if (!snap->pending && hdr->count > 0)
+		goto out;
+
+	for (i = 0; i < hdr->count; ++i) {
+		struct bsc_nat_msc *msc = bsc_nat_msc_num(nat, recs[i].msc_nr);
+
+		if (!msc || sccp_ref_reserve(msc, recs[i].patched_ref) != 0) {
+			LOGP(DNAT, LOGL_ERROR, "Can not restore 0x%x of MSC %d.\n",
+			     recs[i].patched_ref, recs[i].msc_nr);
+			continue;
+		}
+
+		snap->pending[snap->nr_pending++] = recs[i];
+	}
+
+	qsort(snap->pending, snap->nr_pending, sizeof(*snap->pending), rec_cmp);
+	snap->left = snap->nr_pending;
+
+	snap->grace_timer.cb = grace_cb;
+	snap->grace_timer.data = nat;
+	bsc_schedule_timer(&snap->grace_timer, snap->grace, 0);
+
+	LOGP(DNAT, LOGL_NOTICE, "Waiting %d seconds for the BSCs of %d connections.\n",
+	     snap->grace, snap->left);
+
+out:
+	munmap(map, st.st_size);
+	return snap->left;
+}
+
+static void adopt_endpoints(struct bsc_connection *bsc, struct sccp_connections *con,
+			    const struct bsc_nat_snapshot_con *rec)
+{
+	struct bsc_nat *nat = bsc->nat;
+
+	if (!nat->bsc_endpoints)
+		return;
+
+	if (rec->msc_endp <= 0 || rec->msc_endp >= nat->mgcp_cfg->number_endpoints ||
+	    rec->bsc_endp <= 0 || rec->bsc_endp >= ARRAY_SIZE(bsc->endpoint_status))
+		return;
+
+	if (nat->bsc_endpoints[rec->msc_endp].con || bsc->endpoint_status[rec->bsc_endp])
+		return;
+
+	con->msc_endp = rec->msc_endp;
+	con->bsc_endp = rec->bsc_endp;
+	nat->bsc_endpoints[con->msc_endp].con = con;
+	bsc->endpoint_status[con->bsc_endp] = 1;
+}
+
+/* the BSC authenticated, take over its connections of the last run */
+int bsc_nat_snapshot_adopt(struct bsc_connection *bsc)
+{
+	struct bsc_nat_snapshot *snap = &bsc->nat->snapshot;
+	int lo = 0, hi = snap->nr_pending, adopted = 0;
+
+	if (snap->left == 0)
+		return 0;
+
+	/* the first record of the BSC */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (snap->pending[mid].bsc_nr < bsc->cfg->nr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < snap->nr_pending && snap->pending[lo].bsc_nr == bsc->cfg->nr; ++lo) {
+		struct bsc_nat_snapshot_con *rec = &snap->pending[lo];
+		struct sccp_source_reference real, patched, remote;
+		struct sccp_connections *con;
+		struct bsc_nat_msc *msc;
+
+		if (rec->flags & NAT_SNAP_DONE || rec->lac != bsc->cfg->lac)
+			continue;
+
+		msc = bsc_nat_msc_num(bsc->nat, rec->msc_nr);
+		int_to_ref(rec->real_ref, &real);
+		int_to_ref(rec->patched_ref, &patched);
+		con = sccp_connection_adopt(bsc, msc, &real, &patched);
+		if (!con)
+			continue;
+
+		rec->flags |= NAT_SNAP_DONE;
+		snap->left -= 1;
+		adopted += 1;
+
+		con->con_type = rec->con_type;
+		con->imsi_checked = !!(rec->flags & NAT_SNAP_IMSI_CHECKED);
+		if (rec->flags & NAT_SNAP_REMOTE) {
+			int_to_ref(rec->remote_ref, &remote);
+			sccp_connection_set_remote(con, &remote);
+		}
+		adopt_endpoints(bsc, con, rec);
+	}
+
+	if (adopted > 0)
+		LOGP(DNAT, LOGL_NOTICE, "BSC nr: %d took over %d connections.\n",
+		     bsc->cfg->nr, adopted);
+
+	snap->adopted += adopted;
+	if (snap->left == 0)
+		bsc_nat_snapshot_expire(bsc->nat);
+	return adopted;
+}
+
+/* the MSC is not reset while it has connections waiting for a BSC */
+int bsc_nat_snapshot_pending(struct bsc_nat_msc *msc)
+{
+	struct bsc_nat_snapshot *snap = &msc->nat->snapshot;
+	int i, count = 0;
+
+	for (i = 0; snap->left > 0 && i < snap->nr_pending; ++i)
+		if (!(snap->pending[i].flags & NAT_SNAP_DONE) &&
+		    snap->pending[i].msc_nr == msc->nr)
+			count += 1;
+
+	return count;
+}
+
+/* returns 1 if the MSC is reset later, once no connection waits */
+int bsc_nat_snapshot_defer_reset(struct bsc_nat_msc *msc)
+{
+	int pending = bsc_nat_snapshot_pending(msc);
+
+	if (pending == 0)
+		return 0;
+
+	LOGP(DMSC, LOGL_NOTICE, "Not resetting MSC %d, %d connections wait for their BSC.\n",
+	     msc->nr, pending);
+	msc->reset_deferred = 1;
+	return 1;
+}
+
+static void release_to_msc(struct bsc_nat_msc *msc, const struct bsc_nat_snapshot_con *rec)
+{
+	struct sccp_source_reference patched, remote;
+	struct msgb *msg;
+
+	if (!(rec->flags & NAT_SNAP_REMOTE) || !msc->con || !msc->con->is_connected)
+		return;
+
+	int_to_ref(rec->patched_ref, &patched);
+	int_to_ref(rec->remote_ref, &remote);
+	msg = sccp_create_rlsd(&patched, &remote, SCCP_RELEASE_CAUSE_SCCP_FAILURE);
+	if (!msg)
+		return;
+
+	ipaccess_prepend_header(msg, IPAC_PROTO_SCCP);
+	bsc_nat_queue_enqueue(&msc->queue, msg);
+}
+
+/* the grace time is over, give up on the BSCs that did not come back */
+void bsc_nat_snapshot_expire(struct bsc_nat *nat)
+{
+	struct bsc_nat_snapshot *snap = &nat->snapshot;
+	struct bsc_nat_msc *msc;
+	int i;
+
+	for (i = 0; i < snap->nr_pending; ++i) {
+		struct bsc_nat_snapshot_con *rec = &snap->pending[i];
+
+		if (rec->flags & NAT_SNAP_DONE)
+			continue;
+
+		msc = bsc_nat_msc_num(nat, rec->msc_nr);
+		release_to_msc(msc, rec);
+		sccp_ref_release(msc, rec->patched_ref);
+		snap->expired += 1;
+	}
+
+	if (snap->left > 0)
+		LOGP(DNAT, LOGL_NOTICE, "Released %d connections of the snapshot.\n",
+		     snap->left);
+
+	bsc_del_timer(&snap->grace_timer);
+	talloc_free(snap->pending);
+	snap->pending = NULL;
+	snap->nr_pending = 0;
+	snap->left = 0;
+
+	/* a MSC that is not connected now is reset on its next contact */
+	llist_for_each_entry(msc, &nat->mscs, entry) {
+		if (!msc->reset_deferred)
+			continue;
+		msc->reset_deferred = 0;
+		if (msc->con && msc->con->is_connected)
+			bsc_nat_msc_send_reset(msc);
+	}
+}
@@ -28,11 +28,13 @@
 #include <openbsc/gsm_data.h>
 #include <openbsc/debug.h>
 #include <openbsc/ipaccess.h>
+#include <openbsc/select_epoll.h>
 
 #include <osmocore/linuxlist.h>
 #include <osmocore/talloc.h>
 #include <osmocore/gsm0808.h>
 
+#include <osmocore/protocol/gsm_04_08.h>
 #include <osmocore/protocol/gsm_08_08.h>
 
 #include <osmocom/sccp/sccp.h>
@@ -40,6 +42,9 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <time.h>
+#include <math.h>
+
 
 static const struct rate_ctr_desc bsc_cfg_ctr_description[] = {
 	[BCFG_CTR_SCCP_CONN]     = { "sccp.conn",      "SCCP Connections         "},
@@ -56,9 +61,25 @@ static const struct rate_ctr_group_desc bsc_cfg_ctrg_desc = {
 	.ctr_desc = bsc_cfg_ctr_description,
 };
 
+static const struct rate_ctr_desc msc_ctr_description[] = {
+	[MSC_CTR_SCCP_CONN]     = { "sccp.conn",      "SCCP Connections         "},
+	[MSC_CTR_SCCP_RELEASED] = { "sccp.released",  "Released on MSC loss     "},
+	[MSC_CTR_RECONN]        = { "reconnects",     "MSC reconnects           "},
+	[MSC_CTR_LOST]          = { "lost",           "MSC connection lost      "},
+};
+
+static const struct rate_ctr_group_desc msc_ctrg_desc = {
+	.group_name_prefix = "nat.msc",
+	.group_description = "NAT MSC Statistics",
+	.num_ctr = ARRAY_SIZE(msc_ctr_description),
+	.ctr_desc = msc_ctr_description,
+};
+
 struct bsc_nat *bsc_nat_alloc(void)
 {
 	struct bsc_nat *nat = talloc_zero(tall_bsc_ctx, struct bsc_nat);
+	int i;
+
 	if (!nat)
 		return NULL;
 
@@ -66,25 +87,175 @@ struct bsc_nat *bsc_nat_alloc(void)
 	INIT_LLIST_HEAD(&nat->bsc_connections);
 	INIT_LLIST_HEAD(&nat->bsc_configs);
 	INIT_LLIST_HEAD(&nat->access_lists);
+	INIT_LLIST_HEAD(&nat->mscs);
+	for (i = 0; i < NAT_LAC_BUCKETS; ++i)
+		INIT_LLIST_HEAD(&nat->bsc_by_lac[i]);
 
 	nat->stats.sccp.conn = counter_alloc("nat.sccp.conn");
 	nat->stats.sccp.calls = counter_alloc("nat.sccp.calls");
 	nat->stats.bsc.reconn = counter_alloc("nat.bsc.conn");
 	nat->stats.bsc.auth_fail = counter_alloc("nat.bsc.auth_fail");
 	nat->stats.msc.reconn = counter_alloc("nat.msc.conn");
-	nat->msc_ip = talloc_strdup(nat, "127.0.0.1");
-	nat->msc_port = 5000;
 	nat->auth_timeout = 2;
 	nat->ping_timeout = 20;
 	nat->pong_timeout = 5;
+	nat->bsc_queue_limit.msgs = 1000;
+	nat->bsc_queue_limit.bytes = 256 * 1024;
+	nat->msc_queue_limit.msgs = 10000;
+	nat->msc_queue_limit.bytes = 2 * 1024 * 1024;
+	nat->snapshot.grace = 30;
+
+	/* the first MSC is always present */
+	if (!bsc_nat_msc_alloc(nat, 0)) {
+		talloc_free(nat);
+		return NULL;
+	}
+
 	return nat;
 }
 
+struct bsc_nat_msc *bsc_nat_msc_num(struct bsc_nat *nat, int nr)
+{
+	struct bsc_nat_msc *msc;
+
+	llist_for_each_entry(msc, &nat->mscs, entry)
+		if (msc->nr == nr)
+			return msc;
+
+	return NULL;
+}
+
+struct bsc_nat_msc *bsc_nat_msc_alloc(struct bsc_nat *nat, int nr)
+{
+	struct bsc_nat_msc *msc = talloc_zero(nat, struct bsc_nat_msc);
+	if (!msc)
+		return NULL;
+
+	msc->nr = nr;
+	msc->ip = talloc_strdup(msc, "127.0.0.1");
+	msc->port = 5000;
+	msc->weight = 1;
+	msc->nat = nat;
+
+	msc->ctrg = rate_ctr_group_alloc(msc, &msc_ctrg_desc, nr);
+	if (!msc->ctrg) {
+		talloc_free(msc);
+		return NULL;
+	}
+
+	llist_add_tail(&msc->entry, &nat->mscs);
+	++nat->num_msc;
+	return msc;
+}
+
 void bsc_nat_set_msc_ip(struct bsc_nat *nat, const char *ip)
 {
-	if (nat->msc_ip)
-		talloc_free(nat->msc_ip);
-	nat->msc_ip = talloc_strdup(nat, ip);
+	struct bsc_nat_msc *msc = bsc_nat_msc_num(nat, 0);
+
+	talloc_free(msc->ip);
+	msc->ip = talloc_strdup(msc, ip);
+}
+
+void bsc_nat_msc_send_reset(struct bsc_nat_msc *msc)
+{
+	static const uint8_t reset[] = {
+		0x00, 0x12, 0xfd,
+		0x09, 0x00, 0x03, 0x05, 0x07, 0x02, 0x42, 0xfe,
+		0x02, 0x42, 0xfe, 0x06, 0x00, 0x04, 0x30, 0x04,
+		0x01, 0x20
+	};
+
+	struct msgb *msg;
+
+	msg = msgb_alloc_headroom(4096, 128, "08.08 reset");
+	if (!msg) {
+		LOGP(DMSC, LOGL_ERROR, "Failed to allocate reset msg.\n");
+		return;
+	}
+
+	msg->l2h = msgb_put(msg, sizeof(reset));
+	memcpy(msg->l2h, reset, msgb_l2len(msg));
+
+	if (bsc_nat_queue_enqueue(&msc->queue, msg) != 0)
+		return;
+	if (msc->con->write_queue.current_length > msc->wq_hwm)
+		msc->wq_hwm = msc->con->write_queue.current_length;
+
+	LOGP(DMSC, LOGL_NOTICE, "Scheduled GSM0808 reset msg for the MSC.\n");
+}
+
+static int msc_usable(struct bsc_nat_msc *msc)
+{
+	return msc->con && msc->con->is_connected && msc->weight > 0;
+}
+
+/*
+ * Weighted rendezvous hashing of the IMSI. Each MSC draws -ln(u) / weight
+ * with u in (0, 1) taken from the hash of the IMSI and the MSC, and the
+ * smallest draw wins. The draws are exponentially distributed with the
+ * weight as rate, so every MSC gets the share of its weight. When an
+ * MSC goes away only the subscribers of that MSC move to another one.
+ */
+static struct bsc_nat_msc *msc_select_imsi(struct bsc_nat *nat, const char *imsi)
+{
+	struct bsc_nat_msc *msc, *best = NULL;
+	double best_score = 0;
+	uint32_t imsi_hash = 2166136261u;
+
+	for (; *imsi; ++imsi)
+		imsi_hash = (imsi_hash ^ *imsi) * 16777619;
+
+	llist_for_each_entry(msc, &nat->mscs, entry) {
+		uint32_t hash = imsi_hash ^ (msc->nr * 0x9e3779b1);
+		double score;
+
+		if (!msc_usable(msc))
+			continue;
+
+		/* the finaliser of MurmurHash3 */
+		hash ^= hash >> 16;
+		hash *= 0x85ebca6b;
+		hash ^= hash >> 13;
+		hash *= 0xc2b2ae35;
+		hash ^= hash >> 16;
+
+		score = -log((hash + 0.5) / 4294967296.0) / msc->weight;
+		if (!best || score < best_score) {
+			best = msc;
+			best_score = score;
+		}
+	}
+
+	return best;
+}
+
+/* smooth weighted round robin as done by nginx */
+static struct bsc_nat_msc *msc_select_rr(struct bsc_nat *nat)
+{
+	struct bsc_nat_msc *msc, *best = NULL;
+	int total = 0;
+
+	llist_for_each_entry(msc, &nat->mscs, entry) {
+		if (!msc_usable(msc))
+			continue;
+
+		msc->current_weight += msc->weight;
+		total += msc->weight;
+		if (!best || msc->current_weight > best->current_weight)
+			best = msc;
+	}
+
+	if (best)
+		best->current_weight -= total;
+	return best;
+}
+
+/* pick a connected MSC for a new SCCP connection */
+struct bsc_nat_msc *bsc_nat_msc_select(struct bsc_nat *nat, struct bsc_nat_parsed *parsed)
+{
+	if (nat->msc_dist == NAT_MSC_DIST_IMSI && parsed->imsi[0] != '\0')
+		return msc_select_imsi(nat, parsed->imsi);
+	return msc_select_rr(nat);
 }
 
 struct bsc_connection *bsc_connection_alloc(struct bsc_nat *nat)
@@ -94,7 +265,9 @@ struct bsc_connection *bsc_connection_alloc(struct bsc_nat *nat)
 		return NULL;
 
 	con->nat = nat;
+	INIT_LLIST_HEAD(&con->lac_entry);
 	write_queue_init(&con->write_queue, 100);
+	bsc_nat_queue_init(&con->queue, &con->write_queue, &nat->bsc_queue_limit);
 	return con;
 }
 
@@ -127,57 +300,111 @@ void sccp_connection_destroy(struct sccp_connections *conn)
 	     sccp_src_ref_to_int(&conn->real_ref),
 	     sccp_src_ref_to_int(&conn->patched_ref), conn->bsc);
 	bsc_mgcp_dlcx(conn);
-	llist_del(&conn->list_entry);
+	sccp_connection_unlink(conn);
 	talloc_free(conn);
 }
 
-struct bsc_connection *bsc_nat_find_bsc(struct bsc_nat *nat, struct msgb *msg, int *lac_out)
+static struct llist_head *lac_bucket(struct bsc_nat *nat, unsigned int lac)
+{
+	return &nat->bsc_by_lac[(lac ^ (lac >> 8)) & (NAT_LAC_BUCKETS - 1)];
+}
+
+/* called once the BSC is authenticated */
+void bsc_nat_lac_add(struct bsc_connection *bsc)
+{
+	llist_del_init(&bsc->lac_entry);
+	llist_add_tail(&bsc->lac_entry, lac_bucket(bsc->nat, bsc->cfg->lac));
+}
+
+void bsc_nat_lac_del(struct bsc_connection *bsc)
+{
+	llist_del_init(&bsc->lac_entry);
+}
+
+/* the LAC of the config was changed */
+void bsc_nat_lac_update(struct bsc_nat *nat, struct bsc_config *conf)
+{
+	struct bsc_connection *bsc;
+
+	llist_for_each_entry(bsc, &nat->bsc_connections, list_entry)
+		if (bsc->cfg == conf && !llist_empty(&bsc->lac_entry))
+			bsc_nat_lac_add(bsc);
+}
+
+/*
+ * Call cb for every authenticated BSC a paging is sent to. A BSC
+ * is called once even if several cells of the list are in its LAC.
+ * Returns the number of BSCs or -1 if the cell list can not be used,
+ * _lac is set to the first LAC of the list.
+ */
+int bsc_nat_find_paging(struct bsc_nat *nat, struct msgb *msg, int *_lac,
+			void (*cb)(struct bsc_connection *bsc, void *data), void *data)
 {
 	struct bsc_connection *bsc;
-	int data_length;
-	const uint8_t *data;
-	struct tlv_parsed tp;
-	int i = 0;
+	uint16_t cells_length;
+	const uint8_t *cells;
+	int i, size, offset, found = 0;
 
-	*lac_out = -1;
+	*_lac = -1;
 
 	if (!msg->l3h || msgb_l3len(msg) < 3) {
 		LOGP(DNAT, LOGL_ERROR, "Paging message is too short.\n");
-		return NULL;
+		return -1;
 	}
 
-	tlv_parse(&tp, gsm0808_att_tlvdef(), msg->l3h + 3, msgb_l3len(msg) - 3, 0, 0);
-	if (!TLVP_PRESENT(&tp, GSM0808_IE_CELL_IDENTIFIER_LIST)) {
+	cells = bsc_nat_find_ie(msg->l3h + 3, msgb_l3len(msg) - 3,
+			       GSM0808_IE_CELL_IDENTIFIER_LIST, &cells_length);
+	if (!cells || cells_length < 1) {
 		LOGP(DNAT, LOGL_ERROR, "No CellIdentifier List inside paging msg.\n");
-		return NULL;
+		return -1;
 	}
 
-	data_length = TLVP_LEN(&tp, GSM0808_IE_CELL_IDENTIFIER_LIST);
-	data = TLVP_VAL(&tp, GSM0808_IE_CELL_IDENTIFIER_LIST);
-
-	/* No need to try a different BSS */
-	if (data[0] == CELL_IDENT_BSS) {
-		return NULL;
-	} else if (data[0] != CELL_IDENT_LAC) {
-		LOGP(DNAT, LOGL_ERROR, "Unhandled cell ident discrminator: %d\n", data[0]);
-		return NULL;
+	/* the size of a cell and where the LAC is */
+	switch (cells[0]) {
+	case CELL_IDENT_WHOLE_GLOBAL:
+		size = 7;
+		offset = 3;
+		break;
+	case CELL_IDENT_LAC_AND_CI:
+		size = 4;
+		offset = 0;
+		break;
+	case CELL_IDENT_LAI_AND_LAC:
+		size = 5;
+		offset = 3;
+		break;
+	case CELL_IDENT_LAC:
+		size = 2;
+		offset = 0;
+		break;
+	case CELL_IDENT_BSS:
+		/* No need to try a different BSS */
+		return 0;
+	default:
+		LOGP(DNAT, LOGL_ERROR, "Unhandled cell ident discrminator: %d\n", cells[0]);
+		return -1;
 	}
 
-	/* Currently we only handle one BSC */
-	for (i = 1; i < data_length - 1; i += 2) {
-		unsigned int _lac = ntohs(*(unsigned int *) &data[i]);
-		*lac_out = _lac;
-		llist_for_each_entry(bsc, &nat->bsc_connections, list_entry) {
-			if (!bsc->cfg)
-				continue;
-			if (!bsc->authenticated || _lac != bsc->cfg->lac)
+	nat->paging_generation += 1;
+
+	for (i = 1; i + size <= cells_length; i += size) {
+		unsigned int lac = cells[i + offset] << 8 | cells[i + offset + 1];
+
+		if (*_lac == -1)
+			*_lac = lac;
+
+		llist_for_each_entry(bsc, lac_bucket(nat, lac), lac_entry) {
+			if (bsc->cfg->lac != lac ||
+			    bsc->paging_generation == nat->paging_generation)
 				continue;
 
-			return bsc;
+			bsc->paging_generation = nat->paging_generation;
+			found += 1;
+			cb(bsc, data);
 		}
 	}
 
-	return NULL;
+	return found;
 }
 
 int bsc_write_mgcp(struct bsc_connection *bsc, const uint8_t *data, unsigned int length)
@@ -207,43 +434,363 @@ int bsc_write(struct bsc_connection *bsc, struct msgb *msg, int proto)
 	/* prepend the header */
 	ipaccess_prepend_header(msg, proto);
 
-	if (write_queue_enqueue(&bsc->write_queue, msg) != 0) {
-		LOGP(DINP, LOGL_ERROR, "Failed to enqueue the write.\n");
-		msgb_free(msg);
+	if (bsc_nat_queue_enqueue(&bsc->queue, msg) != 0)
 		return -1;
-	}
 
+	if (bsc->cfg && bsc->write_queue.current_length > bsc->cfg->stats.wq_hwm)
+		bsc->cfg->stats.wq_hwm = bsc->write_queue.current_length;
+
+	bsc_epoll_update_fd(&bsc->write_queue.bfd);
 	return 0;
 }
 
-static int lst_check_allow(struct bsc_nat_acc_lst *lst, const char *mi_string)
+/*
+ * Access list compilation. Every change to an entry bumps the
+ * generation and the lists are compiled again before the next use.
+ */
+static unsigned int acc_lst_generation = 1;
+
+/* longest pattern and most IMSIs a pattern may expand to in the trie */
+#define ACC_MAX_SETS	GSM48_MI_SIZE
+#define ACC_MAX_EXPAND	1024
+
+static int acc_trie_node(struct bsc_nat_acc_lst *lst, struct bsc_nat_acc_trie *trie)
 {
-	struct bsc_nat_acc_lst_entry *entry;
+	if (trie->nr_nodes == trie->size) {
+		struct bsc_nat_acc_node *nodes;
+		int size = trie->size ? trie->size * 2 : 64;
+
+		nodes = talloc_realloc(lst, trie->nodes, struct bsc_nat_acc_node, size);
+		if (!nodes)
+			return -1;
+		trie->nodes = nodes;
+		trie->size = size;
+	}
 
-	llist_for_each_entry(entry, &lst->fltr_list, list) {
-		if (!entry->imsi_allow)
+	memset(&trie->nodes[trie->nr_nodes], 0, sizeof(trie->nodes[0]));
+	return trie->nr_nodes++;
+}
+
+static int acc_trie_add(struct bsc_nat_acc_lst *lst, struct bsc_nat_acc_trie *trie,
+			int node, const uint16_t *sets, int nr_sets, uint8_t flag)
+{
+	int digit;
+
+	if (nr_sets == 0) {
+		trie->nodes[node].flags |= flag;
+		return 0;
+	}
+
+	for (digit = 0; digit < 10; ++digit) {
+		int child;
+
+		if (!(sets[0] & (1 << digit)))
 			continue;
-		if (regexec(&entry->imsi_allow_re, mi_string, 0, NULL, 0) == 0)
-			return 0;
+
+		child = trie->nodes[node].child[digit];
+		if (!child) {
+			child = acc_trie_node(lst, trie);
+			if (child < 0)
+				return -1;
+			trie->nodes[node].child[digit] = child;
+		}
+
+		if (acc_trie_add(lst, trie, child, &sets[1], nr_sets - 1, flag) != 0)
+			return -1;
 	}
 
-	return 1;
+	return 0;
 }
 
-static int lst_check_deny(struct bsc_nat_acc_lst *lst, const char *mi_string)
+/*
+ * Turn a regexp like ^2620[1-3].* into the digits allowed at each
+ * position. Returns the number of positions or -1 if the regexp is
+ * using anything else.
+ */
+static int acc_parse_pattern(const char *pat, uint16_t *sets, int *anchored, int *at_end)
+{
+	int nr = 0, expand = 1;
+
+	*anchored = *at_end = 0;
+	if (*pat == '^') {
+		*anchored = 1;
+		++pat;
+	}
+
+	while (*pat) {
+		uint16_t set = 0;
+		int i, count = 0;
+
+		if (*pat == '$' && pat[1] == '\0') {
+			*at_end = 1;
+			break;
+		} else if (*pat >= '0' && *pat <= '9') {
+			set = 1 << (*pat++ - '0');
+		} else if (*pat == '.') {
+			set = 0x3ff;
+			++pat;
+		} else if (*pat == '[') {
+			++pat;
+			while (*pat != ']') {
+				if (*pat < '0' || *pat > '9')
+					return -1;
+				if (pat[1] == '-' && pat[2] >= pat[0] && pat[2] <= '9') {
+					for (i = pat[0]; i <= pat[2]; ++i)
+						set |= 1 << (i - '0');
+					pat += 3;
+				} else {
+					set |= 1 << (*pat++ - '0');
+				}
+			}
+			if (!set)
+				return -1;
+			++pat;
+		} else {
+			return -1;
+		}
+
+		/* a repetition at the end matches the empty string too */
+		if (*pat == '*') {
+			if (pat[1] != '\0')
+				return -1;
+			break;
+		}
+
+		for (i = 0; i < 10; ++i)
+			if (set & (1 << i))
+				++count;
+		expand *= count;
+		if (nr == ACC_MAX_SETS || expand > ACC_MAX_EXPAND)
+			return -1;
+		sets[nr++] = set;
+	}
+
+	return nr;
+}
+
+/* try to put the pattern into the trie, -1 if the regexp has to be used */
+static int acc_compile_pattern(struct bsc_nat_acc_lst *lst, const char *pat, int allow)
+{
+	uint16_t sets[ACC_MAX_SETS];
+	int nr, anchored, at_end;
+	uint8_t flag;
+
+	nr = acc_parse_pattern(pat, sets, &anchored, &at_end);
+	if (nr < 0)
+		return -1;
+
+	if (allow)
+		flag = at_end ? ACC_ALLOW_END : ACC_ALLOW_ANY;
+	else
+		flag = at_end ? ACC_DENY_END : ACC_DENY_ANY;
+
+	return acc_trie_add(lst, anchored ? &lst->anchored : &lst->unanchored,
+			    0, sets, nr, flag);
+}
+
+/* add the failure links and the missing transitions of Aho-Corasick */
+static int acc_build_automaton(struct bsc_nat_acc_lst *lst, struct bsc_nat_acc_trie *trie)
+{
+	struct bsc_nat_acc_node *nodes = trie->nodes;
+	int *queue, head = 0, tail = 0, digit;
+
+	queue = talloc_array(lst, int, trie->nr_nodes);
+	if (!queue)
+		return -1;
+
+	for (digit = 0; digit < 10; ++digit) {
+		int child = nodes[0].child[digit];
+
+		if (child) {
+			nodes[child].fail = 0;
+			queue[tail++] = child;
+		}
+	}
+
+	while (head < tail) {
+		int node = queue[head++];
+
+		nodes[node].flags |= nodes[nodes[node].fail].flags;
+		for (digit = 0; digit < 10; ++digit) {
+			int child = nodes[node].child[digit];
+			int next = nodes[nodes[node].fail].child[digit];
+
+			if (child) {
+				nodes[child].fail = next;
+				queue[tail++] = child;
+			} else {
+				nodes[node].child[digit] = next;
+			}
+		}
+	}
+
+	talloc_free(queue);
+	return 0;
+}
+
+static int acc_add_regex(struct bsc_nat_acc_lst *lst, regex_t ***res, int *nr, regex_t *re)
+{
+	regex_t **new_res;
+
+	new_res = talloc_realloc(lst, *res, regex_t *, *nr + 1);
+	if (!new_res)
+		return -1;
+
+	new_res[(*nr)++] = re;
+	*res = new_res;
+	return 0;
+}
+
+static void acc_lst_clear(struct bsc_nat_acc_lst *lst)
+{
+	talloc_free(lst->anchored.nodes);
+	talloc_free(lst->unanchored.nodes);
+	talloc_free(lst->allow_re);
+	talloc_free(lst->deny_re);
+
+	memset(&lst->anchored, 0, sizeof(lst->anchored));
+	memset(&lst->unanchored, 0, sizeof(lst->unanchored));
+	lst->allow_re = lst->deny_re = NULL;
+	lst->nr_allow_re = lst->nr_deny_re = 0;
+	lst->generation = 0;
+}
+
+int bsc_nat_acc_lst_compile(struct bsc_nat_acc_lst *lst)
 {
 	struct bsc_nat_acc_lst_entry *entry;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	acc_lst_clear(lst);
+
+	if (acc_trie_node(lst, &lst->anchored) < 0 ||
+	    acc_trie_node(lst, &lst->unanchored) < 0)
+		goto error;
 
 	llist_for_each_entry(entry, &lst->fltr_list, list) {
-		if (!entry->imsi_deny)
-			continue;
-		if (regexec(&entry->imsi_deny_re, mi_string, 0, NULL, 0) == 0)
-			return 0;
+		if (entry->imsi_allow &&
+		    acc_compile_pattern(lst, entry->imsi_allow, 1) != 0 &&
+		    acc_add_regex(lst, &lst->allow_re, &lst->nr_allow_re,
+				  &entry->imsi_allow_re) != 0)
+			goto error;
+		if (entry->imsi_deny &&
+		    acc_compile_pattern(lst, entry->imsi_deny, 0) != 0 &&
+		    acc_add_regex(lst, &lst->deny_re, &lst->nr_deny_re,
+				  &entry->imsi_deny_re) != 0)
+			goto error;
+	}
+
+	if (acc_build_automaton(lst, &lst->unanchored) != 0)
+		goto error;
+
+	lst->generation = acc_lst_generation;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	lst->compile_usec = (end.tv_sec - start.tv_sec) * 1000000 +
+				(end.tv_nsec - start.tv_nsec) / 1000;
+	return 0;
+
+error:
+	LOGP(DNAT, LOGL_ERROR, "Failed to compile access list %s.\n", lst->name);
+	acc_lst_clear(lst);
+	return -1;
+}
+
+static int acc_match(struct bsc_nat_acc_lst *lst, const char *imsi, uint8_t any, uint8_t end)
+{
+	struct bsc_nat_acc_node *nodes;
+	const char *str;
+	int node;
+
+	/* the anchored patterns, a plain trie */
+	nodes = lst->anchored.nodes;
+	for (node = 0, str = imsi; ; ++str) {
+		if (nodes[node].flags & any)
+			return 1;
+		if (*str == '\0') {
+			if (nodes[node].flags & end)
+				return 1;
+			break;
+		}
+		if (*str < '0' || *str > '9')
+			break;
+		node = nodes[node].child[*str - '0'];
+		if (!node)
+			break;
+	}
+
+	/* the other patterns, there is a transition for every digit */
+	nodes = lst->unanchored.nodes;
+	for (node = 0, str = imsi; ; ++str) {
+		if (nodes[node].flags & any)
+			return 1;
+		if (*str == '\0')
+			return (nodes[node].flags & end) != 0;
+		if (*str < '0' || *str > '9')
+			node = 0;
+		else
+			node = nodes[node].child[*str - '0'];
+	}
+}
+
+/* check if the IMSI is matched by an allow or deny entry of the list */
+int bsc_nat_acc_lst_check(struct bsc_nat_acc_lst *lst, const char *imsi, int allow)
+{
+	regex_t **res;
+	int i, nr;
+
+	if (lst->generation != acc_lst_generation)
+		bsc_nat_acc_lst_compile(lst);
+
+	lst->checks += 1;
+	if (lst->anchored.nodes &&
+	    acc_match(lst, imsi, allow ? ACC_ALLOW_ANY : ACC_DENY_ANY,
+		      allow ? ACC_ALLOW_END : ACC_DENY_END))
+		goto hit;
+
+	if (lst->anchored.nodes) {
+		res = allow ? lst->allow_re : lst->deny_re;
+		nr = allow ? lst->nr_allow_re : lst->nr_deny_re;
+	} else {
+		/* compiling failed, check every entry */
+		struct bsc_nat_acc_lst_entry *entry;
+
+		llist_for_each_entry(entry, &lst->fltr_list, list) {
+			if (allow && entry->imsi_allow &&
+			    regexec(&entry->imsi_allow_re, imsi, 0, NULL, 0) == 0)
+				goto regex_hit;
+			if (!allow && entry->imsi_deny &&
+			    regexec(&entry->imsi_deny_re, imsi, 0, NULL, 0) == 0)
+				goto regex_hit;
+		}
+		return 0;
 	}
 
+	for (i = 0; i < nr; ++i)
+		if (regexec(res[i], imsi, 0, NULL, 0) == 0)
+			goto regex_hit;
+
+	return 0;
+
+regex_hit:
+	lst->regex_hits += 1;
+hit:
+	if (allow)
+		lst->allow_hits += 1;
+	else
+		lst->deny_hits += 1;
 	return 1;
 }
 
+static int lst_check_allow(struct bsc_nat_acc_lst *lst, const char *mi_string)
+{
+	return bsc_nat_acc_lst_check(lst, mi_string, 1) ? 0 : 1;
+}
+
+static int lst_check_deny(struct bsc_nat_acc_lst *lst, const char *mi_string)
+{
+	return bsc_nat_acc_lst_check(lst, mi_string, 0) ? 0 : 1;
+}
+
 /* apply white/black list */
 static int auth_imsi(struct bsc_connection *bsc, const char *mi_string)
 {
@@ -286,7 +833,8 @@ static int auth_imsi(struct bsc_connection *bsc, const char *mi_string)
 	return 1;
 }
 
-static int _cr_check_loc_upd(struct bsc_connection *bsc, uint8_t *data, unsigned int length)
+static int _cr_check_loc_upd(struct bsc_connection *bsc, uint8_t *data, unsigned int length,
+			     struct bsc_nat_parsed *parsed)
 {
 	uint8_t mi_type;
 	struct gsm48_loc_upd_req *lu;
@@ -309,10 +857,12 @@ static int _cr_check_loc_upd(struct bsc_connection *bsc, uint8_t *data, unsigned
 		return 0;
 
 	gsm48_mi_to_string(mi_string, sizeof(mi_string), lu->mi, lu->mi_len);
+	strcpy(parsed->imsi, mi_string);
 	return auth_imsi(bsc, mi_string);
 }
 
-static int _cr_check_cm_serv_req(struct bsc_connection *bsc, uint8_t *data, unsigned int length)
+static int _cr_check_cm_serv_req(struct bsc_connection *bsc, uint8_t *data, unsigned int length,
+				 struct bsc_nat_parsed *parsed)
 {
 	static const uint32_t classmark_offset =
 				offsetof(struct gsm48_service_request, classmark);
@@ -342,10 +892,12 @@ static int _cr_check_cm_serv_req(struct bsc_connection *bsc, uint8_t *data, unsi
 	if (mi_type != GSM_MI_TYPE_IMSI)
 		return 0;
 
+	strcpy(parsed->imsi, mi_string);
 	return auth_imsi(bsc, mi_string);
 }
 
-static int _cr_check_pag_resp(struct bsc_connection *bsc, uint8_t *data, unsigned int length)
+static int _cr_check_pag_resp(struct bsc_connection *bsc, uint8_t *data, unsigned int length,
+			      struct bsc_nat_parsed *parsed)
 {
 	struct gsm48_pag_resp *resp;
 	char mi_string[GSM48_MI_SIZE];
@@ -366,6 +918,7 @@ static int _cr_check_pag_resp(struct bsc_connection *bsc, uint8_t *data, unsigne
 	if (mi_type != GSM_MI_TYPE_IMSI)
 		return 0;
 
+	strcpy(parsed->imsi, mi_string);
 	return auth_imsi(bsc, mi_string);
 }
 
@@ -401,9 +954,8 @@ static int _dt_check_id_resp(struct bsc_connection *bsc,
 /* Filter out CR data... */
 int bsc_nat_filter_sccp_cr(struct bsc_connection *bsc, struct msgb *msg, struct bsc_nat_parsed *parsed, int *con_type)
 {
-	struct tlv_parsed tp;
 	struct gsm48_hdr *hdr48;
-	int hdr48_len;
+	uint16_t hdr48_len;
 	int len;
 	uint8_t msg_type;
 
@@ -417,44 +969,38 @@ int bsc_nat_filter_sccp_cr(struct bsc_connection *bsc, struct msgb *msg, struct
 
 	/* the parsed has had some basic l3 length check */
 	len = msg->l3h[1];
-	if (msgb_l3len(msg) - 3 < len) {
+	if (parsed->payload_len < len) {
 		LOGP(DNAT, LOGL_ERROR,
 		     "The CR Data has not enough space...\n");
 		return -1;
 	}
 
-	msg->l4h = &msg->l3h[3];
-	len -= 1;
-
-	tlv_parse(&tp, gsm0808_att_tlvdef(), msg->l4h, len, 0, 0);
-
-	if (!TLVP_PRESENT(&tp, GSM0808_IE_LAYER_3_INFORMATION)) {
+	hdr48 = (struct gsm48_hdr *) bsc_nat_find_ie(parsed->payload, len - 1,
+						    GSM0808_IE_LAYER_3_INFORMATION,
+						    &hdr48_len);
+	if (!hdr48) {
 		LOGP(DNAT, LOGL_ERROR, "CR Data does not contain layer3 information.\n");
 		return -1;
 	}
 
-	hdr48_len = TLVP_LEN(&tp, GSM0808_IE_LAYER_3_INFORMATION);
-
 	if (hdr48_len < sizeof(*hdr48)) {
 		LOGP(DNAT, LOGL_ERROR, "GSM48 header does not fit.\n");
 		return -1;
 	}
 
-	hdr48 = (struct gsm48_hdr *) TLVP_VAL(&tp, GSM0808_IE_LAYER_3_INFORMATION);
-
 	msg_type = hdr48->msg_type & 0xbf;
 	if (hdr48->proto_discr == GSM48_PDISC_MM &&
 	    msg_type == GSM48_MT_MM_LOC_UPD_REQUEST) {
 		*con_type = NAT_CON_TYPE_LU;
-		return _cr_check_loc_upd(bsc, &hdr48->data[0], hdr48_len - sizeof(*hdr48));
+		return _cr_check_loc_upd(bsc, &hdr48->data[0], hdr48_len - sizeof(*hdr48), parsed);
 	} else if (hdr48->proto_discr == GSM48_PDISC_MM &&
 		  msg_type == GSM48_MT_MM_CM_SERV_REQ) {
 		*con_type = NAT_CON_TYPE_CM_SERV_REQ;
-		return _cr_check_cm_serv_req(bsc, &hdr48->data[0], hdr48_len - sizeof(*hdr48));
+		return _cr_check_cm_serv_req(bsc, &hdr48->data[0], hdr48_len - sizeof(*hdr48), parsed);
 	} else if (hdr48->proto_discr == GSM48_PDISC_RR &&
 		   msg_type == GSM48_MT_RR_PAG_RESP) {
 		*con_type = NAT_CON_TYPE_PAG_RESP;
-		return _cr_check_pag_resp(bsc, &hdr48->data[0], hdr48_len - sizeof(*hdr48));
+		return _cr_check_pag_resp(bsc, &hdr48->data[0], hdr48_len - sizeof(*hdr48), parsed);
 	} else {
 		/* We only want to filter the above, let other things pass */
 		*con_type = NAT_CON_TYPE_OTHER;
@@ -478,7 +1024,7 @@ int bsc_nat_filter_dt(struct bsc_connection *bsc, struct msgb *msg,
 
 	/* gsm_type is actually the size of the dtap */
 	len = parsed->gsm_type;
-	if (len < msgb_l3len(msg) - 3) {
+	if (len < parsed->payload_len) {
 		LOGP(DNAT, LOGL_ERROR, "Not enough space for DTAP.\n");
 		return -1;
 	}
@@ -488,8 +1034,7 @@ int bsc_nat_filter_dt(struct bsc_connection *bsc, struct msgb *msg,
 		return -1;
 	}
 
-	msg->l4h = &msg->l3h[3];
-	hdr48 = (struct gsm48_hdr *) msg->l4h;
+	hdr48 = (struct gsm48_hdr *) parsed->payload;
 
 	msg_type = hdr48->msg_type & 0xbf;
 	if (hdr48->proto_discr == GSM48_PDISC_MM &&
@@ -512,6 +1057,8 @@ void bsc_parse_reg(void *ctx, regex_t *reg, char **imsi, int argc, const char **
 		*imsi = talloc_strdup(ctx, argv[0]);
 		regcomp(reg, argv[0], 0);
 	}
+
+	acc_lst_generation += 1;
 }
 
 static const char *con_types [] = {
@@ -564,6 +1111,7 @@ struct bsc_nat_acc_lst *bsc_nat_acc_lst_get(struct bsc_nat *nat, const char *nam
 
 void bsc_nat_acc_lst_delete(struct bsc_nat_acc_lst *lst)
 {
+	acc_lst_generation += 1;
 	llist_del(&lst->list);
 	talloc_free(lst);
 }
@@ -577,10 +1125,18 @@ struct bsc_nat_acc_lst_entry *bsc_nat_acc_lst_entry_create(struct bsc_nat_acc_ls
 		return NULL;
 
 	llist_add_tail(&entry->list, &lst->fltr_list);
+	acc_lst_generation += 1;
 	return entry;
 }
 
+/* is any MSC of the pool connected? */
 int bsc_nat_msc_is_connected(struct bsc_nat *nat)
 {
-	return nat->msc_con->is_connected;
+	struct bsc_nat_msc *msc;
+
+	llist_for_each_entry(msc, &nat->mscs, entry)
+		if (msc->con && msc->con->is_connected)
+			return 1;
+
+	return 0;
 }
@@ -25,6 +25,7 @@
 #include <openbsc/bsc_msc.h>
 #include <openbsc/gsm_04_08.h>
 #include <openbsc/mgcp.h>
+#include <openbsc/timer_wheel.h>
 #include <openbsc/vty.h>
 
 #include <osmocore/talloc.h>
@@ -66,10 +67,24 @@ static void write_acc_lst(struct vty *vty, struct bsc_nat_acc_lst *lst)
 static int config_write_nat(struct vty *vty)
 {
 	struct bsc_nat_acc_lst *lst;
+	struct bsc_nat_msc *msc;
 
 	vty_out(vty, "nat%s", VTY_NEWLINE);
-	vty_out(vty, " msc ip %s%s", _nat->msc_ip, VTY_NEWLINE);
-	vty_out(vty, " msc port %d%s", _nat->msc_port, VTY_NEWLINE);
+	llist_for_each_entry(msc, &_nat->mscs, entry) {
+		if (msc->nr == 0) {
+			vty_out(vty, " msc ip %s%s", msc->ip, VTY_NEWLINE);
+			vty_out(vty, " msc port %d%s", msc->port, VTY_NEWLINE);
+		} else {
+			vty_out(vty, " msc-pool %d ip %s port %d%s",
+				msc->nr, msc->ip, msc->port, VTY_NEWLINE);
+		}
+		if (msc->weight != 1)
+			vty_out(vty, " msc-pool %d weight %d%s",
+				msc->nr, msc->weight, VTY_NEWLINE);
+	}
+	vty_out(vty, " msc-distribution %s%s",
+		_nat->msc_dist == NAT_MSC_DIST_IMSI ? "imsi" : "round-robin",
+		VTY_NEWLINE);
 	vty_out(vty, " timeout auth %d%s", _nat->auth_timeout, VTY_NEWLINE);
 	vty_out(vty, " timeout ping %d%s", _nat->ping_timeout, VTY_NEWLINE);
 	vty_out(vty, " timeout pong %d%s", _nat->pong_timeout, VTY_NEWLINE);
@@ -78,6 +93,19 @@ static int config_write_nat(struct vty *vty)
 	vty_out(vty, " ip-dscp %d%s", _nat->bsc_ip_dscp, VTY_NEWLINE);
 	if (_nat->acc_lst_name)
 		vty_out(vty, " access-list-name %s%s", _nat->acc_lst_name, VTY_NEWLINE);
+	if (_nat->num_workers > 0)
+		vty_out(vty, " bsc-threads %d%s", _nat->num_workers, VTY_NEWLINE);
+	vty_out(vty, " queue-limit bsc %u %u%s", _nat->bsc_queue_limit.msgs,
+		_nat->bsc_queue_limit.bytes, VTY_NEWLINE);
+	vty_out(vty, " queue-limit msc %u %u%s", _nat->msc_queue_limit.msgs,
+		_nat->msc_queue_limit.bytes, VTY_NEWLINE);
+	if (_nat->lat_dump_file)
+		vty_out(vty, " latency-dump %s %d%s", _nat->lat_dump_file,
+			_nat->lat_dump_interval, VTY_NEWLINE);
+	if (_nat->snapshot.file)
+		vty_out(vty, " snapshot %s %d%s", _nat->snapshot.file,
+			_nat->snapshot.interval, VTY_NEWLINE);
+	vty_out(vty, " snapshot-grace %d%s", _nat->snapshot.grace, VTY_NEWLINE);
 
 	llist_for_each_entry(lst, &_nat->access_lists, list) {
 		write_acc_lst(vty, lst);
@@ -130,6 +158,18 @@ DEFUN(show_sccp, show_sccp_cmd, "show sccp connections",
 	return CMD_SUCCESS;
 }
 
+static void dump_queue(struct vty *vty, struct bsc_nat_queue *queue)
+{
+	vty_out(vty, " Write queue: %u messages %u bytes "
+		"(%u connection %u new %u paging)%s",
+		queue->wq->current_length, queue->bytes,
+		queue->queued[NAT_PRIO_CON], queue->queued[NAT_PRIO_CR],
+		queue->queued[NAT_PRIO_PAGING], VTY_NEWLINE);
+	vty_out(vty, " Dropped: %lu connection %lu new %lu paging%s",
+		queue->dropped[NAT_PRIO_CON], queue->dropped[NAT_PRIO_CR],
+		queue->dropped[NAT_PRIO_PAGING], VTY_NEWLINE);
+}
+
 DEFUN(show_bsc, show_bsc_cmd, "show bsc connections",
       SHOW_STR "Display information about current BSCs")
 {
@@ -144,6 +184,7 @@ DEFUN(show_bsc, show_bsc_cmd, "show bsc connections",
 			con->cfg ? con->cfg->lac : -1,
 			con->authenticated, con->write_queue.bfd.fd,
 			inet_ntoa(sock.sin_addr), VTY_NEWLINE);
+		dump_queue(vty, &con->queue);
 	}
 
 	return CMD_SUCCESS;
@@ -197,17 +238,58 @@ DEFUN(show_bsc_cfg, show_bsc_cfg_cmd, "show bsc config",
 
 static void dump_stat_total(struct vty *vty, struct bsc_nat *nat)
 {
+	struct bsc_nat_msc *msc;
+	unsigned int refs = 0;
+	int connected = 0;
+	int i;
+
+	llist_for_each_entry(msc, &nat->mscs, entry) {
+		refs += msc->refs.used;
+		if (msc->con && msc->con->is_connected)
+			connected += 1;
+	}
+
 	vty_out(vty, "NAT statistics%s", VTY_NEWLINE);
 	vty_out(vty, " SCCP Connections %lu total, %lu calls%s",
 		counter_get(nat->stats.sccp.conn),
 		counter_get(nat->stats.sccp.calls), VTY_NEWLINE);
+	vty_out(vty, " SCCP Connections active: %u references used: %u table size: %u%s",
+		nat->sccp_by_patched.count, refs,
+		nat->sccp_by_patched.size, VTY_NEWLINE);
 	vty_out(vty, " MSC Connections %lu%s",
 		counter_get(nat->stats.msc.reconn), VTY_NEWLINE);
-	vty_out(vty, " MSC Connected: %d%s",
-		nat->msc_con->is_connected, VTY_NEWLINE);
+	vty_out(vty, " MSC Connected: %d of %d%s",
+		connected, nat->num_msc, VTY_NEWLINE);
 	vty_out(vty, " BSC Connections %lu total, %lu auth failed.%s",
 		counter_get(nat->stats.bsc.reconn),
 		counter_get(nat->stats.bsc.auth_fail), VTY_NEWLINE);
+	vty_out(vty, " Snapshots written: %lu failed: %lu adopted: %lu expired: %lu waiting: %d%s",
+		nat->snapshot.written, nat->snapshot.write_errors,
+		nat->snapshot.adopted, nat->snapshot.expired,
+		nat->snapshot.left, VTY_NEWLINE);
+
+	if (!nat->workers)
+		return;
+
+	vty_out(vty, " BSC threads: wakeups: %lu messages: %lu queued: %u dropped: %lu%s",
+		nat->frames->wakeups, nat->frames->frames,
+		nat->frames->queue.queued, nat->frames->dropped, VTY_NEWLINE);
+	for (i = 0; i < nat->num_workers; ++i) {
+		struct bsc_nat_worker *worker = &nat->workers[i];
+
+		vty_out(vty, "  BSC thread %d: connections: %u wakeups: %lu "
+			"messages: %lu bytes: %lu parse errors: %lu%s",
+			i, worker->connections, worker->wakeups, worker->messages,
+			worker->bytes, worker->thread.errors[NAT_WORKER_ERR_PARSE], VTY_NEWLINE);
+		vty_out(vty, "   commands pending: %u ring full: %lu throttled: %lu%s",
+			worker->thread.head - worker->thread.tail,
+			worker->thread.ring_full, worker->thread.throttled, VTY_NEWLINE);
+		vty_out(vty, "   errors: alloc: %lu size: %lu watch: %lu wakeup: %lu%s",
+			worker->thread.errors[NAT_WORKER_ERR_ALLOC],
+			worker->thread.errors[NAT_WORKER_ERR_MSG_SIZE],
+			worker->thread.errors[NAT_WORKER_ERR_WATCH],
+			worker->thread.errors[WORKER_ERR_WAKEUP], VTY_NEWLINE);
+	}
 }
 
 static void dump_stat_bsc(struct vty *vty, struct bsc_config *conf)
@@ -277,14 +359,113 @@ DEFUN(show_msc,
       "show msc connection",
       SHOW_STR "Show the status of the MSC connection.")
 {
-	if (!_nat->msc_con) {
-		vty_out(vty, "The MSC is not yet configured.\n");
-		return CMD_WARNING;
+	struct bsc_nat_msc *msc;
+
+	llist_for_each_entry(msc, &_nat->mscs, entry) {
+		if (!msc->con) {
+			vty_out(vty, "MSC %d is not yet configured.%s",
+				msc->nr, VTY_NEWLINE);
+			continue;
+		}
+
+		vty_out(vty, "MSC %d on %s:%d is connected: %d weight: %d%s",
+			msc->nr, msc->con->ip, msc->con->port,
+			msc->con->is_connected, msc->weight, VTY_NEWLINE);
+		vty_out(vty, " SCCP references used: %u%s",
+			msc->refs.used, VTY_NEWLINE);
+		dump_queue(vty, &msc->queue);
+		vty_out_rate_ctr_group(vty, " ", msc->ctrg);
+	}
+
+	return CMD_SUCCESS;
+}
+
+static void dump_lat_hist(struct vty *vty, const char *dir, int type,
+			  const struct bsc_nat_lat_hist *hist)
+{
+	if (hist->count == 0)
+		return;
+
+	vty_out(vty, "  %s %-5s count: %lu avg: %llu p50: %u p90: %u p99: %u max: %u usec%s",
+		dir, bsc_nat_lat_type_name(type), hist->count,
+		(unsigned long long) (hist->sum / hist->count),
+		bsc_nat_lat_percentile(hist, 500),
+		bsc_nat_lat_percentile(hist, 900),
+		bsc_nat_lat_percentile(hist, 990), hist->max, VTY_NEWLINE);
+}
+
+static void dump_lat(struct vty *vty, struct bsc_nat_lat_hist lat[NAT_LAT_DIRS][NAT_LAT_TYPES])
+{
+	int type;
+
+	for (type = 0; type < NAT_LAT_TYPES; ++type)
+		dump_lat_hist(vty, "to MSC:", type, &lat[NAT_LAT_TO_MSC][type]);
+	for (type = 0; type < NAT_LAT_TYPES; ++type)
+		dump_lat_hist(vty, "to BSC:", type, &lat[NAT_LAT_TO_BSC][type]);
+}
+
+DEFUN(show_latency,
+      show_latency_cmd,
+      "show latency [NR]",
+      SHOW_STR "Display the forwarding latency and write queue lengths\n"
+      "The number of the BSC\n")
+{
+	struct bsc_nat_lat_hist total[NAT_LAT_DIRS][NAT_LAT_TYPES];
+	struct bsc_config *conf;
+	struct bsc_nat_msc *msc;
+	int dir, type;
+
+	if (argc == 0) {
+		memset(total, 0, sizeof(total));
+		llist_for_each_entry(conf, &_nat->bsc_configs, entry)
+			for (dir = 0; dir < NAT_LAT_DIRS; ++dir)
+				for (type = 0; type < NAT_LAT_TYPES; ++type)
+					bsc_nat_lat_merge(&total[dir][type],
+							  &conf->stats.lat[dir][type]);
+
+		vty_out(vty, "NAT latency%s", VTY_NEWLINE);
+		dump_lat(vty, total);
+		llist_for_each_entry(msc, &_nat->mscs, entry)
+			vty_out(vty, " MSC %d write queue max: %u%s",
+				msc->nr, msc->wq_hwm, VTY_NEWLINE);
+	}
+
+	llist_for_each_entry(conf, &_nat->bsc_configs, entry) {
+		if (argc == 1 && atoi(argv[0]) != conf->nr)
+			continue;
+
+		vty_out(vty, " BSC lac: %d nr: %d write queue max: %u%s",
+			conf->lac, conf->nr, conf->stats.wq_hwm, VTY_NEWLINE);
+		dump_lat(vty, conf->stats.lat);
+	}
+
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_acc_lst,
+      show_acc_lst_cmd,
+      "show access-lists",
+      SHOW_STR "Display the compiled access lists\n")
+{
+	struct bsc_nat_acc_lst *lst;
+	struct bsc_nat_acc_lst_entry *entry;
+
+	llist_for_each_entry(lst, &_nat->access_lists, list) {
+		int entries = 0;
+
+		llist_for_each_entry(entry, &lst->fltr_list, list)
+			entries += 1;
+
+		vty_out(vty, "Access list %s: entries: %d compiled in %lu us%s",
+			lst->name, entries, lst->compile_usec, VTY_NEWLINE);
+		vty_out(vty, " trie nodes: %d anchored %d unanchored regexp: %d allow %d deny%s",
+			lst->anchored.nr_nodes, lst->unanchored.nr_nodes,
+			lst->nr_allow_re, lst->nr_deny_re, VTY_NEWLINE);
+		vty_out(vty, " checks: %lu allow hits: %lu deny hits: %lu regexp hits: %lu%s",
+			lst->checks, lst->allow_hits, lst->deny_hits,
+			lst->regex_hits, VTY_NEWLINE);
 	}
 
-	vty_out(vty, "MSC on %s:%d is connected: %d%s\n",
-		_nat->msc_con->ip, _nat->msc_con->port,
-		_nat->msc_con->is_connected, VTY_NEWLINE);
 	return CMD_SUCCESS;
 }
 
@@ -328,7 +509,67 @@ DEFUN(cfg_nat_msc_port,
       "msc port <1-65500>",
       "Set the port of the MSC.")
 {
-	_nat->msc_port = atoi(argv[0]);
+	bsc_nat_msc_num(_nat, 0)->port = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+static struct bsc_nat_msc *msc_pool_get(struct vty *vty, const char *nr_str)
+{
+	struct bsc_nat_msc *msc;
+	int nr = atoi(nr_str);
+
+	msc = bsc_nat_msc_num(_nat, nr);
+	if (!msc)
+		msc = bsc_nat_msc_alloc(_nat, nr);
+	if (!msc)
+		vty_out(vty, "Failed to allocate MSC %d.%s", nr, VTY_NEWLINE);
+	return msc;
+}
+
+DEFUN(cfg_nat_msc_pool,
+      cfg_nat_msc_pool_cmd,
+      "msc-pool <0-15> ip A.B.C.D port <1-65500>",
+      "Add an MSC to the pool. It is used after a restart.\n"
+      "The number of the MSC\n" "IP address\n" "The IP address of the MSC\n"
+      "Port\n" "The port of the MSC\n")
+{
+	struct bsc_nat_msc *msc = msc_pool_get(vty, argv[0]);
+	if (!msc)
+		return CMD_WARNING;
+
+	talloc_free(msc->ip);
+	msc->ip = talloc_strdup(msc, argv[1]);
+	msc->port = atoi(argv[2]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_nat_msc_pool_weight,
+      cfg_nat_msc_pool_weight_cmd,
+      "msc-pool <0-15> weight <0-100>",
+      "Configure an MSC of the pool\n" "The number of the MSC\n"
+      "Set the share of new connections, 0 to drain the MSC\n"
+      "The weight\n")
+{
+	struct bsc_nat_msc *msc = msc_pool_get(vty, argv[0]);
+	if (!msc)
+		return CMD_WARNING;
+
+	msc->weight = atoi(argv[1]);
+	msc->current_weight = 0;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_nat_msc_dist,
+      cfg_nat_msc_dist_cmd,
+      "msc-distribution (imsi|round-robin)",
+      "Select the MSC for new connections\n"
+      "By a hash of the IMSI, round robin without an IMSI\n"
+      "Weighted round robin\n")
+{
+	if (strcmp(argv[0], "imsi") == 0)
+		_nat->msc_dist = NAT_MSC_DIST_IMSI;
+	else
+		_nat->msc_dist = NAT_MSC_DIST_ROUND_ROBIN;
 	return CMD_SUCCESS;
 }
 
@@ -382,6 +623,94 @@ ALIAS_DEPRECATED(cfg_nat_bsc_ip_dscp, cfg_nat_bsc_ip_tos_cmd,
       "Use ip-dscp in the future.\n" "Set the DSCP\n")
 
 
+DEFUN(cfg_nat_bsc_threads,
+      cfg_nat_bsc_threads_cmd,
+      "bsc-threads <0-64>",
+      "Read and parse the BSC connections from the given number of threads. This is not dynamic.")
+{
+	_nat->num_workers = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_nat_queue_limit,
+      cfg_nat_queue_limit_cmd,
+      "queue-limit (bsc|msc) <10-100000> <4096-67108864>",
+      "Limit the write queues\n"
+      "The queues towards the BSCs\n" "The queues towards the MSCs\n"
+      "The number of messages\n" "The number of bytes\n")
+{
+	struct bsc_nat_queue_limit *limit;
+
+	if (argv[0][0] == 'b')
+		limit = &_nat->bsc_queue_limit;
+	else
+		limit = &_nat->msc_queue_limit;
+
+	limit->msgs = atoi(argv[1]);
+	limit->bytes = atoi(argv[2]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_nat_lat_dump,
+      cfg_nat_lat_dump_cmd,
+      "latency-dump FILE <1-3600>",
+      "Append the latency histograms to a file\n"
+      "The file name\n" "The interval in seconds\n")
+{
+	if (_nat->lat_dump_file)
+		talloc_free(_nat->lat_dump_file);
+	_nat->lat_dump_file = talloc_strdup(_nat, argv[0]);
+	_nat->lat_dump_interval = atoi(argv[1]);
+	bsc_nat_lat_dump_schedule(_nat);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_nat_no_lat_dump,
+      cfg_nat_no_lat_dump_cmd,
+      "no latency-dump",
+      NO_STR "Stop writing the latency histograms\n")
+{
+	talloc_free(_nat->lat_dump_file);
+	_nat->lat_dump_file = NULL;
+	bsc_nat_lat_dump_schedule(_nat);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_nat_snapshot,
+      cfg_nat_snapshot_cmd,
+      "snapshot FILE <1-3600>",
+      "Write the SCCP connections to a file for a restart\n"
+      "The file name\n" "The interval in seconds\n")
+{
+	if (_nat->snapshot.file)
+		talloc_free(_nat->snapshot.file);
+	_nat->snapshot.file = talloc_strdup(_nat, argv[0]);
+	_nat->snapshot.interval = atoi(argv[1]);
+	bsc_nat_snapshot_schedule(_nat);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_nat_no_snapshot,
+      cfg_nat_no_snapshot_cmd,
+      "no snapshot",
+      NO_STR "Stop writing the SCCP connections\n")
+{
+	talloc_free(_nat->snapshot.file);
+	_nat->snapshot.file = NULL;
+	bsc_nat_snapshot_schedule(_nat);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_nat_snapshot_grace,
+      cfg_nat_snapshot_grace_cmd,
+      "snapshot-grace <1-3600>",
+      "How long the connections of a snapshot wait for their BSC\n"
+      "The time in seconds\n")
+{
+	_nat->snapshot.grace = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_nat_acc_lst_name,
       cfg_nat_acc_lst_name_cmd,
       "access-list-name NAME",
@@ -452,6 +781,7 @@ DEFUN(cfg_bsc_lac, cfg_bsc_lac_cmd, "location_area_code <0-65535>",
 	}
 
 	conf->lac = lac;
+	bsc_nat_lac_update(_nat, conf);
 
 	return CMD_SUCCESS;
 }
@@ -475,6 +805,7 @@ DEFUN(cfg_lst_imsi_allow,
 		return CMD_WARNING;
 
 	bsc_parse_reg(acc, &entry->imsi_allow_re, &entry->imsi_allow, argc - 1, &argv[1]);
+	bsc_nat_acc_lst_compile(acc);
 	return CMD_SUCCESS;
 }
 
@@ -497,6 +828,7 @@ DEFUN(cfg_lst_imsi_deny,
 		return CMD_WARNING;
 
 	bsc_parse_reg(acc, &entry->imsi_deny_re, &entry->imsi_deny, argc - 1, &argv[1]);
+	bsc_nat_acc_lst_compile(acc);
 	return CMD_SUCCESS;
 }
 
@@ -589,7 +921,9 @@ int bsc_nat_vty_init(struct bsc_nat *nat)
 	install_element_ve(&close_bsc_cmd);
 	install_element_ve(&show_msc_cmd);
 	install_element_ve(&test_regex_cmd);
+	install_element_ve(&show_acc_lst_cmd);
 	install_element_ve(&show_bsc_mgcp_cmd);
+	install_element_ve(&show_latency_cmd);
 
 	/* nat group */
 	install_element(CONFIG_NODE, &cfg_nat_cmd);
@@ -599,6 +933,9 @@ int bsc_nat_vty_init(struct bsc_nat *nat)
 	install_element(NAT_NODE, &ournode_end_cmd);
 	install_element(NAT_NODE, &cfg_nat_msc_ip_cmd);
 	install_element(NAT_NODE, &cfg_nat_msc_port_cmd);
+	install_element(NAT_NODE, &cfg_nat_msc_pool_cmd);
+	install_element(NAT_NODE, &cfg_nat_msc_pool_weight_cmd);
+	install_element(NAT_NODE, &cfg_nat_msc_dist_cmd);
 	install_element(NAT_NODE, &cfg_nat_auth_time_cmd);
 	install_element(NAT_NODE, &cfg_nat_ping_time_cmd);
 	install_element(NAT_NODE, &cfg_nat_pong_time_cmd);
@@ -606,6 +943,13 @@ int bsc_nat_vty_init(struct bsc_nat *nat)
 	install_element(NAT_NODE, &cfg_nat_bsc_ip_dscp_cmd);
 	install_element(NAT_NODE, &cfg_nat_bsc_ip_tos_cmd);
 	install_element(NAT_NODE, &cfg_nat_acc_lst_name_cmd);
+	install_element(NAT_NODE, &cfg_nat_bsc_threads_cmd);
+	install_element(NAT_NODE, &cfg_nat_queue_limit_cmd);
+	install_element(NAT_NODE, &cfg_nat_lat_dump_cmd);
+	install_element(NAT_NODE, &cfg_nat_no_lat_dump_cmd);
+	install_element(NAT_NODE, &cfg_nat_snapshot_cmd);
+	install_element(NAT_NODE, &cfg_nat_no_snapshot_cmd);
+	install_element(NAT_NODE, &cfg_nat_snapshot_grace_cmd);
 
 	/* access-list */
 	install_element(NAT_NODE, &cfg_lst_imsi_allow_cmd);
@@ -625,6 +969,7 @@ int bsc_nat_vty_init(struct bsc_nat *nat)
 	install_element(NAT_BSC_NODE, &cfg_bsc_acc_lst_name_cmd);
 
 	mgcp_vty_init();
+	bsc_timer_wheel_vty_init();
 
 	return 0;
 }
@@ -0,0 +1,624 @@
+/* BSC reader threads of the NAT */
+
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * The select loop accepts the BSC, keeps writing to it and owns all
+ * the state of the NAT. The socket is handed to a worker for reading.
+ * The worker frames and parses the IPA messages and pushes them to the
+ * queue of the select loop. No talloc or msgb is used on the workers,
+ * the frames are plain malloc'ed memory.
+ *
+ * The reader of a connection is allocated by the select loop together
+ * with the frames announcing a lost and a closed socket, the worker
+ * never needs to allocate for those. On close the worker drops the
+ * socket from its epoll set and closes it. It returns the closed frame
+ * once no event of the current epoll batch can refer to the reader
+ * anymore. Only then the bsc_connection and the reader are freed.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <osmocore/talloc.h>
+#include <osmocore/select.h>
+#include <osmocore/timer.h>
+#include <osmocore/utils.h>
+
+#include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_nat_sccp.h>
+#include <openbsc/ipaccess.h>
+#include <openbsc/worker_queue.h>
+#include <openbsc/debug.h>
+
+/* the same limit as for the messages sent to the BSC */
+#define NAT_READER_MSG_MAX	(4096 - 128)
+#define NAT_READER_SIZE		(4 * 4096)
+#define NAT_WORKER_REPORT	10
+
+struct bsc_nat_reader {
+	struct bsc_nat_worker *worker;
+	struct bsc_connection *bsc;
+	int fd;
+	int watched;
+	/* the list of closed readers of the worker */
+	struct bsc_nat_reader *next_closed;
+
+	struct bsc_nat_frame *lost;
+	struct bsc_nat_frame *closed;
+
+	unsigned int len;
+	uint8_t buf[NAT_READER_SIZE];
+};
+
+static const char *worker_error_names[_NAT_WORKER_ERR_MAX] = {
+	[NAT_WORKER_ERR_ALLOC]		= "failed frame allocations",
+	[NAT_WORKER_ERR_MSG_SIZE]	= "messages too long",
+	[NAT_WORKER_ERR_WATCH]		= "sockets that could not be watched",
+	[NAT_WORKER_ERR_PARSE]		= "messages that could not be parsed",
+};
+
+static void worker_apply(struct worker_thread *thread, unsigned int slot);
+
+static const struct worker_desc worker_desc = {
+	.name		= "BSC thread",
+	.subsys		= DNAT,
+	.error_names	= worker_error_names,
+	.num_errors	= _NAT_WORKER_ERR_MAX,
+	.ring_size	= NAT_WORKER_RING,
+	.apply		= worker_apply,
+};
+
+static struct timer_list report_timer;
+
+static struct bsc_nat_frame *frame_alloc(int type, struct bsc_connection *bsc,
+					 unsigned int len)
+{
+	struct bsc_nat_frame *frame;
+
+	frame = malloc(sizeof(*frame) + len);
+	if (!frame)
+		return NULL;
+
+	memset(frame, 0, sizeof(*frame));
+	frame->type = type;
+	frame->bsc = bsc;
+	frame->len = len;
+	return frame;
+}
+
+static void frames_push(struct bsc_nat_frames *frames, struct bsc_nat_frame *frame)
+{
+	worker_queue_push(&frames->queue, &frame->node);
+}
+
+static struct bsc_nat_frame *frames_pop(struct bsc_nat_frames *frames)
+{
+	struct worker_queue_node *node = worker_queue_pop(&frames->queue);
+
+	if (!node)
+		return NULL;
+	return worker_queue_entry(node, struct bsc_nat_frame, node);
+}
+
+static struct bsc_nat_worker *worker_least_loaded(struct bsc_nat *nat)
+{
+	struct bsc_nat_worker *best = &nat->workers[0];
+	int i;
+
+	for (i = 1; i < nat->num_workers; ++i)
+		if (nat->workers[i].connections < best->connections)
+			best = &nat->workers[i];
+
+	return best;
+}
+
+/*
+ * Hand the socket of the BSC to the least loaded worker. The select
+ * loop must not read from it anymore.
+ */
+int bsc_nat_worker_add(struct bsc_nat *nat, struct bsc_connection *bsc)
+{
+	struct bsc_nat_worker_cmd *cmd;
+	struct bsc_nat_reader *reader;
+
+	if (!nat->workers)
+		return -1;
+
+	reader = malloc(sizeof(*reader));
+	if (!reader)
+		return -1;
+
+	memset(reader, 0, offsetof(struct bsc_nat_reader, buf));
+	reader->worker = worker_least_loaded(nat);
+	reader->bsc = bsc;
+	reader->fd = bsc->write_queue.bfd.fd;
+	reader->lost = frame_alloc(NAT_FRAME_LOST, bsc, 0);
+	reader->closed = frame_alloc(NAT_FRAME_CLOSED, bsc, 0);
+	if (!reader->lost || !reader->closed) {
+		free(reader->lost);
+		free(reader->closed);
+		free(reader);
+		return -1;
+	}
+
+	bsc->reader = reader;
+	reader->worker->connections += 1;
+
+	cmd = &reader->worker->ring[worker_cmd_get(&reader->worker->thread)];
+	cmd->type = NAT_WORKER_ADD;
+	cmd->reader = reader;
+	worker_cmd_put(&reader->worker->thread);
+	return 0;
+}
+
+/*
+ * The worker closes the socket. The connection is freed once it has
+ * done so, until then every frame for it is dropped.
+ */
+void bsc_nat_worker_close(struct bsc_connection *bsc)
+{
+	struct bsc_nat_worker *worker = bsc->reader->worker;
+	struct bsc_nat_worker_cmd *cmd;
+
+	bsc->closing = 1;
+
+	cmd = &worker->ring[worker_cmd_get(&worker->thread)];
+	cmd->type = NAT_WORKER_CLOSE;
+	cmd->reader = bsc->reader;
+	worker_cmd_put(&worker->thread);
+}
+
+static void frame_handle(struct bsc_nat_frames *frames, struct bsc_nat_frame *frame)
+{
+	struct bsc_connection *bsc = frame->bsc;
+	struct msgb *msg;
+	uint8_t *data;
+
+	switch (frame->type) {
+	case NAT_FRAME_MSG:
+		if (bsc->closing) {
+			frames->dropped += 1;
+			break;
+		}
+
+		msg = msgb_alloc_headroom(4096, 128, "from-bsc");
+		if (!msg) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to allocate the BSC msg.\n");
+			frames->dropped += 1;
+			break;
+		}
+
+		data = msgb_put(msg, frame->len);
+		memcpy(data, frame->data, frame->len);
+		msg->l2h = data + sizeof(struct ipaccess_head);
+		if (frame->l3_off >= 0)
+			msg->l3h = data + frame->l3_off;
+		if (frame->l4_off >= 0)
+			msg->l4h = data + frame->l4_off;
+		bsc_nat_parsed_rebase(&frame->parsed, frame->data, data);
+		NAT_MSGB_CB(msg)->stamp = frame->stamp;
+
+		if (frame->parse_rc != 0)
+			LOGP(DNAT, LOGL_ERROR, "BSC nr: %d: %s.\n", bsc->cfg ? bsc->cfg->nr : -1,
+			     bsc_nat_parse_strerror(frame->parse_rc));
+
+		frames->frames += 1;
+		frames->msg_cb(bsc, msg, frame->parse_rc == 0 ? &frame->parsed : NULL);
+		break;
+	case NAT_FRAME_LOST:
+		if (!bsc->closing)
+			frames->lost_cb(bsc, frame->error);
+		break;
+	case NAT_FRAME_CLOSED:
+		bsc->reader->worker->connections -= 1;
+		free(bsc->reader);
+		talloc_free(bsc);
+		break;
+	}
+
+	free(frame);
+}
+
+static int frames_cb(struct bsc_fd *bfd, unsigned int what)
+{
+	struct bsc_nat_frames *frames = bfd->data;
+	int i, nr;
+
+	if (worker_event_clear(bfd->fd) != 0)
+		LOGP(DNAT, LOGL_ERROR, "Failed to read the wakeup of the BSC threads.\n");
+
+	frames->wakeups += 1;
+
+	for (i = 0; i < NAT_WORKER_FRAMES; ++i) {
+		struct bsc_nat_frame *frame = frames_pop(frames);
+
+		if (!frame)
+			break;
+		frame_handle(frames, frame);
+	}
+
+	/* the throttled workers can go on */
+	for (nr = 0; nr < frames->nat->num_workers; ++nr)
+		worker_resume(&frames->nat->workers[nr].thread, &frames->queue,
+			      NAT_WORKER_FRAMES);
+
+	/* give the other sockets a turn and come back */
+	if (i == NAT_WORKER_FRAMES && worker_event_signal(bfd->fd) != 0)
+		LOGP(DNAT, LOGL_ERROR, "Failed to wake up the select loop.\n");
+	return 0;
+}
+
+static void workers_report(void *data)
+{
+	struct bsc_nat *nat = data;
+	int i;
+
+	for (i = 0; i < nat->num_workers; ++i)
+		worker_report(&nat->workers[i].thread);
+
+	bsc_schedule_timer(&report_timer, NAT_WORKER_REPORT, 0);
+}
+
+/*
+ * Below is running inside the worker thread.
+ */
+static void reader_lost(struct bsc_nat_reader *reader, int error)
+{
+	struct bsc_nat_worker *worker = reader->worker;
+
+	if (!reader->watched)
+		return;
+
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, reader->fd, NULL);
+	reader->watched = 0;
+	reader->len = 0;
+
+	reader->lost->error = error;
+	frames_push(worker->frames, reader->lost);
+	reader->lost = NULL;
+}
+
+static int reader_push(struct bsc_nat_reader *reader, const uint8_t *data, unsigned int len)
+{
+	struct bsc_nat_worker *worker = reader->worker;
+	struct bsc_nat_frame *frame;
+	struct msgb msg;
+
+	frame = frame_alloc(NAT_FRAME_MSG, reader->bsc, len);
+	if (!frame) {
+		worker->thread.errors[NAT_WORKER_ERR_ALLOC] += 1;
+		return 0;
+	}
+	memcpy(frame->data, data, len);
+	frame->stamp = bsc_nat_lat_now();
+
+	/* parse on a view of the frame, the select loop copies it */
+	memset(&msg, 0, sizeof(msg));
+	msg.head = msg.data = frame->data;
+	msg.tail = frame->data + len;
+	msg.len = msg.data_len = len;
+
+	frame->parse_rc = bsc_nat_parse_quiet(&msg, &frame->parsed);
+	frame->l3_off = msg.l3h ? msg.l3h - frame->data : -1;
+	frame->l4_off = msg.l4h ? msg.l4h - frame->data : -1;
+	if (frame->parse_rc != 0)
+		worker->thread.errors[NAT_WORKER_ERR_PARSE] += 1;
+
+	worker->messages += 1;
+	frames_push(worker->frames, frame);
+	return 1;
+}
+
+/* read once per wakeup so one busy BSC can not starve the others */
+static int reader_read(struct bsc_nat_reader *reader)
+{
+	struct bsc_nat_worker *worker = reader->worker;
+	unsigned int off = 0;
+	int rc, pushed = 0;
+
+	rc = read(reader->fd, reader->buf + reader->len,
+		  sizeof(reader->buf) - reader->len);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (rc <= 0) {
+		reader_lost(reader, rc == 0 ? 0 : -errno);
+		return 1;
+	}
+
+	reader->len += rc;
+	worker->bytes += rc;
+
+	while (reader->len - off >= sizeof(struct ipaccess_head)) {
+		struct ipaccess_head *hh = (struct ipaccess_head *) &reader->buf[off];
+		unsigned int len = sizeof(*hh) + ntohs(hh->len);
+
+		if (len > NAT_READER_MSG_MAX) {
+			worker->thread.errors[NAT_WORKER_ERR_MSG_SIZE] += 1;
+			reader_lost(reader, -EIO);
+			return 1;
+		}
+
+		if (reader->len - off < len)
+			break;
+
+		pushed += reader_push(reader, &reader->buf[off], len);
+		off += len;
+	}
+
+	reader->len -= off;
+	memmove(reader->buf, reader->buf + off, reader->len);
+	return pushed;
+}
+
+static void worker_apply_add(struct bsc_nat_worker *worker, struct bsc_nat_reader *reader)
+{
+	struct epoll_event ev;
+	int flags, error;
+
+	reader->watched = 1;
+
+	flags = fcntl(reader->fd, F_GETFL);
+	if (flags < 0 || fcntl(reader->fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		error = -errno;
+		goto error;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = reader;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, reader->fd, &ev) != 0) {
+		error = -errno;
+		goto error;
+	}
+
+	return;
+
+error:
+	worker->thread.errors[NAT_WORKER_ERR_WATCH] += 1;
+	reader_lost(reader, error);
+}
+
+/*
+ * The events of the current batch might still refer to the reader. It
+ * is not watched anymore, the select loop gets it with worker_release.
+ */
+static void worker_apply_close(struct bsc_nat_worker *worker, struct bsc_nat_reader *reader)
+{
+	if (reader->watched)
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, reader->fd, NULL);
+	reader->watched = 0;
+	close(reader->fd);
+
+	free(reader->lost);
+	reader->lost = NULL;
+	reader->next_closed = worker->closed;
+	worker->closed = reader;
+}
+
+/* hand the closed readers back, after that they may be freed any time */
+static int worker_release(struct bsc_nat_worker *worker)
+{
+	struct bsc_nat_reader *reader;
+	int pushed = 0;
+
+	while ((reader = worker->closed)) {
+		worker->closed = reader->next_closed;
+		frames_push(worker->frames, reader->closed);
+		pushed = 1;
+	}
+
+	return pushed;
+}
+
+static void worker_apply(struct worker_thread *thread, unsigned int slot)
+{
+	struct bsc_nat_worker *worker =
+		container_of(thread, struct bsc_nat_worker, thread);
+	struct bsc_nat_worker_cmd *cmd = &worker->ring[slot];
+
+	switch (cmd->type) {
+	case NAT_WORKER_ADD:
+		worker_apply_add(worker, cmd->reader);
+		break;
+	case NAT_WORKER_CLOSE:
+		worker_apply_close(worker, cmd->reader);
+		break;
+	}
+}
+
+static void *worker_main(void *data)
+{
+	struct bsc_nat_worker *worker = data;
+	struct epoll_event events[64];
+	int i, rc, pending, pushed;
+
+	while (1) {
+		rc = epoll_wait(worker->epoll_fd, events, ARRAY_SIZE(events), -1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			worker->thread.failed = errno;
+			break;
+		}
+
+		worker->wakeups += 1;
+		worker_throttle(&worker->thread, &worker->frames->queue,
+				NAT_WORKER_FRAMES, worker->frames->bfd.fd);
+		pending = pushed = 0;
+
+		/* a reader closed by a command of this batch is not watched */
+		for (i = 0; i < rc; ++i) {
+			struct bsc_nat_reader *reader = events[i].data.ptr;
+
+			if (!reader) {
+				pending = 1;
+				continue;
+			}
+
+			if (reader->watched)
+				pushed += reader_read(reader);
+		}
+
+		if (pending)
+			worker_drain(&worker->thread);
+
+		/* no event refers to the closed readers anymore */
+		pushed += worker_release(worker);
+
+		/* one wakeup for everything of this batch */
+		if (pushed && worker_event_signal(worker->frames->bfd.fd) != 0)
+			worker->thread.errors[WORKER_ERR_WAKEUP] += 1;
+	}
+
+	return NULL;
+}
+
+static int worker_init(struct bsc_nat *nat, struct bsc_nat_worker *worker, int nr)
+{
+	struct epoll_event ev;
+	int rc;
+
+	rc = worker_thread_init(&worker->thread, &worker_desc, nr);
+	if (rc != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to create the eventfd: %s\n",
+		     strerror(-rc));
+		return -1;
+	}
+
+	worker->frames = nat->frames;
+
+	worker->epoll_fd = epoll_create(64);
+	if (worker->epoll_fd < 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to create the epoll set: %s\n",
+		     strerror(errno));
+		worker_thread_close(&worker->thread);
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->thread.event_fd, &ev) != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to watch the eventfd: %s\n",
+		     strerror(errno));
+		close(worker->epoll_fd);
+		worker_thread_close(&worker->thread);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int frames_init(struct bsc_nat *nat,
+		       void (*msg_cb)(struct bsc_connection *, struct msgb *,
+				      struct bsc_nat_parsed *),
+		       void (*lost_cb)(struct bsc_connection *, int))
+{
+	struct bsc_nat_frames *frames;
+
+	frames = talloc_zero(nat, struct bsc_nat_frames);
+	if (!frames)
+		return -1;
+
+	frames->nat = nat;
+	worker_queue_init(&frames->queue);
+	frames->msg_cb = msg_cb;
+	frames->lost_cb = lost_cb;
+
+	frames->bfd.fd = eventfd(0, EFD_NONBLOCK);
+	if (frames->bfd.fd < 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to create the eventfd: %s\n",
+		     strerror(errno));
+		talloc_free(frames);
+		return -1;
+	}
+
+	frames->bfd.when = BSC_FD_READ;
+	frames->bfd.cb = frames_cb;
+	frames->bfd.data = frames;
+	if (bsc_register_fd(&frames->bfd) != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to register the eventfd.\n");
+		close(frames->bfd.fd);
+		talloc_free(frames);
+		return -1;
+	}
+
+	nat->frames = frames;
+	return 0;
+}
+
+/*
+ * Start the BSC reader threads. BSCs accepted afterwards are read
+ * and parsed by the threads, the messages are handed to msg_cb from
+ * the select loop. The parsed result is NULL if the parsing failed.
+ */
+int bsc_nat_workers_start(struct bsc_nat *nat,
+			  void (*msg_cb)(struct bsc_connection *, struct msgb *,
+					 struct bsc_nat_parsed *),
+			  void (*lost_cb)(struct bsc_connection *, int))
+{
+	int i, rc;
+
+	if (nat->num_workers <= 0 || nat->workers)
+		return 0;
+
+	if (frames_init(nat, msg_cb, lost_cb) != 0)
+		return -1;
+
+	nat->workers = _talloc_zero_array(nat, sizeof(struct bsc_nat_worker),
+					  nat->num_workers, "bsc-workers");
+	if (!nat->workers)
+		return -1;
+
+	for (i = 0; i < nat->num_workers; ++i) {
+		if (worker_init(nat, &nat->workers[i], i) != 0) {
+			LOGP(DNAT, LOGL_FATAL, "Failed to create BSC thread %d.\n", i);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < nat->num_workers; ++i) {
+		rc = worker_thread_start(&nat->workers[i].thread.thread,
+					 worker_main, &nat->workers[i]);
+		if (rc != 0) {
+			LOGP(DNAT, LOGL_FATAL, "Failed to start BSC thread %d: %s\n",
+			     i, strerror(rc));
+			return -1;
+		}
+	}
+
+	report_timer.cb = workers_report;
+	report_timer.data = nat;
+	bsc_schedule_timer(&report_timer, NAT_WORKER_REPORT, 0);
+
+	LOGP(DNAT, LOGL_NOTICE, "Started %d BSC threads.\n", nat->num_workers);
+	return 0;
+}
@@ -36,72 +36,372 @@ static int equal(struct sccp_source_reference *ref1, struct sccp_source_referenc
 	return memcmp(ref1, ref2, sizeof(*ref1)) == 0;
 }
 
+static uint32_t ref_to_int(const struct sccp_source_reference *ref)
+{
+	return ref->octet1 | ref->octet2 << 8 | ref->octet3 << 16;
+}
+
 /*
- * SCCP patching below
+ * Connection tables
  */
+#define TABLE_MIN_SIZE	256
 
-/* check if we are using this ref for patched already */
-static int sccp_ref_is_free(struct sccp_source_reference *ref, struct bsc_nat *nat)
+static uint32_t ref_hash(const struct sccp_source_reference *ref, const void *bsc)
 {
-	struct sccp_connections *conn;
+	uint32_t key = ref_to_int(ref) ^ (uint32_t) ((unsigned long) bsc >> 4);
 
-	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
-		if (memcmp(ref, &conn->patched_ref, sizeof(*ref)) == 0)
-			return -1;
+	key *= 0x9e3779b1;
+	return key ^ (key >> 16);
+}
+
+static int table_resize(struct bsc_nat *nat, struct sccp_con_table *table,
+			unsigned int size)
+{
+	struct llist_head *buckets;
+	unsigned int i;
+
+	buckets = talloc_array(nat, struct llist_head, size);
+	if (!buckets)
+		return -1;
+
+	for (i = 0; i < size; ++i)
+		INIT_LLIST_HEAD(&buckets[i]);
+
+	for (i = 0; i < table->size; ++i) {
+		struct sccp_con_hentry *entry, *tmp;
+
+		llist_for_each_entry_safe(entry, tmp, &table->buckets[i], list) {
+			llist_del(&entry->list);
+			llist_add_tail(&entry->list, &buckets[entry->hash & (size - 1)]);
+		}
+	}
+
+	talloc_free(table->buckets);
+	table->buckets = buckets;
+	table->size = size;
+	return 0;
+}
+
+static int table_add(struct bsc_nat *nat, struct sccp_con_table *table,
+		     struct sccp_con_hentry *entry, uint32_t hash)
+{
+	/* keep the chains short, a failure only makes them longer */
+	if (table->count >= table->size)
+		table_resize(nat, table, table->size ? table->size * 2 : TABLE_MIN_SIZE);
+	if (!table->size) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to allocate the connection table.\n");
+		return -1;
 	}
 
+	entry->hash = hash;
+	llist_add_tail(&entry->list, &table->buckets[hash & (table->size - 1)]);
+	table->count += 1;
 	return 0;
 }
 
-/* copied from sccp.c */
-static int assign_src_local_reference(struct sccp_source_reference *ref, struct bsc_nat *nat)
+static void table_del(struct sccp_con_table *table, struct sccp_con_hentry *entry)
+{
+	if (!entry->list.next || llist_empty(&entry->list))
+		return;
+
+	llist_del_init(&entry->list);
+	table->count -= 1;
+}
+
+static struct llist_head *table_bucket(struct sccp_con_table *table, uint32_t hash)
+{
+	static LLIST_HEAD(empty);
+
+	if (!table->size)
+		return &empty;
+	return &table->buckets[hash & (table->size - 1)];
+}
+
+/*
+ * SCCP patching below
+ */
+
+/* the bitmaps are uint32_t, only shift unsigned values into them */
+static unsigned int pool_level_bits(int level)
+{
+	return 1U << (SCCP_REF_BITS - 5 * level);
+}
+
+static void pool_set(struct sccp_ref_pool *pool, uint32_t ref)
+{
+	int level;
+
+	for (level = 0; level < SCCP_REF_LEVELS; ++level) {
+		uint32_t *word = &pool->bits[level][ref >> 5];
+
+		*word |= 1U << (ref & 31);
+		if (*word != 0xffffffff)
+			break;
+		ref >>= 5;
+	}
+}
+
+static void pool_clear(struct sccp_ref_pool *pool, uint32_t ref)
+{
+	int level;
+
+	for (level = 0; level < SCCP_REF_LEVELS; ++level) {
+		uint32_t *word = &pool->bits[level][ref >> 5];
+		int was_full = *word == 0xffffffff;
+
+		*word &= ~(1U << (ref & 31));
+		if (!was_full)
+			break;
+		ref >>= 5;
+	}
+}
+
+/* the first free reference at or after start */
+static int pool_find(struct sccp_ref_pool *pool, uint32_t start, uint32_t *ref)
 {
-	static uint32_t last_ref = 0x50000;
-	int wrapped = 0;
+	uint32_t pos = start;
+	int level = 0;
 
-	do {
-		struct sccp_source_reference reference;
-		reference.octet1 = (last_ref >>  0) & 0xff;
-		reference.octet2 = (last_ref >>  8) & 0xff;
-		reference.octet3 = (last_ref >> 16) & 0xff;
+	while (pos < pool_level_bits(level)) {
+		uint32_t bits = ~pool->bits[level][pos >> 5] & (0xffffffffU << (pos & 31));
 
-		++last_ref;
-		/* do not use the reversed word and wrap around */
-		if ((last_ref & 0x00FFFFFF) == 0x00FFFFFF) {
-			LOGP(DNAT, LOGL_NOTICE, "Wrapped searching for a free code\n");
-			last_ref = 0;
-			++wrapped;
+		if (!bits) {
+			if (level == SCCP_REF_LEVELS - 1)
+				break;
+			pos = (pos >> 5) + 1;
+			level += 1;
+			continue;
 		}
 
-		if (sccp_ref_is_free(&reference, nat) == 0) {
-			*ref = reference;
+		pos = (pos & ~31) + __builtin_ctz(bits);
+		if (level == 0) {
+			*ref = pos;
 			return 0;
 		}
-	} while (wrapped != 2);
 
-	LOGP(DNAT, LOGL_ERROR, "Finding a free reference failed\n");
+		/* this word of the level below has a free bit */
+		level -= 1;
+		pos <<= 5;
+	}
+
 	return -1;
 }
 
-struct sccp_connections *create_sccp_src_ref(struct bsc_connection *bsc,
-					     struct bsc_nat_parsed *parsed)
+static int pool_init(void *ctx, struct sccp_ref_pool *pool)
 {
-	struct sccp_connections *conn;
+	int level;
 
-	/* Some commercial BSCs like to reassign there SRC ref */
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
-		if (conn->bsc != bsc)
+	for (level = 0; level < SCCP_REF_LEVELS; ++level) {
+		unsigned int words = (pool_level_bits(level) + 31) / 32;
+
+		pool->bits[level] = talloc_zero_array(ctx, uint32_t, words);
+		if (!pool->bits[level]) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to allocate the reference pool.\n");
+			while (--level >= 0) {
+				talloc_free(pool->bits[level]);
+				pool->bits[level] = NULL;
+			}
+			return -1;
+		}
+	}
+
+	/* do not use the reserved word */
+	pool_set(pool, 0x00FFFFFF);
+	pool->last = 0x50000;
+	return 0;
+}
+
+static int assign_src_local_reference(struct sccp_source_reference *ref, struct bsc_nat_msc *msc)
+{
+	struct sccp_ref_pool *pool = &msc->refs;
+	uint32_t free_ref;
+
+	if (!pool->bits[0] && pool_init(msc, pool) != 0)
+		return -1;
+
+	if (pool_find(pool, pool->last, &free_ref) != 0) {
+		LOGP(DNAT, LOGL_NOTICE, "Wrapped searching for a free code\n");
+		if (pool_find(pool, 0, &free_ref) != 0) {
+			LOGP(DNAT, LOGL_ERROR, "Finding a free reference failed\n");
+			return -1;
+		}
+	}
+
+	pool_set(pool, free_ref);
+	pool->used += 1;
+	pool->last = free_ref + 1;
+
+	ref->octet1 = (free_ref >>  0) & 0xff;
+	ref->octet2 = (free_ref >>  8) & 0xff;
+	ref->octet3 = (free_ref >> 16) & 0xff;
+	return 0;
+}
+
+static void release_src_local_reference(struct sccp_source_reference *ref, struct bsc_nat_msc *msc)
+{
+	struct sccp_ref_pool *pool = &msc->refs;
+
+	if (!pool->bits[0])
+		return;
+
+	pool_clear(pool, ref_to_int(ref));
+	pool->used -= 1;
+}
+
+/* keep a reference of a snapshot until the connection is adopted */
+int sccp_ref_reserve(struct bsc_nat_msc *msc, uint32_t ref)
+{
+	struct sccp_ref_pool *pool = &msc->refs;
+	uint32_t free_ref;
+
+	if (!pool->bits[0] && pool_init(msc, pool) != 0)
+		return -1;
+
+	if (ref >= 0x00FFFFFF || pool_find(pool, ref, &free_ref) != 0 || free_ref != ref)
+		return -1;
+
+	pool_set(pool, ref);
+	pool->used += 1;
+	return 0;
+}
+
+void sccp_ref_release(struct bsc_nat_msc *msc, uint32_t ref)
+{
+	struct sccp_source_reference src;
+
+	src.octet1 = (ref >>  0) & 0xff;
+	src.octet2 = (ref >>  8) & 0xff;
+	src.octet3 = (ref >> 16) & 0xff;
+	release_src_local_reference(&src, msc);
+}
+
+/* assign a new patched reference of the MSC and put it into the index */
+static int assign_patched_ref(struct sccp_connections *conn, struct bsc_nat_msc *msc)
+{
+	struct bsc_nat *nat = msc->nat;
+
+	if (assign_src_local_reference(&conn->patched_ref, msc) != 0)
+		return -1;
+
+	if (table_add(nat, &nat->sccp_by_patched, &conn->by_patched,
+		      ref_hash(&conn->patched_ref, msc)) != 0) {
+		release_src_local_reference(&conn->patched_ref, msc);
+		return -1;
+	}
+
+	conn->msc = msc;
+	return 0;
+}
+
+static void release_patched_ref(struct sccp_connections *conn, struct bsc_nat *nat)
+{
+	if (!conn->by_patched.list.next || llist_empty(&conn->by_patched.list))
+		return;
+
+	table_del(&nat->sccp_by_patched, &conn->by_patched);
+	release_src_local_reference(&conn->patched_ref, conn->msc);
+}
+
+void sccp_connection_set_remote(struct sccp_connections *conn,
+				struct sccp_source_reference *ref)
+{
+	struct bsc_nat *nat = conn->bsc->nat;
+
+	table_del(&nat->sccp_by_remote, &conn->by_remote);
+	conn->remote_ref = *ref;
+	conn->has_remote_ref = 1;
+	if (table_add(nat, &nat->sccp_by_remote, &conn->by_remote,
+		      ref_hash(&conn->remote_ref, conn->bsc)) != 0)
+		LOGP(DNAT, LOGL_ERROR, "Remote reference 0x%x can not be found.\n",
+		     sccp_src_ref_to_int(&conn->remote_ref));
+}
+
+/* remove the connection from the list and the indices */
+void sccp_connection_unlink(struct sccp_connections *conn)
+{
+	struct bsc_nat *nat = conn->bsc->nat;
+
+	release_patched_ref(conn, nat);
+	table_del(&nat->sccp_by_real, &conn->by_real);
+	table_del(&nat->sccp_by_remote, &conn->by_remote);
+	llist_del(&conn->list_entry);
+}
+
+static struct sccp_connections *find_by_real(struct bsc_connection *bsc,
+					     struct sccp_source_reference *ref)
+{
+	struct sccp_con_hentry *entry;
+	uint32_t hash = ref_hash(ref, bsc);
+
+	llist_for_each_entry(entry, table_bucket(&bsc->nat->sccp_by_real, hash), list) {
+		struct sccp_connections *conn;
+
+		if (entry->hash != hash)
+			continue;
+		conn = container_of(entry, struct sccp_connections, by_real);
+		if (conn->bsc == bsc && equal(ref, &conn->real_ref))
+			return conn;
+	}
+
+	return NULL;
+}
+
+static struct sccp_connections *find_by_patched(struct bsc_nat_msc *msc,
+						struct sccp_source_reference *ref)
+{
+	struct sccp_con_hentry *entry;
+	uint32_t hash = ref_hash(ref, msc);
+
+	llist_for_each_entry(entry, table_bucket(&msc->nat->sccp_by_patched, hash), list) {
+		struct sccp_connections *conn;
+
+		if (entry->hash != hash)
 			continue;
-		if (memcmp(&conn->real_ref, parsed->src_local_ref, sizeof(conn->real_ref)) != 0)
+		conn = container_of(entry, struct sccp_connections, by_patched);
+		if (conn->msc == msc && equal(ref, &conn->patched_ref))
+			return conn;
+	}
+
+	return NULL;
+}
+
+static struct sccp_connections *find_by_remote(struct bsc_connection *bsc,
+					       struct sccp_source_reference *ref)
+{
+	struct sccp_con_hentry *entry;
+	uint32_t hash = ref_hash(ref, bsc);
+
+	llist_for_each_entry(entry, table_bucket(&bsc->nat->sccp_by_remote, hash), list) {
+		struct sccp_connections *conn;
+
+		if (entry->hash != hash)
 			continue;
+		conn = container_of(entry, struct sccp_connections, by_remote);
+		if (conn->bsc == bsc && equal(ref, &conn->remote_ref))
+			return conn;
+	}
+
+	return NULL;
+}
+
+struct sccp_connections *create_sccp_src_ref(struct bsc_connection *bsc, struct bsc_nat_msc *msc,
+					     struct bsc_nat_parsed *parsed)
+{
+	struct sccp_connections *conn;
 
+	/* Some commercial BSCs like to reassign there SRC ref */
+	conn = find_by_real(bsc, parsed->src_local_ref);
+	if (conn) {
 		/* the BSC has reassigned the SRC ref and we failed to keep track */
+		table_del(&bsc->nat->sccp_by_remote, &conn->by_remote);
 		memset(&conn->remote_ref, 0, sizeof(conn->remote_ref));
-		if (assign_src_local_reference(&conn->patched_ref, bsc->nat) != 0) {
+		conn->has_remote_ref = 0;
+		release_patched_ref(conn, bsc->nat);
+		if (assign_patched_ref(conn, msc) != 0) {
 			LOGP(DNAT, LOGL_ERROR, "BSC %d reused src ref: %d and we failed to generate a new id.\n",
 			     bsc->cfg->nr, sccp_src_ref_to_int(parsed->src_local_ref));
 			bsc_mgcp_dlcx(conn);
-			llist_del(&conn->list_entry);
+			sccp_connection_unlink(conn);
 			talloc_free(conn);
 			return NULL;
 		} else {
@@ -121,16 +421,27 @@ struct sccp_connections *create_sccp_src_ref(struct bsc_connection *bsc,
 	conn->bsc = bsc;
 	clock_gettime(CLOCK_MONOTONIC, &conn->creation_time);
 	conn->real_ref = *parsed->src_local_ref;
-	if (assign_src_local_reference(&conn->patched_ref, bsc->nat) != 0) {
+	INIT_LLIST_HEAD(&conn->by_real.list);
+	INIT_LLIST_HEAD(&conn->by_patched.list);
+	INIT_LLIST_HEAD(&conn->by_remote.list);
+	if (assign_patched_ref(conn, msc) != 0) {
 		LOGP(DNAT, LOGL_ERROR, "Failed to assign a ref.\n");
 		talloc_free(conn);
 		return NULL;
 	}
 
+	if (table_add(bsc->nat, &bsc->nat->sccp_by_real, &conn->by_real,
+		      ref_hash(&conn->real_ref, bsc)) != 0) {
+		release_patched_ref(conn, bsc->nat);
+		talloc_free(conn);
+		return NULL;
+	}
+
 	bsc_mgcp_init(conn);
 	llist_add_tail(&conn->list_entry, &bsc->nat->sccp_connections);
 	rate_ctr_inc(&bsc->cfg->stats.ctrg->ctr[BCFG_CTR_SCCP_CONN]);
 	counter_inc(bsc->cfg->nat->stats.sccp.conn);
+	rate_ctr_inc(&msc->ctrg->ctr[MSC_CTR_SCCP_CONN]);
 
 	LOGP(DNAT, LOGL_DEBUG, "Created 0x%x <-> 0x%x mapping for con %p\n",
 	     sccp_src_ref_to_int(&conn->real_ref),
@@ -139,6 +450,55 @@ struct sccp_connections *create_sccp_src_ref(struct bsc_connection *bsc,
 	return conn;
 }
 
+/*
+ * Recreate a connection of the snapshot for the BSC that came back. The
+ * patched reference was reserved when the snapshot was loaded and is
+ * owned by the connection now.
+ */
+struct sccp_connections *sccp_connection_adopt(struct bsc_connection *bsc, struct bsc_nat_msc *msc,
+					       struct sccp_source_reference *real,
+					       struct sccp_source_reference *patched)
+{
+	struct sccp_connections *conn;
+
+	if (find_by_real(bsc, real))
+		return NULL;
+
+	conn = talloc_zero(bsc->nat, struct sccp_connections);
+	if (!conn) {
+		LOGP(DNAT, LOGL_ERROR, "Memory allocation failure.\n");
+		return NULL;
+	}
+
+	conn->bsc = bsc;
+	conn->msc = msc;
+	conn->msc_con = msc->con;
+	clock_gettime(CLOCK_MONOTONIC, &conn->creation_time);
+	conn->real_ref = *real;
+	conn->patched_ref = *patched;
+	conn->msc_endp = -1;
+	conn->bsc_endp = -1;
+	INIT_LLIST_HEAD(&conn->by_real.list);
+	INIT_LLIST_HEAD(&conn->by_patched.list);
+	INIT_LLIST_HEAD(&conn->by_remote.list);
+
+	if (table_add(bsc->nat, &bsc->nat->sccp_by_patched, &conn->by_patched,
+		      ref_hash(&conn->patched_ref, msc)) != 0) {
+		talloc_free(conn);
+		return NULL;
+	}
+
+	if (table_add(bsc->nat, &bsc->nat->sccp_by_real, &conn->by_real,
+		      ref_hash(&conn->real_ref, bsc)) != 0) {
+		table_del(&bsc->nat->sccp_by_patched, &conn->by_patched);
+		talloc_free(conn);
+		return NULL;
+	}
+
+	llist_add_tail(&conn->list_entry, &bsc->nat->sccp_connections);
+	return conn;
+}
+
 int update_sccp_src_ref(struct sccp_connections *sccp, struct bsc_nat_parsed *parsed)
 {
 	if (!parsed->dest_local_ref || !parsed->src_local_ref) {
@@ -146,8 +506,7 @@ int update_sccp_src_ref(struct sccp_connections *sccp, struct bsc_nat_parsed *pa
 		return -1;
 	}
 
-	sccp->remote_ref = *parsed->src_local_ref;
-	sccp->has_remote_ref = 1;
+	sccp_connection_set_remote(sccp, parsed->src_local_ref);
 	LOGP(DNAT, LOGL_DEBUG, "Updating 0x%x to remote 0x%x on %p\n",
 	     sccp_src_ref_to_int(&sccp->patched_ref),
 	     sccp_src_ref_to_int(&sccp->remote_ref), sccp->bsc);
@@ -158,11 +517,12 @@ int update_sccp_src_ref(struct sccp_connections *sccp, struct bsc_nat_parsed *pa
 void remove_sccp_src_ref(struct bsc_connection *bsc, struct msgb *msg, struct bsc_nat_parsed *parsed)
 {
 	struct sccp_connections *conn;
+	struct bsc_nat_msc *msc;
 
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
-		if (memcmp(parsed->src_local_ref,
-			   &conn->patched_ref, sizeof(conn->patched_ref)) == 0) {
-
+	/* the reference alone does not tell the MSC */
+	llist_for_each_entry(msc, &bsc->nat->mscs, entry) {
+		conn = find_by_patched(msc, parsed->src_local_ref);
+		if (conn && conn->bsc == bsc) {
 			sccp_connection_destroy(conn);
 			return;
 		}
@@ -179,7 +539,7 @@ void remove_sccp_src_ref(struct bsc_connection *bsc, struct msgb *msg, struct bs
  */
 struct sccp_connections *patch_sccp_src_ref_to_bsc(struct msgb *msg,
 						   struct bsc_nat_parsed *parsed,
-						   struct bsc_nat *nat)
+						   struct bsc_nat_msc *msc)
 {
 	struct sccp_connections *conn;
 
@@ -189,16 +549,13 @@ struct sccp_connections *patch_sccp_src_ref_to_bsc(struct msgb *msg,
 	}
 
 
-	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
-		if (!equal(parsed->dest_local_ref, &conn->patched_ref))
-			continue;
-
-		/* Change the dest address to the real one */
-		*parsed->dest_local_ref = conn->real_ref;
-		return conn;
-	}
+	conn = find_by_patched(msc, parsed->dest_local_ref);
+	if (!conn)
+		return NULL;
 
-	return NULL;
+	/* Change the dest address to the real one */
+	*parsed->dest_local_ref = conn->real_ref;
+	return conn;
 }
 
 /*
@@ -215,23 +572,15 @@ struct sccp_connections *patch_sccp_src_ref_to_msc(struct msgb *msg,
 {
 	struct sccp_connections *conn;
 
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
-		if (conn->bsc != bsc)
-			continue;
-
-		if (parsed->src_local_ref) {
-			if (equal(parsed->src_local_ref, &conn->real_ref)) {
-				*parsed->src_local_ref = conn->patched_ref;
-				return conn;
-			}
-		} else if (parsed->dest_local_ref) {
-			if (equal(parsed->dest_local_ref, &conn->remote_ref))
-				return conn;
-		} else {
-			LOGP(DNAT, LOGL_ERROR, "Header has neither loc/dst ref.\n");
-			return NULL;
-		}
+	if (parsed->src_local_ref) {
+		conn = find_by_real(bsc, parsed->src_local_ref);
+		if (conn)
+			*parsed->src_local_ref = conn->patched_ref;
+		return conn;
+	} else if (parsed->dest_local_ref) {
+		return find_by_remote(bsc, parsed->dest_local_ref);
 	}
 
+	LOGP(DNAT, LOGL_ERROR, "Header has neither loc/dst ref.\n");
 	return NULL;
 }
@@ -0,0 +1,238 @@
+/* epoll backend for the select loop */
+
+/* (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * The epoll set itself is registered as a single bsc_fd with
+ * libosmocore. bsc_select_main() keeps running the timers and the few
+ * remaining sockets (VTY, listeners) and calls into us whenever one of
+ * the sockets in the epoll set is ready. The cost of an iteration no
+ * longer depends on the number of sockets registered here.
+ *
+ * The sockets are watched level triggered. The callbacks in this tree
+ * handle one message per invocation and rely on being called again.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+#include <osmocore/select.h>
+#include <osmocore/talloc.h>
+#include <osmocore/utils.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/select_epoll.h>
+
+#define EPOLL_BATCH	128
+
+static struct bsc_fd epoll_bfd = { .fd = -1 };
+
+/* the batch that is currently dispatched */
+static struct epoll_event events[EPOLL_BATCH];
+static int nr_events;
+
+/* what we told the kernel, indexed by the file descriptor */
+static unsigned char *watched;
+static int nr_watched;
+
+static unsigned int to_epoll(unsigned int when)
+{
+	unsigned int events = 0;
+
+	if (when & BSC_FD_READ)
+		events |= EPOLLIN;
+	if (when & BSC_FD_WRITE)
+		events |= EPOLLOUT;
+	if (when & BSC_FD_EXCEPT)
+		events |= EPOLLPRI;
+	return events;
+}
+
+static int ensure_watched(int fd)
+{
+	unsigned char *tmp;
+	int size;
+
+	if (fd < nr_watched)
+		return 0;
+
+	size = nr_watched ? nr_watched : 1024;
+	while (size <= fd)
+		size *= 2;
+
+	tmp = talloc_realloc_size(NULL, watched, size);
+	if (!tmp)
+		return -1;
+
+	memset(&tmp[nr_watched], 0, size - nr_watched);
+	watched = tmp;
+	nr_watched = size;
+	return 0;
+}
+
+static int epoll_set(struct bsc_fd *fd, int op)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = to_epoll(fd->when);
+	ev.data.ptr = fd;
+	return epoll_ctl(epoll_bfd.fd, op, fd->fd, &ev);
+}
+
+static int epoll_cb(struct bsc_fd *bfd, unsigned int what)
+{
+	int i;
+
+	nr_events = epoll_wait(bfd->fd, events, ARRAY_SIZE(events), 0);
+	if (nr_events < 0) {
+		if (errno != EINTR)
+			LOGP(DINP, LOGL_ERROR, "epoll_wait failed: %s\n", strerror(errno));
+		nr_events = 0;
+		return 0;
+	}
+
+	for (i = 0; i < nr_events; ++i) {
+		struct bsc_fd *fd = events[i].data.ptr;
+		unsigned int flags = 0;
+
+		/* unregistered by a previous callback of this batch */
+		if (!fd)
+			continue;
+
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			flags |= BSC_FD_READ;
+		if (events[i].events & EPOLLOUT)
+			flags |= BSC_FD_WRITE;
+		if (events[i].events & EPOLLPRI)
+			flags |= BSC_FD_EXCEPT;
+
+		flags &= fd->when;
+		if (!flags)
+			continue;
+
+		fd->cb(fd, flags);
+
+		/* a write_queue changes its interest from inside the cb */
+		if (events[i].data.ptr)
+			bsc_epoll_update_fd(fd);
+	}
+
+	nr_events = 0;
+	return 0;
+}
+
+int bsc_epoll_init(void)
+{
+	if (epoll_bfd.fd >= 0)
+		return 0;
+
+	epoll_bfd.fd = epoll_create(1024);
+	if (epoll_bfd.fd < 0) {
+		LOGP(DINP, LOGL_ERROR, "Failed to create epoll set: %s\n",
+		     strerror(errno));
+		return -1;
+	}
+
+	epoll_bfd.when = BSC_FD_READ;
+	epoll_bfd.cb = epoll_cb;
+	if (bsc_register_fd(&epoll_bfd) != 0) {
+		close(epoll_bfd.fd);
+		epoll_bfd.fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int bsc_epoll_enabled(void)
+{
+	return epoll_bfd.fd >= 0;
+}
+
+int bsc_epoll_register_fd(struct bsc_fd *fd)
+{
+	if (!bsc_epoll_enabled())
+		return bsc_register_fd(fd);
+
+	if (ensure_watched(fd->fd) != 0)
+		return -ENOMEM;
+
+	if (epoll_set(fd, EPOLL_CTL_ADD) != 0) {
+		LOGP(DINP, LOGL_ERROR, "Failed to add fd %d to epoll: %s\n",
+		     fd->fd, strerror(errno));
+		return -EIO;
+	}
+
+	watched[fd->fd] = fd->when;
+	return 0;
+}
+
+void bsc_epoll_unregister_fd(struct bsc_fd *fd)
+{
+	int i;
+
+	if (!bsc_epoll_enabled()) {
+		bsc_unregister_fd(fd);
+		return;
+	}
+
+	/*
+	 * The socket might already be closed which removed it from
+	 * the set. Errors are of no interest here.
+	 */
+	if (fd->fd >= 0) {
+		epoll_ctl(epoll_bfd.fd, EPOLL_CTL_DEL, fd->fd, NULL);
+		if (fd->fd < nr_watched)
+			watched[fd->fd] = 0;
+	}
+
+	/* do not dispatch to it for the rest of the current batch */
+	for (i = 0; i < nr_events; ++i)
+		if (events[i].data.ptr == fd)
+			events[i].data.ptr = NULL;
+}
+
+/*
+ * The select loop looks at bsc_fd->when on each iteration. With epoll
+ * the kernel needs to be told. Call this when changing the interest
+ * from outside of the callback, e.g. after write_queue_enqueue.
+ */
+void bsc_epoll_update_fd(struct bsc_fd *fd)
+{
+	if (!bsc_epoll_enabled() || fd->fd < 0 || fd->fd >= nr_watched)
+		return;
+
+	if (watched[fd->fd] == fd->when)
+		return;
+
+	if (epoll_set(fd, EPOLL_CTL_MOD) != 0) {
+		LOGP(DINP, LOGL_ERROR, "Failed to modify fd %d in epoll: %s\n",
+		     fd->fd, strerror(errno));
+		return;
+	}
+
+	watched[fd->fd] = fd->when;
+}
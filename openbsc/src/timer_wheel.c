@@ -0,0 +1,280 @@
+/* Hierarchical timer wheel on top of the libosmocore timers */
+
+/* (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * This follows the timer wheel of the Linux kernel. The root wheel
+ * has one slot per tick, every other level covers TW_LVL_SIZE slots
+ * of the level below. Timers are moved down a level when the root
+ * wheel wraps. All wheels are driven by one libosmocore timer that is
+ * only armed while at least one wheel holds a timer.
+ */
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <osmocore/linuxlist.h>
+#include <osmocore/timer.h>
+
+#include <openbsc/timer_wheel.h>
+
+#define TW_ROOT_MASK	(TW_ROOT_SIZE - 1)
+#define TW_LVL_MASK	(TW_LVL_SIZE - 1)
+#define TW_INDEX(w, n)	(((w)->now >> (TW_ROOT_BITS + (n) * TW_LVL_BITS)) & TW_LVL_MASK)
+
+LLIST_HEAD(bsc_timer_wheels);
+
+static struct bsc_timer_wheel other_wheel = BSC_TIMER_WHEEL("other");
+
+static struct timer_list driver;
+static uint32_t driver_tick;
+
+static uint64_t tv_to_ms(const struct timeval *tv)
+{
+	return (uint64_t) tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+}
+
+static uint32_t tv_to_tick(const struct timeval *tv)
+{
+	return (tv_to_ms(tv) + TW_TICK_MS - 1) / TW_TICK_MS;
+}
+
+static uint32_t current_tick(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000) / TW_TICK_MS;
+}
+
+static void wheel_init(struct bsc_timer_wheel *wheel)
+{
+	int i, j;
+
+	for (i = 0; i < TW_ROOT_SIZE; ++i)
+		INIT_LLIST_HEAD(&wheel->root[i]);
+	for (i = 0; i < TW_LEVELS; ++i)
+		for (j = 0; j < TW_LVL_SIZE; ++j)
+			INIT_LLIST_HEAD(&wheel->lvl[i][j]);
+
+	wheel->now = current_tick();
+	llist_add_tail(&wheel->entry, &bsc_timer_wheels);
+}
+
+static void wheel_add(struct bsc_timer_wheel *wheel, struct timer_list *timer)
+{
+	uint32_t expires = tv_to_tick(&timer->timeout);
+	uint32_t idx = expires - wheel->now;
+	struct llist_head *vec;
+
+	if ((int32_t) idx < 0)
+		vec = &wheel->root[wheel->now & TW_ROOT_MASK];
+	else if (idx < TW_ROOT_SIZE)
+		vec = &wheel->root[expires & TW_ROOT_MASK];
+	else if (idx < 1 << (TW_ROOT_BITS + TW_LVL_BITS))
+		vec = &wheel->lvl[0][(expires >> TW_ROOT_BITS) & TW_LVL_MASK];
+	else if (idx < 1 << (TW_ROOT_BITS + 2 * TW_LVL_BITS))
+		vec = &wheel->lvl[1][(expires >> (TW_ROOT_BITS + TW_LVL_BITS)) & TW_LVL_MASK];
+	else if (idx < 1 << (TW_ROOT_BITS + 3 * TW_LVL_BITS))
+		vec = &wheel->lvl[2][(expires >> (TW_ROOT_BITS + 2 * TW_LVL_BITS)) & TW_LVL_MASK];
+	else
+		vec = &wheel->lvl[3][(expires >> (TW_ROOT_BITS + 3 * TW_LVL_BITS)) & TW_LVL_MASK];
+
+	llist_add_tail(&timer->entry, vec);
+}
+
+/* move the timers of one slot to the level below */
+static int cascade(struct bsc_timer_wheel *wheel, int level, int index)
+{
+	struct timer_list *timer, *tmp;
+	LLIST_HEAD(work);
+
+	llist_splice_init(&wheel->lvl[level][index], &work);
+	llist_for_each_entry_safe(timer, tmp, &work, entry) {
+		llist_del(&timer->entry);
+		wheel_add(wheel, timer);
+	}
+
+	return index;
+}
+
+static void wheel_run(struct bsc_timer_wheel *wheel, uint32_t tick)
+{
+	while ((int32_t) (tick - wheel->now) >= 0) {
+		LLIST_HEAD(work);
+		int index;
+
+		if (wheel->armed == 0) {
+			wheel->now = tick + 1;
+			break;
+		}
+
+		index = wheel->now & TW_ROOT_MASK;
+		if (!index &&
+		    !cascade(wheel, 0, TW_INDEX(wheel, 0)) &&
+		    !cascade(wheel, 1, TW_INDEX(wheel, 1)) &&
+		    !cascade(wheel, 2, TW_INDEX(wheel, 2)))
+			cascade(wheel, 3, TW_INDEX(wheel, 3));
+
+		wheel->now += 1;
+		llist_splice_init(&wheel->root[index], &work);
+
+		/* a callback might cancel other timers from the work list */
+		while (!llist_empty(&work)) {
+			struct timer_list *timer;
+
+			timer = llist_entry(work.next, struct timer_list, entry);
+			llist_del(&timer->entry);
+			timer->active = 0;
+			wheel->armed -= 1;
+			wheel->expired += 1;
+			timer->cb(timer->data);
+		}
+	}
+}
+
+/* the first tick with something to do, at the latest the next cascade */
+static uint32_t wheel_next(struct bsc_timer_wheel *wheel)
+{
+	uint32_t tick;
+
+	for (tick = wheel->now; tick & TW_ROOT_MASK || tick == wheel->now; ++tick)
+		if (!llist_empty(&wheel->root[tick & TW_ROOT_MASK]))
+			return tick;
+
+	return tick;
+}
+
+static void driver_schedule(uint32_t tick)
+{
+	struct timeval now;
+	uint64_t now_ms;
+	int32_t delay;
+
+	gettimeofday(&now, NULL);
+	now_ms = (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+	delay = (int32_t) (tick - (uint32_t) (now_ms / TW_TICK_MS));
+	if (delay < 0)
+		delay = 0;
+	delay = delay * TW_TICK_MS - now_ms % TW_TICK_MS;
+	if (delay < 0)
+		delay = 0;
+
+	driver_tick = tick;
+	bsc_schedule_timer(&driver, delay / 1000, (delay % 1000) * 1000);
+}
+
+static void driver_cb(void *data)
+{
+	struct bsc_timer_wheel *wheel;
+	uint32_t tick = current_tick();
+	uint32_t next = 0;
+	int armed = 0;
+
+	llist_for_each_entry(wheel, &bsc_timer_wheels, entry)
+		wheel_run(wheel, tick);
+
+	llist_for_each_entry(wheel, &bsc_timer_wheels, entry) {
+		uint32_t wnext;
+
+		if (wheel->armed == 0)
+			continue;
+
+		wnext = wheel_next(wheel);
+		if (!armed || (int32_t) (wnext - next) < 0)
+			next = wnext;
+		armed = 1;
+	}
+
+	if (armed)
+		driver_schedule(next);
+}
+
+static void detach(struct bsc_timer_wheel *wheel, struct timer_list *timer)
+{
+	llist_del(&timer->entry);
+	timer->active = 0;
+	wheel->armed -= 1;
+}
+
+void bsc_wheel_schedule(struct bsc_timer_wheel *wheel, struct timer_list *timer,
+			int seconds, int microseconds)
+{
+	struct timeval now, delta;
+	uint32_t expires;
+
+	if (!wheel->entry.next)
+		wheel_init(wheel);
+
+	if (timer->active)
+		detach(wheel, timer);
+
+	/* an empty wheel does not need to catch up */
+	if (wheel->armed == 0)
+		wheel->now = current_tick();
+
+	gettimeofday(&now, NULL);
+	delta.tv_sec = seconds + microseconds / 1000000;
+	delta.tv_usec = microseconds % 1000000;
+	timeradd(&now, &delta, &timer->timeout);
+
+	timer->active = 1;
+	timer->in_list = 0;
+	wheel_add(wheel, timer);
+
+	wheel->armed += 1;
+	wheel->scheduled += 1;
+	if (wheel->armed > wheel->max_armed)
+		wheel->max_armed = wheel->armed;
+
+	/* only wake up earlier, the driver catches up on its own */
+	expires = tv_to_tick(&timer->timeout);
+	if ((int32_t) (expires - wheel->now) < 0)
+		expires = wheel->now;
+	if (!bsc_timer_pending(&driver) || (int32_t) (expires - driver_tick) < 0) {
+		driver.cb = driver_cb;
+		driver_schedule(expires);
+	}
+}
+
+void bsc_wheel_del(struct bsc_timer_wheel *wheel, struct timer_list *timer)
+{
+	if (!timer->active)
+		return;
+
+	detach(wheel, timer);
+	wheel->cancelled += 1;
+}
+
+void bsc_wheel_schedule_timer(struct timer_list *timer, int seconds, int microseconds)
+{
+	bsc_wheel_schedule(&other_wheel, timer, seconds, microseconds);
+}
+
+void bsc_wheel_del_timer(struct timer_list *timer)
+{
+	bsc_wheel_del(&other_wheel, timer);
+}
+
+int bsc_wheel_timer_pending(struct timer_list *timer)
+{
+	return bsc_wheel_pending(timer);
+}
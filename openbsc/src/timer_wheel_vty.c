@@ -0,0 +1,49 @@
+/* VTY interface for the timer wheels */
+
+/* (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <openbsc/timer_wheel.h>
+#include <openbsc/vty.h>
+
+#include <osmocom/vty/command.h>
+#include <osmocom/vty/vty.h>
+
+DEFUN(show_timer_wheels, show_timer_wheels_cmd,
+      "show timer-wheels",
+      SHOW_STR "Display the armed timers per subsystem\n")
+{
+	struct bsc_timer_wheel *wheel;
+
+	llist_for_each_entry(wheel, &bsc_timer_wheels, entry) {
+		vty_out(vty, "Timer wheel %s: armed: %u max: %u%s",
+			wheel->name, wheel->armed, wheel->max_armed, VTY_NEWLINE);
+		vty_out(vty, " scheduled: %lu expired: %lu cancelled: %lu%s",
+			wheel->scheduled, wheel->expired, wheel->cancelled,
+			VTY_NEWLINE);
+	}
+
+	return CMD_SUCCESS;
+}
+
+void bsc_timer_wheel_vty_init(void)
+{
+	install_element_ve(&show_timer_wheels_cmd);
+}
@@ -0,0 +1,307 @@
+/* Queues between the select loop and the worker threads */
+
+/* (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <sys/eventfd.h>
+
+#include <osmocore/logging.h>
+
+#include <openbsc/worker_queue.h>
+
+static const char *worker_error_names[_WORKER_ERR_MAX] = {
+	[WORKER_ERR_WAKEUP]	= "failed wakeups",
+};
+
+void worker_queue_init(struct worker_queue *queue)
+{
+	queue->head = queue->tail = &queue->stub;
+	queue->stub.next = NULL;
+	queue->queued = 0;
+}
+
+/* any thread, the head is swapped atomically */
+static void queue_link(struct worker_queue *queue, struct worker_queue_node *node)
+{
+	struct worker_queue_node *prev;
+
+	node->next = NULL;
+	__sync_synchronize();
+	prev = __sync_lock_test_and_set(&queue->head, node);
+	prev->next = node;
+}
+
+void worker_queue_push(struct worker_queue *queue, struct worker_queue_node *node)
+{
+	__sync_fetch_and_add(&queue->queued, 1);
+	queue_link(queue, node);
+}
+
+/*
+ * Only the consumer pops. NULL is returned when the queue is empty or
+ * a producer has swapped the head but not linked the node yet, it is
+ * going to wake the consumer up once it is done.
+ */
+struct worker_queue_node *worker_queue_pop(struct worker_queue *queue)
+{
+	struct worker_queue_node *tail = queue->tail;
+	struct worker_queue_node *next = tail->next;
+
+	if (tail == &queue->stub) {
+		if (!next)
+			return NULL;
+		queue->tail = next;
+		tail = next;
+		next = next->next;
+	}
+
+	if (!next) {
+		if (tail != queue->head)
+			return NULL;
+
+		/* the last node can only go with the stub behind it */
+		queue_link(queue, &queue->stub);
+		next = tail->next;
+		if (!next)
+			return NULL;
+	}
+
+	__sync_synchronize();
+	queue->tail = next;
+	__sync_fetch_and_sub(&queue->queued, 1);
+	return tail;
+}
+
+int worker_event_signal(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		return -1;
+	return 0;
+}
+
+int worker_event_clear(int fd)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+int worker_thread_init(struct worker_thread *thread,
+		       const struct worker_desc *desc, int nr)
+{
+	if (desc->num_errors > WORKER_ERRORS)
+		return -EINVAL;
+
+	memset(thread, 0, sizeof(*thread));
+	thread->desc = desc;
+	thread->nr = nr;
+
+	thread->event_fd = eventfd(0, EFD_NONBLOCK);
+	if (thread->event_fd < 0)
+		return -errno;
+
+	thread->space_fd = eventfd(0, 0);
+	if (thread->space_fd < 0) {
+		int rc = -errno;
+
+		close(thread->event_fd);
+		return rc;
+	}
+
+	return 0;
+}
+
+void worker_thread_close(struct worker_thread *thread)
+{
+	close(thread->space_fd);
+	close(thread->event_fd);
+}
+
+/* signals stay with the main thread */
+int worker_thread_start(pthread_t *thread, void *(*start)(void *), void *data)
+{
+	sigset_t all, old;
+	int rc;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	rc = pthread_create(thread, NULL, start, data);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return rc;
+}
+
+void worker_wakeup(struct worker_thread *thread)
+{
+	if (worker_event_signal(thread->event_fd) != 0)
+		LOGP(thread->desc->subsys, LOGL_ERROR, "Failed to wake up %s %d.\n",
+		     thread->desc->name, thread->nr);
+}
+
+/*
+ * Called from the select loop only, there is exactly one producer.
+ * When the ring is full the select loop sleeps until the thread has
+ * taken a command, a throttled thread keeps taking them. Returns the
+ * slot to fill in, it is handed over with worker_cmd_put.
+ */
+unsigned int worker_cmd_get(struct worker_thread *thread)
+{
+	const struct worker_desc *desc = thread->desc;
+	uint64_t count;
+
+	if (thread->head - thread->tail >= desc->ring_size)
+		thread->ring_full += 1;
+
+	while (thread->head - thread->tail >= desc->ring_size) {
+		/* nobody is going to take the command */
+		if (thread->failed) {
+			LOGP(desc->subsys, LOGL_FATAL, "%s %d failed: %s\n",
+			     desc->name, thread->nr, strerror(thread->failed));
+			abort();
+		}
+
+		thread->producer_waiting = 1;
+		/* the thread must see the flag before we check the tail */
+		__sync_synchronize();
+		if (thread->head - thread->tail < desc->ring_size)
+			break;
+		worker_wakeup(thread);
+		if (read(thread->space_fd, &count, sizeof(count)) < 0 &&
+		    errno != EINTR) {
+			LOGP(desc->subsys, LOGL_FATAL, "Failed to wait for %s %d: %s\n",
+			     desc->name, thread->nr, strerror(errno));
+			abort();
+		}
+	}
+	thread->producer_waiting = 0;
+
+	return thread->head % desc->ring_size;
+}
+
+void worker_cmd_put(struct worker_thread *thread)
+{
+	/* the command must be visible before the new head */
+	__sync_synchronize();
+	thread->head += 1;
+	worker_wakeup(thread);
+}
+
+/* the consumer of the queue took items, a throttled thread can go on */
+void worker_resume(struct worker_thread *thread, struct worker_queue *queue,
+		   unsigned int limit)
+{
+	if (thread->throttle_waiting && queue->queued < limit)
+		worker_wakeup(thread);
+}
+
+/* log what the thread counted since the last time */
+void worker_report(struct worker_thread *thread)
+{
+	const struct worker_desc *desc = thread->desc;
+	unsigned int err;
+
+	if (thread->failed && !thread->failure_reported) {
+		LOGP(desc->subsys, LOGL_FATAL, "%s %d failed: %s\n",
+		     desc->name, thread->nr, strerror(thread->failed));
+		thread->failure_reported = 1;
+	}
+
+	for (err = 0; err < desc->num_errors; ++err) {
+		unsigned long now = thread->errors[err];
+
+		if (now == thread->reported[err])
+			continue;
+		LOGP(desc->subsys, LOGL_ERROR, "%s %d: %lu %s.\n",
+		     desc->name, thread->nr, now - thread->reported[err],
+		     err < _WORKER_ERR_MAX ? worker_error_names[err] :
+					     desc->error_names[err]);
+		thread->reported[err] = now;
+	}
+}
+
+/*
+ * Below is running inside the worker thread.
+ */
+
+/* take the commands of the ring */
+void worker_drain(struct worker_thread *thread)
+{
+	const struct worker_desc *desc = thread->desc;
+
+	if (worker_event_clear(thread->event_fd) != 0)
+		thread->errors[WORKER_ERR_WAKEUP] += 1;
+
+	while (thread->tail != thread->head) {
+		/* read the command only after we have seen the new head */
+		__sync_synchronize();
+		desc->apply(thread, thread->tail % desc->ring_size);
+
+		/* done with the slot before handing it back */
+		__sync_synchronize();
+		thread->tail += 1;
+
+		/* the tail must be visible before we look at the flag */
+		__sync_synchronize();
+		if (thread->producer_waiting &&
+		    worker_event_signal(thread->space_fd) != 0)
+			thread->errors[WORKER_ERR_WAKEUP] += 1;
+	}
+}
+
+/*
+ * The consumer of the queue is behind. Sleep until it has taken items,
+ * but keep taking commands or the select loop might wait for us in
+ * turn. The consumer is woken up through its eventfd.
+ */
+void worker_throttle(struct worker_thread *thread, struct worker_queue *queue,
+		     unsigned int limit, int consumer_fd)
+{
+	struct pollfd pfd;
+
+	if (queue->queued < limit)
+		return;
+
+	thread->throttled += 1;
+	pfd.fd = thread->event_fd;
+	pfd.events = POLLIN;
+
+	while (1) {
+		thread->throttle_waiting = 1;
+		/* the consumer must see the flag before we check */
+		__sync_synchronize();
+		if (queue->queued < limit)
+			break;
+		if (worker_event_signal(consumer_fd) != 0)
+			thread->errors[WORKER_ERR_WAKEUP] += 1;
+		poll(&pfd, 1, -1);
+		worker_drain(thread);
+	}
+	thread->throttle_waiting = 0;
+}
@@ -81,6 +81,16 @@ static const uint8_t paging_by_lac_cmd[] = {
 0x01, 0x50, 0x02, 0x30, 0x1a, 0x03, 0x05, 0x20,
 0x15 };
 
+/* paging with a cell list of LAC 8213, 23 and again 8213 */
+static const uint8_t paging_by_cells_cmd[] = {
+0x00, 0x2c, 0xfd, 0x09,
+0x00, 0x03, 0x07, 0x0b, 0x04, 0x43, 0x02, 0x00,
+0xfe, 0x04, 0x43, 0x5c, 0x00, 0xfe, 0x1c, 0x00,
+0x1a, 0x52, 0x08, 0x08, 0x29, 0x47, 0x10, 0x02,
+0x01, 0x50, 0x02, 0x30, 0x1a, 0x0d, 0x01, 0x20,
+0x15, 0x00, 0x01, 0x00, 0x17, 0x00, 0x02, 0x20,
+0x15, 0x00, 0x03 };
+
 /* an assignment command */
 static const uint8_t ass_cmd[] = {
 0x00, 0x12, 0xfd, 0x06,
@@ -121,6 +131,10 @@ static const char mdcx_resp_patched[] = "200 23330829\r\n\r\nv=0\r\nc=IN IP4 10.
 static const char mdcx_resp2[] = "200 33330829\n\nv=0\nc=IN IP4 172.16.18.2\nm=audio 4002 RTP/AVP 98\na=rtpmap:98 AMR/8000\n";
 static const char mdcx_resp_patched2[] = "200 33330829\n\nv=0\nc=IN IP4 10.0.0.23\nm=audio 5555 RTP/AVP 98\na=rtpmap:98 AMR/8000\n";
 
+/* two payload types, a connection line per media and no final line end */
+static const char mdcx_resp3[] = "200 33330830\r\nI: 3\r\n\r\nv=0\r\nc=IN IP4 172.16.18.2\r\nm=audio 4002 RTP/AVP 98 101\r\nc=IN IP4 172.16.18.3\r\na=rtpmap:98 AMR/8000\r\na=rtpmap:101 telephone-event/8000";
+static const char mdcx_resp_patched3[] = "200 33330830\r\nI: 3\r\n\r\nv=0\r\nc=IN IP4 10.0.0.23\r\nm=audio 5555 RTP/AVP 98 101\r\nc=IN IP4 10.0.0.23\r\na=rtpmap:98 AMR/8000\r\na=rtpmap:101 telephone-event/8000";
+
 struct mgcp_patch_test {
 	const char *orig;
 	const char *patch;
@@ -159,4 +173,10 @@ static const struct mgcp_patch_test mgcp_messages[] = {
 		.ip = "10.0.0.23",
 		.port = 5555,
 	},
+	{
+		.orig = mdcx_resp3,
+		.patch = mdcx_resp_patched3,
+		.ip = "10.0.0.23",
+		.port = 5555,
+	},
 };
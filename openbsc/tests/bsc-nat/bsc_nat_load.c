@@ -0,0 +1,300 @@
+/*
+ * Load the BSC reader threads of the NAT. Synthetic BSCs replay the
+ * recorded BSC messages over socket pairs, the select loop checks the
+ * order per BSC and the parsing done on the threads.
+ *
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <openbsc/debug.h>
+#include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_nat_sccp.h>
+#include <openbsc/ipaccess.h>
+
+#include <osmocore/talloc.h>
+
+#include <osmocom/sccp/sccp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+
+#include "bsc_data.c"
+
+struct replay_msg {
+	const uint8_t *data;
+	unsigned int len;
+	int sccp_type;
+};
+
+static const struct replay_msg replay[] = {
+	{ bsc_cr, sizeof(bsc_cr), SCCP_MSG_TYPE_CR },
+	{ id_resp, sizeof(id_resp), SCCP_MSG_TYPE_DT1 },
+	{ bsc_dtap, sizeof(bsc_dtap), SCCP_MSG_TYPE_DT1 },
+	{ bsc_rlc, sizeof(bsc_rlc), SCCP_MSG_TYPE_RLC },
+};
+
+struct load_bsc {
+	struct bsc_connection *bsc;
+	int fd;
+	int received;
+	int lost;
+	volatile int closed;
+};
+
+static struct load_bsc *bscs;
+static int nr_bscs;
+static int first_round, rounds;
+static long received;
+static int lost;
+
+static struct load_bsc *load_bsc(struct bsc_connection *bsc)
+{
+	int i;
+
+	for (i = 0; i < nr_bscs; ++i)
+		if (bscs[i].bsc == bsc)
+			return &bscs[i];
+
+	printf("Unknown BSC %p.\n", bsc);
+	abort();
+}
+
+static void load_msg(struct bsc_connection *bsc, struct msgb *msg,
+		     struct bsc_nat_parsed *parsed)
+{
+	struct load_bsc *load = load_bsc(bsc);
+	const struct replay_msg *exp = &replay[load->received % ARRAY_SIZE(replay)];
+
+	if (msg->len != exp->len || memcmp(msg->data, exp->data, exp->len) != 0) {
+		printf("Message %d of BSC %ld out of order.\n",
+		       load->received, load - bscs);
+		abort();
+	}
+
+	if (!parsed || parsed->ipa_proto != IPAC_PROTO_SCCP ||
+	    parsed->sccp_type != exp->sccp_type) {
+		printf("Message %d of BSC %ld was not parsed.\n",
+		       load->received, load - bscs);
+		abort();
+	}
+
+	/* the pointers must have moved into the copy */
+	if (parsed->src_local_ref &&
+	    ((uint8_t *) parsed->src_local_ref < msg->data ||
+	     (uint8_t *) parsed->src_local_ref >= msg->tail)) {
+		printf("The parsed message points outside the copy.\n");
+		abort();
+	}
+
+	load->received += 1;
+	received += 1;
+	msgb_free(msg);
+}
+
+static void load_lost(struct bsc_connection *bsc, int error)
+{
+	struct load_bsc *load = load_bsc(bsc);
+
+	if (error != 0 || load->lost) {
+		printf("Unexpected loss of BSC %ld: %d\n", load - bscs, error);
+		abort();
+	}
+
+	load->lost = 1;
+	lost += 1;
+	bsc_nat_worker_close(bsc);
+}
+
+/* one thread for all synthetic BSCs, the messages are interleaved */
+static void *replay_main(void *data)
+{
+	int i, j;
+
+	for (i = first_round; i < first_round + rounds; ++i) {
+		const struct replay_msg *msg = &replay[i % ARRAY_SIZE(replay)];
+
+		for (j = 0; j < nr_bscs; ++j) {
+			if (send(bscs[j].fd, msg->data, msg->len, MSG_NOSIGNAL) != msg->len &&
+			    !bscs[j].closed) {
+				printf("Failed to write to BSC %d.\n", j);
+				abort();
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static unsigned int connections(struct bsc_nat *nat)
+{
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < nat->num_workers; ++i)
+		count += nat->workers[i].connections;
+	return count;
+}
+
+static int throttled(struct bsc_nat *nat)
+{
+	int i;
+
+	for (i = 0; i < nat->num_workers; ++i)
+		if (nat->workers[i].thread.throttle_waiting)
+			return 1;
+	return 0;
+}
+
+/*
+ * Let the threads fill the queue until one of them waits for the
+ * select loop, then close every other BSC. The commands are taken
+ * while the threads are throttled, their readers must live until the
+ * threads are done with the events of the batch.
+ */
+static void test_close_throttled(struct bsc_nat *nat)
+{
+	pthread_t replay_thread;
+	long expected;
+	int i;
+
+	printf("Closing BSCs while the threads are throttled.\n");
+
+	first_round = rounds;
+	received = 0;
+	pthread_create(&replay_thread, NULL, replay_main, NULL);
+	while (!throttled(nat))
+		usleep(1000);
+
+	for (i = 1; i < nr_bscs; i += 2) {
+		bscs[i].closed = 1;
+		bsc_nat_worker_close(bscs[i].bsc);
+	}
+
+	expected = (long) rounds * ((nr_bscs + 1) / 2);
+	while (received < expected || connections(nat) > (nr_bscs + 1) / 2)
+		bsc_select_main(0);
+	pthread_join(replay_thread, NULL);
+
+	for (i = 0; i < nr_bscs; i += 2) {
+		if (bscs[i].received != 2 * rounds) {
+			printf("BSC %d received %d messages.\n", i, bscs[i].received);
+			abort();
+		}
+	}
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	struct bsc_nat *nat;
+	struct timespec start;
+	pthread_t replay_thread;
+	double secs;
+	int i;
+
+	nr_bscs = argc > 1 ? atoi(argv[1]) : 64;
+	rounds = argc > 2 ? atoi(argv[2]) : 10000;
+
+	sccp_set_log_area(DSCCP);
+	log_init(&log_info);
+
+	nat = bsc_nat_alloc();
+	nat->num_workers = argc > 3 ? atoi(argv[3]) : 4;
+	if (bsc_nat_workers_start(nat, load_msg, load_lost) != 0) {
+		printf("Failed to start the BSC threads.\n");
+		abort();
+	}
+
+	bscs = talloc_zero_array(nat, struct load_bsc, nr_bscs);
+	for (i = 0; i < nr_bscs; ++i) {
+		int sv[2];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+			perror("socketpair");
+			abort();
+		}
+
+		bscs[i].bsc = bsc_connection_alloc(nat);
+		bscs[i].bsc->write_queue.bfd.fd = sv[0];
+		bscs[i].fd = sv[1];
+		if (bsc_nat_worker_add(nat, bscs[i].bsc) != 0) {
+			printf("Failed to add BSC %d.\n", i);
+			abort();
+		}
+	}
+
+	printf("Replaying %d rounds on %d BSCs with %d threads.\n",
+	       rounds, nr_bscs, nat->num_workers);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&replay_thread, NULL, replay_main, NULL);
+	while (received < (long) rounds * nr_bscs)
+		bsc_select_main(0);
+	secs = elapsed(&start);
+	pthread_join(replay_thread, NULL);
+
+	printf("Received %ld messages in %.3f s: %.0f messages/s\n",
+	       received, secs, received / secs);
+	for (i = 0; i < nat->num_workers; ++i)
+		printf(" BSC thread %d: connections: %u messages: %lu bytes: %lu throttled: %lu\n",
+		       i, nat->workers[i].connections, nat->workers[i].messages,
+		       nat->workers[i].bytes, nat->workers[i].thread.throttled);
+
+	if (nat->frames->dropped != 0) {
+		printf("Frames dropped: %lu\n", nat->frames->dropped);
+		abort();
+	}
+
+	test_close_throttled(nat);
+
+	/* hang up on all BSCs and wait for the threads to close them */
+	for (i = 0; i < nr_bscs; ++i)
+		close(bscs[i].fd);
+	while (lost < nr_bscs / 2 || connections(nat) > 0)
+		bsc_select_main(0);
+
+	if (nat->frames->queue.queued != 0) {
+		printf("Frames left: %u\n", nat->frames->queue.queued);
+		abort();
+	}
+
+	printf("Testing the BSC threads done.\n");
+	return 0;
+}
+
+void input_event()
+{}
+int nm_state_event()
+{
+	return -1;
+}
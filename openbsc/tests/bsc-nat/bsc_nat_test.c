@@ -27,6 +27,8 @@
 #include <openbsc/gsm_data.h>
 #include <openbsc/bsc_nat.h>
 #include <openbsc/bsc_nat_sccp.h>
+#include <openbsc/bsc_msc.h>
+#include <openbsc/ipaccess.h>
 
 #include <osmocore/talloc.h>
 
@@ -34,6 +36,9 @@
 #include <osmocore/protocol/gsm_08_08.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 /* test messages for ipa */
 static uint8_t ipa_id[] = {
@@ -232,15 +237,15 @@ static void test_filter(void)
 	fprintf(stderr, "Testing BSS Filtering.\n");
 	for (i = 0; i < ARRAY_SIZE(results); ++i) {
 		int result;
-		struct bsc_nat_parsed *parsed;
+		struct bsc_nat_parsed parsed_msg;
+		struct bsc_nat_parsed *parsed = &parsed_msg;
 		struct msgb *msg = msgb_alloc(4096, "test-message");
 
 		fprintf(stderr, "Going to test item: %d\n", i);
 		memcpy(msg->data, results[i].data, results[i].length);
 		msg->l2h = msgb_put(msg, results[i].length);
 
-		parsed = bsc_nat_parse(msg);
-		if (!parsed) {
+		if (bsc_nat_parse(msg, parsed) != 0) {
 			fprintf(stderr, "FAIL: Failed to parse the message\n");
 			continue;
 		}
@@ -281,24 +286,27 @@ static void test_contrack()
 	struct bsc_connection *con;
 	struct sccp_connections *con_found;
 	struct sccp_connections *rc_con;
-	struct bsc_nat_parsed *parsed;
+	struct bsc_nat_parsed parsed_msg;
+	struct bsc_nat_parsed *parsed = &parsed_msg;
+	struct bsc_nat_msc *msc;
 	struct msgb *msg;
 
 	fprintf(stderr, "Testing connection tracking.\n");
 	nat = bsc_nat_alloc();
+	msc = bsc_nat_msc_num(nat, 0);
 	con = bsc_connection_alloc(nat);
 	con->cfg = bsc_config_alloc(nat, "foo", 23);
 	msg = msgb_alloc(4096, "test");
 
 	/* 1.) create a connection */
 	copy_to_msg(msg, bsc_cr, sizeof(bsc_cr));
-	parsed = bsc_nat_parse(msg);
+	bsc_nat_parse(msg, parsed);
 	con_found = patch_sccp_src_ref_to_msc(msg, parsed, con);
 	if (con_found != NULL) {
 		fprintf(stderr, "Con should not exist %p\n", con_found);
 		abort();
 	}
-	rc_con = create_sccp_src_ref(con, parsed);
+	rc_con = create_sccp_src_ref(con, msc, parsed);
 	if (!rc_con) {
 		fprintf(stderr, "Failed to create a ref\n");
 		abort();
@@ -316,12 +324,11 @@ static void test_contrack()
 		fprintf(stderr, "Failed to patch the BSC CR msg.\n");
 		abort();
 	}
-	talloc_free(parsed);
 
 	/* 2.) get the cc */
 	copy_to_msg(msg, msc_cc, sizeof(msc_cc));
-	parsed = bsc_nat_parse(msg);
-	con_found = patch_sccp_src_ref_to_bsc(msg, parsed, nat);
+	bsc_nat_parse(msg, parsed);
+	con_found = patch_sccp_src_ref_to_bsc(msg, parsed, msc);
 	VERIFY(con_found, con, msg, msc_cc_patched, "MSC CC");
 	if (update_sccp_src_ref(con_found, parsed) != 0) {
 		fprintf(stderr, "Failed to update the SCCP con.\n");
@@ -330,25 +337,25 @@ static void test_contrack()
 
 	/* 3.) send some data */
 	copy_to_msg(msg, bsc_dtap, sizeof(bsc_dtap));
-	parsed = bsc_nat_parse(msg);
+	bsc_nat_parse(msg, parsed);
 	con_found = patch_sccp_src_ref_to_msc(msg, parsed, con);
 	VERIFY(con_found, con, msg, bsc_dtap_patched, "BSC DTAP");
 
 	/* 4.) receive some data */
 	copy_to_msg(msg, msc_dtap, sizeof(msc_dtap));
-	parsed = bsc_nat_parse(msg);
-	con_found = patch_sccp_src_ref_to_bsc(msg, parsed, nat);
+	bsc_nat_parse(msg, parsed);
+	con_found = patch_sccp_src_ref_to_bsc(msg, parsed, msc);
 	VERIFY(con_found, con, msg, msc_dtap_patched, "MSC DTAP");
 
 	/* 5.) close the connection */
 	copy_to_msg(msg, msc_rlsd, sizeof(msc_rlsd));
-	parsed = bsc_nat_parse(msg);
-	con_found = patch_sccp_src_ref_to_bsc(msg, parsed, nat);
+	bsc_nat_parse(msg, parsed);
+	con_found = patch_sccp_src_ref_to_bsc(msg, parsed, msc);
 	VERIFY(con_found, con, msg, msc_rlsd_patched, "MSC RLSD");
 
 	/* 6.) confirm the connection close */
 	copy_to_msg(msg, bsc_rlc, sizeof(bsc_rlc));
-	parsed = bsc_nat_parse(msg);
+	bsc_nat_parse(msg, parsed);
 	con_found = patch_sccp_src_ref_to_msc(msg, parsed, con);
 	if (!con_found || con_found->bsc != con) {
 		fprintf(stderr, "Failed to find the con: %p\n", con_found);
@@ -359,10 +366,9 @@ static void test_contrack()
 		abort();
 	}
 	remove_sccp_src_ref(con, msg, parsed);
-	talloc_free(parsed);
 
 	copy_to_msg(msg, bsc_rlc, sizeof(bsc_rlc));
-	parsed = bsc_nat_parse(msg);
+	bsc_nat_parse(msg, parsed);
 	con_found = patch_sccp_src_ref_to_msc(msg, parsed, con);
 
 	/* verify that it is gone */
@@ -370,20 +376,242 @@ static void test_contrack()
 		fprintf(stderr, "Con should be gone. %p\n", con_found);
 		abort();
 	}
-	talloc_free(parsed);
 
 
 	talloc_free(nat);
 	msgb_free(msg);
 }
 
+/* test the connection table with a lot of connections */
+static void test_contrack_many(void)
+{
+	struct sccp_source_reference real, ref;
+	struct sccp_connections **cons;
+	struct bsc_nat_parsed parsed;
+	struct bsc_connection *con;
+	struct bsc_nat_msc *msc;
+	struct bsc_nat *nat;
+	const int nr = 5000;
+	int i;
+
+	fprintf(stderr, "Testing connection tracking of %d connections.\n", nr);
+	nat = bsc_nat_alloc();
+	msc = bsc_nat_msc_num(nat, 0);
+	con = bsc_connection_alloc(nat);
+	con->cfg = bsc_config_alloc(nat, "foo", 23);
+	cons = talloc_zero_array(nat, struct sccp_connections *, nr);
+	memset(&parsed, 0, sizeof(parsed));
+
+	for (i = 0; i < nr; ++i) {
+		real.octet1 = i;
+		real.octet2 = i >> 8;
+		real.octet3 = 0x23;
+		parsed.src_local_ref = &real;
+		cons[i] = create_sccp_src_ref(con, msc, &parsed);
+		if (!cons[i]) {
+			fprintf(stderr, "Failed to create connection %d.\n", i);
+			abort();
+		}
+
+		ref = cons[i]->patched_ref;
+		parsed.src_local_ref = NULL;
+		parsed.dest_local_ref = &ref;
+		if (update_sccp_src_ref(cons[i], &parsed) == 0) {
+			fprintf(stderr, "CC without a src ref was accepted.\n");
+			abort();
+		}
+		parsed.dest_local_ref = NULL;
+	}
+
+	for (i = 0; i < nr; ++i) {
+		real.octet1 = i;
+		real.octet2 = i >> 8;
+		real.octet3 = 0x23;
+		parsed.src_local_ref = &real;
+		if (patch_sccp_src_ref_to_msc(NULL, &parsed, con) != cons[i] ||
+		    memcmp(&real, &cons[i]->patched_ref, sizeof(real)) != 0) {
+			fprintf(stderr, "Failed to find connection %d by the BSC ref.\n", i);
+			abort();
+		}
+
+		ref = cons[i]->patched_ref;
+		parsed.src_local_ref = NULL;
+		parsed.dest_local_ref = &ref;
+		if (patch_sccp_src_ref_to_bsc(NULL, &parsed, msc) != cons[i] ||
+		    memcmp(&ref, &cons[i]->real_ref, sizeof(ref)) != 0) {
+			fprintf(stderr, "Failed to find connection %d by the MUX ref.\n", i);
+			abort();
+		}
+
+		/* the MSC uses the MUX ref as its own ref */
+		sccp_connection_set_remote(cons[i], &cons[i]->patched_ref);
+		ref = cons[i]->patched_ref;
+		if (patch_sccp_src_ref_to_msc(NULL, &parsed, con) != cons[i]) {
+			fprintf(stderr, "Failed to find connection %d by the MSC ref.\n", i);
+			abort();
+		}
+		parsed.dest_local_ref = NULL;
+	}
+
+	/* a released reference is not handed out again right away */
+	ref = cons[0]->patched_ref;
+	sccp_connection_destroy(cons[0]);
+	parsed.dest_local_ref = &ref;
+	if (patch_sccp_src_ref_to_bsc(NULL, &parsed, msc) != NULL) {
+		fprintf(stderr, "Found the released connection.\n");
+		abort();
+	}
+
+	real.octet1 = real.octet2 = real.octet3 = 0x42;
+	parsed.src_local_ref = &real;
+	parsed.dest_local_ref = NULL;
+	cons[0] = create_sccp_src_ref(con, msc, &parsed);
+	if (!cons[0] || memcmp(&cons[0]->patched_ref, &ref, sizeof(ref)) == 0) {
+		fprintf(stderr, "The released reference was reused.\n");
+		abort();
+	}
+
+	for (i = 0; i < nr; ++i)
+		sccp_connection_destroy(cons[i]);
+	if (msc->refs.used != 0 || !llist_empty(&nat->sccp_connections)) {
+		fprintf(stderr, "Connections were left behind.\n");
+		abort();
+	}
+
+	talloc_free(nat);
+}
+
+static struct bsc_nat_msc *add_msc(struct bsc_nat *nat, int nr, int weight)
+{
+	struct bsc_nat_msc *msc;
+
+	msc = bsc_nat_msc_num(nat, nr);
+	if (!msc)
+		msc = bsc_nat_msc_alloc(nat, nr);
+	msc->weight = weight;
+	msc->con = talloc_zero(msc, struct bsc_msc_connection);
+	msc->con->is_connected = 1;
+	return msc;
+}
+
+static void test_msc_pool(void)
+{
+	struct sccp_source_reference real, ref;
+	struct sccp_connections *cons[3];
+	struct bsc_nat_msc *mscs[3];
+	struct bsc_nat_parsed parsed;
+	struct bsc_connection *con;
+	struct bsc_nat *nat;
+	int i, count[3] = { 0, };
+
+	fprintf(stderr, "Testing the MSC pool.\n");
+	nat = bsc_nat_alloc();
+	con = bsc_connection_alloc(nat);
+	con->cfg = bsc_config_alloc(nat, "foo", 23);
+	memset(&parsed, 0, sizeof(parsed));
+
+	if (bsc_nat_msc_select(nat, &parsed) != NULL) {
+		fprintf(stderr, "Selected an unconnected MSC.\n");
+		abort();
+	}
+
+	for (i = 0; i < 3; ++i)
+		mscs[i] = add_msc(nat, i, i + 1);
+
+	/* weighted round robin */
+	nat->msc_dist = NAT_MSC_DIST_ROUND_ROBIN;
+	for (i = 0; i < 600; ++i)
+		count[bsc_nat_msc_select(nat, &parsed)->nr] += 1;
+	if (count[0] != 100 || count[1] != 200 || count[2] != 300) {
+		fprintf(stderr, "Wrong distribution %d %d %d.\n",
+			count[0], count[1], count[2]);
+		abort();
+	}
+
+	/* the IMSI sticks to the MSC, only the lost MSC moves */
+	nat->msc_dist = NAT_MSC_DIST_IMSI;
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < 6000; ++i) {
+		struct bsc_nat_msc *msc;
+
+		snprintf(parsed.imsi, sizeof(parsed.imsi), "26201%010d", i * 7919);
+		msc = bsc_nat_msc_select(nat, &parsed);
+		count[msc->nr] += 1;
+		if (bsc_nat_msc_select(nat, &parsed) != msc) {
+			fprintf(stderr, "IMSI %s moved.\n", parsed.imsi);
+			abort();
+		}
+
+		mscs[1]->con->is_connected = 0;
+		if ((msc != mscs[1] && bsc_nat_msc_select(nat, &parsed) != msc) ||
+		    bsc_nat_msc_select(nat, &parsed) == mscs[1]) {
+			fprintf(stderr, "IMSI %s moved with MSC 1.\n", parsed.imsi);
+			abort();
+		}
+		mscs[1]->con->is_connected = 1;
+	}
+	/* in proportion to the weights 1:2:3 */
+	if (abs(count[0] - 1000) > 100 || abs(count[1] - 2000) > 150 ||
+	    abs(count[2] - 3000) > 150) {
+		fprintf(stderr, "Wrong IMSI distribution %d %d %d.\n",
+			count[0], count[1], count[2]);
+		abort();
+	}
+
+	/* every MSC has its own references */
+	parsed.imsi[0] = '\0';
+	for (i = 0; i < 3; ++i) {
+		real.octet1 = real.octet2 = 0x23;
+		real.octet3 = i;
+		parsed.src_local_ref = &real;
+		parsed.dest_local_ref = NULL;
+		cons[i] = create_sccp_src_ref(con, mscs[i], &parsed);
+		if (!cons[i] || cons[i]->msc != mscs[i] ||
+		    memcmp(&cons[i]->patched_ref, &cons[0]->patched_ref, sizeof(ref)) != 0) {
+			fprintf(stderr, "Failed to create connection on MSC %d.\n", i);
+			abort();
+		}
+	}
+
+	for (i = 0; i < 3; ++i) {
+		ref = cons[i]->patched_ref;
+		parsed.src_local_ref = NULL;
+		parsed.dest_local_ref = &ref;
+		if (patch_sccp_src_ref_to_bsc(NULL, &parsed, mscs[i]) != cons[i]) {
+			fprintf(stderr, "Connection %d was not found on its MSC.\n", i);
+			abort();
+		}
+	}
+
+	for (i = 0; i < 3; ++i) {
+		sccp_connection_destroy(cons[i]);
+		if (mscs[i]->refs.used != 0) {
+			fprintf(stderr, "Reference of MSC %d left behind.\n", i);
+			abort();
+		}
+	}
+
+	talloc_free(nat);
+}
+
+static struct bsc_connection *paged[4];
+static int nr_paged;
+
+static void paging_cb(struct bsc_connection *bsc, void *data)
+{
+	if (nr_paged < ARRAY_SIZE(paged))
+		paged[nr_paged] = bsc;
+	nr_paged += 1;
+}
+
 static void test_paging(void)
 {
 	int lac;
 	struct bsc_nat *nat;
-	struct bsc_connection *con;
-	struct bsc_nat_parsed *parsed;
-	struct bsc_config cfg;
+	struct bsc_connection *con, *con2, *con3;
+	struct bsc_nat_parsed parsed_msg;
+	struct bsc_nat_parsed *parsed = &parsed_msg;
+	struct bsc_config cfg, cfg3;
 	struct msgb *msg;
 
 	fprintf(stderr, "Testing paging by lac.\n");
@@ -394,33 +622,72 @@ static void test_paging(void)
 	cfg.lac = 23;
 	con->authenticated = 1;
 	llist_add(&con->list_entry, &nat->bsc_connections);
+	bsc_nat_lac_add(con);
 	msg = msgb_alloc(4096, "test");
 
 	/* Test completely bad input */
+	nr_paged = 0;
 	copy_to_msg(msg, paging_by_lac_cmd, sizeof(paging_by_lac_cmd));
-	if (bsc_nat_find_bsc(nat, msg, &lac) != 0) {
+	if (bsc_nat_find_paging(nat, msg, &lac, paging_cb, NULL) > 0 || nr_paged != 0) {
 		fprintf(stderr, "Should have not found anything.\n");
 		abort();
 	}
 
 	/* Test it by not finding it */
 	copy_to_msg(msg, paging_by_lac_cmd, sizeof(paging_by_lac_cmd));
-	parsed = bsc_nat_parse(msg);
-	if (bsc_nat_find_bsc(nat, msg, &lac) != 0) {
+	bsc_nat_parse(msg, parsed);
+	if (bsc_nat_find_paging(nat, msg, &lac, paging_cb, NULL) != 0 ||
+	    nr_paged != 0 || lac != 8213) {
 		fprintf(stderr, "Should have not found aynthing.\n");
 		abort();
 	}
-	talloc_free(parsed);
 
 	/* Test by finding it */
 	cfg.lac = 8213;
+	bsc_nat_lac_update(nat, &cfg);
 	copy_to_msg(msg, paging_by_lac_cmd, sizeof(paging_by_lac_cmd));
-	parsed = bsc_nat_parse(msg);
-	if (bsc_nat_find_bsc(nat, msg, &lac) != con) {
+	bsc_nat_parse(msg, parsed);
+	if (bsc_nat_find_paging(nat, msg, &lac, paging_cb, NULL) != 1 ||
+	    nr_paged != 1 || paged[0] != con) {
 		fprintf(stderr, "Should have found it.\n");
 		abort();
 	}
-	talloc_free(parsed);
+
+	/* two connections of the LAC and one of another in the cell list */
+	con2 = bsc_connection_alloc(nat);
+	con2->cfg = &cfg;
+	con2->authenticated = 1;
+	llist_add(&con2->list_entry, &nat->bsc_connections);
+	bsc_nat_lac_add(con2);
+
+	con3 = bsc_connection_alloc(nat);
+	con3->cfg = &cfg3;
+	cfg3.lac = 23;
+	con3->authenticated = 1;
+	llist_add(&con3->list_entry, &nat->bsc_connections);
+	bsc_nat_lac_add(con3);
+
+	nr_paged = 0;
+	copy_to_msg(msg, paging_by_cells_cmd, sizeof(paging_by_cells_cmd));
+	bsc_nat_parse(msg, parsed);
+	if (bsc_nat_find_paging(nat, msg, &lac, paging_cb, NULL) != 3 ||
+	    nr_paged != 3 || lac != 8213 || paged[0] != con ||
+	    paged[1] != con2 || paged[2] != con3) {
+		fprintf(stderr, "Should have paged every BSC once: %d.\n", nr_paged);
+		abort();
+	}
+
+	/* a closed connection is gone from the index */
+	bsc_nat_lac_del(con2);
+	nr_paged = 0;
+	if (bsc_nat_find_paging(nat, msg, &lac, paging_cb, NULL) != 2 ||
+	    paged[0] != con || paged[1] != con3) {
+		fprintf(stderr, "The closed BSC was paged.\n");
+		abort();
+	}
+
+	msgb_free(msg);
+	talloc_free(nat);
 }
 
 static void test_mgcp_ass_tracking(void)
@@ -428,7 +695,8 @@ static void test_mgcp_ass_tracking(void)
 	struct bsc_connection *bsc;
 	struct bsc_nat *nat;
 	struct sccp_connections con;
-	struct bsc_nat_parsed *parsed;
+	struct bsc_nat_parsed parsed_msg;
+	struct bsc_nat_parsed *parsed = &parsed_msg;
 	struct msgb *msg;
 
 	fprintf(stderr, "Testing MGCP.\n");
@@ -445,7 +713,7 @@ static void test_mgcp_ass_tracking(void)
 
 	msg = msgb_alloc(4096, "foo");
 	copy_to_msg(msg, ass_cmd, sizeof(ass_cmd));
-	parsed = bsc_nat_parse(msg);
+	bsc_nat_parse(msg, parsed);
 
 	if (msg->l2h[16] != 0 ||
 	    msg->l2h[17] != 0x1) {
@@ -455,11 +723,16 @@ static void test_mgcp_ass_tracking(void)
 		abort();
 	}
 
-	if (bsc_mgcp_assign_patch(&con, msg) != 0) {
+	if (bsc_mgcp_assign_patch(&con, msg, parsed) != 0) {
 		fprintf(stderr, "Failed to handle assignment.\n");
 		abort();
 	}
 
+	if (bsc_mgcp_find_con(nat, 1) != &con) {
+		fprintf(stderr, "The connection was not indexed.\n");
+		abort();
+	}
+
 	if (con.msc_endp != 1) {
 		fprintf(stderr, "Timeslot should be 1.\n");
 		abort();
@@ -484,7 +757,6 @@ static void test_mgcp_ass_tracking(void)
 		abort();
 	}
 
-	talloc_free(parsed);
 
 	bsc_mgcp_dlcx(&con);
 	if (con.bsc_endp != -1 || con.msc_endp != -1 ||
@@ -506,6 +778,9 @@ static void test_mgcp_find(void)
 	fprintf(stderr, "Testing finding of a BSC Connection\n");
 
 	nat = bsc_nat_alloc();
+	nat->bsc_endpoints = talloc_zero_array(nat,
+					       struct bsc_endpoint,
+					       33);
 	con = bsc_connection_alloc(nat);
 	llist_add(&con->list_entry, &nat->bsc_connections);
 
@@ -513,6 +788,8 @@ static void test_mgcp_find(void)
 	sccp_con->msc_endp = 12;
 	sccp_con->bsc_endp = 12;
 	sccp_con->bsc = con;
+	con->endpoint_status[12] = 1;
+	nat->bsc_endpoints[12].con = sccp_con;
 	llist_add(&sccp_con->list_entry, &nat->sccp_connections);
 
 	if (bsc_mgcp_find_con(nat, 11) != NULL) {
@@ -525,12 +802,20 @@ static void test_mgcp_find(void)
 		abort();
 	}
 
+	/* clearing the call removes it from the index */
+	bsc_mgcp_dlcx(sccp_con);
+	if (bsc_mgcp_find_con(nat, 12) != NULL) {
+		fprintf(stderr, "Found the connection after the DLCX.\n");
+		abort();
+	}
+
 	/* free everything */
 	talloc_free(nat);
 }
 
 static void test_mgcp_rewrite(void)
 {
+	static const char bad_audio[] = "200 1\r\nI: 1\r\n\r\nm=audio none RTP/AVP 98\r\n";
 	int i;
 	struct msgb *output;
 	fprintf(stderr, "Test rewriting MGCP messages.\n");
@@ -558,6 +843,12 @@ static void test_mgcp_rewrite(void)
 		msgb_free(output);
 		free(input);
 	}
+
+	output = bsc_mgcp_rewrite(bad_audio, strlen(bad_audio), 0x1e, "10.0.0.23", 5555);
+	if (output) {
+		fprintf(stderr, "The broken audio line was accepted.\n");
+		abort();
+	}
 }
 
 static void test_mgcp_parse(void)
@@ -662,7 +953,8 @@ static void test_cr_filter()
 {
 	int i, res, contype;
 	struct msgb *msg = msgb_alloc(4096, "test_cr_filter");
-	struct bsc_nat_parsed *parsed;
+	struct bsc_nat_parsed parsed_msg;
+	struct bsc_nat_parsed *parsed = &parsed_msg;
 	struct bsc_nat_acc_lst *nat_lst, *bsc_lst;
 	struct bsc_nat_acc_lst_entry *nat_entry, *bsc_entry;
 
@@ -695,8 +987,7 @@ static void test_cr_filter()
 			      cr_filter[i].bsc_imsi_deny ? 1 : 0,
 			      &cr_filter[i].bsc_imsi_deny);
 
-		parsed = bsc_nat_parse(msg);
-		if (!parsed) {
+		if (bsc_nat_parse(msg, parsed) != 0) {
 			fprintf(stderr, "FAIL: Failed to parse the message\n");
 			abort();
 		}
@@ -712,7 +1003,6 @@ static void test_cr_filter()
 			abort();
 		}
 
-		talloc_free(parsed);
 	}
 
 	msgb_free(msg);
@@ -722,7 +1012,8 @@ static void test_dt_filter()
 {
 	int i;
 	struct msgb *msg = msgb_alloc(4096, "test_dt_filter");
-	struct bsc_nat_parsed *parsed;
+	struct bsc_nat_parsed parsed_msg;
+	struct bsc_nat_parsed *parsed = &parsed_msg;
 
 	struct bsc_nat *nat = bsc_nat_alloc();
 	struct bsc_connection *bsc = bsc_connection_alloc(nat);
@@ -734,8 +1025,7 @@ static void test_dt_filter()
 	msgb_reset(msg);
 	copy_to_msg(msg, id_resp, ARRAY_SIZE(id_resp));
 
-	parsed = bsc_nat_parse(msg);
-	if (!parsed) {
+	if (bsc_nat_parse(msg, parsed) != 0) {
 		fprintf(stderr, "FAIL: Could not parse ID resp\n");
 		abort();
 	}
@@ -761,8 +1051,7 @@ static void test_dt_filter()
 		msgb_reset(msg);
 		copy_to_msg(msg, id_resp, ARRAY_SIZE(id_resp));
 
-		parsed = bsc_nat_parse(msg);
-		if (!parsed)
+		if (bsc_nat_parse(msg, parsed) != 0)
 			continue;
 
 		con->imsi_checked = 0;
@@ -770,6 +1059,416 @@ static void test_dt_filter()
 	}
 }
 
+/* the compiled access lists must match like the regexps */
+static const char *acc_patterns[] = {
+	"^262", "^2620[1-3]", "2440[0-9]*", "^26201.*", "[0-9]*", "01$",
+	"^262011234567890$", "^[2-3]6.2", "2[45]", "^2621*3", "1\\{3\\}",
+	"^$", "^[]0]", "0.*1", "[^0-9]",
+};
+
+static const char *acc_imsis[] = {
+	"262011234567890", "262031234567890", "244001234567801",
+	"226001234567890", "2621113", "262", "", "111", "3652",
+	"26201", "2440", "1234560",
+};
+
+static void test_acc_lst_compile(void)
+{
+	struct bsc_nat *nat = bsc_nat_alloc();
+	struct bsc_nat_acc_lst *lst = bsc_nat_acc_lst_get(nat, "compile");
+	struct bsc_nat_acc_lst_entry *entry = bsc_nat_acc_lst_entry_create(lst);
+	int i, j, allow;
+
+	for (i = 0; i < ARRAY_SIZE(acc_patterns); ++i) {
+		bsc_parse_reg(entry, &entry->imsi_allow_re, &entry->imsi_allow,
+			      1, &acc_patterns[i]);
+		if (bsc_nat_acc_lst_compile(lst) != 0) {
+			fprintf(stderr, "FAIL: Could not compile '%s'\n", acc_patterns[i]);
+			abort();
+		}
+
+		for (j = 0; j < ARRAY_SIZE(acc_imsis); ++j) {
+			allow = regexec(&entry->imsi_allow_re, acc_imsis[j], 0, NULL, 0) == 0;
+			if (bsc_nat_acc_lst_check(lst, acc_imsis[j], 1) != allow ||
+			    bsc_nat_acc_lst_check(lst, acc_imsis[j], 0) != 0) {
+				fprintf(stderr, "FAIL: '%s' and '%s' should be %d\n",
+					acc_patterns[i], acc_imsis[j], allow);
+				abort();
+			}
+		}
+	}
+
+	/* many entries, the unanchored ones share the automaton */
+	for (i = 0; i < ARRAY_SIZE(acc_patterns); ++i) {
+		entry = bsc_nat_acc_lst_entry_create(lst);
+		bsc_parse_reg(entry, &entry->imsi_deny_re, &entry->imsi_deny,
+			      1, &acc_patterns[i]);
+	}
+
+	for (j = 0; j < ARRAY_SIZE(acc_imsis); ++j) {
+		int deny = 0;
+
+		llist_for_each_entry(entry, &lst->fltr_list, list)
+			if (entry->imsi_deny &&
+			    regexec(&entry->imsi_deny_re, acc_imsis[j], 0, NULL, 0) == 0)
+				deny = 1;
+
+		if (bsc_nat_acc_lst_check(lst, acc_imsis[j], 0) != deny) {
+			fprintf(stderr, "FAIL: '%s' should be denied %d\n",
+				acc_imsis[j], deny);
+			abort();
+		}
+	}
+
+	if (lst->nr_deny_re == 0 || lst->nr_deny_re == ARRAY_SIZE(acc_patterns)) {
+		fprintf(stderr, "FAIL: The patterns were not compiled\n");
+		abort();
+	}
+
+	bsc_nat_acc_lst_delete(lst);
+	talloc_free(nat);
+}
+
+static void test_latency(void)
+{
+	struct bsc_nat_lat_hist hist;
+	uint32_t usec, start;
+	int i, bucket, last = -1;
+
+	/* the buckets are in order and every value is in its bucket */
+	for (usec = 0; usec < 1 << 20; usec += 1 + usec / 64) {
+		bucket = bsc_nat_lat_bucket(usec);
+		start = bsc_nat_lat_bucket_start(bucket);
+		if (bucket < last || start > usec ||
+		    (bucket + 1 < NAT_LAT_BUCKETS &&
+		     bsc_nat_lat_bucket_start(bucket + 1) <= usec) ||
+		    (usec - start) * 8 > usec) {
+			fprintf(stderr, "FAIL: %u usec in bucket %d starting at %u\n",
+				usec, bucket, start);
+			abort();
+		}
+		last = bucket;
+	}
+
+	if (bsc_nat_lat_bucket(0xffffffff) != NAT_LAT_BUCKETS - 1) {
+		fprintf(stderr, "FAIL: The largest value is not in the last bucket\n");
+		abort();
+	}
+
+	/* 1..1000 usec */
+	memset(&hist, 0, sizeof(hist));
+	for (i = 1; i <= 1000; ++i)
+		bsc_nat_lat_add(&hist, i);
+
+	if (hist.count != 1000 || hist.max != 1000 || hist.sum != 500500 ||
+	    bsc_nat_lat_percentile(&hist, 500) < 500 ||
+	    bsc_nat_lat_percentile(&hist, 500) > 500 + 500 / 8 ||
+	    bsc_nat_lat_percentile(&hist, 990) < 990 ||
+	    bsc_nat_lat_percentile(&hist, 1000) != 1000) {
+		fprintf(stderr, "FAIL: Wrong percentiles p50: %u p99: %u p100: %u\n",
+			bsc_nat_lat_percentile(&hist, 500),
+			bsc_nat_lat_percentile(&hist, 990),
+			bsc_nat_lat_percentile(&hist, 1000));
+		abort();
+	}
+
+	bsc_nat_lat_merge(&hist, &hist);
+	if (hist.count != 2000 || hist.max != 1000 ||
+	    bsc_nat_lat_percentile(&hist, 500) < 500 ||
+	    bsc_nat_lat_percentile(&hist, 500) > 500 + 500 / 8) {
+		fprintf(stderr, "FAIL: Merging changed the percentiles\n");
+		abort();
+	}
+
+	if (bsc_nat_lat_type(SCCP_MSG_TYPE_DT1) != NAT_LAT_DT1 ||
+	    bsc_nat_lat_type(SCCP_MSG_TYPE_RLC) != NAT_LAT_OTHER) {
+		fprintf(stderr, "FAIL: Wrong message types\n");
+		abort();
+	}
+}
+
+static struct msgb *queue_msg(int prio, int nr)
+{
+	struct msgb *msg = msgb_alloc(100, "queue test");
+
+	msgb_put(msg, 10);
+	msg->data[0] = nr;
+	NAT_MSGB_CB(msg)->prio = prio;
+	return msg;
+}
+
+static void test_write_queue(void)
+{
+	static const struct bsc_nat_queue_limit limit = { 8, 1000 };
+	static const int order[] = { 3, 7, 8, 4, 5, 6 };
+	struct write_queue wq;
+	struct bsc_nat_queue queue;
+	struct msgb *msg;
+	int i;
+
+	write_queue_init(&wq, 100);
+	bsc_nat_queue_init(&queue, &wq, &limit);
+
+	/* paging gets half of the queue */
+	for (i = 0; i < 5; ++i)
+		bsc_nat_queue_enqueue(&queue, queue_msg(NAT_PRIO_PAGING, i));
+	if (wq.current_length != 4 || queue.dropped[NAT_PRIO_PAGING] != 1) {
+		fprintf(stderr, "FAIL: Paging was not limited: %u\n", wq.current_length);
+		abort();
+	}
+
+	/* the rest is put in front of the paging and pushes it out */
+	for (i = 0; i < 3; ++i)
+		bsc_nat_queue_enqueue(&queue, queue_msg(NAT_PRIO_CR, 4 + i));
+	bsc_nat_queue_enqueue(&queue, queue_msg(NAT_PRIO_CON, 3));
+	bsc_nat_queue_enqueue(&queue, queue_msg(NAT_PRIO_CON, 7));
+	if (wq.current_length != 8 || queue.bytes != 80 ||
+	    queue.queued[NAT_PRIO_CON] != 2 || queue.queued[NAT_PRIO_CR] != 3 ||
+	    queue.queued[NAT_PRIO_PAGING] != 3 || queue.dropped[NAT_PRIO_PAGING] != 2) {
+		fprintf(stderr, "FAIL: Wrong queue %u %u\n", wq.current_length, queue.bytes);
+		abort();
+	}
+
+	/* the queue is full, one more paging goes */
+	bsc_nat_queue_enqueue(&queue, queue_msg(NAT_PRIO_CON, 8));
+	if (wq.current_length != 8 || queue.dropped[NAT_PRIO_PAGING] != 3) {
+		fprintf(stderr, "FAIL: Paging was not dropped for a connection\n");
+		abort();
+	}
+
+	/* drain it the way write_queue_bfd_cb does */
+	for (i = 0; !llist_empty(&wq.msg_queue); ++i) {
+		msg = msgb_dequeue(&wq.msg_queue);
+		wq.current_length -= 1;
+		bsc_nat_queue_written(&queue, msg);
+
+		if ((i < ARRAY_SIZE(order) && msg->data[0] != order[i]) ||
+		    (i >= ARRAY_SIZE(order) && NAT_MSGB_CB(msg)->prio != NAT_PRIO_PAGING)) {
+			fprintf(stderr, "FAIL: Message %d is %d\n", i, msg->data[0]);
+			abort();
+		}
+		msgb_free(msg);
+	}
+
+	if (queue.bytes != 0 || queue.queued[NAT_PRIO_PAGING] != 0) {
+		fprintf(stderr, "FAIL: The queue was not drained\n");
+		abort();
+	}
+
+	/* without paging to drop a new connection is refused */
+	for (i = 0; i < 6; ++i)
+		bsc_nat_queue_enqueue(&queue, queue_msg(NAT_PRIO_CON, i));
+	if (bsc_nat_queue_admit(&queue, NAT_PRIO_CR, 10) ||
+	    !bsc_nat_queue_admit(&queue, NAT_PRIO_CON, 10)) {
+		fprintf(stderr, "FAIL: Wrong admission of a busy queue\n");
+		abort();
+	}
+	write_queue_clear(&wq);
+}
+
+/* parse the recorded messages the way the NAT does and time it */
+static void bench_parse(int rounds)
+{
+	static const struct {
+		const uint8_t *data;
+		unsigned int length;
+	} msgs[] = {
+		{ bsc_cr, sizeof(bsc_cr) },
+		{ msc_cc, sizeof(msc_cc) },
+		{ bsc_dtap, sizeof(bsc_dtap) },
+		{ msc_dtap, sizeof(msc_dtap) },
+		{ ass_cmd, sizeof(ass_cmd) },
+		{ id_resp, sizeof(id_resp) },
+		{ paging_by_lac_cmd, sizeof(paging_by_lac_cmd) },
+		{ msc_rlsd, sizeof(msc_rlsd) },
+		{ bsc_rlc, sizeof(bsc_rlc) },
+	};
+	struct bsc_nat_parsed parsed;
+	struct timespec start, end;
+	struct msgb *msg;
+	unsigned long nr = 0;
+	double elapsed;
+	int i, j;
+
+	msg = msgb_alloc(4096, "bench");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; ++i) {
+		for (j = 0; j < ARRAY_SIZE(msgs); ++j) {
+			uint16_t len;
+
+			copy_to_msg(msg, msgs[j].data, msgs[j].length);
+			if (bsc_nat_parse(msg, &parsed) != 0) {
+				fprintf(stderr, "Failed to parse message %d.\n", j);
+				abort();
+			}
+
+			bsc_nat_filter_ipa(DIR_MSC, msg, &parsed);
+			if (parsed.gsm_type == BSS_MAP_MSG_ASSIGMENT_RQST &&
+			    !bsc_nat_find_ie(parsed.payload, parsed.payload_len,
+					     GSM0808_IE_CIRCUIT_IDENTITY_CODE, &len)) {
+				fprintf(stderr, "No CIC in the assignment.\n");
+				abort();
+			}
+			nr += 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	msgb_free(msg);
+
+	elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	fprintf(stderr, "Parsed %lu messages in %.1f ms, %.1f ns per message.\n",
+		nr, elapsed / 1e6, elapsed / nr);
+}
+
+static void bench_mgcp_rewrite(int rounds)
+{
+	static const char *msgs[] = { crcx_resp, mdcx, mdcx_resp };
+	struct timespec start, end;
+	struct msgb *output;
+	unsigned long nr = 0;
+	double elapsed;
+	int i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; ++i) {
+		for (j = 0; j < ARRAY_SIZE(msgs); ++j) {
+			output = bsc_mgcp_rewrite(msgs[j], strlen(msgs[j]), 0x1e,
+						  "10.0.0.23", 5555);
+			if (!output) {
+				fprintf(stderr, "Failed to rewrite message %d.\n", j);
+				abort();
+			}
+			msgb_free(output);
+			nr += 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	fprintf(stderr, "Rewrote %lu MGCP messages in %.1f ms, %.1f ns per message.\n",
+		nr, elapsed / 1e6, elapsed / nr);
+}
+
+static struct bsc_nat *snapshot_nat(struct bsc_connection **bsc)
+{
+	struct bsc_nat *nat;
+	struct bsc_nat_msc *msc;
+
+	nat = bsc_nat_alloc();
+	nat->snapshot.file = talloc_strdup(nat, "bsc_nat_test.snapshot");
+	msc = add_msc(nat, 0, 1);
+	write_queue_init(&msc->con->write_queue, 100);
+	bsc_nat_queue_init(&msc->queue, &msc->con->write_queue, &nat->msc_queue_limit);
+
+	*bsc = bsc_connection_alloc(nat);
+	(*bsc)->cfg = bsc_config_alloc(nat, "foo", 23);
+	return nat;
+}
+
+static void test_snapshot(void)
+{
+	struct sccp_source_reference real, patched[3];
+	struct sccp_connections *con;
+	struct bsc_nat_parsed parsed;
+	struct bsc_connection *bsc;
+	struct bsc_nat_msc *msc;
+	struct bsc_nat *nat;
+	struct msgb *last;
+	int i;
+
+	fprintf(stderr, "Testing the connection snapshot.\n");
+	nat = snapshot_nat(&bsc);
+	msc = bsc_nat_msc_num(nat, 0);
+	memset(&parsed, 0, sizeof(parsed));
+	parsed.src_local_ref = &real;
+	for (i = 0; i < 3; ++i) {
+		real.octet1 = i;
+		real.octet2 = real.octet3 = 0x23;
+		con = create_sccp_src_ref(bsc, msc, &parsed);
+		con->con_type = NAT_CON_TYPE_LU;
+		patched[i] = con->patched_ref;
+		if (i > 0)
+			sccp_connection_set_remote(con, &con->patched_ref);
+	}
+
+	/* a connection the NAT handles itself is not written */
+	real.octet1 = 3;
+	con = create_sccp_src_ref(bsc, msc, &parsed);
+	con->con_local = 1;
+
+	if (bsc_nat_snapshot_write(nat) != 0) {
+		fprintf(stderr, "FAIL: Writing the snapshot failed.\n");
+		abort();
+	}
+	talloc_free(nat);
+
+	/* the new NAT takes the connections back */
+	nat = snapshot_nat(&bsc);
+	msc = bsc_nat_msc_num(nat, 0);
+	if (bsc_nat_snapshot_load(nat) != 3 || bsc_nat_snapshot_pending(msc) != 3) {
+		fprintf(stderr, "FAIL: Loading the snapshot failed.\n");
+		abort();
+	}
+
+	/* the references can not be taken by a new connection */
+	real.octet1 = 4;
+	con = create_sccp_src_ref(bsc, msc, &parsed);
+	for (i = 0; i < 3; ++i)
+		if (memcmp(&con->patched_ref, &patched[i], sizeof(patched[i])) == 0) {
+			fprintf(stderr, "FAIL: A reserved reference was used.\n");
+			abort();
+		}
+
+	if (bsc_nat_snapshot_adopt(bsc) != 3 || nat->snapshot.left != 0 ||
+	    bsc_nat_snapshot_pending(msc) != 0) {
+		fprintf(stderr, "FAIL: Adopting the connections failed.\n");
+		abort();
+	}
+
+	for (i = 0; i < 3; ++i) {
+		real.octet1 = i;
+		real.octet2 = real.octet3 = 0x23;
+		con = patch_sccp_src_ref_to_msc(NULL, &parsed, bsc);
+		if (!con || memcmp(&con->patched_ref, &patched[i], sizeof(patched[i])) != 0 ||
+		    con->con_type != NAT_CON_TYPE_LU || con->has_remote_ref != (i > 0)) {
+			fprintf(stderr, "FAIL: Connection %d was not restored.\n", i);
+			abort();
+		}
+	}
+	talloc_free(nat);
+
+	/* nobody comes back, the MSC is told about the released connections */
+	nat = snapshot_nat(&bsc);
+	msc = bsc_nat_msc_num(nat, 0);
+	bsc_nat_snapshot_load(nat);
+	if (bsc_nat_snapshot_defer_reset(msc) != 1) {
+		fprintf(stderr, "FAIL: The MSC reset was not deferred.\n");
+		abort();
+	}
+	bsc_nat_snapshot_expire(nat);
+	if (nat->snapshot.expired != 3 || msc->con->write_queue.current_length != 3 ||
+	    msc->refs.used != 0) {
+		fprintf(stderr, "FAIL: The snapshot did not expire.\n");
+		abort();
+	}
+
+	/* the deferred reset goes out behind the releases */
+	last = llist_entry(msc->con->write_queue.msg_queue.prev, struct msgb, list);
+	if (msc->reset_deferred || last->len != 21 || last->data[2] != IPAC_PROTO_SCCP ||
+	    last->data[3] != SCCP_MSG_TYPE_UDT) {
+		fprintf(stderr, "FAIL: The MSC was not reset after the expiry.\n");
+		abort();
+	}
+	if (bsc_nat_snapshot_defer_reset(msc) != 0) {
+		fprintf(stderr, "FAIL: The MSC reset was deferred again.\n");
+		abort();
+	}
+
+	write_queue_clear(&msc->con->write_queue);
+	unlink(nat->snapshot.file);
+	talloc_free(nat);
+}
+
 int main(int argc, char **argv)
 {
 	struct log_target *stderr_target;
@@ -782,6 +1481,8 @@ int main(int argc, char **argv)
 
 	test_filter();
 	test_contrack();
+	test_contrack_many();
+	test_msc_pool();
 	test_paging();
 	test_mgcp_ass_tracking();
 	test_mgcp_find();
@@ -789,6 +1490,15 @@ int main(int argc, char **argv)
 	test_mgcp_parse();
 	test_cr_filter();
 	test_dt_filter();
+	test_acc_lst_compile();
+	test_latency();
+	test_write_queue();
+	test_snapshot();
+
+	/* no logging for the benchmark */
+	log_set_all_filter(stderr_target, 0);
+	bench_parse(argc > 1 ? atoi(argv[1]) : 10000);
+	bench_mgcp_rewrite(argc > 1 ? atoi(argv[1]) : 10000);
 	return 0;
 }
 
@@ -0,0 +1,223 @@
+/* test the BSSGP flow control */
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <osmocore/msgb.h>
+#include <osmocore/rate_ctr.h>
+
+#include <openbsc/gsm_data.h>
+#include <openbsc/gprs_bssgp.h>
+
+#define PDU_LEN		500
+#define NR_PDUS		10
+
+void *bssgp_tall_ctx = NULL;
+
+/* the flow control runs on a clock that only moves when we say so */
+static struct timeval fake_now = { .tv_sec = 1000 };
+static struct timeval start;
+static int out_ms[NR_PDUS];
+static unsigned int nr_out;
+
+static int fake_gettime(struct timeval *tv)
+{
+	*tv = fake_now;
+	return 0;
+}
+
+static void advance_to_ms(int ms)
+{
+	struct timeval diff;
+
+	diff.tv_sec = ms / 1000;
+	diff.tv_usec = (ms % 1000) * 1000;
+	timeradd(&start, &diff, &fake_now);
+}
+
+static int elapsed_ms(void)
+{
+	struct timeval diff;
+
+	timersub(&fake_now, &start, &diff);
+	return diff.tv_sec * 1000 + diff.tv_usec / 1000;
+}
+
+/* the first octet of each PDU is its sequence number */
+static int out_cb(struct bssgp_flow_control *fc, struct msgb *msg,
+		  uint32_t llc_pdu_len, void *priv)
+{
+	if (msg->data[0] != nr_out || llc_pdu_len != PDU_LEN) {
+		printf("PDU %u passed out of order.\n", msg->data[0]);
+		abort();
+	}
+
+	out_ms[nr_out++] = elapsed_ms();
+	msgb_free(msg);
+	return 0;
+}
+
+static int send_pdus(struct bssgp_flow_control *fc, int nr)
+{
+	int i, dropped = 0;
+
+	for (i = 0; i < nr; ++i) {
+		struct msgb *msg = msgb_alloc(PDU_LEN, "test");
+
+		msgb_put(msg, PDU_LEN);
+		msg->data[0] = nr_out + fc->queue_depth;
+		if (bssgp_fc_in(fc, msg, PDU_LEN) == -ENOSPC)
+			dropped += 1;
+	}
+	return dropped;
+}
+
+static void reset(struct bssgp_flow_control *fc, struct rate_ctr *ctr,
+		  unsigned int max_queue_depth)
+{
+	bssgp_fc_init(fc, max_queue_depth, out_cb, NULL);
+	memset(ctr, 0, 3 * sizeof(*ctr));
+	fc->ctr = ctr;
+	nr_out = 0;
+	start = fake_now;
+}
+
+/* without FLOW-CONTROL from the BSS everything passes */
+static void test_unconfigured(void)
+{
+	struct bssgp_flow_control fc;
+	struct rate_ctr ctr[3];
+
+	reset(&fc, ctr, NR_PDUS);
+	send_pdus(&fc, NR_PDUS);
+	if (nr_out != NR_PDUS || ctr[BSSGP_FC_CTR_DELAYED].current) {
+		printf("Unconfigured flow control held back PDUs.\n");
+		abort();
+	}
+}
+
+/*
+ * Two PDUs fit into the bucket, the others leak out every 50 ms. The
+ * clock is moved by hand and the timer of the flow control is fired
+ * directly, a PDU must not pass a millisecond early.
+ */
+static void test_shaping(void)
+{
+	struct bssgp_flow_control fc;
+	struct rate_ctr ctr[3];
+	unsigned int i;
+
+	reset(&fc, ctr, NR_PDUS);
+	bssgp_fc_set(&fc, 2 * PDU_LEN, 10000);
+	send_pdus(&fc, NR_PDUS);
+	if (nr_out != 2 || fc.queue_depth != NR_PDUS - 2) {
+		printf("Wrong number of conforming PDUs: %u\n", nr_out);
+		abort();
+	}
+
+	for (i = 2; i < NR_PDUS; ++i) {
+		int expected = (i - 1) * PDU_LEN * 1000 / 10000;
+
+		if (!fc.timer.active) {
+			printf("No timer for PDU %u.\n", i);
+			abort();
+		}
+
+		advance_to_ms(expected - 1);
+		fc.timer.cb(fc.timer.data);
+		if (nr_out != i) {
+			printf("PDU %u passed before %d ms.\n", i, expected);
+			abort();
+		}
+
+		advance_to_ms(expected);
+		fc.timer.cb(fc.timer.data);
+		if (nr_out != i + 1 || out_ms[i] != expected) {
+			printf("PDU %u should pass after %d ms.\n", i, expected);
+			abort();
+		}
+		printf("PDU %u passed after %d ms\n", i, out_ms[i]);
+	}
+
+	/* 50 + 100 + ... + 400 ms */
+	if (ctr[BSSGP_FC_CTR_DELAYED].current != NR_PDUS - 2 ||
+	    ctr[BSSGP_FC_CTR_DROPPED].current != 0 ||
+	    ctr[BSSGP_FC_CTR_DELAY].current != 1800) {
+		printf("Wrong counters delayed: %llu dropped: %llu delay: %llu\n",
+			(unsigned long long) ctr[BSSGP_FC_CTR_DELAYED].current,
+			(unsigned long long) ctr[BSSGP_FC_CTR_DROPPED].current,
+			(unsigned long long) ctr[BSSGP_FC_CTR_DELAY].current);
+		abort();
+	}
+
+	bssgp_fc_flush(&fc);
+}
+
+/* a full queue drops, a new leak rate releases the queue */
+static void test_queue_full(void)
+{
+	struct bssgp_flow_control fc;
+	struct rate_ctr ctr[3];
+	int dropped;
+
+	reset(&fc, ctr, 4);
+	bssgp_fc_set(&fc, PDU_LEN, 10);
+	dropped = send_pdus(&fc, NR_PDUS);
+	if (nr_out != 1 || fc.queue_depth != 4 || dropped != NR_PDUS - 5 ||
+	    ctr[BSSGP_FC_CTR_DROPPED].current != NR_PDUS - 5) {
+		printf("Wrong queue: passed: %u queued: %u dropped: %d\n",
+			nr_out, fc.queue_depth, dropped);
+		abort();
+	}
+
+	/* without a bucket everything queued passes */
+	bssgp_fc_set(&fc, 0, 0);
+	if (nr_out != 5 || fc.queue_depth != 0) {
+		printf("Queue not released: passed: %u queued: %u\n",
+			nr_out, fc.queue_depth);
+		abort();
+	}
+
+	bssgp_fc_set(&fc, PDU_LEN, 10);
+	send_pdus(&fc, 3);
+	bssgp_fc_flush(&fc);
+	if (fc.queue_depth != 0 || ctr[BSSGP_FC_CTR_DROPPED].current != NR_PDUS - 5 + 3) {
+		printf("Queue not flushed: %u\n", fc.queue_depth);
+		abort();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bssgp_fc_gettime = fake_gettime;
+
+	test_unconfigured();
+	test_shaping();
+	test_queue_full();
+
+	printf("Testing the BSSGP flow control done.\n");
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Throughput of the CRC-24 implementations for the LLC FCS, for frames
+ * of the given size (default 1500 octets).
+ *
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <openbsc/crc24.h>
+
+#include "bscconfig.h"
+
+/* octets per implementation */
+#define TOTAL		(1024 * 1024 * 1024)
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench(const char *name,
+		  u_int32_t (*calc)(u_int32_t fcs, u_int8_t *cp, unsigned int len),
+		  u_int8_t *frame, unsigned int len)
+{
+	struct timespec start;
+	u_int32_t fcs = 0;
+	long i, nr = TOTAL / len;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr; ++i)
+		fcs ^= calc(INIT_CRC24, frame, len);
+	secs = elapsed(&start);
+
+	printf("%-12s %5u octets: %.3f GB/s %.0f frames/s (0x%06x)\n", name,
+	       len, (double) nr * len / secs / 1e9, nr / secs, fcs);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int len = argc > 1 ? atoi(argv[1]) : 1500;
+	u_int8_t *frame;
+	unsigned int i;
+
+	if (len == 0)
+		len = 1;
+	frame = malloc(len);
+	for (i = 0; i < len; ++i)
+		frame[i] = random();
+
+	bench("table", crc24_calc_table, frame, len);
+	bench("slice-by-8", crc24_calc_slice8, frame, len);
+#ifdef HAVE_PCLMUL
+	if (crc24_pclmul_supported())
+		bench("pclmul", crc24_calc_pclmul, frame, len);
+#endif
+	bench("crc24_calc", crc24_calc, frame, len);
+
+	free(frame);
+	return 0;
+}
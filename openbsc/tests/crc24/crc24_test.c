@@ -0,0 +1,110 @@
+/* test the CRC-24 implementations against the byte table */
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include <openbsc/crc24.h>
+
+#include "bscconfig.h"
+
+#define MAX_LEN		2048
+#define MAX_ALIGN	16
+
+struct crc24_impl {
+	const char *name;
+	u_int32_t (*calc)(u_int32_t fcs, u_int8_t *cp, unsigned int len);
+};
+
+static struct crc24_impl impls[] = {
+	{ "slice-by-8", crc24_calc_slice8 },
+	{ "crc24_calc", crc24_calc },
+#ifdef HAVE_PCLMUL
+	{ "pclmul", crc24_calc_pclmul },
+#endif
+};
+
+#define NR_IMPLS	(sizeof(impls) / sizeof(impls[0]))
+
+static u_int8_t buf[MAX_LEN + MAX_ALIGN];
+
+static void check(u_int32_t fcs, u_int8_t *cp, unsigned int len)
+{
+	u_int32_t expected = crc24_calc_table(fcs, cp, len);
+	unsigned int i;
+
+	for (i = 0; i < NR_IMPLS; ++i) {
+		u_int32_t got = impls[i].calc(fcs, cp, len);
+
+		if (got != expected) {
+			printf("%s: len %u offset %u init 0x%06x: 0x%06x "
+			       "instead of 0x%06x\n", impls[i].name, len,
+			       (unsigned int) (cp - buf), fcs, got, expected);
+			abort();
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int len, align, bit, i;
+	u_int32_t fcs;
+
+#ifdef HAVE_PCLMUL
+	if (!crc24_pclmul_supported()) {
+		printf("The CPU has no PCLMULQDQ, not testing it.\n");
+		impls[NR_IMPLS - 1] = impls[0];
+	}
+#endif
+
+	srandom(42);
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = random();
+
+	/* the FCS of the empty frame */
+	if (crc24_calc(INIT_CRC24, buf, 0) != INIT_CRC24) {
+		printf("The CRC of nothing is not the initial value.\n");
+		abort();
+	}
+
+	/* every length at every alignment */
+	for (len = 0; len <= MAX_LEN; ++len)
+		for (align = 0; align < MAX_ALIGN; ++align)
+			check(random() & 0xffffff, buf + align, len);
+
+	/* every single bit error in a frame of the maximum N201-I */
+	for (bit = 0; bit < 1520 * 8; ++bit) {
+		buf[bit / 8] ^= 1 << (bit % 8);
+		check(INIT_CRC24, buf, 1520);
+		buf[bit / 8] ^= 1 << (bit % 8);
+	}
+
+	/* every value of the first 16 bit of the initial CRC */
+	for (fcs = 0; fcs <= 0xffff; ++fcs) {
+		check(fcs, buf, 64);
+		check(fcs << 8 | 0xff, buf, 64);
+	}
+
+	printf("Testing %u CRC-24 implementations done.\n", (unsigned int) NR_IMPLS);
+	return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * Relay UL and DL UNITDATA through the Gb proxy. A BSS and a SGSN are
+ * simulated by two sockets on the loopback, each sends a window of
+ * NS UNITDATA to the proxy and the other one reads the relayed PDUs.
+ * The second argument is the number of NS threads of the proxy.
+ *
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <osmocore/select.h>
+#include <osmocore/talloc.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/signal.h>
+#include <openbsc/gsm_data.h>
+#include <openbsc/gprs_ns.h>
+#include <openbsc/gprs_bssgp.h>
+#include <openbsc/gb_proxy.h>
+
+/* used by the logging code */
+void *tall_bsc_ctx = NULL;
+struct gbproxy_config gbcfg;
+
+#define BSS_NSEI	100
+#define SGSN_NSEI	101
+#define PTP_BVCI	2
+#define PAYLOAD		1400
+/* datagrams in flight, the default socket buffer holds about 90 */
+#define WINDOW		64
+
+struct sim_peer {
+	const char *name;
+	uint16_t nsei;
+	struct sockaddr_in addr;
+	int fd;
+};
+
+static struct sim_peer bss = { .name = "BSS", .nsei = BSS_NSEI };
+static struct sim_peer sgsn = { .name = "SGSN", .nsei = SGSN_NSEI };
+static struct sockaddr_in proxy_addr;
+
+static int proxy_ns_cb(enum gprs_ns_evt event, struct gprs_nsvc *nsvc,
+		       struct msgb *msg, uint16_t bvci)
+{
+	return gbprox_rcvmsg(msg, nsvc, bvci);
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void peer_send(struct sim_peer *peer, const uint8_t *data, unsigned int len)
+{
+	if (sendto(peer->fd, data, len, 0, (struct sockaddr *) &proxy_addr,
+		   sizeof(proxy_addr)) != len) {
+		perror("sendto");
+		abort();
+	}
+}
+
+static void peer_drain(struct sim_peer *peer)
+{
+	uint8_t buf[2048];
+
+	while (recv(peer->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+
+static int recv_one(struct sim_peer *peer)
+{
+	uint8_t buf[2048];
+
+	return recv(peer->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0;
+}
+
+static void peer_init(struct sim_peer *peer)
+{
+	socklen_t len = sizeof(peer->addr);
+
+	peer->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&peer->addr, 0, sizeof(peer->addr));
+	peer->addr.sin_family = AF_INET;
+	peer->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(peer->fd, (struct sockaddr *) &peer->addr, len) != 0 ||
+	    getsockname(peer->fd, (struct sockaddr *) &peer->addr, &len) != 0) {
+		perror("bind");
+		abort();
+	}
+}
+
+/* NS-RESET and NS-UNBLOCK from the peer */
+static void peer_connect(struct sim_peer *peer)
+{
+	uint8_t reset[] = {
+		NS_PDUT_RESET,
+		NS_IE_CAUSE, 0x81, NS_CAUSE_OM_INTERVENTION,
+		NS_IE_VCI, 0x82, peer->nsei >> 8, peer->nsei & 0xff,
+		NS_IE_NSEI, 0x82, peer->nsei >> 8, peer->nsei & 0xff,
+	};
+	uint8_t unblock[] = { NS_PDUT_UNBLOCK };
+	struct gprs_nsvc *nsvc = NULL;
+	int i;
+
+	peer_send(peer, reset, sizeof(reset));
+	peer_send(peer, unblock, sizeof(unblock));
+	for (i = 0; i < 1000; ++i) {
+		bsc_select_main(1);
+		nsvc = nsvc_by_nsei(bssgp_nsi, peer->nsei);
+		if (nsvc && nsvc->state == NSE_S_ALIVE)
+			break;
+		usleep(1000);
+	}
+
+	if (!nsvc || nsvc->state != NSE_S_ALIVE) {
+		printf("The NS-VC of the %s did not come up.\n", peer->name);
+		abort();
+	}
+	peer_drain(peer);
+}
+
+static unsigned int build_unitdata(uint8_t *data, uint8_t pdu_type)
+{
+	data[0] = NS_PDUT_UNITDATA;
+	data[1] = 0;
+	data[2] = PTP_BVCI >> 8;
+	data[3] = PTP_BVCI & 0xff;
+	data[4] = pdu_type;
+	memset(&data[5], 0x23, PAYLOAD);
+	return 5 + PAYLOAD;
+}
+
+/* the sender sends a window of UNITDATA, the proxy relays them */
+static void bench_relay(const char *dir, struct sim_peer *from,
+			struct sim_peer *to, uint8_t pdu_type, long nr)
+{
+	struct timespec start;
+	uint8_t buf[2048], rx[2048];
+	unsigned int len = build_unitdata(buf, pdu_type);
+	long sent = 0, relayed = 0;
+	double secs;
+	int i, rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (sent < nr) {
+		for (i = 0; i < WINDOW && sent < nr; ++i, ++sent)
+			peer_send(from, buf, len);
+
+		while (relayed < sent) {
+			bsc_select_main(1);
+			while ((rc = recv(to->fd, rx, sizeof(rx), MSG_DONTWAIT)) > 0) {
+				if (rc != len || memcmp(rx, buf, len) != 0) {
+					printf("%s: relayed PDU differs.\n", dir);
+					abort();
+				}
+				relayed += 1;
+			}
+		}
+	}
+	secs = elapsed(&start);
+
+	printf("%s: %ld UNITDATA in %.3f s: %.0f msgs/s %.1f Mbit/s\n",
+	       dir, relayed, secs, relayed / secs,
+	       relayed * len * 8 / secs / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	long nr = argc > 1 ? atol(argv[1]) : 100000;
+	socklen_t len = sizeof(proxy_addr);
+	int i;
+	const uint8_t bvc_reset[] = {
+		NS_PDUT_UNITDATA, 0, 0, 0,
+		BSSGP_PDUT_BVC_RESET,
+		BSSGP_IE_BVCI, 0x82, PTP_BVCI >> 8, PTP_BVCI & 0xff,
+		BSSGP_IE_CAUSE, 0x81, BSSGP_CAUSE_OML_INTERV,
+	};
+
+	log_init(&log_info);
+
+	gbcfg.nsip_sgsn_nsei = SGSN_NSEI;
+	gbcfg.num_workers = argc > 2 ? atoi(argv[2]) : 0;
+	bssgp_nsi = gbcfg.nsi = gprs_ns_instantiate(proxy_ns_cb);
+	register_signal_handler(SS_NS, &gbprox_signal, NULL);
+	bssgp_nsi->nsip.local_ip = INADDR_LOOPBACK;
+	bssgp_nsi->nsip.reuse_port = gbcfg.num_workers > 0;
+	if (gprs_ns_nsip_listen(bssgp_nsi) < 0 ||
+	    gbprox_workers_start(&gbcfg) < 0) {
+		printf("Failed to listen for NS/UDP.\n");
+		abort();
+	}
+	getsockname(bssgp_nsi->nsip.fd.fd, (struct sockaddr *) &proxy_addr, &len);
+
+	peer_init(&bss);
+	peer_init(&sgsn);
+	peer_connect(&bss);
+	peer_connect(&sgsn);
+
+	/* the BVC-RESET of the BSS creates the PTP BVC in the proxy */
+	peer_send(&bss, bvc_reset, sizeof(bvc_reset));
+	for (i = 0; i < 1000 && !recv_one(&sgsn); ++i) {
+		bsc_select_main(1);
+		usleep(1000);
+	}
+
+	bench_relay("UL BSS->SGSN", &bss, &sgsn, BSSGP_PDUT_UL_UNITDATA, nr);
+	bench_relay("DL SGSN->BSS", &sgsn, &bss, BSSGP_PDUT_DL_UNITDATA, nr);
+
+	for (i = 0; i < gbcfg.num_workers; ++i)
+		printf("NS thread %d: received: %lu to SGSN: %lu to BSS: %lu "
+		       "to NS: %lu dropped: %lu\n", i, gbcfg.workers[i].received,
+		       gbcfg.workers[i].to_sgsn, gbcfg.workers[i].to_bss,
+		       gbcfg.workers[i].slow_path, gbcfg.workers[i].dropped);
+
+	gprs_ns_destroy(bssgp_nsi);
+	return 0;
+}
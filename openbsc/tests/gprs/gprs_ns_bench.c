@@ -0,0 +1,254 @@
+/*
+ * Push NS UNITDATA through the NS layer: directly into gprs_ns_rcvmsg(),
+ * through the NS/UDP socket from a peer on the loopback and from
+ * gprs_ns_sendmsg() back to that peer. A window of datagrams is sent
+ * and read before the next one, the socket buffers do not overflow.
+ *
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <osmocore/select.h>
+#include <osmocore/talloc.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/gsm_data.h>
+#include <openbsc/gprs_ns.h>
+
+/* used by the logging code */
+void *tall_bsc_ctx = NULL;
+
+#define NSEI		1234
+#define NSVCI		4321
+#define BVCI		2
+#define PAYLOAD		1400
+/* datagrams in flight, the default socket buffer holds about 90 */
+#define WINDOW		64
+
+static const uint8_t ns_reset[] = {
+	NS_PDUT_RESET,
+	NS_IE_CAUSE, 0x81, NS_CAUSE_OM_INTERVENTION,
+	NS_IE_VCI, 0x82, NSVCI >> 8, NSVCI & 0xff,
+	NS_IE_NSEI, 0x82, NSEI >> 8, NSEI & 0xff,
+};
+
+static const uint8_t ns_unblock[] = { NS_PDUT_UNBLOCK };
+
+static struct gprs_ns_inst *nsi;
+static struct sockaddr_in ns_addr, peer_addr;
+static int peer_fd;
+static long received;
+/* the same message is passed to gprs_ns_rcvmsg() again */
+static int keep_msg;
+
+static int ns_cb(enum gprs_ns_evt event, struct gprs_nsvc *nsvc,
+		 struct msgb *msg, uint16_t bvci)
+{
+	if (event == GPRS_NS_EVT_UNIT_DATA && bvci == BVCI)
+		received += 1;
+	if (keep_msg)
+		gprs_ns_msgb_take(nsvc->nsi, msg);
+	return 0;
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static unsigned int build_unitdata(uint8_t *data)
+{
+	data[0] = NS_PDUT_UNITDATA;
+	data[1] = 0;
+	data[2] = BVCI >> 8;
+	data[3] = BVCI & 0xff;
+	memset(&data[4], 0x23, PAYLOAD);
+	return 4 + PAYLOAD;
+}
+
+static void rcvmsg(const uint8_t *data, unsigned int len)
+{
+	struct msgb *msg = gprs_ns_msgb_alloc();
+
+	msg->l2h = msgb_put(msg, len);
+	memcpy(msg->l2h, data, len);
+	gprs_ns_rcvmsg(nsi, msg, &peer_addr, GPRS_NS_LL_UDP);
+}
+
+static void drain_peer(void)
+{
+	uint8_t buf[2048];
+
+	while (recv(peer_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+
+static void bench_rcvmsg(long nr)
+{
+	struct timespec start;
+	struct msgb *msg;
+	unsigned int len;
+	double secs;
+	long i;
+
+	msg = gprs_ns_msgb_alloc();
+	len = build_unitdata(msgb_put(msg, 4 + PAYLOAD));
+	msg->l2h = msg->data;
+
+	received = 0;
+	keep_msg = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr; ++i)
+		gprs_ns_rcvmsg(nsi, msg, &peer_addr, GPRS_NS_LL_UDP);
+	secs = elapsed(&start);
+	keep_msg = 0;
+	msgb_free(msg);
+
+	if (received != nr) {
+		printf("Only %ld of %ld UNITDATA reached the callback.\n", received, nr);
+		abort();
+	}
+
+	printf("gprs_ns_rcvmsg: %ld UNITDATA in %.3f s: %.0f msgs/s %.1f Mbit/s\n",
+	       nr, secs, nr / secs, nr * len * 8 / secs / 1e6);
+}
+
+/* the peer sends a window of datagrams, the NS layer reads them */
+static void bench_socket_rx(long nr)
+{
+	struct timespec start;
+	uint8_t buf[2048];
+	unsigned int len = build_unitdata(buf);
+	long sent = 0;
+	double secs;
+	int i;
+
+	received = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (sent < nr) {
+		for (i = 0; i < WINDOW && sent < nr; ++i, ++sent)
+			if (sendto(peer_fd, buf, len, 0, (struct sockaddr *) &ns_addr,
+				   sizeof(ns_addr)) != len)
+				abort();
+		while (received < sent)
+			bsc_select_main(0);
+	}
+	secs = elapsed(&start);
+
+	printf("NS/UDP rx: %ld UNITDATA in %.3f s: %.0f msgs/s, "
+	       "dropped by the socket: %u\n", received, secs,
+	       received / secs, nsi->nsip.rx_overflow);
+}
+
+/* the NS layer sends a window of datagrams, the peer reads them */
+static void bench_socket_tx(long nr)
+{
+	struct gprs_nsvc *nsvc = nsvc_by_nsei(nsi, NSEI);
+	unsigned int max_queue = 0;
+	struct timespec start;
+	uint8_t buf[2048];
+	long sent = 0, peer_received = 0;
+	double secs;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (sent < nr) {
+		for (i = 0; i < WINDOW && sent < nr; ++i, ++sent) {
+			struct msgb *msg = gprs_ns_msgb_alloc();
+
+			memset(msgb_put(msg, PAYLOAD), 0x42, PAYLOAD);
+			msgb_nsei(msg) = NSEI;
+			msgb_bvci(msg) = BVCI;
+			gprs_ns_sendmsg(nsi, msg);
+			if (nsvc->tx_queue_len > max_queue)
+				max_queue = nsvc->tx_queue_len;
+		}
+
+		/* the queued messages are written when the socket has room */
+		while (peer_received < sent) {
+			if (nsvc->tx_queue_len > 0)
+				bsc_select_main(1);
+			if (recv(peer_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0 &&
+			    buf[0] == NS_PDUT_UNITDATA)
+				peer_received += 1;
+		}
+	}
+	secs = elapsed(&start);
+
+	printf("NS/UDP tx: %ld UNITDATA in %.3f s: %.0f msgs/s, max queue: %u\n",
+	       peer_received, secs, peer_received / secs, max_queue);
+}
+
+int main(int argc, char **argv)
+{
+	long nr = argc > 1 ? atol(argv[1]) : 100000;
+	socklen_t len = sizeof(ns_addr);
+	struct gprs_nsvc *nsvc;
+
+	log_init(&log_info);
+
+	nsi = gprs_ns_instantiate(ns_cb);
+	nsi->nsip.local_ip = INADDR_LOOPBACK;
+	if (gprs_ns_nsip_listen(nsi) < 0) {
+		printf("Failed to listen for NS/UDP.\n");
+		abort();
+	}
+	getsockname(nsi->nsip.fd.fd, (struct sockaddr *) &ns_addr, &len);
+
+	peer_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&peer_addr, 0, sizeof(peer_addr));
+	peer_addr.sin_family = AF_INET;
+	peer_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(peer_addr);
+	if (bind(peer_fd, (struct sockaddr *) &peer_addr, len) != 0 ||
+	    getsockname(peer_fd, (struct sockaddr *) &peer_addr, &len) != 0) {
+		perror("bind");
+		abort();
+	}
+
+	/* bring up the NS-VC of the peer */
+	rcvmsg(ns_reset, sizeof(ns_reset));
+	rcvmsg(ns_unblock, sizeof(ns_unblock));
+	nsvc = nsvc_by_nsei(nsi, NSEI);
+	if (!nsvc || nsvc->state != NSE_S_ALIVE) {
+		printf("The NS-VC did not come up.\n");
+		abort();
+	}
+	drain_peer();
+
+	bench_rcvmsg(nr);
+	bench_socket_rx(nr);
+	drain_peer();
+	bench_socket_tx(nr);
+
+	gprs_ns_destroy(nsi);
+	return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Send the same N-PDU once with gtp_data_req() of libgtp and once with
+ * the fast path of the SGSN and compare the two T-PDUs, for GTP v0 and
+ * GTP v1. Both are sent to the GTP-U port on the loopback interface.
+ *
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/* the fast path is private to the SGSN's libgtp glue */
+#include "../../src/gprs/sgsn_libgtp.c"
+
+#include <osmocore/utils.h>
+
+/* this is here for the vty... it will never be called */
+void subscr_put() { abort(); }
+
+void *tall_bsc_ctx;
+const char *openbsc_copyright = "";
+
+static struct sgsn_instance sgsn_inst;
+struct sgsn_instance *sgsn = &sgsn_inst;
+
+/* receive the next T-PDU on the GTP-U port */
+static int recv_tpdu(int fd, uint8_t *buf, int len)
+{
+	int rc;
+
+	rc = recv(fd, buf, len, 0);
+	if (rc < 0) {
+		perror("recv");
+		abort();
+	}
+	return rc;
+}
+
+static void test_tpdu(int version)
+{
+	static const uint8_t npdu[] = {
+		0x45, 0x00, 0x00, 0x1c, 0x00, 0x01, 0x00, 0x00,
+		0x40, 0x11, 0x7c, 0xce, 0x7f, 0x00, 0x00, 0x01,
+		0x7f, 0x00, 0x00, 0x01, 0x30, 0x39, 0x30, 0x39,
+		0x00, 0x08, 0x00, 0x00,
+	};
+	uint8_t lib_buf[256], fp_buf[256];
+	struct gprs_llc_llme llme;
+	struct sgsn_mm_ctx mm;
+	struct sgsn_pdp_ctx pctx;
+	struct sockaddr_in addr;
+	struct gsn_t gsn;
+	struct pdp_t pdp;
+	int tx, rx, lib_len, fp_len;
+	uint16_t seq;
+
+	printf("Testing the GTP v%d T-PDU.\n", version);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(version == 0 ? GTP0_PORT : GTP1U_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	rx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	tx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (rx < 0 || tx < 0) {
+		perror("socket");
+		abort();
+	}
+	if (bind(rx, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		printf("GTP port %u is in use, skipping.\n",
+			ntohs(addr.sin_port));
+		close(rx);
+		close(tx);
+		return;
+	}
+
+	/* libgtp only needs the sockets of the GSN for the T-PDU */
+	memset(&gsn, 0, sizeof(gsn));
+	gsn.fd0 = tx;
+	gsn.fd1u = tx;
+	sgsn->gsn = &gsn;
+
+	memset(&pdp, 0, sizeof(pdp));
+	pdp.version = version;
+	pdp.imsi = 0x0f21436587092143ULL;
+	pdp.nsapi = 5;
+	pdp.flru = 0x1234;
+	pdp.teid_gn = 0xdeadbeef;
+	pdp.gtpsntx = 0xfffe;
+	pdp.gsnru.l = sizeof(addr.sin_addr);
+	memcpy(pdp.gsnru.v, &addr.sin_addr, sizeof(addr.sin_addr));
+
+	memset(&llme, 0, sizeof(llme));
+	memset(&mm, 0, sizeof(mm));
+	mm.llme = &llme;
+	memset(&pctx, 0, sizeof(pctx));
+	pctx.lib = &pdp;
+	pctx.mm = &mm;
+	pctx.sapi = 3;
+	pctx.nsapi = pdp.nsapi;
+
+	pdp_fp_setup(&pctx);
+	if (pctx.fp.gtpu_hdr_len == 0) {
+		fprintf(stderr, "The fast path was not set up.\n");
+		abort();
+	}
+
+	/* twice, after the second T-PDU the sequence number wraps */
+	for (seq = pdp.gtpsntx; seq != 0x0000; seq++) {
+		pdp.gtpsntx = seq;
+		if (gtp_data_req(&gsn, &pdp, (void *) npdu, sizeof(npdu)) != 0) {
+			fprintf(stderr, "libgtp failed to send the T-PDU.\n");
+			abort();
+		}
+		lib_len = recv_tpdu(rx, lib_buf, sizeof(lib_buf));
+
+		pdp.gtpsntx = seq;
+		if (pdp_fp_tx_gtpu(&pctx, (uint8_t *) npdu, sizeof(npdu)) != 0) {
+			fprintf(stderr, "The fast path failed to send the T-PDU.\n");
+			abort();
+		}
+		fp_len = recv_tpdu(rx, fp_buf, sizeof(fp_buf));
+
+		if (lib_len != fp_len || memcmp(lib_buf, fp_buf, lib_len) != 0) {
+			fprintf(stderr, "T-PDU with sequence number %u differs:\n", seq);
+			fprintf(stderr, " libgtp: %s\n", hexdump(lib_buf, lib_len));
+			fprintf(stderr, " fast:   %s\n", hexdump(fp_buf, fp_len));
+			abort();
+		}
+		if (pdp.gtpsntx != (uint16_t) (seq + 1)) {
+			fprintf(stderr, "The sequence number was not advanced.\n");
+			abort();
+		}
+	}
+
+	sgsn->gsn = NULL;
+	close(rx);
+	close(tx);
+}
+
+int main(int argc, char **argv)
+{
+	log_init(&log_info);
+
+	test_tpdu(0);
+	test_tpdu(1);
+
+	printf("Done.\n");
+	return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Segment 1500 octet IP packets into SN-UNITDATA for a range of N201-U
+ * and reassemble them again. The LLC layer is replaced by a loop that
+ * hands each segment straight back to SNDCP, in order or with all but
+ * the first segment reversed. Then the same for the segments of a TCP
+ * download with RFC 1144 negotiated as if the MS proposed it.
+ *
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <osmocore/msgb.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/gsm_data.h>
+#include <openbsc/gprs_bssgp.h>
+#include <openbsc/gprs_llc.h>
+#include <openbsc/sgsn.h>
+
+/* used by the logging code */
+void *tall_bsc_ctx = NULL;
+
+static struct sgsn_instance sgsn_inst = {
+	.cfg = {
+		.pcomp_rfc1144 = SGSN_PCOMP_PASSIVE,
+	},
+};
+struct sgsn_instance *sgsn = &sgsn_inst;
+
+#define NSAPI		5
+#define IP_LEN		1500
+
+static uint8_t packet[IP_LEN];
+static struct gprs_llc_llme llme;
+static int reorder, tcp;
+static struct msgb *frames[16];
+static unsigned int nr_frames;
+static unsigned long nr_segments, nr_npdus, nr_octets;
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+uint16_t bssgp_parse_cell_id(struct gprs_ra_id *raid, const uint8_t *buf)
+{
+	return 0;
+}
+
+static void deliver(struct msgb *msg)
+{
+	sndcp_llunitdata_ind(msg, &llme.lle[3], msg->data, msg->len);
+	msgb_free(msg);
+}
+
+/* the downlink segments are looped back as uplink */
+int gprs_llc_tx_ui(struct msgb *msg, uint8_t sapi, int command, void *mmctx)
+{
+	nr_segments += 1;
+	nr_octets += msg->len;
+	if (msg->len > llme.lle[sapi].params.n201_u) {
+		printf("Segment of %u octets exceeds N201-U.\n", msg->len);
+		abort();
+	}
+
+	if (!reorder) {
+		deliver(msg);
+		return 0;
+	}
+
+	frames[nr_frames++] = msg;
+	/* the first segment, then the others backwards */
+	if (!(msg->data[0] & 0x10)) {
+		deliver(frames[0]);
+		while (--nr_frames)
+			deliver(frames[nr_frames]);
+	}
+	return 0;
+}
+
+int gprs_ll_xid_req(struct gprs_llc_lle *lle, const uint8_t *l3,
+		    unsigned int l3_len)
+{
+	return 0;
+}
+
+int sgsn_rx_sndcp_ud_ind(struct gprs_ra_id *ra_id, int32_t tlli, uint8_t nsapi,
+			 struct msgb *msg, uint32_t npdu_len, uint8_t *npdu)
+{
+	if (npdu_len != IP_LEN || memcmp(npdu, packet, IP_LEN) != 0) {
+		printf("Reassembled N-PDU differs.\n");
+		abort();
+	}
+	nr_npdus += 1;
+	return 0;
+}
+
+/* the next segment of a download: IP and TCP header, ACK set */
+static void next_tcp_segment(void)
+{
+	static uint32_t seq;
+	static uint16_t id;
+	uint32_t sum = 0;
+	int i;
+
+	memset(packet, 0, 40);
+	packet[0] = 0x45;
+	packet[2] = IP_LEN >> 8;
+	packet[3] = IP_LEN & 0xff;
+	packet[4] = id >> 8;
+	packet[5] = id++ & 0xff;
+	packet[8] = 64;
+	packet[9] = 6;
+	packet[12] = 10;
+	packet[15] = 1;
+	packet[16] = 192;
+	packet[17] = 168;
+	packet[19] = 1;
+	for (i = 0; i < 20; i += 2)
+		sum += (packet[i] << 8) | packet[i + 1];
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum += sum >> 16;
+	packet[10] = ~sum >> 8;
+	packet[11] = ~sum & 0xff;
+
+	packet[21] = 80;
+	packet[23] = 80;
+	packet[24] = seq >> 24;
+	packet[25] = seq >> 16;
+	packet[26] = seq >> 8;
+	packet[27] = seq;
+	packet[32] = 5 << 4;
+	packet[33] = 0x10;
+	packet[34] = 0x16;
+	packet[35] = 0xd0;
+	seq += IP_LEN - 40;
+}
+
+/* MS proposes entity 0 with PCOMP 1 and 2 for NSAPI 5 and 16 slots */
+static void negotiate_rfc1144(void)
+{
+	const uint8_t xid[] = { 2, 7, 0x80, 0, 4, 0x12, 0x00, 1 << NSAPI, 15 };
+	uint8_t resp[32];
+
+	if (sndcp_ll_xid_ind(&llme.lle[3], xid, sizeof(xid), resp, sizeof(resp)) != 7 ||
+	    resp[2] != 0 || resp[3] != 3 || resp[5] != 1 << NSAPI) {
+		printf("RFC 1144 not accepted.\n");
+		abort();
+	}
+}
+
+static void bench(uint16_t n201_u, long nr)
+{
+	struct timespec start;
+	double secs;
+	long i;
+
+	llme.lle[3].params.n201_u = n201_u;
+	nr_segments = nr_npdus = nr_octets = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr; ++i) {
+		/* like the N-PDU received by GTP */
+		struct msgb *msg = msgb_alloc_headroom(IP_LEN + 256, 128, "GTP->SNDCP");
+
+		if (tcp)
+			next_tcp_segment();
+		memcpy(msgb_put(msg, IP_LEN), packet, IP_LEN);
+		if (sndcp_unitdata_req(msg, &llme.lle[3], NSAPI, NULL) < 0) {
+			printf("Failed to send the N-PDU.\n");
+			abort();
+		}
+	}
+	secs = elapsed(&start);
+
+	if (nr_npdus != nr) {
+		printf("Only %lu of %ld N-PDUs reassembled.\n", nr_npdus, nr);
+		abort();
+	}
+
+	printf("N201-U %4u %s%s: %lu segments/N-PDU %.1f octets/N-PDU "
+	       "%.0f N-PDUs/s %.1f Mbit/s\n", n201_u,
+	       reorder ? "reordered" : "in order ", tcp ? " RFC 1144" : "",
+	       nr_segments / nr, (double) nr_octets / nr, nr / secs,
+	       nr * IP_LEN * 8 / secs / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	const uint16_t n201_u[] = { 140, 270, 500, 1000, 1520 };
+	long nr = argc > 1 ? atol(argv[1]) : 200000;
+	unsigned int i;
+
+	log_init(&log_info);
+
+	for (i = 0; i < sizeof(packet); ++i)
+		packet[i] = random();
+
+	llme.tlli = 0xc0000001;
+	llme.lle[3].llme = &llme;
+	llme.lle[3].sapi = 3;
+	sndcp_sm_activate_ind(&llme.lle[3], NSAPI);
+
+	for (reorder = 0; reorder < 2; ++reorder)
+		for (i = 0; i < ARRAY_SIZE(n201_u); ++i)
+			bench(n201_u[i], nr);
+
+	negotiate_rfc1144();
+	tcp = 1;
+	for (reorder = 0; reorder < 2; ++reorder)
+		for (i = 0; i < ARRAY_SIZE(n201_u); ++i)
+			bench(n201_u[i], nr);
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+/* test the hash index */
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <osmocore/talloc.h>
+
+#include <openbsc/hash_index.h>
+
+struct test_obj {
+	uint16_t key;
+	struct hash_entry entry;
+};
+
+#define NR_OBJS		1000
+#define NR_MORE		100
+
+static struct test_obj objs[NR_OBJS];
+static struct test_obj more[NR_MORE];
+static struct hash_index test_idx;
+
+static struct test_obj *obj_by_key(uint16_t key)
+{
+	struct test_obj *obj;
+
+	hash_index_for_each(obj, &test_idx, hash_index_u32(key), entry) {
+		if (obj->key == key)
+			return obj;
+	}
+	return NULL;
+}
+
+static int nr_hashes;
+
+static uint32_t counted_hash(uint16_t key)
+{
+	nr_hashes++;
+	return hash_index_u32(key);
+}
+
+/* the hash is computed once per walk and an else is not swallowed */
+static void check_macro(uint16_t key)
+{
+	struct test_obj *obj;
+	int found = 0, other = 0;
+
+	nr_hashes = 0;
+	if (key == 0xffff)
+		other = 1;
+	else
+		hash_index_for_each(obj, &test_idx, counted_hash(key), entry)
+			if (obj->key == key)
+				found++;
+	if (nr_hashes != 1 || found != 1 || other) {
+		printf("Walk for %u hashed %d times, found %d.\n",
+			key, nr_hashes, found);
+		abort();
+	}
+
+	if (key != 0xffff)
+		hash_index_for_each(obj, &test_idx, hash_index_u32(key), entry)
+			found++;
+	else
+		other = 1;
+	if (other) {
+		printf("The else was taken by the walk.\n");
+		abort();
+	}
+}
+
+static void check(uint16_t key, struct test_obj *expected)
+{
+	struct test_obj *obj = obj_by_key(key);
+
+	if (obj != expected) {
+		printf("Key %u found %p instead of %p.\n", key, obj, expected);
+		abort();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct test_obj dup = { .key = 7 };
+	int i;
+
+	/* an empty index finds nothing, deleting a new entry is fine */
+	check(7, NULL);
+	hash_index_del(&test_idx, &dup.entry);
+	hash_index_rehash(NULL, &test_idx, &dup.entry, hash_index_u32(8));
+	if (test_idx.count != 0) {
+		printf("Unindexed entry was added.\n");
+		abort();
+	}
+
+	/* grow the table a few times */
+	for (i = 0; i < NR_OBJS; ++i) {
+		objs[i].key = i;
+		hash_index_add(NULL, &test_idx, &objs[i].entry, hash_index_u32(i));
+	}
+	if (test_idx.count != NR_OBJS || test_idx.size < NR_OBJS) {
+		printf("Wrong size %u for %u entries.\n", test_idx.size, test_idx.count);
+		abort();
+	}
+	for (i = 0; i < NR_OBJS; ++i)
+		check(i, &objs[i]);
+	check(NR_OBJS, NULL);
+	check_macro(23);
+
+	/* the most recent entry with a key wins, also after growing */
+	hash_index_add(NULL, &test_idx, &dup.entry, hash_index_u32(dup.key));
+	check(7, &dup);
+	for (i = 0; i < NR_MORE; ++i) {
+		more[i].key = NR_OBJS + i;
+		hash_index_add(NULL, &test_idx, &more[i].entry,
+			       hash_index_u32(more[i].key));
+	}
+	if (test_idx.size < NR_OBJS + NR_MORE) {
+		printf("The index did not grow.\n");
+		abort();
+	}
+	check(7, &dup);
+	hash_index_del(&test_idx, &dup.entry);
+	check(7, &objs[7]);
+	hash_index_add(NULL, &test_idx, &dup.entry, hash_index_u32(dup.key));
+
+	/* change the key of an entry */
+	dup.key = 4711;
+	hash_index_rehash(NULL, &test_idx, &dup.entry, hash_index_u32(dup.key));
+	check(7, &objs[7]);
+	check(4711, &dup);
+
+	hash_index_del(&test_idx, &dup.entry);
+	hash_index_del(&test_idx, &dup.entry);
+	check(4711, NULL);
+	if (test_idx.count != NR_OBJS + NR_MORE) {
+		printf("Wrong count %u.\n", test_idx.count);
+		abort();
+	}
+
+	hash_index_free(&test_idx);
+	check(1, NULL);
+
+	printf("Testing the hash index done.\n");
+	return 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * Test the MGCP parser and the handling of retransmissions. Garbage
+ * derived from recorded traffic is fed into the parser and the
+ * commands are timed.
+ *
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/mgcp.h>
+#include <openbsc/mgcp_internal.h>
+
+#include <osmocore/talloc.h>
+
+#include "mgcp_traffic.c"
+
+static struct mgcp_config *cfg;
+
+static struct msgb *create_msg(const char *str, int len)
+{
+	struct msgb *msg = msgb_alloc_headroom(4096, 128, "MGCP test");
+
+	msg->l2h = msgb_put(msg, len);
+	memcpy(msg->l2h, str, len);
+	return msg;
+}
+
+static struct msgb *handle(const char *str)
+{
+	struct msgb *msg, *resp;
+
+	msg = create_msg(str, strlen(str));
+	resp = mgcp_handle_message(cfg, msg);
+	msgb_free(msg);
+	return resp;
+}
+
+static int resp_code(struct msgb *resp)
+{
+	if (!resp)
+		return -1;
+	return atoi((const char *) resp->l2h);
+}
+
+static void setup_config(void)
+{
+	cfg = mgcp_config_alloc();
+	cfg->number_endpoints = 32;
+	cfg->bts_ports.mode = PORT_ALLOC_STATIC;
+	cfg->net_ports.mode = PORT_ALLOC_STATIC;
+	if (mgcp_endpoints_allocate(cfg) != 0)
+		abort();
+}
+
+static void test_parse(void)
+{
+	struct mgcp_parse_data p;
+	char line[128];
+
+	printf("Testing parsing.\n");
+
+	if (mgcp_parse_msg(&p, mdcx, strlen(mdcx)) != 0 || !p.valid) {
+		printf("Failed to parse MDCX.\n");
+		abort();
+	}
+
+	if (strcmp(p.trans_id, "23330829") != 0 || p.trans_nr != 23330829 ||
+	    p.code != -1 || p.bad_line != -1 ||
+	    memcmp(&p.data[p.verb.start], "MDCX", 4) != 0 ||
+	    p.endp.length != 5 || memcmp(&p.data[p.endp.start], "8@mgw", 5) != 0) {
+		printf("Wrong header of MDCX.\n");
+		abort();
+	}
+
+	if (p.params_mask != ((1 << ('C' - 'A')) | (1 << ('I' - 'A')) |
+			      (1 << ('L' - 'A')) | (1 << ('M' - 'A')))) {
+		printf("Wrong parameters 0x%x.\n", p.params_mask);
+		abort();
+	}
+
+	snprintf(line, sizeof(line), "%.*s", p.params['M' - 'A'].length,
+		 &p.data[p.params['M' - 'A'].start]);
+	if (strcmp(line, "recvonly") != 0) {
+		printf("Wrong mode: '%s'\n", line);
+		abort();
+	}
+
+	snprintf(line, sizeof(line), "%.*s", p.sdp_audio.length,
+		 &p.data[p.sdp_audio.start]);
+	if (strcmp(line, "m=audio 4410 RTP/AVP 126") != 0) {
+		printf("Wrong audio line: '%s'\n", line);
+		abort();
+	}
+
+	snprintf(line, sizeof(line), "%.*s", p.sdp_conn.length,
+		 &p.data[p.sdp_conn.start]);
+	if (strcmp(line, "c=IN IP4 172.16.18.2") != 0) {
+		printf("Wrong connection line: '%s'\n", line);
+		abort();
+	}
+
+	/* lower case parameters and no \r */
+	if (mgcp_parse_msg(&p, mdcx_sendrecv, strlen(mdcx_sendrecv)) != 0 ||
+	    !(p.params_mask & (1 << ('M' - 'A'))) ||
+	    p.params['M' - 'A'].length != 8) {
+		printf("Failed to parse MDCX without CR.\n");
+		abort();
+	}
+
+	if (mgcp_parse_msg(&p, crcx_resp, strlen(crcx_resp)) != 0 ||
+	    p.code != 200 || strcmp(p.trans_id, "23265295") != 0) {
+		printf("Failed to parse the response.\n");
+		abort();
+	}
+
+	if (mgcp_parse_msg(&p, "CRCX 1 1@mgw", 12) == 0 || p.valid) {
+		printf("Incomplete header was accepted.\n");
+		abort();
+	}
+
+	if (mgcp_parse_msg(&p, "CRCX 1 1@mgw MGCP 0.1\r\n", 23) == 0) {
+		printf("Wrong version was accepted.\n");
+		abort();
+	}
+
+	if (mgcp_parse_msg(&p, "CRCX 1 1@mgw MGCP 1.0\r\nfoo\r\n", 28) != 0 ||
+	    p.bad_line != 23) {
+		printf("Malformed line was not found.\n");
+		abort();
+	}
+}
+
+static void test_call(void)
+{
+	struct mgcp_endpoint *endp = &cfg->endpoints[8];
+	struct msgb *resp, *resp2;
+	unsigned int ci;
+
+	printf("Testing a call with retransmissions.\n");
+
+	resp = handle(crcx);
+	if (resp_code(resp) != 200 || !endp->allocated) {
+		printf("CRCX failed.\n");
+		abort();
+	}
+	ci = endp->ci;
+
+	/* the retransmission must not create a new connection */
+	resp2 = handle(crcx);
+	if (!resp2 || msgb_l2len(resp) != msgb_l2len(resp2) ||
+	    memcmp(resp->l2h, resp2->l2h, msgb_l2len(resp)) != 0 ||
+	    endp->ci != ci || cfg->trans_cache->hits != 1) {
+		printf("CRCX retransmission was not answered from the cache.\n");
+		abort();
+	}
+	msgb_free(resp);
+	msgb_free(resp2);
+
+	/* the CI of the response was 1 */
+	endp->ci = 1;
+	resp = handle(mdcx);
+	if (resp_code(resp) != 200 || endp->net_end.rtp_port != htons(4410) ||
+	    endp->net_end.payload_type != 126 ||
+	    endp->net_end.addr.s_addr != inet_addr("172.16.18.2") ||
+	    endp->conn_mode != MGCP_CONN_RECV_ONLY) {
+		printf("MDCX failed.\n");
+		abort();
+	}
+	msgb_free(resp);
+
+	resp = handle(mdcx_sendrecv);
+	if (resp_code(resp) != 200 || endp->conn_mode != MGCP_CONN_RECV_SEND) {
+		printf("MDCX to sendrecv failed.\n");
+		abort();
+	}
+	msgb_free(resp);
+
+	resp = handle(dlcx);
+	if (resp_code(resp) != 250 || endp->allocated) {
+		printf("DLCX failed.\n");
+		abort();
+	}
+	msgb_free(resp);
+
+	/* the endpoint is gone but the retransmission gets the 250 */
+	resp = handle(dlcx);
+	if (resp_code(resp) != 250) {
+		printf("DLCX retransmission failed.\n");
+		abort();
+	}
+	msgb_free(resp);
+
+	/* a new transaction does not */
+	resp = handle("DLCX 23330832 8@mgw MGCP 1.0\r\n");
+	if (resp_code(resp) != 400) {
+		printf("DLCX on a free endpoint should fail.\n");
+		abort();
+	}
+	msgb_free(resp);
+
+	resp = handle(auep);
+	if (resp_code(resp) != 200) {
+		printf("AUEP failed.\n");
+		abort();
+	}
+	msgb_free(resp);
+}
+
+static void check_ptr(const struct mgcp_parse_data *p, const struct mgcp_msg_ptr *ptr)
+{
+	if (ptr->start > p->len || ptr->start + ptr->length > p->len) {
+		printf("Pointer %u/%u out of the message of %u.\n",
+			ptr->start, ptr->length, p->len);
+		abort();
+	}
+}
+
+/* mutate the recorded traffic and make sure nothing goes wrong */
+static void test_fuzz(int rounds)
+{
+	char buf[1024], copy[1024];
+	int i, j;
+
+	printf("Fuzzing the parser %d times.\n", rounds);
+	srand(2342);
+
+	for (i = 0; i < rounds; ++i) {
+		const char *orig = mgcp_traffic[rand() % ARRAY_SIZE(mgcp_traffic)];
+		struct mgcp_parse_data p;
+		struct msgb *msg, *resp;
+		int len = strlen(orig);
+
+		memcpy(buf, orig, len);
+		for (j = rand() % 8; j > 0; --j) {
+			switch (rand() % 4) {
+			case 0:
+				buf[rand() % len] = rand();
+				break;
+			case 1:
+				buf[rand() % len] = " \r\n:=@0"[rand() % 7];
+				break;
+			case 2:
+				len = rand() % len + 1;
+				break;
+			case 3:
+				buf[rand() % len] = '\0';
+				break;
+			}
+		}
+
+		memcpy(copy, buf, len);
+		mgcp_parse_msg(&p, buf, len);
+		if (memcmp(copy, buf, len) != 0) {
+			printf("The parser modified the input.\n");
+			abort();
+		}
+
+		check_ptr(&p, &p.verb);
+		check_ptr(&p, &p.trans);
+		check_ptr(&p, &p.endp);
+		check_ptr(&p, &p.sdp_conn);
+		check_ptr(&p, &p.sdp_audio);
+		for (j = 0; j < 26; ++j)
+			if (p.params_mask & (1 << j))
+				check_ptr(&p, &p.params[j]);
+
+		/* and through the command handling */
+		msg = create_msg(buf, len);
+		resp = mgcp_handle_message(cfg, msg);
+		msgb_free(msg);
+		if (resp)
+			msgb_free(resp);
+	}
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+static void bench(int rounds)
+{
+	static const char *cmds[] = { crcx, mdcx, dlcx };
+	struct mgcp_parse_data p;
+	struct timespec start;
+	char buf[256];
+	int i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; ++i)
+		for (j = 0; j < ARRAY_SIZE(cmds); ++j)
+			mgcp_parse_msg(&p, cmds[j], strlen(cmds[j]));
+	printf("Parsing: %.1f ns per message\n",
+		elapsed(&start) / (rounds * ARRAY_SIZE(cmds)));
+
+	/* a full call with new transactions */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; ++i) {
+		struct msgb *resp;
+
+		snprintf(buf, sizeof(buf), "CRCX %d 8@mgw MGCP 1.0\r\nC: 394b0439fb\r\n"
+			"M: recvonly\r\n", 3 * i + 1000000);
+		resp = handle(buf);
+		if (resp)
+			msgb_free(resp);
+
+		snprintf(buf, sizeof(buf), "MDCX %d 8@mgw MGCP 1.0\r\nM: sendrecv\r\n"
+			"\r\nc=IN IP4 172.16.18.2\r\nm=audio 4410 RTP/AVP 126\r\n",
+			3 * i + 1000001);
+		resp = handle(buf);
+		if (resp)
+			msgb_free(resp);
+
+		snprintf(buf, sizeof(buf), "DLCX %d 8@mgw MGCP 1.0\r\n", 3 * i + 1000002);
+		resp = handle(buf);
+		if (resp)
+			msgb_free(resp);
+	}
+	printf("Call: %.1f ns per CRCX/MDCX/DLCX\n", elapsed(&start) / (rounds * 3));
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = 100000;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+
+	log_init(&log_info);
+
+	setup_config();
+	test_parse();
+	test_call();
+	test_fuzz(rounds);
+	bench(rounds);
+
+	printf("Testing MGCP done.\n");
+	return 0;
+}
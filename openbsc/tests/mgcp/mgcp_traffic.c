@@ -0,0 +1,53 @@
+/*
+ * MGCP commands as sent by a call agent during a call setup and
+ * release. Used by the parser tests and the benchmark.
+ */
+
+static const char auep[] = "AUEP 158663169 3@mgw MGCP 1.0\r\n";
+
+static const char crcx[] = "CRCX 23265295 8@mgw MGCP 1.0\r\n"
+	"C: 394b0439fb\r\n"
+	"L: p:20, a:AMR, nt:IN\r\n"
+	"M: recvonly\r\n";
+
+static const char mdcx[] = "MDCX 23330829 8@mgw MGCP 1.0\r\n"
+	"C: 394b0439fb\r\n"
+	"I: 1\r\n"
+	"L: p:20, a:AMR, nt:IN\r\n"
+	"M: recvonly\r\n"
+	"\r\n"
+	"v=0\r\n"
+	"o=- 1049380491 0 IN IP4 172.16.18.2\r\n"
+	"s=-\r\n"
+	"c=IN IP4 172.16.18.2\r\n"
+	"t=0 0\r\n"
+	"m=audio 4410 RTP/AVP 126\r\n"
+	"a=rtpmap:126 AMR/8000/1\r\n"
+	"a=fmtp:126 mode-set=2;start-mode=0\r\n"
+	"a=ptime:20\r\n"
+	"a=recvonly\r\n"
+	"m=image 4412 udptl t38\r\n"
+	"a=T38FaxVersion:0\r\n"
+	"a=T38MaxBitRate:14400\r\n";
+
+static const char mdcx_sendrecv[] = "MDCX 23330830 8@mgw MGCP 1.0\n"
+	"c: 394b0439fb\n"
+	"i: 1\n"
+	"m: sendrecv\n";
+
+static const char dlcx[] = "DLCX 23330831 8@mgw MGCP 1.0\r\n"
+	"C: 394b0439fb\r\n"
+	"I: 1\r\n";
+
+static const char dlcx_noanswer[] = "DLCX 26 1e@mgw MGCP 1.0\r\n"
+	"Z: noanswer\r\n";
+
+static const char rsip[] = "RSIP 2 *@mgw MGCP 1.0\r\n";
+
+static const char crcx_resp[] = "200 23265295\r\nI: 1\r\n\r\nv=0\r\n"
+	"c=IN IP4 172.16.18.2\r\nm=audio 4002 RTP/AVP 98\r\n"
+	"a=rtpmap:98 AMR/8000\r\n";
+
+static const char *mgcp_traffic[] = {
+	auep, crcx, mdcx, mdcx_sendrecv, dlcx, dlcx_noanswer, rsip, crcx_resp,
+};
@@ -0,0 +1,217 @@
+/*
+ * Compare the select() loop of libosmocore with the epoll backend.
+ *
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <osmocore/select.h>
+#include <osmocore/timer.h>
+#include <osmocore/talloc.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/select_epoll.h>
+
+/* used by the logging code */
+void *tall_bsc_ctx = NULL;
+
+struct pipe_fd {
+	struct bsc_fd bfd;
+	int wfd;
+};
+
+static struct pipe_fd *pipes;
+static int nr_pipes;
+
+static struct timespec sent;
+static int received;
+static double lat_sum, lat_max;
+
+static struct timer_list tick;
+static int ticks;
+
+static double ts_diff(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+static double cpu_time(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec +
+	       usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+}
+
+static int pipe_cb(struct bsc_fd *bfd, unsigned int what)
+{
+	struct timespec now;
+	char c;
+	double lat;
+
+	if (read(bfd->fd, &c, 1) != 1)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lat = ts_diff(&sent, &now);
+	lat_sum += lat;
+	if (lat > lat_max)
+		lat_max = lat;
+	received = 1;
+	return 0;
+}
+
+static void tick_cb(void *data)
+{
+	ticks += 1;
+	bsc_schedule_timer(&tick, 0, 1000);
+}
+
+static int create_pipes(int nr, int limit)
+{
+	int i, fds[2];
+
+	pipes = talloc_zero_array(NULL, struct pipe_fd, nr);
+	for (i = 0; i < nr; ++i) {
+		if (pipe(fds) != 0) {
+			perror("pipe");
+			break;
+		}
+
+		/* the select() backend can not go beyond FD_SETSIZE */
+		if (limit && fds[0] >= FD_SETSIZE) {
+			close(fds[0]);
+			close(fds[1]);
+			break;
+		}
+
+		pipes[i].bfd.fd = fds[0];
+		pipes[i].bfd.when = BSC_FD_READ;
+		pipes[i].bfd.cb = pipe_cb;
+		pipes[i].wfd = fds[1];
+		if (bsc_epoll_register_fd(&pipes[i].bfd) != 0) {
+			close(fds[0]);
+			close(fds[1]);
+			break;
+		}
+	}
+
+	nr_pipes = i;
+	return nr_pipes;
+}
+
+static void destroy_pipes(void)
+{
+	int i;
+
+	for (i = 0; i < nr_pipes; ++i) {
+		bsc_epoll_unregister_fd(&pipes[i].bfd);
+		close(pipes[i].bfd.fd);
+		close(pipes[i].wfd);
+	}
+
+	talloc_free(pipes);
+	pipes = NULL;
+	nr_pipes = 0;
+}
+
+static void run(const char *name, int nr, int rounds, int limit)
+{
+	struct timespec start, stop;
+	double cpu;
+	int i;
+
+	create_pipes(nr, limit);
+
+	/* idle: only a 1ms timer is firing */
+	ticks = 0;
+	tick.cb = tick_cb;
+	bsc_schedule_timer(&tick, 0, 1000);
+	cpu = cpu_time();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (ticks < 1000)
+		bsc_select_main(0);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	cpu = cpu_time() - cpu;
+	bsc_del_timer(&tick);
+
+	printf("%-7s fds: %6d idle cpu: %6.2f%% per wakeup: %8.2fus\n",
+		name, nr_pipes, 100.0 * cpu / ts_diff(&start, &stop),
+		cpu / ticks);
+
+	/* latency: one random socket becomes readable */
+	lat_sum = lat_max = 0;
+	for (i = 0; i < rounds; ++i) {
+		struct pipe_fd *p = &pipes[rand() % nr_pipes];
+
+		received = 0;
+		clock_gettime(CLOCK_MONOTONIC, &sent);
+		if (write(p->wfd, "x", 1) != 1)
+			abort();
+		while (!received)
+			bsc_select_main(0);
+	}
+
+	printf("%-7s fds: %6d latency avg: %8.2fus max: %8.2fus\n",
+		name, nr_pipes, lat_sum / rounds, lat_max);
+
+	destroy_pipes();
+}
+
+int main(int argc, char **argv)
+{
+	struct rlimit lim;
+	int nr = 10000, rounds = 1000;
+
+	if (argc > 1)
+		nr = atoi(argv[1]);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+
+	log_init(&log_info);
+
+	/* two file descriptors per pipe */
+	getrlimit(RLIMIT_NOFILE, &lim);
+	lim.rlim_cur = lim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &lim);
+	if (lim.rlim_cur < 2 * nr + 16) {
+		nr = (lim.rlim_cur - 16) / 2;
+		printf("Limited to %d sockets by RLIMIT_NOFILE.\n", nr);
+	}
+
+	run("select", nr, rounds, 1);
+
+	if (bsc_epoll_init() != 0) {
+		fprintf(stderr, "Failed to initialize epoll.\n");
+		return -1;
+	}
+	run("epoll", nr, rounds, 0);
+
+	return 0;
+}
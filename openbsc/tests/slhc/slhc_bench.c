@@ -0,0 +1,164 @@
+/*
+ * The CPU time of the RFC 1144 compression and decompression per packet
+ * for the segments of a download, for its ACKs and for as many
+ * connections as slots taking turns. Each round builds a batch of
+ * packets first, only the compression and decompression are timed.
+ *
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <openbsc/slhc.h>
+
+#define BATCH		256
+#define MAX_PKT		1500
+#define SLOTS		16
+
+struct pkt {
+	uint8_t buf[SLHC_MAX_HDR + MAX_PKT];
+	uint8_t *data;
+	unsigned int len;
+	enum slhc_type type;
+};
+
+static struct pkt batch[BATCH];
+static uint32_t seq[SLOTS], ack[SLOTS];
+static uint16_t id[SLOTS];
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void put16(uint8_t *p, uint16_t val)
+{
+	p[0] = val >> 8;
+	p[1] = val;
+}
+
+static void put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+/* the next segment of connection conn, the payload is left as it is */
+static void build(struct pkt *p, unsigned int conn, unsigned int payload,
+		  uint32_t ack_inc)
+{
+	uint8_t *ip = p->buf + SLHC_MAX_HDR, *th = ip + 20;
+
+	memset(ip, 0, 40);
+	ip[0] = 0x45;
+	put16(ip + 2, 40 + payload);
+	put16(ip + 4, id[conn]++);
+	put16(ip + 6, 0x4000);
+	ip[8] = 64;
+	ip[9] = 6;
+	put32(ip + 12, 0x0a000001);
+	put32(ip + 16, 0xc0a80001);
+	put16(th, 1024 + conn);
+	put16(th + 2, 80);
+	put32(th + 4, seq[conn]);
+	ack[conn] += ack_inc;
+	put32(th + 8, ack[conn]);
+	th[12] = 5 << 4;
+	th[13] = 0x10;
+	put16(th + 14, 5840);
+	put16(th + 16, seq[conn]);
+
+	seq[conn] += payload;
+	p->data = ip;
+	p->len = 40 + payload;
+}
+
+static void bench(const char *name, unsigned int conns, unsigned int payload,
+		  uint32_t ack_inc, long nr)
+{
+	struct slhc *tx = slhc_alloc(NULL, SLOTS, SLOTS);
+	struct slhc *rx = slhc_alloc(NULL, SLOTS, SLOTS);
+	unsigned long hdr_in = 0, hdr_out = 0;
+	unsigned long nr_compressed = 0;
+	double comp_secs = 0, decomp_secs = 0;
+	struct timespec start;
+	long done;
+	int i;
+
+	memset(seq, 0, sizeof(seq));
+	memset(ack, 0, sizeof(ack));
+	memset(id, 0, sizeof(id));
+
+	for (done = 0; done < nr; done += BATCH) {
+		for (i = 0; i < BATCH; ++i)
+			build(&batch[i], i % conns, payload, ack_inc);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < BATCH; ++i)
+			batch[i].type = slhc_compress(tx, &batch[i].data,
+						      &batch[i].len, 0);
+		comp_secs += elapsed(&start);
+
+		for (i = 0; i < BATCH; ++i) {
+			hdr_in += 40;
+			hdr_out += batch[i].len - payload;
+			if (batch[i].type == SLHC_TYPE_COMPRESSED_TCP)
+				nr_compressed += 1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < BATCH; ++i)
+			if (slhc_uncompress(rx, batch[i].type, &batch[i].data,
+					    batch[i].len) != 40 + payload) {
+				printf("Decompression failed.\n");
+				abort();
+			}
+		decomp_secs += elapsed(&start);
+	}
+
+	printf("%-16s %2u conns: compress %5.1f ns decompress %5.1f ns per "
+	       "packet, %lu%% compressed, header %.1f octets\n", name, conns,
+	       comp_secs * 1e9 / done, decomp_secs * 1e9 / done,
+	       nr_compressed * 100 / done, (double) hdr_out / done);
+
+	slhc_free(tx);
+	slhc_free(rx);
+}
+
+int main(int argc, char **argv)
+{
+	long nr = argc > 1 ? atol(argv[1]) : 10000000;
+
+	bench("download 1460", 1, 1460, 0, nr);
+	bench("ACKs", 1, 0, 2920, nr);
+	bench("download 1460", SLOTS, 1460, 0, nr);
+	bench("ACKs", SLOTS, 0, 2920, nr);
+
+	return 0;
+}
@@ -0,0 +1,382 @@
+/* test the RFC 1144 TCP/IP header compression */
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <openbsc/slhc.h>
+
+#define MAX_PKT		1500
+
+/* one direction of a TCP connection */
+struct flow {
+	uint32_t saddr, daddr;
+	uint16_t sport, dport;
+	uint32_t seq, ack;
+	uint16_t id, win;
+	/* with a timestamp option that changes in each segment */
+	int timestamps;
+	uint32_t tsval;
+};
+
+static unsigned int nr_type[3];
+
+static void put16(uint8_t *p, uint16_t val)
+{
+	p[0] = val >> 8;
+	p[1] = val;
+}
+
+static void put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+/* the next segment of the flow with a valid IP header checksum */
+static unsigned int build(uint8_t *ip, struct flow *f, uint8_t flags,
+			  unsigned int payload)
+{
+	unsigned int thlen = f->timestamps ? 32 : 20;
+	unsigned int len = 20 + thlen + payload, i;
+	uint8_t *th = ip + 20;
+	uint32_t sum = 0;
+
+	memset(ip, 0, 20 + thlen);
+	ip[0] = 0x45;
+	put16(ip + 2, len);
+	put16(ip + 4, f->id++);
+	put16(ip + 6, 0x4000);
+	ip[8] = 64;
+	ip[9] = 6;
+	put32(ip + 12, f->saddr);
+	put32(ip + 16, f->daddr);
+	for (i = 0; i < 20; i += 2)
+		sum += (ip[i] << 8) | ip[i + 1];
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum += sum >> 16;
+	put16(ip + 10, ~sum);
+
+	put16(th, f->sport);
+	put16(th + 2, f->dport);
+	put32(th + 4, f->seq);
+	put32(th + 8, f->ack);
+	th[12] = (thlen / 4) << 4;
+	th[13] = flags;
+	put16(th + 14, f->win);
+	/* not checked by the compression */
+	put16(th + 16, f->seq ^ f->id);
+	if (f->timestamps) {
+		th[20] = th[21] = 1;
+		th[22] = 8;
+		th[23] = 10;
+		put32(th + 24, f->tsval++);
+	}
+
+	for (i = 0; i < payload; ++i)
+		ip[20 + thlen + i] = i;
+
+	f->seq += payload;
+	return len;
+}
+
+/* compress, decompress and compare, returns the compressed length */
+static unsigned int roundtrip(struct slhc *tx, struct slhc *rx, uint8_t *pkt,
+			      unsigned int len, int compress_cid,
+			      enum slhc_type expected)
+{
+	uint8_t buf[SLHC_MAX_HDR + MAX_PKT];
+	uint8_t *cur = buf + SLHC_MAX_HDR;
+	unsigned int clen = len;
+	enum slhc_type type;
+	int rc;
+
+	memcpy(cur, pkt, len);
+	type = slhc_compress(tx, &cur, &clen, compress_cid);
+	if (type != expected) {
+		printf("Packet of %u octets compressed as %d instead of %d.\n",
+			len, type, expected);
+		abort();
+	}
+	nr_type[type] += 1;
+
+	rc = slhc_uncompress(rx, type, &cur, clen);
+	if (rc != len || memcmp(cur, pkt, len) != 0) {
+		printf("Packet of %u octets restored as %d octets differs.\n",
+			len, rc);
+		abort();
+	}
+	return clen;
+}
+
+static void check_len(const char *what, unsigned int clen, unsigned int expected)
+{
+	if (clen != expected) {
+		printf("%s: %u octets instead of %u.\n", what, clen, expected);
+		abort();
+	}
+}
+
+static void init_flow(struct flow *f, uint16_t sport)
+{
+	memset(f, 0, sizeof(*f));
+	f->saddr = 0x0a000001;
+	f->daddr = 0xc0a80001;
+	f->sport = sport;
+	f->dport = 80;
+	f->seq = 0xfffff000;
+	f->ack = 1000;
+	f->win = 5840;
+}
+
+/* a download in full segments, the header is the change mask, the
+ * connection and the checksum */
+static void test_bulk(void)
+{
+	struct slhc *tx = slhc_alloc(NULL, 16, 16);
+	struct slhc *rx = slhc_alloc(NULL, 16, 16);
+	uint8_t pkt[MAX_PKT];
+	struct flow f;
+	unsigned int i, len;
+
+	init_flow(&f, 1024);
+	len = build(pkt, &f, 0x10, 1400);
+	roundtrip(tx, rx, pkt, len, 0, SLHC_TYPE_UNCOMPRESSED_TCP);
+	for (i = 0; i < 100; ++i) {
+		len = build(pkt, &f, i & 1 ? 0x18 : 0x10, 1400);
+		check_len("Bulk data", roundtrip(tx, rx, pkt, len, 0,
+				SLHC_TYPE_COMPRESSED_TCP), 1400 + 4);
+	}
+
+	/* a window update and a smaller segment are explicit deltas */
+	f.win += 1000;
+	len = build(pkt, &f, 0x10, 500);
+	check_len("Window update", roundtrip(tx, rx, pkt, len, 0,
+			SLHC_TYPE_COMPRESSED_TCP), 500 + 4 + 3 + 3);
+
+	slhc_free(tx);
+	slhc_free(rx);
+}
+
+/* the ACKs of a download, a duplicate ACK is sent uncompressed */
+static void test_acks(void)
+{
+	struct slhc *tx = slhc_alloc(NULL, 16, 16);
+	struct slhc *rx = slhc_alloc(NULL, 16, 16);
+	uint8_t pkt[MAX_PKT];
+	struct flow f;
+	unsigned int i, len;
+
+	init_flow(&f, 1025);
+	len = build(pkt, &f, 0x10, 0);
+	roundtrip(tx, rx, pkt, len, 0, SLHC_TYPE_UNCOMPRESSED_TCP);
+	for (i = 0; i < 100; ++i) {
+		f.ack += 2800;
+		len = build(pkt, &f, 0x10, 0);
+		check_len("ACK", roundtrip(tx, rx, pkt, len, 0,
+				SLHC_TYPE_COMPRESSED_TCP), 4 + 3);
+	}
+
+	len = build(pkt, &f, 0x10, 0);
+	roundtrip(tx, rx, pkt, len, 0, SLHC_TYPE_UNCOMPRESSED_TCP);
+
+	slhc_free(tx);
+	slhc_free(rx);
+}
+
+/* echoed keystrokes advance the sequence and the ACK by the same */
+static void test_interactive(void)
+{
+	struct slhc *tx = slhc_alloc(NULL, 16, 16);
+	struct slhc *rx = slhc_alloc(NULL, 16, 16);
+	uint8_t pkt[MAX_PKT];
+	struct flow f;
+	unsigned int i, len;
+
+	init_flow(&f, 1026);
+	len = build(pkt, &f, 0x18, 1);
+	roundtrip(tx, rx, pkt, len, 0, SLHC_TYPE_UNCOMPRESSED_TCP);
+	for (i = 0; i < 20; ++i) {
+		f.ack += 1;
+		len = build(pkt, &f, 0x18, 1);
+		check_len("Echo", roundtrip(tx, rx, pkt, len, 0,
+				SLHC_TYPE_COMPRESSED_TCP), 1 + 4);
+	}
+
+	slhc_free(tx);
+	slhc_free(rx);
+}
+
+/* more connections than slots replace each other, as many as slots are
+ * compressed after the first round */
+static void test_connections(void)
+{
+	struct slhc *tx = slhc_alloc(NULL, 4, 4);
+	struct slhc *rx = slhc_alloc(NULL, 4, 4);
+	uint8_t pkt[MAX_PKT];
+	struct flow f[5];
+	unsigned int i, len;
+
+	for (i = 0; i < 5; ++i)
+		init_flow(&f[i], 2000 + i);
+
+	for (i = 0; i < 50; ++i) {
+		len = build(pkt, &f[i % 5], 0x10, 100);
+		roundtrip(tx, rx, pkt, len, 0, SLHC_TYPE_UNCOMPRESSED_TCP);
+	}
+	for (i = 0; i < 50; ++i) {
+		len = build(pkt, &f[i % 4], 0x10, 100);
+		roundtrip(tx, rx, pkt, len, 1, i < 4 ?
+			  SLHC_TYPE_UNCOMPRESSED_TCP : SLHC_TYPE_COMPRESSED_TCP);
+	}
+
+	slhc_free(tx);
+	slhc_free(rx);
+}
+
+/* changing options, other protocols and SYNs are not compressed */
+static void test_uncompressible(void)
+{
+	struct slhc *tx = slhc_alloc(NULL, 16, 16);
+	struct slhc *rx = slhc_alloc(NULL, 16, 16);
+	uint8_t pkt[MAX_PKT];
+	struct flow f;
+	unsigned int i, len;
+
+	init_flow(&f, 1027);
+	f.timestamps = 1;
+	for (i = 0; i < 10; ++i) {
+		len = build(pkt, &f, 0x10, 100);
+		roundtrip(tx, rx, pkt, len, 0, SLHC_TYPE_UNCOMPRESSED_TCP);
+	}
+
+	init_flow(&f, 1028);
+	len = build(pkt, &f, 0x02, 0);
+	roundtrip(tx, rx, pkt, len, 0, SLHC_TYPE_IP);
+
+	len = build(pkt, &f, 0x10, 100);
+	pkt[9] = 17;
+	roundtrip(tx, rx, pkt, len, 0, SLHC_TYPE_IP);
+
+	slhc_free(tx);
+	slhc_free(rx);
+}
+
+/* after a loss the packets without connection number are discarded up
+ * to the retransmission which is sent uncompressed */
+static void test_toss(void)
+{
+	struct slhc *tx = slhc_alloc(NULL, 16, 16);
+	struct slhc *rx = slhc_alloc(NULL, 16, 16);
+	uint8_t pkt[MAX_PKT], buf[SLHC_MAX_HDR + MAX_PKT], *cur;
+	struct flow f;
+	unsigned int i, len, lost_seq;
+
+	init_flow(&f, 1029);
+	len = build(pkt, &f, 0x10, 1000);
+	roundtrip(tx, rx, pkt, len, 1, SLHC_TYPE_UNCOMPRESSED_TCP);
+	len = build(pkt, &f, 0x10, 1000);
+	roundtrip(tx, rx, pkt, len, 1, SLHC_TYPE_COMPRESSED_TCP);
+
+	/* lost on the way */
+	lost_seq = f.seq;
+	len = build(pkt, &f, 0x10, 1000);
+	cur = pkt;
+	slhc_compress(tx, &cur, &len, 1);
+	slhc_toss(rx);
+
+	for (i = 0; i < 3; ++i) {
+		cur = buf + SLHC_MAX_HDR;
+		len = build(cur, &f, 0x10, 1000);
+		if (slhc_compress(tx, &cur, &len, 1) != SLHC_TYPE_COMPRESSED_TCP ||
+		    slhc_uncompress(rx, SLHC_TYPE_COMPRESSED_TCP, &cur, len) != 0) {
+			printf("Compressed packet after a loss not discarded.\n");
+			abort();
+		}
+	}
+
+	f.seq = lost_seq;
+	len = build(pkt, &f, 0x10, 1000);
+	roundtrip(tx, rx, pkt, len, 1, SLHC_TYPE_UNCOMPRESSED_TCP);
+	len = build(pkt, &f, 0x10, 1000);
+	roundtrip(tx, rx, pkt, len, 1, SLHC_TYPE_COMPRESSED_TCP);
+
+	slhc_free(tx);
+	slhc_free(rx);
+}
+
+/* truncated and random compressed packets must not be read beyond */
+static void test_malformed(void)
+{
+	struct slhc *tx = slhc_alloc(NULL, 16, 16);
+	struct slhc *rx = slhc_alloc(NULL, 16, 16);
+	uint8_t pkt[MAX_PKT], buf[SLHC_MAX_HDR + 32], *cur;
+	struct flow f;
+	unsigned int i, n, len;
+
+	init_flow(&f, 1030);
+	len = build(pkt, &f, 0x10, 0);
+	roundtrip(tx, rx, pkt, len, 0, SLHC_TYPE_UNCOMPRESSED_TCP);
+
+	for (i = 0; i < 10000; ++i) {
+		len = 1 + random() % 16;
+		for (n = 0; n < len; ++n)
+			buf[SLHC_MAX_HDR + n] = random();
+		/* the connection of the first packet */
+		buf[SLHC_MAX_HDR] |= 0x40;
+		buf[SLHC_MAX_HDR + 1] = 0;
+		cur = buf + SLHC_MAX_HDR;
+		slhc_uncompress(rx, SLHC_TYPE_COMPRESSED_TCP, &cur, len);
+	}
+
+	cur = buf + SLHC_MAX_HDR;
+	cur[0] = 0x40;
+	cur[1] = 16;
+	if (slhc_uncompress(rx, SLHC_TYPE_COMPRESSED_TCP, &cur, 4) >= 0) {
+		printf("Connection beyond the slots accepted.\n");
+		abort();
+	}
+
+	slhc_free(tx);
+	slhc_free(rx);
+}
+
+int main(int argc, char **argv)
+{
+	test_bulk();
+	test_acks();
+	test_interactive();
+	test_connections();
+	test_uncompressible();
+	test_toss();
+	test_malformed();
+
+	printf("IP: %u uncompressed TCP: %u compressed TCP: %u\n",
+		nr_type[SLHC_TYPE_IP], nr_type[SLHC_TYPE_UNCOMPRESSED_TCP],
+		nr_type[SLHC_TYPE_COMPRESSED_TCP]);
+	printf("Testing the RFC 1144 header compression done.\n");
+	return 0;
+}
@@ -0,0 +1,130 @@
+/* test the timer wheel */
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <osmocore/select.h>
+
+#include <openbsc/timer_wheel.h>
+
+static struct bsc_timer_wheel test_wheel = BSC_TIMER_WHEEL("test");
+
+struct test_timer {
+	struct timer_list timer;
+	struct timeval armed;
+	int ms;
+	int fired;
+};
+
+/* below, in and above the first level of the wheel */
+static struct test_timer timers[] = {
+	{ .ms = 0 },
+	{ .ms = 15 },
+	{ .ms = 15 },
+	{ .ms = 120 },
+	{ .ms = 700 },
+	{ .ms = 2700 },
+};
+
+#define NR_TIMERS	(sizeof(timers) / sizeof(timers[0]))
+
+static struct test_timer *cancelled = &timers[4];
+static int last_ms = -1;
+static unsigned int nr_fired;
+
+static void timer_cb(void *data)
+{
+	struct test_timer *t = data;
+	struct timeval now, diff;
+	int elapsed;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &t->armed, &diff);
+	elapsed = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+
+	printf("Timer %d ms fired after %d ms\n", t->ms, elapsed);
+	if (t == cancelled || t->fired) {
+		printf("Timer should not fire.\n");
+		abort();
+	}
+	if (elapsed < t->ms) {
+		printf("Timer fired too early.\n");
+		abort();
+	}
+	if (t->ms < last_ms) {
+		printf("Timer fired out of order.\n");
+		abort();
+	}
+
+	last_ms = t->ms;
+	t->fired = 1;
+	nr_fired += 1;
+
+	/* cancel a timer from within a callback */
+	if (t->ms == 120)
+		bsc_wheel_del(&test_wheel, &cancelled->timer);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_TIMERS; ++i) {
+		timers[i].timer.cb = timer_cb;
+		timers[i].timer.data = &timers[i];
+		gettimeofday(&timers[i].armed, NULL);
+		bsc_wheel_schedule(&test_wheel, &timers[i].timer,
+				   timers[i].ms / 1000, (timers[i].ms % 1000) * 1000);
+	}
+
+	/* re-arming does not count as cancel */
+	bsc_wheel_schedule(&test_wheel, &timers[1].timer, 0, 15000);
+
+	if (!bsc_wheel_pending(&cancelled->timer) || test_wheel.armed != NR_TIMERS) {
+		printf("Wrong number of armed timers: %u\n", test_wheel.armed);
+		abort();
+	}
+
+	while (nr_fired != NR_TIMERS - 1)
+		bsc_select_main(0);
+
+	if (test_wheel.armed != 0 || test_wheel.max_armed != NR_TIMERS ||
+	    test_wheel.scheduled != NR_TIMERS + 1 ||
+	    test_wheel.expired != NR_TIMERS - 1 || test_wheel.cancelled != 1) {
+		printf("Wrong statistics armed: %u max: %u scheduled: %lu "
+			"expired: %lu cancelled: %lu\n",
+			test_wheel.armed, test_wheel.max_armed,
+			test_wheel.scheduled, test_wheel.expired,
+			test_wheel.cancelled);
+		abort();
+	}
+
+	if (bsc_wheel_pending(&cancelled->timer)) {
+		printf("Cancelled timer still pending.\n");
+		abort();
+	}
+
+	printf("Testing the timer wheel done.\n");
+	return 0;
+}
@@ -0,0 +1,254 @@
+/* test the queues between the select loop and the worker threads */
+/*
+ * (C) 2010 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <poll.h>
+
+#include <sys/eventfd.h>
+
+#include <openbsc/worker_queue.h>
+#include <openbsc/debug.h>
+
+#define NR_PRODUCERS	4
+#define NR_ITEMS	20000
+#define NR_CMDS		20000
+#define TEST_RING	4
+#define TEST_LIMIT	8
+
+struct test_item {
+	struct worker_queue_node node;
+	int producer;
+	int seq;
+};
+
+static struct test_item items[NR_PRODUCERS][NR_ITEMS];
+static struct worker_queue test_queue;
+
+static void *producer_main(void *data)
+{
+	struct test_item *mine = data;
+	int i;
+
+	for (i = 0; i < NR_ITEMS; ++i)
+		worker_queue_push(&test_queue, &mine[i].node);
+	return NULL;
+}
+
+/* every producer is seen in its own order, nothing is lost */
+static void test_queue_order(void)
+{
+	pthread_t threads[NR_PRODUCERS];
+	int next[NR_PRODUCERS];
+	int p, i, popped = 0;
+
+	printf("Testing the queue with %d producers.\n", NR_PRODUCERS);
+
+	worker_queue_init(&test_queue);
+	if (worker_queue_pop(&test_queue)) {
+		printf("Popped from the empty queue.\n");
+		abort();
+	}
+
+	for (p = 0; p < NR_PRODUCERS; ++p) {
+		for (i = 0; i < NR_ITEMS; ++i) {
+			items[p][i].producer = p;
+			items[p][i].seq = i;
+		}
+		next[p] = 0;
+		pthread_create(&threads[p], NULL, producer_main, items[p]);
+	}
+
+	while (popped < NR_PRODUCERS * NR_ITEMS) {
+		struct worker_queue_node *node = worker_queue_pop(&test_queue);
+		struct test_item *item;
+
+		if (!node) {
+			sched_yield();
+			continue;
+		}
+
+		item = worker_queue_entry(node, struct test_item, node);
+		if (item->seq != next[item->producer]) {
+			printf("Producer %d: got %d instead of %d.\n",
+			       item->producer, item->seq, next[item->producer]);
+			abort();
+		}
+		next[item->producer] += 1;
+		popped += 1;
+	}
+
+	for (p = 0; p < NR_PRODUCERS; ++p)
+		pthread_join(threads[p], NULL);
+
+	if (worker_queue_pop(&test_queue) || test_queue.queued != 0) {
+		printf("The queue is not empty: %u.\n", test_queue.queued);
+		abort();
+	}
+}
+
+static int test_ring[TEST_RING];
+static int applied;
+static int done;
+
+static void test_apply(struct worker_thread *thread, unsigned int slot)
+{
+	if (test_ring[slot] < 0) {
+		done = 1;
+		return;
+	}
+
+	if (test_ring[slot] != applied) {
+		printf("Command %d instead of %d.\n", test_ring[slot], applied);
+		abort();
+	}
+	applied += 1;
+}
+
+static const struct worker_desc test_desc = {
+	.name		= "test thread",
+	.subsys		= DINP,
+	.num_errors	= _WORKER_ERR_MAX,
+	.ring_size	= TEST_RING,
+	.apply		= test_apply,
+};
+
+static void *consumer_main(void *data)
+{
+	struct worker_thread *thread = data;
+	struct pollfd pfd;
+
+	pfd.fd = thread->event_fd;
+	pfd.events = POLLIN;
+	while (!done) {
+		poll(&pfd, 1, -1);
+		worker_drain(thread);
+	}
+	return NULL;
+}
+
+/* the select loop waits while the small ring is full */
+static void test_cmd_ring(void)
+{
+	struct worker_thread thread;
+	unsigned int slot;
+	int i;
+
+	printf("Testing the command ring with %d slots.\n", TEST_RING);
+
+	if (worker_thread_init(&thread, &test_desc, 0) != 0) {
+		printf("Failed to create the thread.\n");
+		abort();
+	}
+	if (worker_thread_start(&thread.thread, consumer_main, &thread) != 0) {
+		printf("Failed to start the thread.\n");
+		abort();
+	}
+
+	for (i = 0; i < NR_CMDS; ++i) {
+		slot = worker_cmd_get(&thread);
+		test_ring[slot] = i;
+		worker_cmd_put(&thread);
+	}
+	slot = worker_cmd_get(&thread);
+	test_ring[slot] = -1;
+	worker_cmd_put(&thread);
+
+	pthread_join(thread.thread, NULL);
+	if (applied != NR_CMDS || thread.errors[WORKER_ERR_WAKEUP] != 0) {
+		printf("Applied %d commands with %lu failed wakeups.\n",
+		       applied, thread.errors[WORKER_ERR_WAKEUP]);
+		abort();
+	}
+	worker_thread_close(&thread);
+}
+
+static struct worker_thread throttle_thread;
+static int consumer_fd;
+
+static void *throttled_main(void *data)
+{
+	struct test_item *mine = data;
+	int i;
+
+	for (i = 0; i < NR_ITEMS; ++i) {
+		worker_throttle(&throttle_thread, &test_queue, TEST_LIMIT,
+				consumer_fd);
+		worker_queue_push(&test_queue, &mine[i].node);
+		worker_event_signal(consumer_fd);
+	}
+	return NULL;
+}
+
+/* the thread waits for the consumer instead of filling the queue */
+static void test_throttle(void)
+{
+	struct pollfd pfd;
+	int popped = 0;
+
+	printf("Testing the throttle at %d items.\n", TEST_LIMIT);
+
+	worker_queue_init(&test_queue);
+	consumer_fd = eventfd(0, EFD_NONBLOCK);
+	if (consumer_fd < 0 ||
+	    worker_thread_init(&throttle_thread, &test_desc, 1) != 0) {
+		printf("Failed to create the thread.\n");
+		abort();
+	}
+	if (worker_thread_start(&throttle_thread.thread, throttled_main,
+				items[0]) != 0) {
+		printf("Failed to start the thread.\n");
+		abort();
+	}
+
+	pfd.fd = consumer_fd;
+	pfd.events = POLLIN;
+	while (popped < NR_ITEMS) {
+		poll(&pfd, 1, -1);
+		worker_event_clear(consumer_fd);
+
+		if (test_queue.queued > TEST_LIMIT) {
+			printf("The queue grew to %u.\n", test_queue.queued);
+			abort();
+		}
+		while (worker_queue_pop(&test_queue))
+			popped += 1;
+		worker_resume(&throttle_thread, &test_queue, TEST_LIMIT);
+	}
+
+	pthread_join(throttle_thread.thread, NULL);
+	worker_thread_close(&throttle_thread);
+	close(consumer_fd);
+}
+
+int main(int argc, char **argv)
+{
+	test_queue_order();
+	test_cmd_ring();
+	test_throttle();
+
+	printf("Testing the worker queues done.\n");
+	return 0;
+}